@@ -0,0 +1,101 @@
+#pragma once
+
+#include <algorithm>
+#include <limits>
+
+#include "tools/point3.h"
+#include "tools/vec3.h"
+
+template <class T>
+class Bounds3 {
+ public:
+  Bounds3() = default;
+  explicit Bounds3(const Point3<T>& p) : m_min(p), m_max(p) {}
+  Bounds3(const Point3<T>& p1, const Point3<T>& p2)
+      : m_min(std::min(p1.x(), p2.x()), std::min(p1.y(), p2.y()),
+              std::min(p1.z(), p2.z())),
+        m_max(std::max(p1.x(), p2.x()), std::max(p1.y(), p2.y()),
+              std::max(p1.z(), p2.z())) {}
+
+  Point3<T> min() const { return m_min; }
+  Point3<T> max() const { return m_max; }
+
+  bool empty() const {
+    return m_min.x() > m_max.x() || m_min.y() > m_max.y() ||
+           m_min.z() > m_max.z();
+  }
+
+  void expand(const Point3<T>& p) {
+    m_min = Point3<T>(std::min(m_min.x(), p.x()), std::min(m_min.y(), p.y()),
+                      std::min(m_min.z(), p.z()));
+    m_max = Point3<T>(std::max(m_max.x(), p.x()), std::max(m_max.y(), p.y()),
+                      std::max(m_max.z(), p.z()));
+  }
+
+  void expand(const Bounds3<T>& b) {
+    if (b.empty()) return;
+    expand(b.m_min);
+    expand(b.m_max);
+  }
+
+  bool contains(const Point3<T>& p) const {
+    return p.x() >= m_min.x() && p.x() <= m_max.x() && p.y() >= m_min.y() &&
+           p.y() <= m_max.y() && p.z() >= m_min.z() && p.z() <= m_max.z();
+  }
+
+  Vec3<T> diagonal() const { return m_max - m_min; }
+  Point3<T> centroid() const { return m_min + diagonal() * T(0.5); }
+
+  T surfaceArea() const {
+    if (empty()) return T{0};
+    Vec3<T> d = diagonal();
+    return T{2} * (d.x() * d.y() + d.x() * d.z() + d.y() * d.z());
+  }
+
+  int maxExtent() const {
+    Vec3<T> d = diagonal();
+    if (d.x() > d.y() && d.x() > d.z()) return 0;
+    return d.y() > d.z() ? 1 : 2;
+  }
+
+  // Position of p relative to the box, (0,0,0) at min and (1,1,1) at max.
+  Vec3<T> offset(const Point3<T>& p) const {
+    Vec3<T> o = p - m_min;
+    Vec3<T> d = diagonal();
+    if (d.x() > T{0}) o.setX(o.x() / d.x());
+    if (d.y() > T{0}) o.setY(o.y() / d.y());
+    if (d.z() > T{0}) o.setZ(o.z() / d.z());
+    return o;
+  }
+
+  T distanceSquared(const Point3<T>& p) const {
+    T dx = std::max({m_min.x() - p.x(), T{0}, p.x() - m_max.x()});
+    T dy = std::max({m_min.y() - p.y(), T{0}, p.y() - m_max.y()});
+    T dz = std::max({m_min.z() - p.z(), T{0}, p.z() - m_max.z()});
+    return dx * dx + dy * dy + dz * dz;
+  }
+
+ private:
+  Point3<T> m_min = Point3<T>(std::numeric_limits<T>::max(),
+                              std::numeric_limits<T>::max(),
+                              std::numeric_limits<T>::max());
+  Point3<T> m_max = Point3<T>(std::numeric_limits<T>::lowest(),
+                              std::numeric_limits<T>::lowest(),
+                              std::numeric_limits<T>::lowest());
+};
+
+using Bounds3D = Bounds3<float>;
+
+template <typename T>
+Bounds3<T> merge(const Bounds3<T>& b1, const Bounds3<T>& b2) {
+  Bounds3<T> ret = b1;
+  ret.expand(b2);
+  return ret;
+}
+
+template <typename T>
+Bounds3<T> merge(const Bounds3<T>& b, const Point3<T>& p) {
+  Bounds3<T> ret = b;
+  ret.expand(p);
+  return ret;
+}
@@ -0,0 +1,229 @@
+#pragma once
+
+#include <algorithm>
+#include <cmath>
+#include <cstddef>
+#include <cstdint>
+#include <limits>
+#include <vector>
+
+#include "tools/cpudispatch.h"
+#include "tools/mat4.h"
+#include "tools/perfcounters.h"
+#include "tools/point3.h"
+#include "tools/profiling.h"
+#include "tools/ray.h"
+#include "tools/raybatch.h"
+#include "tools/vec3.h"
+#include "tools/vec4.h"
+
+// Half-open pixel rectangle [x0, x1) x [y0, y1) of the image.
+struct Tile {
+  int x0 = 0, y0 = 0, x1 = 0, y1 = 0;
+
+  int width() const { return x1 - x0; }
+  int height() const { return y1 - y0; }
+  std::size_t pixelCount() const {
+    return static_cast<std::size_t>(width()) * height();
+  }
+};
+
+struct CameraSampling {
+  int samplesPerPixel = 1;
+  // Uniform random subpixel positions; otherwise every sample goes through
+  // the pixel center.
+  bool jitter = false;
+  // Jitter is a hash of (seed, pixel, sample), so any tile can be
+  // regenerated identically on any thread. Change it per frame/pass.
+  std::uint32_t seed = 0;
+};
+
+namespace detail {
+
+// PCG output permutation of an LCG step (Jarzynski & Olano 2020).
+inline std::uint32_t pcgHash(std::uint32_t v) {
+  std::uint32_t state = v * 747796405u + 2891336453u;
+  std::uint32_t word = ((state >> ((state >> 28u) + 4u)) ^ state) * 277803737u;
+  return (word >> 22u) ^ word;
+}
+
+// Top 24 bits as a float in [0, 1).
+inline float hashToUnitFloat(std::uint32_t h) {
+  return static_cast<float>(h >> 8) * (1.f / 16777216.f);
+}
+
+}  // namespace detail
+
+//--------------------------------------------
+// Pinhole camera looking down -z of its view space, as view_transform sets
+// it up. The inverse view matrix is kept, and from it the world-space
+// direction to film position (px, py) is the affine function
+//   d(px, py) = m_corner + px * m_du + py * m_dv,
+// so generating a ray costs a few multiply-adds instead of a matrix-vector
+// product. Pixel coordinates start at the top-left corner of the image and
+// (x + 0.5, y + 0.5) is the center of pixel (x, y).
+//--------------------------------------------
+
+class Camera {
+ public:
+  Camera() { update(); }
+  Camera(int width, int height, float fovy)
+      : m_width(width), m_height(height), m_fovy(fovy) {
+    update();
+  }
+  Camera(const Point3D& from, const Point3D& to, const Vec3D& up, float fovy,
+         int width, int height)
+      : m_width(width), m_height(height), m_fovy(fovy) {
+    lookAt(from, to, up);
+  }
+
+  // Builds the camera-to-world matrix directly from an orthonormal frame.
+  // view_transform does not normalize its left axis when up is not
+  // perpendicular to the view direction, which would skew the field of view.
+  void lookAt(const Point3D& from, const Point3D& to, const Vec3D& up) {
+    Vec3D forward = getUnitVectorOf(to - from);
+    Vec3D left = getUnitVectorOf(cross(forward, up));
+    Vec3D trueUp = cross(left, forward);
+    m_inverseView =
+        Mat4D(Vec4D(left.x(), trueUp.x(), -forward.x(), from.x()),
+              Vec4D(left.y(), trueUp.y(), -forward.y(), from.y()),
+              Vec4D(left.z(), trueUp.z(), -forward.z(), from.z()),
+              Vec4D(0.f, 0.f, 0.f, 1.f));
+    update();
+  }
+
+  // World-to-camera matrix, e.g. from view_transform. Its inverse is taken
+  // once here.
+  void setView(const Mat4D& view) {
+    m_inverseView = view.inverse();
+    update();
+  }
+
+  // Vertical field of view in radians.
+  void setFov(float fovy) {
+    m_fovy = fovy;
+    update();
+  }
+
+  void setResolution(int width, int height) {
+    m_width = width;
+    m_height = height;
+    update();
+  }
+
+  const Mat4D& inverseView() const { return m_inverseView; }
+  Point3D position() const { return m_origin; }
+  float fov() const { return m_fovy; }
+  float aspect() const { return static_cast<float>(m_width) / m_height; }
+  int width() const { return m_width; }
+  int height() const { return m_height; }
+
+  Ray generateRay(float px, float py) const {
+    Vec3D d = m_corner + px * m_du + py * m_dv;
+    return Ray(m_origin, getUnitVectorOf(d));
+  }
+
+  // Rays for every pixel of the tile, samplesPerPixel consecutive rays per
+  // pixel and pixels in row-major order within the tile: ray i belongs to
+  // pixel (x0 + (i / spp) % width, y0 + (i / spp) / width). Directions are
+  // unit length and tmax is infinite.
+  void generateTile(const Tile& tile, RayBatch& rays,
+                    const CameraSampling& sampling = {}) const;
+
+ private:
+  void update() {
+    float h = std::tan(m_fovy * 0.5f);
+    float w = h * aspect();
+    // Camera-space steps per pixel, carried to world space once.
+    Vec4D du = m_inverseView * Vec4D(2.f * w / m_width, 0.f, 0.f, 0.f);
+    Vec4D dv = m_inverseView * Vec4D(0.f, -2.f * h / m_height, 0.f, 0.f);
+    Vec4D corner = m_inverseView * Vec4D(-w, h, -1.f, 0.f);
+    Vec4D origin = m_inverseView * Vec4D(0.f, 0.f, 0.f, 1.f);
+    m_du = Vec3D(du);
+    m_dv = Vec3D(dv);
+    m_corner = Vec3D(corner);
+    m_origin = Point3D(origin);
+  }
+
+  int m_width = 1, m_height = 1;
+  float m_fovy = 1.f;
+  Mat4D m_inverseView;
+  Point3D m_origin;
+  Vec3D m_corner, m_du, m_dv;
+};
+
+namespace detail {
+
+// One row of the tile: directions for n samples at film positions
+// (px[i], py). Branch-free, so the loop vectorizes; it runs the build for
+// the active ISA.
+inline void cameraRowDirections(std::size_t n, const float* __restrict px,
+                                const float* __restrict py, Vec3D corner,
+                                Vec3D du, Vec3D dv, float* __restrict dx,
+                                float* __restrict dy, float* __restrict dz) {
+  const float cx = corner.x(), cy = corner.y(), cz = corner.z();
+  const float ux = du.x(), uy = du.y(), uz = du.z();
+  const float vx = dv.x(), vy = dv.y(), vz = dv.z();
+  for (std::size_t i = 0; i < n; ++i) {
+    float x = cx + px[i] * ux + py[i] * vx;
+    float y = cy + px[i] * uy + py[i] * vy;
+    float z = cz + px[i] * uz + py[i] * vz;
+    float inv = 1.f / std::sqrt(x * x + y * y + z * z);
+    dx[i] = x * inv;
+    dy[i] = y * inv;
+    dz[i] = z * inv;
+  }
+}
+
+}  // namespace detail
+
+inline void Camera::generateTile(const Tile& tile, RayBatch& rays,
+                                 const CameraSampling& sampling) const {
+  const std::size_t spp =
+      static_cast<std::size_t>(std::max(sampling.samplesPerPixel, 1));
+  const std::size_t rowRays = static_cast<std::size_t>(tile.width()) * spp;
+  const std::size_t n = tile.pixelCount() * spp;
+  TOOLS_PERF_REGION("camera_rays", n);
+  TOOLS_PROFILE_SCOPE("camera_rays");
+  rays.resize(n);
+  float *ox = rays.ox(), *oy = rays.oy(), *oz = rays.oz();
+  float* tmax = rays.tmax();
+  const float inf = std::numeric_limits<float>::infinity();
+  for (std::size_t i = 0; i < n; ++i) {
+    ox[i] = m_origin.x();
+    oy[i] = m_origin.y();
+    oz[i] = m_origin.z();
+    tmax[i] = inf;
+  }
+
+  // Film positions of one row, filled before the direction kernel so the
+  // hashing stays out of the vectorized loop.
+  std::vector<float> px(rowRays), py(rowRays);
+  for (int y = tile.y0; y < tile.y1; ++y) {
+    for (std::size_t i = 0; i < rowRays; ++i) {
+      std::uint32_t x = tile.x0 + static_cast<std::uint32_t>(i / spp);
+      float jx = 0.5f, jy = 0.5f;
+      if (sampling.jitter) {
+        std::uint32_t pixel = static_cast<std::uint32_t>(y) * m_width + x;
+        std::uint32_t h = detail::pcgHash(
+            sampling.seed ^
+            detail::pcgHash(pixel * static_cast<std::uint32_t>(spp) +
+                            static_cast<std::uint32_t>(i % spp)));
+        jx = detail::hashToUnitFloat(h);
+        jy = detail::hashToUnitFloat(detail::pcgHash(h));
+      }
+      px[i] = static_cast<float>(x) + jx;
+      py[i] = static_cast<float>(y) + jy;
+    }
+    std::size_t base = static_cast<std::size_t>(y - tile.y0) * rowRays;
+    dispatchRange(
+        [&](std::size_t b, std::size_t e) {
+          detail::cameraRowDirections(e - b, px.data() + b, py.data() + b,
+                                      m_corner, m_du, m_dv,
+                                      rays.dx() + base + b,
+                                      rays.dy() + base + b,
+                                      rays.dz() + base + b);
+        },
+        0, rowRays);
+  }
+}
@@ -0,0 +1,9 @@
+#pragma once
+
+#include <limits>
+
+// inline constexpr: one definition across translation units and no dynamic
+// initializer in each of them.
+inline constexpr float PI = 3.14159265358979323846f;
+inline constexpr float EPS = std::numeric_limits<float>::epsilon();
+inline constexpr float EPS1 = 0.000002f;
@@ -0,0 +1,210 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <cctype>
+#include <cstddef>
+#include <cstdint>
+#include <cstdlib>
+#include <ostream>
+#include <string>
+
+#include "tools/parallel.h"
+
+//--------------------------------------------
+// Runtime instruction set dispatch. The library is compiled for the
+// baseline target, and the batch kernels are additionally compiled for
+// AVX2 and AVX-512 through target attributes. The widest set the CPU
+// supports is picked on first use; TOOLS_FORCE_ISA=baseline|sse2|avx2|
+// avx512 lowers it for testing and comparisons (it is never raised above
+// what the CPU reports), and ScopedIsa does the same from code.
+//--------------------------------------------
+
+#if (defined(__GNUC__) || defined(__clang__)) && \
+    (defined(__x86_64__) || defined(__i386__))
+#define TOOLS_HAS_ISA_DISPATCH 1
+// flatten inlines the whole kernel into the wrapper, so every loop in it
+// is compiled for the wrapper's target. Contraction into FMA stays off so
+// every build rounds like the baseline and the undispatched scalar paths.
+#define TOOLS_TARGET_AVX2                                          \
+  __attribute__((target("avx2,fma"), optimize("fp-contract=off"), \
+                 flatten))
+#define TOOLS_TARGET_AVX512                                       \
+  __attribute__((target("avx512f,avx512vl,avx512dq,avx2,fma"),    \
+                 optimize("fp-contract=off"), flatten))
+#else
+#define TOOLS_HAS_ISA_DISPATCH 0
+#endif
+
+enum class Isa : std::uint8_t {
+  Baseline,  // Whatever the compiler targets by default (SSE2 on x86-64).
+  Avx2,      // AVX2 + FMA.
+  Avx512     // AVX-512 F/VL/DQ.
+};
+
+inline const char* isaName(Isa isa) {
+  switch (isa) {
+    case Isa::Avx2:
+      return "avx2";
+    case Isa::Avx512:
+      return "avx512";
+    default:
+      return "baseline";
+  }
+}
+
+// Parses an ISA name, case-insensitively; "sse2" and "scalar" mean the
+// baseline. Returns false for unknown names.
+inline bool parseIsa(const std::string& name, Isa& isa) {
+  std::string s;
+  for (char c : name) {
+    s += static_cast<char>(std::tolower(static_cast<unsigned char>(c)));
+  }
+  if (s == "baseline" || s == "sse2" || s == "scalar") {
+    isa = Isa::Baseline;
+  } else if (s == "avx2") {
+    isa = Isa::Avx2;
+  } else if (s == "avx512" || s == "avx-512" || s == "avx512f") {
+    isa = Isa::Avx512;
+  } else {
+    return false;
+  }
+  return true;
+}
+
+// Widest supported set, from CPUID.
+inline Isa detectIsa() {
+#if TOOLS_HAS_ISA_DISPATCH
+  __builtin_cpu_init();
+  if (__builtin_cpu_supports("avx512f") &&
+      __builtin_cpu_supports("avx512vl") &&
+      __builtin_cpu_supports("avx512dq")) {
+    return Isa::Avx512;
+  }
+  if (__builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma")) {
+    return Isa::Avx2;
+  }
+#endif
+  return Isa::Baseline;
+}
+
+struct IsaSelection {
+  Isa detected = Isa::Baseline;
+  Isa active = Isa::Baseline;
+  std::string forced;  // The override as given, empty when unset.
+};
+
+// Applies an override to the detected set. Unknown names are ignored, and
+// an override cannot select a set the CPU lacks.
+inline IsaSelection resolveIsa(Isa detected, const char* forced) {
+  IsaSelection selection;
+  selection.detected = selection.active = detected;
+  Isa requested;
+  if (forced && *forced) {
+    selection.forced = forced;
+    if (parseIsa(forced, requested) && requested < detected) {
+      selection.active = requested;
+    }
+  }
+  return selection;
+}
+
+// The selection used by every dispatched kernel, made once per process.
+inline const IsaSelection& isaSelection() {
+  static const IsaSelection selection =
+      resolveIsa(detectIsa(), std::getenv("TOOLS_FORCE_ISA"));
+  return selection;
+}
+
+namespace detail {
+
+// The set dispatched kernels run with: the selection, or a ScopedIsa's.
+inline std::atomic<Isa>& dispatchedIsa() {
+  static std::atomic<Isa> isa(isaSelection().active);
+  return isa;
+}
+
+}  // namespace detail
+
+inline Isa activeIsa() {
+  return detail::dispatchedIsa().load(std::memory_order_relaxed);
+}
+
+// Runs every dispatched kernel with the given set, lowered to what the CPU
+// supports, until the scope ends. The switch is process-wide: it is meant
+// for tests and benchmarks comparing the builds, not for use while other
+// threads run dispatched kernels.
+class ScopedIsa {
+ public:
+  explicit ScopedIsa(Isa isa)
+      : m_previous(detail::dispatchedIsa().exchange(
+            std::min(isa, isaSelection().detected))) {}
+  ~ScopedIsa() { detail::dispatchedIsa().store(m_previous); }
+
+  ScopedIsa(const ScopedIsa&) = delete;
+  ScopedIsa& operator=(const ScopedIsa&) = delete;
+
+ private:
+  Isa m_previous;
+};
+
+// One line such as "avx2 (detected avx512, TOOLS_FORCE_ISA=avx2)".
+inline std::ostream& reportIsa(std::ostream& out) {
+  const IsaSelection& s = isaSelection();
+  out << isaName(activeIsa()) << " (detected " << isaName(s.detected);
+  if (!s.forced.empty()) out << ", TOOLS_FORCE_ISA=" << s.forced;
+  return out << ")";
+}
+
+namespace detail {
+
+template <class F>
+using RangeKernel = void (*)(const F&, std::size_t, std::size_t);
+
+template <class F>
+void runBaseline(const F& f, std::size_t b, std::size_t e) {
+  f(b, e);
+}
+
+#if TOOLS_HAS_ISA_DISPATCH
+template <class F>
+TOOLS_TARGET_AVX2 void runAvx2(const F& f, std::size_t b, std::size_t e) {
+  f(b, e);
+}
+
+template <class F>
+TOOLS_TARGET_AVX512 void runAvx512(const F& f, std::size_t b, std::size_t e) {
+  f(b, e);
+}
+#endif
+
+// The build of kernel f for one instruction set. Sets without a build
+// fall back to the next narrower one.
+template <class F>
+RangeKernel<F> isaKernel(Isa isa) {
+#if TOOLS_HAS_ISA_DISPATCH
+  if (isa == Isa::Avx512) return &runAvx512<F>;
+  if (isa == Isa::Avx2) return &runAvx2<F>;
+#else
+  (void)isa;
+#endif
+  return &runBaseline<F>;
+}
+
+}  // namespace detail
+
+// Runs kernel(b, e) as compiled for the active ISA; a call costs a relaxed
+// load, two compares and an indirect jump.
+template <class F>
+void dispatchRange(const F& kernel, std::size_t b, std::size_t e) {
+  detail::isaKernel<F>(activeIsa())(kernel, b, e);
+}
+
+// parallelFor whose chunks run the kernel build for the active ISA.
+template <class F>
+void dispatchParallelFor(std::size_t count, std::size_t grain,
+                         const F& kernel) {
+  parallelFor(count, grain, [&](std::size_t b, std::size_t e) {
+    dispatchRange(kernel, b, e);
+  });
+}
@@ -0,0 +1,313 @@
+#pragma once
+
+#include <algorithm>
+#include <array>
+#include <cmath>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <mutex>
+#include <ostream>
+#include <string>
+#include <vector>
+
+#include "application/error.h"
+#include "tools/camera.h"
+#include "tools/parallel.h"
+#include "tools/perfcounters.h"
+#include "tools/profiling.h"
+#include "tools/vec3.h"
+
+enum class ToneMap : std::uint8_t {
+  Clamp,     // Exposure, then clamp to [0, 1].
+  Reinhard,  // c / (1 + c) per channel.
+  Aces       // Narkowicz's fit of the ACES filmic curve.
+};
+
+struct ToneMapParams {
+  ToneMap op = ToneMap::Aces;
+  float exposure = 1.f;
+};
+
+namespace detail {
+
+// Tone maps n pixels given as separate channels into [0, 1]. One loop per
+// operator keeps the loop bodies branch-free for vectorization.
+inline void toneMapRow(std::size_t n, const float* __restrict r,
+                       const float* __restrict g, const float* __restrict b,
+                       const ToneMapParams& params, float* __restrict outR,
+                       float* __restrict outG, float* __restrict outB) {
+  const float e = params.exposure;
+  const float* in[3] = {r, g, b};
+  float* out[3] = {outR, outG, outB};
+  for (int c = 0; c < 3; ++c) {
+    const float* __restrict x = in[c];
+    float* __restrict y = out[c];
+    switch (params.op) {
+      case ToneMap::Clamp:
+        for (std::size_t i = 0; i < n; ++i) {
+          y[i] = std::min(std::max(x[i] * e, 0.f), 1.f);
+        }
+        break;
+      case ToneMap::Reinhard:
+        for (std::size_t i = 0; i < n; ++i) {
+          float v = std::max(x[i] * e, 0.f);
+          y[i] = v / (1.f + v);
+        }
+        break;
+      case ToneMap::Aces:
+        for (std::size_t i = 0; i < n; ++i) {
+          float v = std::max(x[i] * e, 0.f);
+          float num = v * (2.51f * v + 0.03f);
+          float den = v * (2.43f * v + 0.59f) + 0.14f;
+          y[i] = std::min(num / den, 1.f);
+        }
+        break;
+    }
+  }
+}
+
+}  // namespace detail
+
+// Exact sRGB transfer function for linear values in [0, 1].
+inline float linearToSrgb(float v) {
+  return v <= 0.0031308f ? 12.92f * v
+                         : 1.055f * std::pow(v, 1.f / 2.4f) - 0.055f;
+}
+
+//--------------------------------------------
+// 8-bit sRGB encoding by table lookup. Linear [0, 1] is quantized to
+// kBits bits first; at 12 bits the result is within one code of the exact
+// curve everywhere, including the steep segment near black.
+//--------------------------------------------
+
+class SrgbLut {
+ public:
+  static constexpr int kBits = 12;
+  static constexpr std::size_t kSize = std::size_t{1} << kBits;
+
+  static const SrgbLut& instance() {
+    static const SrgbLut lut;
+    return lut;
+  }
+
+  std::uint8_t encode(float v) const {
+    float x = std::min(std::max(v, 0.f), 1.f);
+    return m_table[static_cast<std::size_t>(x * (kSize - 1) + 0.5f)];
+  }
+
+ private:
+  SrgbLut() {
+    for (std::size_t i = 0; i < kSize; ++i) {
+      float s = linearToSrgb(static_cast<float>(i) / (kSize - 1));
+      m_table[i] = static_cast<std::uint8_t>(s * 255.f + 0.5f);
+    }
+  }
+
+  std::array<std::uint8_t, kSize> m_table;
+};
+
+//--------------------------------------------
+// Linear radiance image in SoA layout: one float plane per channel, rows
+// top to bottom. setTile matches the render() sink, so rendering can fill
+// it tile by tile.
+//--------------------------------------------
+
+class Framebuffer {
+ public:
+  Framebuffer() = default;
+  Framebuffer(int width, int height) { resize(width, height); }
+
+  void resize(int width, int height) {
+    m_width = width;
+    m_height = height;
+    std::size_t n = static_cast<std::size_t>(width) * height;
+    m_r.assign(n, 0.f);
+    m_g.assign(n, 0.f);
+    m_b.assign(n, 0.f);
+  }
+
+  void clear() {
+    std::fill(m_r.begin(), m_r.end(), 0.f);
+    std::fill(m_g.begin(), m_g.end(), 0.f);
+    std::fill(m_b.begin(), m_b.end(), 0.f);
+  }
+
+  int width() const { return m_width; }
+  int height() const { return m_height; }
+  std::size_t size() const { return m_r.size(); }
+
+  void set(int x, int y, const Vec3D& c) {
+    std::size_t i = index(x, y);
+    m_r[i] = c.x();
+    m_g[i] = c.y();
+    m_b[i] = c.z();
+  }
+
+  Vec3D get(int x, int y) const {
+    std::size_t i = index(x, y);
+    return Vec3D(m_r[i], m_g[i], m_b[i]);
+  }
+
+  // Stores the tile's pixels, row-major within the tile. Different tiles
+  // may be set concurrently.
+  void setTile(const Tile& tile, const Vec3D* pixels) {
+    for (int y = tile.y0; y < tile.y1; ++y) {
+      std::size_t row = index(tile.x0, y);
+      for (int x = 0; x < tile.width(); ++x, ++pixels) {
+        m_r[row + x] = pixels->x();
+        m_g[row + x] = pixels->y();
+        m_b[row + x] = pixels->z();
+      }
+    }
+  }
+
+  // Tone maps and sRGB-encodes the tile into interleaved 8-bit RGB, rows
+  // top to bottom, 3 * tile.pixelCount() bytes.
+  void encodeTile(const Tile& tile, const ToneMapParams& params,
+                  std::uint8_t* rgb) const;
+
+  // The whole image as interleaved 8-bit sRGB, rows spread over threads.
+  void encode(const ToneMapParams& params,
+              std::vector<std::uint8_t>& rgb) const;
+
+  float* r() { return m_r.data(); }
+  float* g() { return m_g.data(); }
+  float* b() { return m_b.data(); }
+  const float* r() const { return m_r.data(); }
+  const float* g() const { return m_g.data(); }
+  const float* b() const { return m_b.data(); }
+
+ private:
+  std::size_t index(int x, int y) const {
+    return static_cast<std::size_t>(y) * m_width + x;
+  }
+
+  int m_width = 0, m_height = 0;
+  std::vector<float> m_r, m_g, m_b;
+};
+
+inline void Framebuffer::encodeTile(const Tile& tile,
+                                    const ToneMapParams& params,
+                                    std::uint8_t* rgb) const {
+  const std::size_t w = static_cast<std::size_t>(tile.width());
+  std::vector<float> mapped(3 * w);
+  const SrgbLut& lut = SrgbLut::instance();
+  for (int y = tile.y0; y < tile.y1; ++y) {
+    std::size_t row = index(tile.x0, y);
+    detail::toneMapRow(w, r() + row, g() + row, b() + row, params,
+                       mapped.data(), mapped.data() + w,
+                       mapped.data() + 2 * w);
+    for (std::size_t x = 0; x < w; ++x, rgb += 3) {
+      rgb[0] = lut.encode(mapped[x]);
+      rgb[1] = lut.encode(mapped[w + x]);
+      rgb[2] = lut.encode(mapped[2 * w + x]);
+    }
+  }
+}
+
+inline void Framebuffer::encode(const ToneMapParams& params,
+                                std::vector<std::uint8_t>& rgb) const {
+  TOOLS_PERF_REGION("tone_map", size());
+  TOOLS_PROFILE_SCOPE("tone_map");
+  rgb.resize(3 * size());
+  parallelFor(m_height, 16, [&](std::size_t b, std::size_t e) {
+    Tile rows{0, static_cast<int>(b), m_width, static_cast<int>(e)};
+    encodeTile(rows, params, rgb.data() + 3 * index(0, rows.y0));
+  });
+}
+
+enum class ImageFormat : std::uint8_t {
+  Ppm,  // Binary P6: tone mapped 8-bit sRGB.
+  Pfm   // Little-endian float RGB, linear radiance, rows bottom to top.
+};
+
+//--------------------------------------------
+// Writes an image to a seekable stream tile by tile, so encoding and output
+// overlap rendering instead of running as one serial pass at the end. The
+// constructor writes the header and reserves the pixel area; writeTile then
+// seeks to each row of the tile. writeTile is thread-safe: conversion runs
+// in the caller's thread and only the seek and write are serialized.
+//--------------------------------------------
+
+class ImageStreamWriter {
+ public:
+  ImageStreamWriter(std::ostream& out, ImageFormat format, int width,
+                    int height, const ToneMapParams& params = {})
+      : m_out(out),
+        m_format(format),
+        m_width(width),
+        m_height(height),
+        m_params(params) {
+    std::string header =
+        (format == ImageFormat::Ppm ? "P6\n" : "PF\n") + std::to_string(width) +
+        " " + std::to_string(height) +
+        (format == ImageFormat::Ppm ? "\n255\n" : "\n-1.0\n");
+    m_out.write(header.data(), header.size());
+    m_origin = m_out.tellp();
+    std::vector<char> zeros(rowBytes(), 0);
+    for (int y = 0; y < height; ++y) m_out.write(zeros.data(), zeros.size());
+  }
+
+  ImageStreamWriter(const ImageStreamWriter&) = delete;
+  ImageStreamWriter& operator=(const ImageStreamWriter&) = delete;
+
+  void writeTile(const Framebuffer& fb, const Tile& tile);
+
+  // Writes the whole framebuffer as one tile.
+  void write(const Framebuffer& fb) {
+    writeTile(fb, Tile{0, 0, m_width, m_height});
+  }
+
+  bool good() const { return m_out.good(); }
+
+ private:
+  std::size_t pixelBytes() const {
+    return m_format == ImageFormat::Ppm ? 3 : 3 * sizeof(float);
+  }
+  std::size_t rowBytes() const { return pixelBytes() * m_width; }
+
+  std::ostream& m_out;
+  ImageFormat m_format;
+  int m_width, m_height;
+  ToneMapParams m_params;
+  std::streampos m_origin;
+  std::mutex m_mutex;
+};
+
+inline void ImageStreamWriter::writeTile(const Framebuffer& fb,
+                                         const Tile& tile) {
+  TOOLS_PROFILE_SCOPE("image_write_tile");
+  APP_ASSERT(fb.width() == m_width && fb.height() == m_height,
+             "Framebuffer and image differ in size!");
+  APP_ASSERT(tile.x0 >= 0 && tile.y0 >= 0 && tile.x0 <= tile.x1 &&
+                 tile.y0 <= tile.y1 && tile.x1 <= m_width &&
+                 tile.y1 <= m_height,
+             "Tile outside the image!");
+  const std::size_t span = pixelBytes() * tile.width();
+  std::vector<char> bytes(span * tile.height());
+  if (m_format == ImageFormat::Ppm) {
+    fb.encodeTile(tile, m_params,
+                  reinterpret_cast<std::uint8_t*>(bytes.data()));
+  } else {
+    // PFM is little-endian here, as on every platform this builds for.
+    char* dst = bytes.data();
+    for (int y = tile.y0; y < tile.y1; ++y) {
+      for (int x = tile.x0; x < tile.x1; ++x) {
+        std::size_t i = static_cast<std::size_t>(y) * fb.width() + x;
+        float px[3] = {fb.r()[i], fb.g()[i], fb.b()[i]};
+        std::memcpy(dst, px, sizeof(px));
+        dst += sizeof(px);
+      }
+    }
+  }
+
+  std::lock_guard<std::mutex> lock(m_mutex);
+  for (int y = tile.y0; y < tile.y1; ++y) {
+    int fileRow = m_format == ImageFormat::Ppm ? y : m_height - 1 - y;
+    std::streamoff offset = static_cast<std::streamoff>(fileRow) * rowBytes() +
+                            static_cast<std::streamoff>(pixelBytes()) * tile.x0;
+    m_out.seekp(m_origin + offset);
+    m_out.write(bytes.data() + span * (y - tile.y0), span);
+  }
+}
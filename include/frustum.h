@@ -0,0 +1,142 @@
+#pragma once
+
+#include <algorithm>
+#include <cassert>
+#include <cmath>
+#include <cstddef>
+#include <cstdint>
+#include <limits>
+#include <vector>
+
+#include "tools/mat4.h"
+#include "tools/parallel.h"
+#include "tools/perfcounters.h"
+#include "tools/profiling.h"
+#include "tools/primitives.h"
+#include "tools/vec4.h"
+
+enum class Visibility : std::uint8_t {
+  Outside = 0,
+  Intersecting = 1,
+  Inside = 2
+};
+
+// Six planes (left, right, bottom, top, near, far) with inward unit normals:
+// p is inside when a * p.x + b * p.y + c * p.z + d >= 0 for all of them.
+class Frustum {
+ public:
+  Frustum() = default;
+  explicit Frustum(const Mat4D& viewProjection) { extract(viewProjection); }
+
+  // Gribb-Hartmann extraction from projection * view_transform.
+  void extract(const Mat4D& m) {
+    const Vec4D r0 = m[0], r1 = m[1], r2 = m[2], r3 = m[3];
+    const Vec4D planes[6] = {r3 + r0, r3 - r0, r3 + r1,
+                             r3 - r1, r3 + r2, r3 - r2};
+    for (int i = 0; i < 6; ++i) {
+      float len = Vec3D(planes[i]).length();
+      m_a[i] = planes[i].x() / len;
+      m_b[i] = planes[i].y() / len;
+      m_c[i] = planes[i].z() / len;
+      m_d[i] = planes[i].w() / len;
+    }
+  }
+
+  Vec4D plane(int i) const {
+    assert(i >= 0 && i <= 5);
+    return Vec4D(m_a[i], m_b[i], m_c[i], m_d[i]);
+  }
+
+  Visibility classify(const Point3D& center, float radius) const {
+    return classifyLane(center.x(), center.y(), center.z(), radius, 0.f, 0.f,
+                        0.f);
+  }
+
+  Visibility classify(const Bounds3D& b) const {
+    Point3D c = b.centroid();
+    Vec3D e = b.diagonal() * 0.5f;
+    return classifyLane(c.x(), c.y(), c.z(), 0.f, e.x(), e.y(), e.z());
+  }
+
+  // Spheres pass their radius r, boxes their half extents e. The distance
+  // band on each plane is then r + |a| ex + |b| ey + |c| ez.
+  Visibility classifyLane(float cx, float cy, float cz, float r, float ex,
+                          float ey, float ez) const {
+    float minOuter = std::numeric_limits<float>::infinity();
+    float minInner = minOuter;
+    for (int i = 0; i < 6; ++i) {
+      float dist = m_a[i] * cx + m_b[i] * cy + m_c[i] * cz + m_d[i];
+      float band = r + std::fabs(m_a[i]) * ex + std::fabs(m_b[i]) * ey +
+                   std::fabs(m_c[i]) * ez;
+      minOuter = std::min(minOuter, dist + band);
+      minInner = std::min(minInner, dist - band);
+    }
+    std::uint8_t v = minOuter < 0.f ? 0 : (minInner >= 0.f ? 2 : 1);
+    return static_cast<Visibility>(v);
+  }
+
+ private:
+  float m_a[6] = {};
+  float m_b[6] = {};
+  float m_c[6] = {};
+  float m_d[6] = {};
+};
+
+//--------------------------------------------
+// Batch culling. Masks are computed in parallel chunks, one element per SIMD
+// lane; the index lists keep 'inside' and 'intersecting' apart so children
+// of fully visible nodes can skip their own tests.
+//--------------------------------------------
+
+inline void cull(const Frustum& frustum, const SphereSoA& spheres,
+                 std::vector<Visibility>& mask) {
+  TOOLS_PERF_REGION("frustum_cull_spheres", spheres.size());
+  TOOLS_PROFILE_SCOPE("frustum_cull_spheres");
+  mask.resize(spheres.size());
+  const float *cx = spheres.cx(), *cy = spheres.cy(), *cz = spheres.cz(),
+              *r = spheres.radii();
+  Visibility* out = mask.data();
+  parallelFor(spheres.size(), 8192, [&](std::size_t b, std::size_t e) {
+    for (std::size_t i = b; i < e; ++i) {
+      out[i] = frustum.classifyLane(cx[i], cy[i], cz[i], r[i], 0.f, 0.f, 0.f);
+    }
+  });
+}
+
+inline void cull(const Frustum& frustum, const BoundsSoA& boxes,
+                 std::vector<Visibility>& mask) {
+  TOOLS_PERF_REGION("frustum_cull_boxes", boxes.size());
+  TOOLS_PROFILE_SCOPE("frustum_cull_boxes");
+  mask.resize(boxes.size());
+  const float *x0 = boxes.minx(), *y0 = boxes.miny(), *z0 = boxes.minz();
+  const float *x1 = boxes.maxx(), *y1 = boxes.maxy(), *z1 = boxes.maxz();
+  Visibility* out = mask.data();
+  parallelFor(boxes.size(), 8192, [&](std::size_t b, std::size_t e) {
+    for (std::size_t i = b; i < e; ++i) {
+      out[i] = frustum.classifyLane(
+          0.5f * (x0[i] + x1[i]), 0.5f * (y0[i] + y1[i]),
+          0.5f * (z0[i] + z1[i]), 0.f, 0.5f * (x1[i] - x0[i]),
+          0.5f * (y1[i] - y0[i]), 0.5f * (z1[i] - z0[i]));
+    }
+  });
+}
+
+inline void compact(const std::vector<Visibility>& mask,
+                    std::vector<int>& inside, std::vector<int>& intersecting) {
+  inside.clear();
+  intersecting.clear();
+  for (std::size_t i = 0; i < mask.size(); ++i) {
+    if (mask[i] == Visibility::Inside) inside.push_back(static_cast<int>(i));
+    if (mask[i] == Visibility::Intersecting) {
+      intersecting.push_back(static_cast<int>(i));
+    }
+  }
+}
+
+template <typename Bounds>
+void cullIndices(const Frustum& frustum, const Bounds& bounds,
+                 std::vector<int>& inside, std::vector<int>& intersecting) {
+  std::vector<Visibility> mask;
+  cull(frustum, bounds, mask);
+  compact(mask, inside, intersecting);
+}
@@ -0,0 +1,82 @@
+#pragma once
+
+#include <cstdint>
+
+//--------------------------------------------
+// Forward declarations of the library types and their float aliases, for
+// headers that only pass them by reference or pointer. Including this
+// instead of the full headers keeps such headers free of the math code and
+// its standard library dependencies.
+//--------------------------------------------
+
+template <class T>
+class Vec2;
+template <class T>
+class Vec3;
+template <class T>
+class Vec4;
+template <class T>
+class Point3;
+template <class T>
+class Normal3;
+template <class T>
+class AlignedVec3;
+template <class T>
+class AlignedPoint3;
+template <class T>
+class AlignedNormal3;
+template <class T>
+class Mat2;
+template <class T>
+class Mat3;
+template <class T>
+class Mat4;
+template <class T>
+class VecX;
+template <class T>
+class MatX;
+template <class T, int N>
+class MatSoA;
+template <class T, int N>
+class VecSoA;
+template <class T>
+class Bounds3;
+
+using Vec2D = Vec2<float>;
+using Vec3D = Vec3<float>;
+using Vec4D = Vec4<float>;
+using Point3D = Point3<float>;
+using Normal3D = Normal3<float>;
+using Vec3A = AlignedVec3<float>;
+using Point3A = AlignedPoint3<float>;
+using Normal3A = AlignedNormal3<float>;
+using Mat2D = Mat2<float>;
+using Mat3D = Mat3<float>;
+using Mat4D = Mat4<float>;
+using VecXD = VecX<float>;
+using MatXD = MatX<float>;
+using Bounds3D = Bounds3<float>;
+
+class Ray;
+class RayBatch;
+class HitBatch;
+class RayQueue;
+class OrthoNormalBasis;
+class PointLight;
+class SphereSoA;
+class BoundsSoA;
+class PlaneSoA;
+class Frustum;
+class LBVH;
+class SphereGeometry;
+class Instance;
+class InstanceBVH;
+class Camera;
+class Framebuffer;
+struct Tile;
+struct HitRecord;
+
+enum class Isa : std::uint8_t;
+enum class Summation : std::uint8_t;
+enum class SpaceFillingCurve : std::uint8_t;
+enum class Visibility : std::uint8_t;
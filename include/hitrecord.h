@@ -0,0 +1,56 @@
+#pragma once
+
+#include <limits>
+#include <type_traits>
+
+#include "tools/normal3.h"
+#include "tools/orthonormal.h"
+#include "tools/ray.h"
+
+//--------------------------------------------
+// Result of a closest-hit query. The record holds only plain floats and
+// ints so it stays trivially copyable and can be stored in result buffers
+// as is; the hit point and the shading frame are derived on demand.
+//
+// Closest-hit protocol: a primitive test offers its hit through report(),
+// which accepts it only inside the ray's current range and then clips the
+// range to it. Tests run later with the same ray reject everything behind
+// the closest hit so far, and the caller computes the normal (and anything
+// else expensive) only when report() returns true.
+//--------------------------------------------
+
+struct HitRecord {
+  float t = std::numeric_limits<float>::infinity();
+  int primId = -1;
+  int instId = -1;  // Instance holding the primitive, -1 outside instancing.
+  // Barycentric weights of the second and third triangle vertices (the
+  // first gets 1 - u - v). Primitives without vertices leave them zero.
+  float u = 0.f;
+  float v = 0.f;
+  Normal3D normal;  // Unit geometric normal, set for accepted hits.
+
+  bool hit() const { return primId >= 0; }
+
+  Point3D position(const Ray& ray) const { return ray.position(t); }
+
+  // Shading frame with w along the normal.
+  OrthoNormalBasis basis() const {
+    OrthoNormalBasis onb;
+    onb.buildFromW(Vec3D(normal.x(), normal.y(), normal.z()));
+    return onb;
+  }
+
+  bool report(const Ray& ray, float tHit, int id, float b1 = 0.f,
+              float b2 = 0.f) {
+    if (!ray.clipMaxRange(tHit)) return false;
+    t = tHit;
+    primId = id;
+    instId = -1;
+    u = b1;
+    v = b2;
+    return true;
+  }
+};
+
+static_assert(std::is_trivially_copyable_v<HitRecord>);
+static_assert(sizeof(HitRecord) == 8 * sizeof(float));
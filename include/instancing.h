@@ -0,0 +1,210 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <limits>
+#include <utility>
+#include <vector>
+
+#include "application/error.h"
+#include "tools/bounds3.h"
+#include "tools/hitrecord.h"
+#include "tools/lbvh.h"
+#include "tools/mat4.h"
+#include "tools/parallel.h"
+#include "tools/perfcounters.h"
+#include "tools/primitives.h"
+#include "tools/profiling.h"
+#include "tools/ray.h"
+#include "tools/vec4.h"
+
+//--------------------------------------------
+// Two-level (instanced) scenes. Geometry is stored and built once in its
+// own object space; an instance places it in the world through a Mat4 and
+// the cached inverse. The top level is an LBVH over the world boxes of the
+// instances, and rays reaching an instance are carried into its object
+// space to traverse the shared bottom level.
+//
+// Ray directions are transformed but not renormalized, so a hit distance t
+// means the same point in both spaces and ranges pass through unchanged.
+//--------------------------------------------
+
+// Bottom level: spheres in object space with their BVH.
+class SphereGeometry {
+ public:
+  SphereGeometry() = default;
+  explicit SphereGeometry(SphereSoA spheres,
+                          const LBVHBuildParams& params = {}) {
+    build(std::move(spheres), params);
+  }
+
+  void build(SphereSoA spheres, const LBVHBuildParams& params = {}) {
+    m_spheres = std::move(spheres);
+    m_bvh.build(primitiveBounds(m_spheres), params);
+  }
+
+  const SphereSoA& spheres() const { return m_spheres; }
+  const LBVH& bvh() const { return m_bvh; }
+  Bounds3D bounds() const { return m_bvh.bounds(); }
+
+ private:
+  SphereSoA m_spheres;
+  LBVH m_bvh;
+};
+
+class Instance {
+ public:
+  Instance() = default;
+  Instance(const Mat4D& objectToWorld, std::uint32_t geometry)
+      : m_geometry(geometry) {
+    setTransform(objectToWorld);
+  }
+
+  // Also refreshes the cached inverse; the transform must be invertible.
+  void setTransform(const Mat4D& objectToWorld) {
+    m_objectToWorld = objectToWorld;
+    m_worldToObject = objectToWorld.inverse();
+  }
+
+  const Mat4D& objectToWorld() const { return m_objectToWorld; }
+  const Mat4D& worldToObject() const { return m_worldToObject; }
+  std::uint32_t geometry() const { return m_geometry; }
+
+  // The world ray in object space, keeping its range.
+  Ray toObject(const Ray& ray) const {
+    Ray local(Point3D(m_worldToObject * Vec4D(ray.origin())),
+              Vec3D(m_worldToObject * Vec4D(ray.direction())));
+    local.setMaxRange(ray.getMaxRange());
+    return local;
+  }
+
+  // Object-space normal to world space through the inverse transpose.
+  Normal3D normalToWorld(const Normal3D& n) const {
+    const Mat4D& w = m_worldToObject;
+    Vec3D out(w[0][0] * n.x() + w[1][0] * n.y() + w[2][0] * n.z(),
+              w[0][1] * n.x() + w[1][1] * n.y() + w[2][1] * n.z(),
+              w[0][2] * n.x() + w[1][2] * n.y() + w[2][2] * n.z());
+    return Normal3D(getUnitVectorOf(out));
+  }
+
+  // World box around an object-space box: the box of its eight corners.
+  Bounds3D toWorld(const Bounds3D& local) const {
+    Bounds3D world;
+    for (int c = 0; c < 8; ++c) {
+      Point3D corner(c & 1 ? local.max().x() : local.min().x(),
+                     c & 2 ? local.max().y() : local.min().y(),
+                     c & 4 ? local.max().z() : local.min().z());
+      world.expand(Point3D(m_objectToWorld * Vec4D(corner)));
+    }
+    return world;
+  }
+
+ private:
+  Mat4D m_objectToWorld;
+  Mat4D m_worldToObject;
+  std::uint32_t m_geometry = 0;
+};
+
+//--------------------------------------------
+// Top level. Moving instances only needs setTransform() and refit(), which
+// refreshes the instance boxes and the top-level tree; no bottom level is
+// touched. Adding instances or geometry needs build().
+//--------------------------------------------
+
+class InstanceBVH {
+ public:
+  std::uint32_t addGeometry(SphereGeometry geometry) {
+    m_geometries.push_back(std::move(geometry));
+    return static_cast<std::uint32_t>(m_geometries.size() - 1);
+  }
+
+  std::uint32_t addInstance(const Mat4D& objectToWorld,
+                            std::uint32_t geometry) {
+    APP_ASSERT(geometry < m_geometries.size(), "Unknown geometry!");
+    m_instances.emplace_back(objectToWorld, geometry);
+    return static_cast<std::uint32_t>(m_instances.size() - 1);
+  }
+
+  void setTransform(std::size_t i, const Mat4D& objectToWorld) {
+    m_instances[i].setTransform(objectToWorld);
+  }
+
+  std::size_t geometryCount() const { return m_geometries.size(); }
+  std::size_t instanceCount() const { return m_instances.size(); }
+  const SphereGeometry& geometry(std::size_t i) const {
+    return m_geometries[i];
+  }
+  const Instance& instance(std::size_t i) const { return m_instances[i]; }
+  const LBVH& bvh() const { return m_bvh; }
+  Bounds3D bounds() const { return m_bvh.bounds(); }
+
+  void build(const LBVHBuildParams& params = {}) {
+    m_bvh.build(instanceBounds(), params);
+  }
+
+  void refit() { m_bvh.refit(instanceBounds()); }
+
+ private:
+  std::vector<Bounds3D> instanceBounds() const {
+    std::vector<Bounds3D> boxes(m_instances.size());
+    parallelFor(boxes.size(), 1024, [&](std::size_t b, std::size_t e) {
+      for (std::size_t i = b; i < e; ++i) {
+        const Instance& inst = m_instances[i];
+        boxes[i] = inst.toWorld(m_geometries[inst.geometry()].bounds());
+      }
+    });
+    return boxes;
+  }
+
+  std::vector<SphereGeometry> m_geometries;
+  std::vector<Instance> m_instances;
+  LBVH m_bvh;
+};
+
+//--------------------------------------------
+// Queries. Each instance the top level reaches is tested with the ray
+// carried into its object space, ranged to the closest hit so far.
+//--------------------------------------------
+
+inline bool intersect(const Ray& ray, const InstanceBVH& scene,
+                      HitRecord& rec, float tMin = kRayEpsilon) {
+  TOOLS_PROFILE_SCOPE("instance_intersect");
+  int prim = -1;
+  NearestHit hit = scene.bvh().intersect(
+      ray,
+      [&](std::uint32_t i, float t0, float t1) {
+        const Instance& inst = scene.instance(i);
+        const SphereGeometry& geometry = scene.geometry(inst.geometry());
+        Ray local = inst.toObject(ray);
+        local.setMaxRange(t1);
+        NearestHit h = intersect(local, geometry.bvh(), geometry.spheres(), t0);
+        // Only hits closer than t1 come back, and those always win.
+        if (h.hit()) prim = h.index;
+        return h.t;
+      },
+      tMin);
+  if (!hit.hit() || !rec.report(ray, hit.t, prim)) return false;
+  const Instance& inst = scene.instance(hit.index);
+  const SphereSoA& spheres = scene.geometry(inst.geometry()).spheres();
+  Point3D local = inst.toObject(ray).position(hit.t);
+  rec.instId = hit.index;
+  rec.normal = inst.normalToWorld(spheres.normalAt(prim, local));
+  return true;
+}
+
+inline bool occluded(const Ray& ray, const InstanceBVH& scene,
+                     float tMin = kRayEpsilon) {
+  const float inf = std::numeric_limits<float>::infinity();
+  return scene.bvh().occluded(
+      ray,
+      [&](std::uint32_t i, float t0, float t1) {
+        const Instance& inst = scene.instance(i);
+        const SphereGeometry& geometry = scene.geometry(inst.geometry());
+        Ray local = inst.toObject(ray);
+        local.setMaxRange(t1);
+        // Any distance inside the range reads as blocked.
+        return occluded(local, geometry.bvh(), geometry.spheres(), t0) ? t0
+                                                                       : inf;
+      },
+      tMin);
+}
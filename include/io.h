@@ -0,0 +1,180 @@
+#pragma once
+
+#include <iostream>
+#include <sstream>
+
+#include "tools/mat2.h"
+#include "tools/mat3.h"
+#include "tools/mat4.h"
+#include "tools/matx.h"
+#include "tools/normal3.h"
+#include "tools/point3.h"
+#include "tools/vec2.h"
+#include "tools/vec3.h"
+#include "tools/vec3a.h"
+#include "tools/vec4.h"
+
+//--------------------------------------------
+// Stream operators for the math types. They live apart from the type
+// headers so that code which only computes does not compile iostreams;
+// include this header (or tools.h) to print or parse values.
+//--------------------------------------------
+
+// Vec2
+
+template <typename T>
+inline std::istream& operator>>(std::istream& in, Vec2<T>& v) {
+  T x, y;
+  in >> x >> y;
+  v.set(x, y);
+  return in;
+}
+
+template <typename T>
+inline std::ostream& operator<<(std::ostream& out, const Vec2<T>& v) {
+  out << "(" << v.x() << "," << v.y() << ")";
+  return out;
+}
+
+// Vec3
+
+template <typename T>
+inline std::istream& operator>>(std::istream& in, Vec3<T>& v) {
+  T x, y, z;
+  in >> x >> y >> z;
+  v.set(x, y, z);
+  return in;
+}
+
+template <typename T>
+inline std::ostream& operator<<(std::ostream& out, const Vec3<T>& v) {
+  out << "(" << v.x() << "," << v.y() << "," << v.z() << ")" << std::endl;
+  return out;
+}
+
+// Vec4
+
+template <typename T>
+std::istream& operator>>(std::istream& in, Vec4<T>& v) {
+  T x, y, z, w;
+  in >> x >> y >> z >> w;
+  v.set(x, y, z, w);
+  return in;
+}
+
+template <typename T>
+std::ostream& operator<<(std::ostream& out, const Vec4<T>& v) {
+  out << "(" << v.x() << "," << v.y() << "," << v.z() << "," << v.w() << ")";
+  return out;
+}
+
+// Point3
+
+template <typename T>
+std::stringstream &operator<<(std::stringstream &out, const Point3<T> &p) {
+  out << "(" << p.x() << "," << p.y() << "," << p.z() << ")";
+  return out;
+}
+
+template <typename T>
+std::ostream &operator<<(std::ostream &out, const Point3<T> &p) {
+  out << "(" << p.x() << "," << p.y() << "," << p.z() << ")";
+  return out;
+}
+
+// Normal3
+
+template <typename T>
+inline std::istream& operator>>(std::istream& in, Normal3<T>& n) {
+  T x, y, z;
+  in >> x >> y >> z;
+  n.set(x, y, z);
+  return in;
+}
+
+template <typename T>
+inline std::ostream& operator<<(std::ostream& out, const Normal3<T>& n) {
+  out << "(" << n.x() << "," << n.y() << "," << n.z() << ")" << std::endl;
+  return out;
+}
+
+// Vec3A / Point3A / Normal3A
+
+template <typename T>
+inline std::istream& operator>>(std::istream& in, AlignedVec3<T>& v) {
+  T x, y, z;
+  in >> x >> y >> z;
+  v.set(x, y, z);
+  return in;
+}
+
+template <typename T>
+inline std::ostream& operator<<(std::ostream& out, const AlignedVec3<T>& v) {
+  return out << Vec3<T>(v);
+}
+
+template <typename T>
+inline std::ostream& operator<<(std::ostream& out,
+                                const AlignedPoint3<T>& p) {
+  return out << Point3<T>(p);
+}
+
+template <typename T>
+inline std::istream& operator>>(std::istream& in, AlignedNormal3<T>& n) {
+  T x, y, z;
+  in >> x >> y >> z;
+  n.set(x, y, z);
+  return in;
+}
+
+template <typename T>
+inline std::ostream& operator<<(std::ostream& out,
+                                const AlignedNormal3<T>& n) {
+  return out << Normal3<T>(n);
+}
+
+// Mat2
+
+template <typename T>
+std::ostream& operator<<(std::ostream& out, const Mat2<T>& m) {
+  out << "{" << m[0] << "," << m[1] << "}";
+  return out;
+}
+
+// Mat3
+
+template <typename T>
+std::ostream& operator<<(std::ostream& out, const Mat3<T>& m) {
+  out << "{" << m[0] << "," << m[1] << "," << m[2] << "}";
+  return out;
+}
+
+// Mat4
+
+template <typename T>
+std::ostream& operator<<(std::ostream& out, const Mat4<T>& m) {
+  out << "{" << m[0] << "," << m[1] << "," << m[2] << "," << m[3] << "}";
+  return out;
+}
+
+// VecX / MatX
+
+template <typename T>
+std::ostream& operator<<(std::ostream& out, const VecX<T>& v) {
+  out << "(";
+  for (std::size_t i = 0; i < v.size(); ++i) out << (i ? "," : "") << v[i];
+  out << ")";
+  return out;
+}
+
+template <typename T>
+std::ostream& operator<<(std::ostream& out, const MatX<T>& m) {
+  out << "{";
+  for (std::size_t r = 0; r < m.rows(); ++r) {
+    out << (r ? ",(" : "(");
+    for (std::size_t c = 0; c < m.cols(); ++c) out << (c ? "," : "") << m(r, c);
+    out << ")";
+  }
+  out << "}";
+  return out;
+}
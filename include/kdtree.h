@@ -0,0 +1,310 @@
+#pragma once
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <limits>
+#include <numeric>
+#include <vector>
+
+#include "tools/parallel.h"
+#include "tools/perfcounters.h"
+#include "tools/point3.h"
+#include "tools/profiling.h"
+#include "tools/vec2.h"
+#include "tools/vec3.h"
+#include "tools/vec4.h"
+
+// Scalar type and dimension of the point types a KdTree can index.
+template <class P>
+struct KdPointTraits;
+
+template <class T>
+struct KdPointTraits<Vec2<T>> {
+  using Scalar = T;
+  static constexpr int kDim = 2;
+};
+
+template <class T>
+struct KdPointTraits<Vec3<T>> {
+  using Scalar = T;
+  static constexpr int kDim = 3;
+};
+
+template <class T>
+struct KdPointTraits<Point3<T>> {
+  using Scalar = T;
+  static constexpr int kDim = 3;
+};
+
+template <class T>
+struct KdPointTraits<Vec4<T>> {
+  using Scalar = T;
+  static constexpr int kDim = 4;
+};
+
+template <class T>
+struct KdNeighbor {
+  std::uint32_t index;
+  T distSquared;
+
+  bool operator<(const KdNeighbor& rhs) const {
+    if (distSquared != rhs.distSquared) return distSquared < rhs.distSquared;
+    return index < rhs.index;
+  }
+};
+
+//--------------------------------------------
+// Implicit k-d tree. The points are stored in tree order: the node of a
+// range [b, e) is its median m = (b + e) / 2, with children [b, m) and
+// [m + 1, e), so the tree needs no child pointers and a subtree is one
+// contiguous block of memory. Ranges of at most kLeafSize points are
+// scanned linearly.
+//--------------------------------------------
+
+template <class P>
+class KdTree {
+ public:
+  using Scalar = typename KdPointTraits<P>::Scalar;
+  using Neighbor = KdNeighbor<Scalar>;
+  static constexpr int kDim = KdPointTraits<P>::kDim;
+  static constexpr std::size_t kLeafSize = 8;
+
+  KdTree() = default;
+  explicit KdTree(const std::vector<P>& points) { build(points); }
+
+  void build(const std::vector<P>& points);
+
+  std::size_t size() const { return m_points.size(); }
+  bool empty() const { return m_points.empty(); }
+
+  // Original indices in tree order. Consecutive entries are spatially
+  // close, which makes this a good order for streaming over the points.
+  const std::vector<std::uint32_t>& sortedIndices() const { return m_index; }
+
+  // The k nearest points to q, nearest first (ties by index). Returns fewer
+  // than k when the tree is smaller.
+  void knn(const P& q, std::size_t k, std::vector<Neighbor>& out) const;
+
+  // All points within radius of q, nearest first.
+  void radius(const P& q, Scalar r, std::vector<Neighbor>& out) const;
+
+  // Batched kNN over threads. Results use a fixed stride of
+  // min(k, size()) entries per query: query i owns
+  // out[i * stride .. (i + 1) * stride). Returns the stride.
+  std::size_t knn(const std::vector<P>& queries, std::size_t k,
+                  std::vector<Neighbor>& out) const;
+
+  // Batched radius search in CSR form: the neighbors of query i are
+  // out[offsets[i] .. offsets[i + 1]).
+  void radius(const std::vector<P>& queries, Scalar r,
+              std::vector<std::uint32_t>& offsets,
+              std::vector<Neighbor>& out) const;
+
+ private:
+  static Scalar distSquared(const P& a, const P& b) {
+    Scalar d2 = Scalar{0};
+    for (int i = 0; i < kDim; ++i) {
+      Scalar d = a[i] - b[i];
+      d2 += d * d;
+    }
+    return d2;
+  }
+
+  void buildRecursive(std::vector<std::uint32_t>& order, std::size_t begin,
+                      std::size_t end, int depth);
+
+  template <typename Visit>
+  void search(const P& q, std::size_t begin, std::size_t end,
+              const Scalar& bound, Visit& visit) const;
+
+  std::vector<P> m_points;
+  std::vector<std::uint32_t> m_index;
+  std::vector<std::uint8_t> m_split;
+};
+
+using KdTreeVec2D = KdTree<Vec2D>;
+using KdTreeVec3D = KdTree<Vec3D>;
+using KdTreePoint3D = KdTree<Point3D>;
+using KdTreeVec4D = KdTree<Vec4D>;
+
+namespace detail {
+inline constexpr std::size_t kKdQueryGrain = 256;
+}  // namespace detail
+
+template <class P>
+void KdTree<P>::build(const std::vector<P>& points) {
+  const std::size_t n = points.size();
+  TOOLS_PERF_REGION("kdtree_build", n);
+  TOOLS_PROFILE_SCOPE("kdtree_build");
+  m_points = points;
+  m_index.resize(n);
+  m_split.assign(n, 0);
+  std::vector<std::uint32_t> order(n);
+  std::iota(order.begin(), order.end(), 0);
+  buildRecursive(order, 0, n, 0);
+
+  std::vector<P> sorted(n);
+  parallelFor(n, 4096, [&](std::size_t b, std::size_t e) {
+    for (std::size_t i = b; i < e; ++i) {
+      sorted[i] = points[order[i]];
+      m_index[i] = order[i];
+    }
+  });
+  m_points.swap(sorted);
+}
+
+// Splits on the axis of largest spread. Sibling subtrees own disjoint
+// ranges of `order`, so the upper levels are built concurrently.
+template <class P>
+void KdTree<P>::buildRecursive(std::vector<std::uint32_t>& order,
+                               std::size_t begin, std::size_t end,
+                               int depth) {
+  if (end - begin <= kLeafSize) return;
+
+  Scalar lo[kDim], hi[kDim];
+  for (int d = 0; d < kDim; ++d) {
+    lo[d] = std::numeric_limits<Scalar>::max();
+    hi[d] = std::numeric_limits<Scalar>::lowest();
+  }
+  for (std::size_t i = begin; i < end; ++i) {
+    const P& p = m_points[order[i]];
+    for (int d = 0; d < kDim; ++d) {
+      lo[d] = std::min(lo[d], p[d]);
+      hi[d] = std::max(hi[d], p[d]);
+    }
+  }
+  int axis = 0;
+  for (int d = 1; d < kDim; ++d) {
+    if (hi[d] - lo[d] > hi[axis] - lo[axis]) axis = d;
+  }
+
+  std::size_t mid = begin + (end - begin) / 2;
+  std::nth_element(order.begin() + begin, order.begin() + mid,
+                   order.begin() + end, [&](std::uint32_t a, std::uint32_t b) {
+                     return m_points[a][axis] < m_points[b][axis];
+                   });
+  m_split[mid] = static_cast<std::uint8_t>(axis);
+
+  auto buildLeft = [&, depth]() {
+    buildRecursive(order, begin, mid, depth + 1);
+  };
+  auto buildRight = [&, depth]() {
+    buildRecursive(order, mid + 1, end, depth + 1);
+  };
+  if (depth < 4 && end - begin > 8192) {
+    parallelInvoke(buildLeft, buildRight);
+  } else {
+    buildLeft();
+    buildRight();
+  }
+}
+
+// Visits candidate points of [begin, end), nearest subtree first. `bound`
+// is the current squared search radius; visit may shrink it.
+template <class P>
+template <typename Visit>
+void KdTree<P>::search(const P& q, std::size_t begin, std::size_t end,
+                       const Scalar& bound, Visit& visit) const {
+  if (end - begin <= kLeafSize) {
+    for (std::size_t i = begin; i < end; ++i) {
+      visit(i, distSquared(q, m_points[i]));
+    }
+    return;
+  }
+  std::size_t mid = begin + (end - begin) / 2;
+  int axis = m_split[mid];
+  Scalar diff = q[axis] - m_points[mid][axis];
+  visit(mid, distSquared(q, m_points[mid]));
+  if (diff < Scalar{0}) {
+    search(q, begin, mid, bound, visit);
+    if (diff * diff <= bound) search(q, mid + 1, end, bound, visit);
+  } else {
+    search(q, mid + 1, end, bound, visit);
+    if (diff * diff <= bound) search(q, begin, mid, bound, visit);
+  }
+}
+
+template <class P>
+void KdTree<P>::knn(const P& q, std::size_t k,
+                    std::vector<Neighbor>& out) const {
+  out.clear();
+  k = std::min(k, size());
+  if (k == 0) return;
+  // Max-heap of the best k so far; the bound is the worst of them once full.
+  Scalar bound = std::numeric_limits<Scalar>::infinity();
+  auto visit = [&](std::size_t i, Scalar d2) {
+    Neighbor cand{m_index[i], d2};
+    if (out.size() < k) {
+      out.push_back(cand);
+      std::push_heap(out.begin(), out.end());
+      if (out.size() == k) bound = out.front().distSquared;
+    } else if (cand < out.front()) {
+      std::pop_heap(out.begin(), out.end());
+      out.back() = cand;
+      std::push_heap(out.begin(), out.end());
+      bound = out.front().distSquared;
+    }
+  };
+  search(q, 0, size(), bound, visit);
+  std::sort_heap(out.begin(), out.end());
+}
+
+template <class P>
+void KdTree<P>::radius(const P& q, Scalar r,
+                       std::vector<Neighbor>& out) const {
+  out.clear();
+  const Scalar bound = r * r;
+  auto visit = [&](std::size_t i, Scalar d2) {
+    if (d2 <= bound) out.push_back(Neighbor{m_index[i], d2});
+  };
+  search(q, 0, size(), bound, visit);
+  std::sort(out.begin(), out.end());
+}
+
+template <class P>
+std::size_t KdTree<P>::knn(const std::vector<P>& queries, std::size_t k,
+                           std::vector<Neighbor>& out) const {
+  TOOLS_PERF_REGION("kdtree_knn", queries.size());
+  TOOLS_PROFILE_SCOPE("kdtree_knn");
+  const std::size_t stride = std::min(k, size());
+  out.resize(queries.size() * stride);
+  parallelFor(queries.size(), detail::kKdQueryGrain,
+              [&](std::size_t b, std::size_t e) {
+                std::vector<Neighbor> local;
+                for (std::size_t i = b; i < e; ++i) {
+                  knn(queries[i], stride, local);
+                  std::copy(local.begin(), local.end(),
+                            out.begin() + i * stride);
+                }
+              });
+  return stride;
+}
+
+template <class P>
+void KdTree<P>::radius(const std::vector<P>& queries, Scalar r,
+                       std::vector<std::uint32_t>& offsets,
+                       std::vector<Neighbor>& out) const {
+  const std::size_t q = queries.size();
+  TOOLS_PERF_REGION("kdtree_radius", q);
+  TOOLS_PROFILE_SCOPE("kdtree_radius");
+  const std::size_t chunks =
+      (q + detail::kKdQueryGrain - 1) / detail::kKdQueryGrain;
+  std::vector<std::vector<Neighbor>> partial(chunks);
+  offsets.assign(q + 1, 0);
+  parallelFor(chunks, 1, [&](std::size_t cb, std::size_t ce) {
+    std::vector<Neighbor> local;
+    for (std::size_t c = cb; c < ce; ++c) {
+      std::size_t end = std::min(q, (c + 1) * detail::kKdQueryGrain);
+      for (std::size_t i = c * detail::kKdQueryGrain; i < end; ++i) {
+        radius(queries[i], r, local);
+        partial[c].insert(partial[c].end(), local.begin(), local.end());
+        offsets[i + 1] = static_cast<std::uint32_t>(local.size());
+      }
+    }
+  });
+  for (std::size_t i = 0; i < q; ++i) offsets[i + 1] += offsets[i];
+  out.clear();
+  out.reserve(offsets[q]);
+  for (const auto& p : partial) out.insert(out.end(), p.begin(), p.end());
+}
@@ -0,0 +1,510 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <bit>
+#include <cstddef>
+#include <cstdint>
+#include <limits>
+#include <vector>
+
+#include "application/error.h"
+#include "tools/bounds3.h"
+#include "tools/morton.h"
+#include "tools/parallel.h"
+#include "tools/perfcounters.h"
+#include "tools/point3.h"
+#include "tools/primitives.h"
+#include "tools/profiling.h"
+#include "tools/ray.h"
+#include "tools/raybatch.h"
+
+struct LBVHBuildParams {
+  // Restructures every three-level treelet by the rotation that lowers its
+  // surface area most (Kensler 2008), during the bottom-up bounds pass. A
+  // cheap form of Karras & Aila's treelet optimization: it adds little to
+  // the build and gains a few percent of SAH cost on uniform scenes, more on
+  // uneven ones.
+  bool optimizeTreelets = false;
+};
+
+//--------------------------------------------
+// Linear BVH (Karras 2012). Primitives are sorted by the 30-bit Morton code
+// of their centroid, ties broken by index, which fixes the whole topology:
+// every internal node finds its key range and split independently, so all
+// n - 1 of them are emitted in parallel. Bounds are then filled bottom-up,
+// each leaf walking towards the root and the second thread to reach a node
+// continuing past it.
+//
+// Every leaf holds one primitive. An internal node stores the boxes of both
+// children, so traversal tests the children of a node together and visits
+// the nearer one first. A child index c >= 0 is an internal node, c < 0
+// the leaf ~c, whose primitive is primitive(~c).
+//--------------------------------------------
+
+class LBVH {
+ public:
+  struct alignas(64) Node {
+    float minX[2], minY[2], minZ[2];
+    float maxX[2], maxY[2], maxZ[2];
+    int child[2];
+    int parent;
+  };
+
+  LBVH() = default;
+  explicit LBVH(const std::vector<Bounds3D>& primitives,
+                const LBVHBuildParams& params = {}) {
+    build(primitives, params);
+  }
+
+  void build(const std::vector<Bounds3D>& primitives,
+             const LBVHBuildParams& params = {});
+
+  // Refreshes every box for primitives that moved, keeping the topology of
+  // the last build; primitives must have the build's size and order. Much
+  // cheaper than build(), but the tree loosens as primitives drift from
+  // where they were built, so rebuild once sahCost() has grown noticeably.
+  void refit(const std::vector<Bounds3D>& primitives);
+
+  std::size_t size() const { return m_primitive.size(); }
+  bool empty() const { return m_primitive.empty(); }
+  const std::vector<Node>& nodes() const { return m_nodes; }
+  int root() const { return m_root; }
+  std::uint32_t primitive(int leaf) const { return m_primitive[leaf]; }
+  Bounds3D bounds() const { return m_bounds; }
+
+  // Surface-area cost with unit traversal and intersection costs:
+  // sum over nodes of area(node) / area(root) times (1 for internal nodes,
+  // 1 primitive test for leaves).
+  float sahCost() const;
+
+  // Closest hit along the ray within [tMin, ray max range). For each leaf
+  // the traversal calls test(primitive, tMin, tMax), which returns the hit
+  // distance or +infinity; every hit narrows tMax for the rest of the walk.
+  template <typename Test>
+  NearestHit intersect(const Ray& ray, Test&& test,
+                       float tMin = kRayEpsilon) const;
+
+  // Any-hit query for shadow rays: true as soon as test reports a hit
+  // within [tMin, ray max range). Children are still visited nearer first,
+  // which finds a blocker early, but the range never shrinks.
+  template <typename Test>
+  bool occluded(const Ray& ray, Test&& test, float tMin = kRayEpsilon) const;
+
+ private:
+  // Traversal pushes at most one entry per level. Karras trees are at most
+  // 62 levels deep, but rotations can add to that with no fixed bound, so
+  // the pushes are checked.
+  static constexpr int kStackSize = 128;
+
+  Bounds3D childBounds(const Node& node, int c) const {
+    return Bounds3D(Point3D(node.minX[c], node.minY[c], node.minZ[c]),
+                    Point3D(node.maxX[c], node.maxY[c], node.maxZ[c]));
+  }
+  static void setChildBounds(Node& node, int c, const Bounds3D& b) {
+    node.minX[c] = b.min().x();
+    node.minY[c] = b.min().y();
+    node.minZ[c] = b.min().z();
+    node.maxX[c] = b.max().x();
+    node.maxY[c] = b.max().y();
+    node.maxZ[c] = b.max().z();
+  }
+  void setParent(int child, int parent) {
+    if (child >= 0) {
+      m_nodes[child].parent = parent;
+    } else {
+      m_leafParent[~child] = parent;
+    }
+  }
+
+  void emitNode(const std::vector<std::uint32_t>& keys, int i);
+  void rotateTreelet(int node);
+  void fitBounds(const std::vector<Bounds3D>& primitives, bool optimize);
+
+  std::vector<Node> m_nodes;
+  std::vector<std::uint32_t> m_primitive;
+  std::vector<int> m_leafParent;
+  Bounds3D m_bounds;
+  int m_root = 0;
+};
+
+namespace detail {
+
+inline constexpr std::size_t kLbvhGrain = 4096;
+
+// Length of the common prefix of sorted keys i and j, extended by the
+// index bits when the keys are equal; -1 outside the array.
+inline int lbvhDelta(const std::vector<std::uint32_t>& keys, int i, int j) {
+  if (j < 0 || j >= static_cast<int>(keys.size())) return -1;
+  std::uint32_t a = keys[i], b = keys[j];
+  if (a == b) {
+    return 32 + std::countl_zero(static_cast<std::uint32_t>(i ^ j));
+  }
+  return std::countl_zero(a ^ b);
+}
+
+inline float halfArea(const Bounds3D& b) {
+  Vec3D d = b.diagonal();
+  return d.x() * d.y() + d.x() * d.z() + d.y() * d.z();
+}
+
+}  // namespace detail
+
+// Internal node i covers the key range that starts or ends at i, extending
+// in the direction of the neighbour sharing the longer prefix; its split is
+// where the prefix of the range grows.
+inline void LBVH::emitNode(const std::vector<std::uint32_t>& keys, int i) {
+  using detail::lbvhDelta;
+  int d = lbvhDelta(keys, i, i + 1) - lbvhDelta(keys, i, i - 1) >= 0 ? 1 : -1;
+  int deltaMin = lbvhDelta(keys, i, i - d);
+  int lMax = 2;
+  while (lbvhDelta(keys, i, i + lMax * d) > deltaMin) lMax *= 2;
+  int l = 0;
+  for (int t = lMax / 2; t >= 1; t /= 2) {
+    if (lbvhDelta(keys, i, i + (l + t) * d) > deltaMin) l += t;
+  }
+  int j = i + l * d;
+  int deltaNode = lbvhDelta(keys, i, j);
+  int s = 0;
+  int t = l;
+  do {
+    t = (t + 1) / 2;
+    if (lbvhDelta(keys, i, i + (s + t) * d) > deltaNode) s += t;
+  } while (t > 1);
+  int split = i + s * d + std::min(d, 0);
+
+  Node& node = m_nodes[i];
+  node.child[0] = std::min(i, j) == split ? ~split : split;
+  node.child[1] = std::max(i, j) == split + 1 ? ~(split + 1) : split + 1;
+  setParent(node.child[0], i);
+  setParent(node.child[1], i);
+}
+
+// Both children of node are final. Swapping one child with a grandchild
+// under the other child only changes that child's box, so the best
+// rotation is the one giving it the smallest area.
+inline void LBVH::rotateTreelet(int node) {
+  Node& n = m_nodes[node];
+  float best = 0.f;
+  int bestChild = -1, bestGrand = -1;
+  for (int c = 0; c < 2; ++c) {
+    if (n.child[c] < 0) continue;
+    const Node& inner = m_nodes[n.child[c]];
+    Bounds3D other = childBounds(n, 1 - c);
+    float before = detail::halfArea(childBounds(n, c));
+    for (int g = 0; g < 2; ++g) {
+      Bounds3D after = merge(other, childBounds(inner, 1 - g));
+      float gain = before - detail::halfArea(after);
+      if (gain > best) {
+        best = gain;
+        bestChild = c;
+        bestGrand = g;
+      }
+    }
+  }
+  if (bestChild < 0) return;
+
+  const int c = bestChild, g = bestGrand;
+  const int innerIndex = n.child[c];
+  Node& inner = m_nodes[innerIndex];
+  Bounds3D otherBounds = childBounds(n, 1 - c);
+  Bounds3D grandBounds = childBounds(inner, g);
+  int other = n.child[1 - c], grand = inner.child[g];
+  n.child[1 - c] = grand;
+  setChildBounds(n, 1 - c, grandBounds);
+  inner.child[g] = other;
+  setChildBounds(inner, g, otherBounds);
+  setParent(grand, node);
+  setParent(other, innerIndex);
+  setChildBounds(n, c, merge(childBounds(inner, 0), childBounds(inner, 1)));
+}
+
+inline void LBVH::build(const std::vector<Bounds3D>& primitives,
+                        const LBVHBuildParams& params) {
+  const std::size_t n = primitives.size();
+  TOOLS_PERF_REGION("lbvh_build", n);
+  TOOLS_PROFILE_SCOPE("lbvh_build");
+  m_nodes.clear();
+  m_primitive.clear();
+  m_leafParent.clear();
+  m_bounds = Bounds3D();
+  m_root = 0;
+  if (n == 0) return;
+
+  std::vector<Point3D> centroids(n);
+  parallelFor(n, detail::kLbvhGrain, [&](std::size_t b, std::size_t e) {
+    for (std::size_t i = b; i < e; ++i) centroids[i] = primitives[i].centroid();
+  });
+  std::vector<std::uint32_t> keys;
+  computeSpatialKeys(centroids, computeBounds(centroids),
+                     SpaceFillingCurve::Morton, keys);
+  m_primitive = radixSortOrder(keys, 30);
+  m_leafParent.assign(n, -1);
+  if (n == 1) {
+    m_root = ~0;
+    m_bounds = primitives[0];
+    return;
+  }
+
+  m_nodes.resize(n - 1);
+  m_nodes[0].parent = -1;
+  parallelFor(n - 1, detail::kLbvhGrain, [&](std::size_t b, std::size_t e) {
+    for (std::size_t i = b; i < e; ++i) emitNode(keys, static_cast<int>(i));
+  });
+  fitBounds(primitives, params.optimizeTreelets);
+}
+
+inline void LBVH::refit(const std::vector<Bounds3D>& primitives) {
+  APP_ASSERT(primitives.size() == size(), "Refit with a different size!");
+  TOOLS_PERF_REGION("lbvh_refit", primitives.size());
+  TOOLS_PROFILE_SCOPE("lbvh_refit");
+  if (empty()) return;
+  if (m_root < 0) {
+    m_bounds = primitives[0];
+    return;
+  }
+  fitBounds(primitives, false);
+}
+
+inline void LBVH::fitBounds(const std::vector<Bounds3D>& primitives,
+                            bool optimize) {
+  const std::size_t n = primitives.size();
+  // The first thread to reach a node stops; the second sees both child
+  // boxes (acquire/release on the counter) and carries on upwards.
+  std::vector<std::atomic<int>> visits(n - 1);
+  parallelFor(n, detail::kLbvhGrain, [&](std::size_t b, std::size_t e) {
+    for (std::size_t leaf = b; leaf < e; ++leaf) {
+      int child = ~static_cast<int>(leaf);
+      Bounds3D box = primitives[m_primitive[leaf]];
+      int node = m_leafParent[leaf];
+      while (node >= 0) {
+        Node& current = m_nodes[node];
+        setChildBounds(current, current.child[0] == child ? 0 : 1, box);
+        if (visits[node].fetch_add(1, std::memory_order_acq_rel) == 0) break;
+        if (optimize) rotateTreelet(node);
+        box = merge(childBounds(current, 0), childBounds(current, 1));
+        child = node;
+        node = current.parent;
+      }
+    }
+  });
+  m_bounds = merge(childBounds(m_nodes[0], 0), childBounds(m_nodes[0], 1));
+}
+
+inline float LBVH::sahCost() const {
+  if (empty()) return 0.f;
+  if (m_nodes.empty()) return 1.f;
+  const float rootArea = std::max(detail::halfArea(m_bounds), 1.E-30f);
+  double cost = 1.;
+  for (const Node& node : m_nodes) {
+    for (int c = 0; c < 2; ++c) {
+      cost += detail::halfArea(childBounds(node, c)) / rootArea;
+    }
+  }
+  return static_cast<float>(cost);
+}
+
+template <typename Test>
+NearestHit LBVH::intersect(const Ray& ray, Test&& test, float tMin) const {
+  NearestHit best;
+  best.t = ray.getMaxRange();
+  if (empty()) {
+    best.t = std::numeric_limits<float>::infinity();
+    return best;
+  }
+  const float inf = std::numeric_limits<float>::infinity();
+  const float ox = ray.origin().x(), oy = ray.origin().y(),
+              oz = ray.origin().z();
+  const float idx = 1.f / ray.direction().x(), idy = 1.f / ray.direction().y(),
+              idz = 1.f / ray.direction().z();
+
+  auto visitLeaf = [&](int leaf) {
+    TOOLS_COUNT_OP(ProfileOp::RayPrimitive);
+    std::uint32_t prim = m_primitive[leaf];
+    float t = test(prim, tMin, best.t);
+    if (t < best.t) {
+      best.t = t;
+      best.index = static_cast<int>(prim);
+    }
+  };
+  if (m_root < 0) {
+    visitLeaf(~m_root);
+  } else {
+    // Entries carry the entry distance of their box, so subtrees behind a
+    // closer hit found meanwhile are dropped without being touched.
+    int stack[kStackSize];
+    float stackT[kStackSize];
+    int top = 0;
+    int node = m_root;
+    for (;;) {
+      const Node& n = m_nodes[node];
+      TOOLS_COUNT_OPS(ProfileOp::RayBox, 2);
+      float t0 = rayBoxT(ox, oy, oz, idx, idy, idz, n.minX[0], n.minY[0],
+                         n.minZ[0], n.maxX[0], n.maxY[0], n.maxZ[0], tMin,
+                         best.t);
+      float t1 = rayBoxT(ox, oy, oz, idx, idy, idz, n.minX[1], n.minY[1],
+                         n.minZ[1], n.maxX[1], n.maxY[1], n.maxZ[1], tMin,
+                         best.t);
+      int near = t0 <= t1 ? 0 : 1;
+      float tNear = std::min(t0, t1), tFar = std::max(t0, t1);
+      int next = -1;
+      bool descend = false;
+      if (tNear < inf) {
+        int c = n.child[near];
+        if (c < 0) {
+          visitLeaf(~c);
+        } else {
+          next = c;
+          descend = true;
+        }
+      }
+      if (tFar < inf) {
+        int c = n.child[1 - near];
+        if (c < 0) {
+          if (tFar < best.t) visitLeaf(~c);
+        } else if (descend) {
+          APP_ASSERT(top < kStackSize, "LBVH traversal stack overflow!");
+          stack[top] = c;
+          stackT[top++] = tFar;
+        } else {
+          next = c;
+          descend = true;
+        }
+      }
+      if (!descend) {
+        // Pop the next subtree still in front of the closest hit.
+        while (top > 0 && stackT[top - 1] >= best.t) --top;
+        if (top == 0) break;
+        next = stack[--top];
+      }
+      node = next;
+    }
+  }
+  if (!best.hit()) best.t = inf;
+  return best;
+}
+
+template <typename Test>
+bool LBVH::occluded(const Ray& ray, Test&& test, float tMin) const {
+  if (empty()) return false;
+  const float inf = std::numeric_limits<float>::infinity();
+  const float tMax = ray.getMaxRange();
+  const float ox = ray.origin().x(), oy = ray.origin().y(),
+              oz = ray.origin().z();
+  const float idx = 1.f / ray.direction().x(), idy = 1.f / ray.direction().y(),
+              idz = 1.f / ray.direction().z();
+
+  auto hitsLeaf = [&](int leaf) {
+    TOOLS_COUNT_OP(ProfileOp::RayPrimitive);
+    return test(m_primitive[leaf], tMin, tMax) < tMax;
+  };
+  if (m_root < 0) return hitsLeaf(~m_root);
+  int stack[kStackSize];
+  int top = 0;
+  int node = m_root;
+  for (;;) {
+    const Node& n = m_nodes[node];
+    TOOLS_COUNT_OPS(ProfileOp::RayBox, 2);
+    float t0 = rayBoxT(ox, oy, oz, idx, idy, idz, n.minX[0], n.minY[0],
+                       n.minZ[0], n.maxX[0], n.maxY[0], n.maxZ[0], tMin, tMax);
+    float t1 = rayBoxT(ox, oy, oz, idx, idy, idz, n.minX[1], n.minY[1],
+                       n.minZ[1], n.maxX[1], n.maxY[1], n.maxZ[1], tMin, tMax);
+    int near = t0 <= t1 ? 0 : 1;
+    float tNear = std::min(t0, t1), tFar = std::max(t0, t1);
+    int next = -1;
+    for (int k = 0; k < 2; ++k) {
+      if ((k == 0 ? tNear : tFar) == inf) break;
+      int c = n.child[k == 0 ? near : 1 - near];
+      if (c < 0) {
+        if (hitsLeaf(~c)) return true;
+      } else if (next < 0) {
+        next = c;
+      } else {
+        APP_ASSERT(top < kStackSize, "LBVH traversal stack overflow!");
+        stack[top++] = c;
+      }
+    }
+    if (next < 0) {
+      if (top == 0) return false;
+      next = stack[--top];
+    }
+    node = next;
+  }
+}
+
+// Boxes of the spheres, in order, for building an LBVH over them.
+inline std::vector<Bounds3D> primitiveBounds(const SphereSoA& spheres) {
+  std::vector<Bounds3D> boxes(spheres.size());
+  parallelFor(spheres.size(), detail::kLbvhGrain,
+              [&](std::size_t b, std::size_t e) {
+                for (std::size_t i = b; i < e; ++i) {
+                  Point3D c = spheres.center(i);
+                  float r = spheres.radius(i);
+                  boxes[i] = Bounds3D(c - Vec3D(r, r, r), c + Vec3D(r, r, r));
+                }
+              });
+  return boxes;
+}
+
+inline NearestHit intersect(const Ray& ray, const LBVH& bvh,
+                            const SphereSoA& spheres,
+                            float tMin = kRayEpsilon) {
+  const float ox = ray.origin().x(), oy = ray.origin().y(),
+              oz = ray.origin().z();
+  const float dx = ray.direction().x(), dy = ray.direction().y(),
+              dz = ray.direction().z();
+  const float *cx = spheres.cx(), *cy = spheres.cy(), *cz = spheres.cz(),
+              *r = spheres.radii();
+  return bvh.intersect(
+      ray,
+      [&](std::uint32_t i, float t0, float t1) {
+        return raySphereT(ox, oy, oz, dx, dy, dz, cx[i], cy[i], cz[i], r[i],
+                          t0, t1);
+      },
+      tMin);
+}
+
+inline bool intersect(const Ray& ray, const LBVH& bvh,
+                      const SphereSoA& spheres, HitRecord& rec,
+                      float tMin = kRayEpsilon) {
+  NearestHit hit = intersect(ray, bvh, spheres, tMin);
+  if (!hit.hit() || !rec.report(ray, hit.t, hit.index)) return false;
+  rec.normal = spheres.normalAt(hit.index, rec.position(ray));
+  return true;
+}
+
+inline bool occluded(const Ray& ray, const LBVH& bvh,
+                     const SphereSoA& spheres, float tMin = kRayEpsilon) {
+  const float ox = ray.origin().x(), oy = ray.origin().y(),
+              oz = ray.origin().z();
+  const float dx = ray.direction().x(), dy = ray.direction().y(),
+              dz = ray.direction().z();
+  const float *cx = spheres.cx(), *cy = spheres.cy(), *cz = spheres.cz(),
+              *r = spheres.radii();
+  return bvh.occluded(
+      ray,
+      [&](std::uint32_t i, float t0, float t1) {
+        return raySphereT(ox, oy, oz, dx, dy, dz, cx[i], cy[i], cz[i], r[i],
+                          t0, t1);
+      },
+      tMin);
+}
+
+// Closest hit per ray of the batch through the BVH, rays spread over
+// threads. hits must have been reset from the same batch.
+inline void intersect(const RayBatch& rays, HitBatch& hits, const LBVH& bvh,
+                      const SphereSoA& spheres, float tMin = kRayEpsilon) {
+  TOOLS_PERF_REGION("lbvh_spheres", rays.size());
+  TOOLS_PROFILE_SCOPE("lbvh_spheres");
+  parallelFor(rays.size(), 256, [&](std::size_t b, std::size_t e) {
+    for (std::size_t i = b; i < e; ++i) {
+      Ray ray = rays.ray(i);
+      ray.setMaxRange(hits.t()[i]);
+      NearestHit hit = intersect(ray, bvh, spheres, tMin);
+      if (hit.hit()) {
+        hits.t()[i] = hit.t;
+        hits.index()[i] = hit.index;
+      }
+    }
+  });
+}
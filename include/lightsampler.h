@@ -0,0 +1,278 @@
+#pragma once
+
+#include <algorithm>
+#include <cstddef>
+#include <numeric>
+#include <vector>
+
+#include "tools/bounds3.h"
+#include "tools/light.h"
+#include "tools/parallel.h"
+#include "tools/perfcounters.h"
+#include "tools/profiling.h"
+
+// Scalar power used for importance sampling (luminance of the intensity).
+inline float lightPower(const PointLight& light) {
+  Vec3D i = light.intensity();
+  float y = 0.2126f * i.x() + 0.7152f * i.y() + 0.0722f * i.z();
+  return std::max(y, 0.f);
+}
+
+//--------------------------------------------
+// Alias table: O(1) light selection proportional to power
+//--------------------------------------------
+
+class LightAliasTable {
+ public:
+  LightAliasTable() = default;
+  explicit LightAliasTable(const std::vector<PointLight>& lights) {
+    build(lights);
+  }
+
+  void build(const std::vector<PointLight>& lights);
+
+  // Picks a light index with u in [0,1). Returns -1 if there are no lights.
+  int sample(float u, float* pdf = nullptr) const;
+  float pdf(int index) const {
+    if (index < 0 || index >= static_cast<int>(m_pdf.size())) return 0.f;
+    return m_pdf[index];
+  }
+
+  std::size_t size() const { return m_pdf.size(); }
+  bool empty() const { return m_pdf.empty(); }
+
+ private:
+  struct Bin {
+    float prob;
+    int alias;
+  };
+  std::vector<Bin> m_bins;
+  std::vector<float> m_pdf;
+};
+
+inline void LightAliasTable::build(const std::vector<PointLight>& lights) {
+  const std::size_t n = lights.size();
+  TOOLS_PERF_REGION("light_alias_build", n);
+  TOOLS_PROFILE_SCOPE("light_alias_build");
+  m_bins.assign(n, Bin{1.f, 0});
+  m_pdf.assign(n, 0.f);
+  if (n == 0) return;
+
+  std::vector<double> scaled(n);
+  parallelFor(n, 4096, [&](std::size_t b, std::size_t e) {
+    for (std::size_t i = b; i < e; ++i) scaled[i] = lightPower(lights[i]);
+  });
+  double total = parallelReduce(
+      n, 4096, 0.,
+      [&](std::size_t b, std::size_t e) {
+        return std::accumulate(scaled.begin() + b, scaled.begin() + e, 0.);
+      },
+      [](double a, double b) { return a + b; });
+
+  // No light emits anything: fall back to uniform selection.
+  if (total <= 0.) {
+    std::fill(scaled.begin(), scaled.end(), 1.);
+    total = static_cast<double>(n);
+  }
+
+  parallelFor(n, 4096, [&](std::size_t b, std::size_t e) {
+    for (std::size_t i = b; i < e; ++i) {
+      m_pdf[i] = static_cast<float>(scaled[i] / total);
+      scaled[i] *= n / total;
+    }
+  });
+
+  // Vose's method; bins left over at the end are full up to rounding.
+  std::vector<int> small, large;
+  for (std::size_t i = 0; i < n; ++i) {
+    (scaled[i] < 1. ? small : large).push_back(static_cast<int>(i));
+  }
+  while (!small.empty() && !large.empty()) {
+    int s = small.back();
+    int l = large.back();
+    small.pop_back();
+    m_bins[s] = Bin{static_cast<float>(scaled[s]), l};
+    scaled[l] -= 1. - scaled[s];
+    if (scaled[l] < 1.) {
+      large.pop_back();
+      small.push_back(l);
+    }
+  }
+  for (int i : large) m_bins[i] = Bin{1.f, i};
+  for (int i : small) m_bins[i] = Bin{1.f, i};
+}
+
+inline int LightAliasTable::sample(float u, float* pdf) const {
+  if (m_bins.empty()) {
+    if (pdf) *pdf = 0.f;
+    return -1;
+  }
+  const std::size_t n = m_bins.size();
+  float scaled = u * n;
+  std::size_t i = std::min(static_cast<std::size_t>(scaled), n - 1);
+  float frac = scaled - i;
+  int index = frac < m_bins[i].prob ? static_cast<int>(i) : m_bins[i].alias;
+  if (pdf) *pdf = m_pdf[index];
+  return index;
+}
+
+//--------------------------------------------
+// Light BVH: spatially aware selection at a shading point
+//--------------------------------------------
+
+class LightBVH {
+ public:
+  LightBVH() = default;
+  explicit LightBVH(const std::vector<PointLight>& lights) { build(lights); }
+
+  void build(const std::vector<PointLight>& lights);
+
+  // Descends the tree choosing children by estimated contribution at p.
+  // Returns -1 (and pdf 0) if nothing can be sampled.
+  int sample(const Point3D& p, float u, float* pdf = nullptr) const;
+  float pdf(const Point3D& p, int index) const;
+
+  std::size_t size() const { return m_leaf_of_light.size(); }
+  bool empty() const { return m_nodes.empty(); }
+
+ private:
+  // Left child of an interior node i is i + 1, the right child is stored.
+  struct Node {
+    Bounds3D bounds;
+    float power = 0.f;
+    int light = -1;
+    int right = -1;
+    int parent = -1;
+  };
+
+  int buildRecursive(std::vector<int>& order, std::size_t begin,
+                     std::size_t end, int nodeIndex, int parent, int depth);
+  float importance(const Point3D& p, const Node& node) const;
+
+  std::vector<PointLight> m_lights;
+  std::vector<float> m_power;
+  std::vector<Node> m_nodes;
+  std::vector<int> m_leaf_of_light;
+};
+
+inline void LightBVH::build(const std::vector<PointLight>& lights) {
+  const std::size_t n = lights.size();
+  TOOLS_PERF_REGION("light_bvh_build", n);
+  TOOLS_PROFILE_SCOPE("light_bvh_build");
+  m_lights = lights;
+  m_power.resize(n);
+  m_leaf_of_light.assign(n, -1);
+  m_nodes.clear();
+  if (n == 0) return;
+
+  parallelFor(n, 4096, [&](std::size_t b, std::size_t e) {
+    for (std::size_t i = b; i < e; ++i) m_power[i] = lightPower(lights[i]);
+  });
+
+  // A binary tree over n leaves always has 2n - 1 nodes, so every subtree
+  // knows its slot range up front and subtrees can be built concurrently.
+  m_nodes.resize(2 * n - 1);
+  std::vector<int> order(n);
+  std::iota(order.begin(), order.end(), 0);
+  buildRecursive(order, 0, n, 0, -1, 0);
+}
+
+inline int LightBVH::buildRecursive(std::vector<int>& order,
+                                    std::size_t begin, std::size_t end,
+                                    int nodeIndex, int parent, int depth) {
+  Node& node = m_nodes[nodeIndex];
+  node.parent = parent;
+  if (end - begin == 1) {
+    int light = order[begin];
+    node.bounds = Bounds3D(m_lights[light].position());
+    node.power = m_power[light];
+    node.light = light;
+    m_leaf_of_light[light] = nodeIndex;
+    return nodeIndex;
+  }
+
+  Bounds3D centroids;
+  for (std::size_t i = begin; i < end; ++i) {
+    centroids.expand(m_lights[order[i]].position());
+  }
+  int axis = centroids.maxExtent();
+  std::size_t mid = begin + (end - begin) / 2;
+  std::nth_element(order.begin() + begin, order.begin() + mid,
+                   order.begin() + end, [&](int a, int b) {
+                     return m_lights[a].position()[axis] <
+                            m_lights[b].position()[axis];
+                   });
+
+  int left = nodeIndex + 1;
+  int right = nodeIndex + 2 * static_cast<int>(mid - begin);
+  node.right = right;
+  auto buildLeft = [&, depth]() {
+    buildRecursive(order, begin, mid, left, nodeIndex, depth + 1);
+  };
+  auto buildRight = [&, depth]() {
+    buildRecursive(order, mid, end, right, nodeIndex, depth + 1);
+  };
+  if (depth < 4 && end - begin > 8192) {
+    parallelInvoke(buildLeft, buildRight);
+  } else {
+    buildLeft();
+    buildRight();
+  }
+
+  node.bounds = merge(m_nodes[left].bounds, m_nodes[right].bounds);
+  node.power = m_nodes[left].power + m_nodes[right].power;
+  return nodeIndex;
+}
+
+// Power over squared distance to the cluster centre. The distance is clamped
+// to the cluster radius so the estimate stays finite inside a cluster.
+inline float LightBVH::importance(const Point3D& p, const Node& node) const {
+  if (node.power <= 0.f) return 0.f;
+  Vec3D d = node.bounds.centroid() - p;
+  Vec3D diag = node.bounds.diagonal();
+  float d2 = std::max(dot(d, d), 0.25f * dot(diag, diag));
+  return node.power / std::max(d2, 1.E-6f);
+}
+
+inline int LightBVH::sample(const Point3D& p, float u, float* pdf) const {
+  if (pdf) *pdf = 0.f;
+  if (m_nodes.empty() || m_nodes[0].power <= 0.f) return -1;
+
+  int index = 0;
+  float prob = 1.f;
+  while (m_nodes[index].light < 0) {
+    int left = index + 1;
+    int right = m_nodes[index].right;
+    float wl = importance(p, m_nodes[left]);
+    float wr = importance(p, m_nodes[right]);
+    if (wl + wr <= 0.f) return -1;
+    float pl = wl / (wl + wr);
+    if (u < pl) {
+      u = std::min(u / pl, 0x1.fffffep-1f);
+      prob *= pl;
+      index = left;
+    } else {
+      u = std::min((u - pl) / (1.f - pl), 0x1.fffffep-1f);
+      prob *= 1.f - pl;
+      index = right;
+    }
+  }
+  if (pdf) *pdf = prob;
+  return m_nodes[index].light;
+}
+
+inline float LightBVH::pdf(const Point3D& p, int index) const {
+  if (index < 0 || index >= static_cast<int>(m_leaf_of_light.size())) {
+    return 0.f;
+  }
+  float prob = 1.f;
+  int child = m_leaf_of_light[index];
+  for (int parent = m_nodes[child].parent; parent >= 0;
+       child = parent, parent = m_nodes[parent].parent) {
+    float wl = importance(p, m_nodes[parent + 1]);
+    float wr = importance(p, m_nodes[m_nodes[parent].right]);
+    if (wl + wr <= 0.f) return 0.f;
+    prob *= (child == parent + 1 ? wl : wr) / (wl + wr);
+  }
+  return m_nodes[0].power > 0.f ? prob : 0.f;
+}
@@ -1,7 +1,9 @@
 #pragma once
 
-template <class T>
-class Vec2;
+#include <cassert>
+
+#include "tools/fwd.h"
+#include "tools/vec2.h"
 
 template <class T>
 class Mat2 {
@@ -73,9 +75,3 @@ Mat2<T> operator*(const Mat2<T>& m1, const Mat2<T>& m2) {
 
   return ret;
 }
-
-template <typename T>
-std::ostream& operator<<(std::ostream& out, const Mat2<T>& m) {
-  out << "{" << m[0] << "," << m[1] << "}";
-  return out;
-}
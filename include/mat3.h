@@ -1,10 +1,9 @@
 #pragma once
 
-template <class T>
-class Vec3;
+#include <cassert>
 
-template <class T>
-class Mat2;
+#include "tools/fwd.h"
+#include "tools/vec3.h"
 
 template <class T>
 class Mat3 {
@@ -58,7 +57,7 @@ class Mat3 {
   Mat3<T> inverse() const;
   Mat3<T> transpose() const;
   T coFactor(int i, int j) const {
-    return T(pow(-1., i + 1. + j + 1.)) * minor(i, j).determinant();
+    return ((i + j) % 2 ? T{-1} : T{1}) * minor(i, j).determinant();
   }
 
  private:
@@ -179,9 +178,3 @@ template <typename T>
 Mat3<T> operator*(const Mat3<T>& m1, T num) {
   return Mat3<T>(m1[0] * num, m1[1] * num, m1[2] * num);
 }
-
-template <typename T>
-std::ostream& operator<<(std::ostream& out, const Mat3<T>& m) {
-  out << "{" << m[0] << "," << m[1] << "," << m[2] << "}";
-  return out;
-}
@@ -1,21 +1,12 @@
 #pragma once
 
 #include "application/error.h"
-
-template <class T>
-class Vec4;
-
-template <class T>
-class Vec3;
-
-template <class T>
-class Point3;
-
-template <class T>
-class Mat2;
-
-template <class T>
-class Mat3;
+#include "tools/fwd.h"
+#include "tools/mat3.h"
+#include "tools/point3.h"
+#include "tools/profiling.h"
+#include "tools/vec3.h"
+#include "tools/vec4.h"
 
 template <class T>
 class Mat4 {
@@ -79,7 +70,7 @@ class Mat4 {
   Mat4<T> inverse() const;
   Mat4<T> transpose() const;
   T coFactor(int i, int j) const {
-    return T(pow(-1., i + 1. + j + 1.)) * minor(i, j).determinant();
+    return ((i + j) % 2 ? T{-1} : T{1}) * minor(i, j).determinant();
   }
 
   void Orient(const Vec3<T>& pos, const Vec3<T>& fwd, const Vec3<T>& up);
@@ -125,6 +116,7 @@ Mat3<T> Mat4<T>::minor(int i, int j) const {
 
 template <typename T>
 Mat4<T> Mat4<T>::inverse() const {
+  TOOLS_COUNT_OP(ProfileOp::Mat4Inverse);
   T det = determinant();
   APP_ASSERT(det != 0, "Matrix is not invertible!");
   Mat4<T> inv;
@@ -346,10 +338,18 @@ Mat4<T> view_transform(const Point3<T>& from, const Point3<T>& to,
   return orientation * translation(-from.x(), -from.y(), -from.z());
 }
 
-// TODO: Shearing
-
+// OpenGL-style projection: the camera looks down -z and clip space z runs
+// from -w (near) to w (far).
 template <typename T>
-std::ostream& operator<<(std::ostream& out, const Mat4<T>& m) {
-  out << "{" << m[0] << "," << m[1] << "," << m[2] << "," << m[3] << "}";
-  return out;
-}
\ No newline at end of file
+Mat4<T> perspective(T fovy, T aspect, T near, T far) {
+  T f = static_cast<T>(1. / tan(fovy / 2.));
+  Mat4<T> ret(T{0});
+  ret[0][0] = f / aspect;
+  ret[1][1] = f;
+  ret[2][2] = (far + near) / (near - far);
+  ret[2][3] = T{2} * far * near / (near - far);
+  ret[3][2] = T{-1};
+  return ret;
+}
+
+// TODO: Shearing
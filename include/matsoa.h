@@ -0,0 +1,434 @@
+#pragma once
+
+#include <algorithm>
+#include <cstddef>
+#include <type_traits>
+#include <vector>
+
+#include "application/error.h"
+#include "tools/cpudispatch.h"
+#include "tools/mat2.h"
+#include "tools/mat3.h"
+#include "tools/mat4.h"
+#include "tools/parallel.h"
+#include "tools/perfcounters.h"
+#include "tools/profiling.h"
+#include "tools/vec2.h"
+#include "tools/vec3.h"
+#include "tools/vec4.h"
+
+// Matrices (and vectors) per block in the batched layouts below.
+inline constexpr std::size_t kMatLanes = 16;
+
+//--------------------------------------------
+// Many small N x N matrices in blocked SoA layout: each block holds element
+// (r, c) of kMatLanes consecutive matrices next to each other, so the batch
+// kernels run one matrix per SIMD lane. Unused lanes of the last block are
+// zero.
+//--------------------------------------------
+
+template <class T, int N>
+class MatSoA {
+ public:
+  static_assert(N >= 2 && N <= 4, "batched matrices are 2x2, 3x3 or 4x4");
+  using Fixed = std::conditional_t<
+      N == 2, Mat2<T>, std::conditional_t<N == 3, Mat3<T>, Mat4<T>>>;
+  static constexpr std::size_t kBlockSize = N * N * kMatLanes;
+
+  MatSoA() = default;
+  explicit MatSoA(std::size_t n) { resize(n); }
+
+  // Shrinking also zeroes the lanes it vacates in the last block.
+  void resize(std::size_t n) {
+    const std::size_t old = m_size;
+    m_size = n;
+    m_data.resize(blocks() * kBlockSize, T{0});
+    for (std::size_t i = n; i < std::min(old, blocks() * kMatLanes); ++i) {
+      for (int e = 0; e < N * N; ++e) at(i, e / N, e % N) = T{0};
+    }
+  }
+  void clear() { resize(0); }
+  std::size_t size() const { return m_size; }
+  std::size_t blocks() const { return (m_size + kMatLanes - 1) / kMatLanes; }
+
+  std::size_t add(const Fixed& m) {
+    std::size_t i = m_size;
+    resize(i + 1);
+    set(i, m);
+    return i;
+  }
+
+  T& at(std::size_t i, int r, int c) {
+    return m_data[i / kMatLanes * kBlockSize + (r * N + c) * kMatLanes +
+                  i % kMatLanes];
+  }
+  T at(std::size_t i, int r, int c) const {
+    return m_data[i / kMatLanes * kBlockSize + (r * N + c) * kMatLanes +
+                  i % kMatLanes];
+  }
+
+  void set(std::size_t i, const Fixed& m) {
+    for (int r = 0; r < N; ++r) {
+      for (int c = 0; c < N; ++c) at(i, r, c) = m[r][c];
+    }
+  }
+  Fixed get(std::size_t i) const {
+    Fixed m;
+    for (int r = 0; r < N; ++r) {
+      for (int c = 0; c < N; ++c) m[r][c] = at(i, r, c);
+    }
+    return m;
+  }
+
+  T* block(std::size_t b) { return m_data.data() + b * kBlockSize; }
+  const T* block(std::size_t b) const {
+    return m_data.data() + b * kBlockSize;
+  }
+
+ private:
+  std::size_t m_size = 0;
+  std::vector<T> m_data;
+};
+
+using Mat2SoA = MatSoA<float, 2>;
+using Mat3SoA = MatSoA<float, 3>;
+using Mat4SoA = MatSoA<float, 4>;
+
+// Vectors of length N in the same blocked layout, for batched solves.
+template <class T, int N>
+class VecSoA {
+ public:
+  static_assert(N >= 2 && N <= 4, "batched vectors have 2, 3 or 4 entries");
+  using Fixed = std::conditional_t<
+      N == 2, Vec2<T>, std::conditional_t<N == 3, Vec3<T>, Vec4<T>>>;
+  static constexpr std::size_t kBlockSize = N * kMatLanes;
+
+  VecSoA() = default;
+  explicit VecSoA(std::size_t n) { resize(n); }
+
+  // Shrinking also zeroes the lanes it vacates in the last block.
+  void resize(std::size_t n) {
+    const std::size_t old = m_size;
+    m_size = n;
+    m_data.resize(blocks() * kBlockSize, T{0});
+    for (std::size_t i = n; i < std::min(old, blocks() * kMatLanes); ++i) {
+      for (int k = 0; k < N; ++k) at(i, k) = T{0};
+    }
+  }
+  void clear() { resize(0); }
+  std::size_t size() const { return m_size; }
+  std::size_t blocks() const { return (m_size + kMatLanes - 1) / kMatLanes; }
+
+  std::size_t add(const Fixed& v) {
+    std::size_t i = m_size;
+    resize(i + 1);
+    set(i, v);
+    return i;
+  }
+
+  T& at(std::size_t i, int k) {
+    return m_data[i / kMatLanes * kBlockSize + k * kMatLanes + i % kMatLanes];
+  }
+  T at(std::size_t i, int k) const {
+    return m_data[i / kMatLanes * kBlockSize + k * kMatLanes + i % kMatLanes];
+  }
+
+  void set(std::size_t i, const Fixed& v) {
+    for (int k = 0; k < N; ++k) at(i, k) = v[k];
+  }
+  Fixed get(std::size_t i) const {
+    Fixed v;
+    for (int k = 0; k < N; ++k) v[k] = at(i, k);
+    return v;
+  }
+
+  T* block(std::size_t b) { return m_data.data() + b * kBlockSize; }
+  const T* block(std::size_t b) const {
+    return m_data.data() + b * kBlockSize;
+  }
+
+ private:
+  std::size_t m_size = 0;
+  std::vector<T> m_data;
+};
+
+using Vec2SoA = VecSoA<float, 2>;
+using Vec3SoA = VecSoA<float, 3>;
+using Vec4SoA = VecSoA<float, 4>;
+
+namespace detail {
+
+inline constexpr std::size_t kMatBlockGrain = 1024;
+
+// Closed-form determinant and adjugate of one row-major matrix. The
+// adjugate is the transposed cofactor matrix, so inverse = adj / det.
+template <class T>
+inline T determinantOf(const T (&m)[4]) {
+  return m[0] * m[3] - m[1] * m[2];
+}
+
+template <class T>
+inline T adjugateOf(const T (&m)[4], T (&adj)[4]) {
+  adj[0] = m[3];
+  adj[1] = -m[1];
+  adj[2] = -m[2];
+  adj[3] = m[0];
+  return determinantOf(m);
+}
+
+template <class T>
+inline T determinantOf(const T (&m)[9]) {
+  return m[0] * (m[4] * m[8] - m[5] * m[7]) -
+         m[1] * (m[3] * m[8] - m[5] * m[6]) +
+         m[2] * (m[3] * m[7] - m[4] * m[6]);
+}
+
+template <class T>
+inline T adjugateOf(const T (&m)[9], T (&adj)[9]) {
+  adj[0] = m[4] * m[8] - m[5] * m[7];
+  adj[1] = m[2] * m[7] - m[1] * m[8];
+  adj[2] = m[1] * m[5] - m[2] * m[4];
+  adj[3] = m[5] * m[6] - m[3] * m[8];
+  adj[4] = m[0] * m[8] - m[2] * m[6];
+  adj[5] = m[2] * m[3] - m[0] * m[5];
+  adj[6] = m[3] * m[7] - m[4] * m[6];
+  adj[7] = m[1] * m[6] - m[0] * m[7];
+  adj[8] = m[0] * m[4] - m[1] * m[3];
+  return m[0] * adj[0] + m[1] * adj[3] + m[2] * adj[6];
+}
+
+// 4x4 via the 2x2 sub-determinants of the top (s) and bottom (c) row pairs.
+template <class T>
+inline T determinantOf(const T (&m)[16]) {
+  T s0 = m[0] * m[5] - m[4] * m[1], s1 = m[0] * m[6] - m[4] * m[2];
+  T s2 = m[0] * m[7] - m[4] * m[3], s3 = m[1] * m[6] - m[5] * m[2];
+  T s4 = m[1] * m[7] - m[5] * m[3], s5 = m[2] * m[7] - m[6] * m[3];
+  T c5 = m[10] * m[15] - m[14] * m[11], c4 = m[9] * m[15] - m[13] * m[11];
+  T c3 = m[9] * m[14] - m[13] * m[10], c2 = m[8] * m[15] - m[12] * m[11];
+  T c1 = m[8] * m[14] - m[12] * m[10], c0 = m[8] * m[13] - m[12] * m[9];
+  return s0 * c5 - s1 * c4 + s2 * c3 + s3 * c2 - s4 * c1 + s5 * c0;
+}
+
+template <class T>
+inline T adjugateOf(const T (&m)[16], T (&adj)[16]) {
+  T s0 = m[0] * m[5] - m[4] * m[1], s1 = m[0] * m[6] - m[4] * m[2];
+  T s2 = m[0] * m[7] - m[4] * m[3], s3 = m[1] * m[6] - m[5] * m[2];
+  T s4 = m[1] * m[7] - m[5] * m[3], s5 = m[2] * m[7] - m[6] * m[3];
+  T c5 = m[10] * m[15] - m[14] * m[11], c4 = m[9] * m[15] - m[13] * m[11];
+  T c3 = m[9] * m[14] - m[13] * m[10], c2 = m[8] * m[15] - m[12] * m[11];
+  T c1 = m[8] * m[14] - m[12] * m[10], c0 = m[8] * m[13] - m[12] * m[9];
+  adj[0] = m[5] * c5 - m[6] * c4 + m[7] * c3;
+  adj[1] = -m[1] * c5 + m[2] * c4 - m[3] * c3;
+  adj[2] = m[13] * s5 - m[14] * s4 + m[15] * s3;
+  adj[3] = -m[9] * s5 + m[10] * s4 - m[11] * s3;
+  adj[4] = -m[4] * c5 + m[6] * c2 - m[7] * c1;
+  adj[5] = m[0] * c5 - m[2] * c2 + m[3] * c1;
+  adj[6] = -m[12] * s5 + m[14] * s2 - m[15] * s1;
+  adj[7] = m[8] * s5 - m[10] * s2 + m[11] * s1;
+  adj[8] = m[4] * c4 - m[5] * c2 + m[7] * c0;
+  adj[9] = -m[0] * c4 + m[1] * c2 - m[3] * c0;
+  adj[10] = m[12] * s4 - m[13] * s2 + m[15] * s0;
+  adj[11] = -m[8] * s4 + m[9] * s2 - m[11] * s0;
+  adj[12] = -m[4] * c3 + m[5] * c1 - m[6] * c0;
+  adj[13] = m[0] * c3 - m[1] * c1 + m[2] * c0;
+  adj[14] = -m[12] * s3 + m[13] * s1 - m[14] * s0;
+  adj[15] = m[8] * s3 - m[9] * s1 + m[10] * s0;
+  return s0 * c5 - s1 * c4 + s2 * c3 + s3 * c2 - s4 * c1 + s5 * c0;
+}
+
+// Gathers lane l of a block into a row-major matrix and back. With the
+// fixed trip counts these unroll, and the lane loops around them vectorize.
+template <class T, int NN>
+void loadLane(const T* __restrict block, std::size_t l, T (&m)[NN]) {
+#pragma GCC unroll 16
+  for (int e = 0; e < NN; ++e) m[e] = block[e * kMatLanes + l];
+}
+
+template <class T, int NN>
+void storeLane(const T (&m)[NN], std::size_t l, T* __restrict block) {
+#pragma GCC unroll 16
+  for (int e = 0; e < NN; ++e) block[e * kMatLanes + l] = m[e];
+}
+
+// The block kernels stage their operands in local arrays. __restrict does
+// not survive inlining into the per-ISA dispatch wrappers, and without it
+// the lane loops over the caller's buffers would not vectorize.
+template <class T, std::size_t S>
+void stageBlock(const T* __restrict src, T (&dst)[S]) {
+  std::copy(src, src + S, dst);
+}
+
+// Inverse factor 1 / det, or 0 for singular lanes so they come out as zero
+// matrices instead of infinities. Written without a guarded division so the
+// lane loops stay branch-free.
+template <class T>
+T safeInverse(T det) {
+  T nonzero = det != T{0} ? T{1} : T{0};
+  return nonzero / (det + (T{1} - nonzero));
+}
+
+template <class T, int N>
+void determinantBlock(const T* __restrict a, T* __restrict det) {
+  T in[N * N * kMatLanes], res[kMatLanes];
+  stageBlock(a, in);
+  for (std::size_t l = 0; l < kMatLanes; ++l) {
+    T m[N * N];
+    loadLane(in, l, m);
+    res[l] = determinantOf(m);
+  }
+  std::copy(res, res + kMatLanes, det);
+}
+
+template <class T, int N>
+void inverseBlock(const T* __restrict a, T* __restrict out) {
+  T in[N * N * kMatLanes], res[N * N * kMatLanes];
+  stageBlock(a, in);
+  for (std::size_t l = 0; l < kMatLanes; ++l) {
+    T m[N * N], adj[N * N];
+    loadLane(in, l, m);
+    T inv = safeInverse(adjugateOf(m, adj));
+#pragma GCC unroll 16
+    for (int e = 0; e < N * N; ++e) adj[e] *= inv;
+    storeLane(adj, l, res);
+  }
+  std::copy(res, res + N * N * kMatLanes, out);
+}
+
+template <class T, int N>
+void transposeBlock(const T* __restrict a, T* __restrict out) {
+  for (int r = 0; r < N; ++r) {
+    for (int c = 0; c < N; ++c) {
+      const T* src = a + (r * N + c) * kMatLanes;
+      T* dst = out + (c * N + r) * kMatLanes;
+      for (std::size_t l = 0; l < kMatLanes; ++l) dst[l] = src[l];
+    }
+  }
+}
+
+template <class T, int N>
+void multiplyBlock(const T* __restrict a, const T* __restrict b,
+                   T* __restrict out) {
+  T lhs[N * N * kMatLanes], rhs[N * N * kMatLanes], res[N * N * kMatLanes];
+  stageBlock(a, lhs);
+  stageBlock(b, rhs);
+  for (int r = 0; r < N; ++r) {
+    for (int c = 0; c < N; ++c) {
+      T* dst = res + (r * N + c) * kMatLanes;
+      for (std::size_t l = 0; l < kMatLanes; ++l) {
+        T sum = T{0};
+        for (int k = 0; k < N; ++k) {
+          sum += lhs[(r * N + k) * kMatLanes + l] *
+                 rhs[(k * N + c) * kMatLanes + l];
+        }
+        dst[l] = sum;
+      }
+    }
+  }
+  std::copy(res, res + N * N * kMatLanes, out);
+}
+
+template <class T, int N>
+void solveBlock(const T* __restrict a, const T* __restrict b,
+                T* __restrict x) {
+  T mat[N * N * kMatLanes], vec[N * kMatLanes], res[N * kMatLanes];
+  stageBlock(a, mat);
+  stageBlock(b, vec);
+  for (std::size_t l = 0; l < kMatLanes; ++l) {
+    T m[N * N], adj[N * N], rhs[N], sol[N];
+    loadLane(mat, l, m);
+    loadLane(vec, l, rhs);
+    T inv = safeInverse(adjugateOf(m, adj));
+    for (int r = 0; r < N; ++r) {
+      T sum = T{0};
+      for (int k = 0; k < N; ++k) sum += adj[r * N + k] * rhs[k];
+      sol[r] = sum * inv;
+    }
+    storeLane(sol, l, res);
+  }
+  std::copy(res, res + N * kMatLanes, x);
+}
+
+}  // namespace detail
+
+//--------------------------------------------
+// Batch kernels: blocks are split across threads and run the build for the
+// active ISA (cpudispatch.h); within a block every lane is an independent
+// matrix. Singular matrices give a zero inverse and a zero solution.
+//--------------------------------------------
+
+template <class T, int N>
+void batchDeterminant(const MatSoA<T, N>& a, std::vector<T>& det) {
+  TOOLS_PERF_REGION("mat_soa_determinant", a.size());
+  TOOLS_PROFILE_SCOPE("mat_soa_determinant");
+  det.resize(a.blocks() * kMatLanes);
+  dispatchParallelFor(a.blocks(), detail::kMatBlockGrain,
+                      [&](std::size_t b, std::size_t e) {
+                        for (std::size_t i = b; i < e; ++i) {
+                          detail::determinantBlock<T, N>(
+                              a.block(i), det.data() + i * kMatLanes);
+                        }
+                      });
+  det.resize(a.size());
+}
+
+template <class T, int N>
+void batchInverse(const MatSoA<T, N>& a, MatSoA<T, N>& out) {
+  TOOLS_PERF_REGION("mat_soa_inverse", a.size());
+  TOOLS_PROFILE_SCOPE("mat_soa_inverse");
+  out.resize(a.size());
+  dispatchParallelFor(a.blocks(), detail::kMatBlockGrain,
+                      [&](std::size_t b, std::size_t e) {
+                        for (std::size_t i = b; i < e; ++i) {
+                          detail::inverseBlock<T, N>(a.block(i),
+                                                     out.block(i));
+                        }
+                      });
+}
+
+template <class T, int N>
+void batchTranspose(const MatSoA<T, N>& a, MatSoA<T, N>& out) {
+  TOOLS_PERF_REGION("mat_soa_transpose", a.size());
+  TOOLS_PROFILE_SCOPE("mat_soa_transpose");
+  out.resize(a.size());
+  dispatchParallelFor(a.blocks(), detail::kMatBlockGrain,
+                      [&](std::size_t b, std::size_t e) {
+                        for (std::size_t i = b; i < e; ++i) {
+                          detail::transposeBlock<T, N>(a.block(i),
+                                                       out.block(i));
+                        }
+                      });
+}
+
+// out[i] = a[i] * b[i]. out must not be a or b.
+template <class T, int N>
+void batchMultiply(const MatSoA<T, N>& a, const MatSoA<T, N>& b,
+                   MatSoA<T, N>& out) {
+  APP_ASSERT(a.size() == b.size(), "Batches differ in size!");
+  TOOLS_PERF_REGION("mat_soa_multiply", a.size());
+  TOOLS_PROFILE_SCOPE("mat_soa_multiply");
+  out.resize(a.size());
+  dispatchParallelFor(a.blocks(), detail::kMatBlockGrain,
+                      [&](std::size_t lo, std::size_t hi) {
+                        for (std::size_t i = lo; i < hi; ++i) {
+                          detail::multiplyBlock<T, N>(a.block(i), b.block(i),
+                                                      out.block(i));
+                        }
+                      });
+}
+
+// Solves a[i] * x[i] = b[i] for every i.
+template <class T, int N>
+void batchSolve(const MatSoA<T, N>& a, const VecSoA<T, N>& b,
+                VecSoA<T, N>& x) {
+  APP_ASSERT(a.size() == b.size(), "Batches differ in size!");
+  TOOLS_PERF_REGION("mat_soa_solve", a.size());
+  TOOLS_PROFILE_SCOPE("mat_soa_solve");
+  x.resize(a.size());
+  dispatchParallelFor(a.blocks(), detail::kMatBlockGrain,
+                      [&](std::size_t lo, std::size_t hi) {
+                        for (std::size_t i = lo; i < hi; ++i) {
+                          detail::solveBlock<T, N>(a.block(i), b.block(i),
+                                                   x.block(i));
+                        }
+                      });
+}
@@ -0,0 +1,428 @@
+#pragma once
+
+#include <algorithm>
+#include <cassert>
+#include <cmath>
+#include <cstddef>
+#include <initializer_list>
+#include <vector>
+
+#include "application/error.h"
+#include "tools/cpudispatch.h"
+#include "tools/mat2.h"
+#include "tools/mat3.h"
+#include "tools/mat4.h"
+#include "tools/parallel.h"
+#include "tools/perfcounters.h"
+#include "tools/profiling.h"
+#include "tools/vec2.h"
+#include "tools/vec3.h"
+#include "tools/vec4.h"
+
+//--------------------------------------------
+// Heap-backed vector and row-major matrix of run-time size. They convert to
+// and from the fixed-size Vec2/3/4 and Mat2/3/4 types.
+//--------------------------------------------
+
+template <class T>
+class VecX {
+ public:
+  VecX() = default;
+  explicit VecX(std::size_t n, T value = T{0}) : m_data(n, value) {}
+  VecX(std::initializer_list<T> values) : m_data(values) {}
+  explicit VecX(const Vec2<T>& v) : m_data{v.x(), v.y()} {}
+  explicit VecX(const Vec3<T>& v) : m_data{v.x(), v.y(), v.z()} {}
+  explicit VecX(const Vec4<T>& v) : m_data{v.x(), v.y(), v.z(), v.w()} {}
+
+  std::size_t size() const { return m_data.size(); }
+  void resize(std::size_t n, T value = T{0}) { m_data.resize(n, value); }
+  void fill(T value) { std::fill(m_data.begin(), m_data.end(), value); }
+
+  T operator[](std::size_t i) const {
+    assert(i < m_data.size());
+    return m_data[i];
+  }
+  T& operator[](std::size_t i) {
+    assert(i < m_data.size());
+    return m_data[i];
+  }
+
+  T* data() { return m_data.data(); }
+  const T* data() const { return m_data.data(); }
+
+  Vec2<T> toVec2() const {
+    assert(size() == 2);
+    return Vec2<T>(m_data[0], m_data[1]);
+  }
+  Vec3<T> toVec3() const {
+    assert(size() == 3);
+    return Vec3<T>(m_data[0], m_data[1], m_data[2]);
+  }
+  Vec4<T> toVec4() const {
+    assert(size() == 4);
+    return Vec4<T>(m_data[0], m_data[1], m_data[2], m_data[3]);
+  }
+
+  bool operator==(const VecX<T>&) const = default;
+
+ private:
+  std::vector<T> m_data;
+};
+
+using VecXD = VecX<float>;
+
+template <class T>
+class MatX {
+ public:
+  MatX() = default;
+  MatX(std::size_t rows, std::size_t cols, T value = T{0})
+      : m_rows(rows), m_cols(cols), m_data(rows * cols, value) {}
+  explicit MatX(const Mat2<T>& m) : MatX(2, 2) { copyFixed(m, 2); }
+  explicit MatX(const Mat3<T>& m) : MatX(3, 3) { copyFixed(m, 3); }
+  explicit MatX(const Mat4<T>& m) : MatX(4, 4) { copyFixed(m, 4); }
+
+  static MatX<T> identity(std::size_t n) {
+    MatX<T> ret(n, n);
+    for (std::size_t i = 0; i < n; ++i) ret(i, i) = T{1};
+    return ret;
+  }
+
+  std::size_t rows() const { return m_rows; }
+  std::size_t cols() const { return m_cols; }
+  void resize(std::size_t rows, std::size_t cols, T value = T{0}) {
+    m_rows = rows;
+    m_cols = cols;
+    m_data.assign(rows * cols, value);
+  }
+  void fill(T value) { std::fill(m_data.begin(), m_data.end(), value); }
+
+  T operator()(std::size_t r, std::size_t c) const {
+    assert(r < m_rows && c < m_cols);
+    return m_data[r * m_cols + c];
+  }
+  T& operator()(std::size_t r, std::size_t c) {
+    assert(r < m_rows && c < m_cols);
+    return m_data[r * m_cols + c];
+  }
+
+  T* data() { return m_data.data(); }
+  const T* data() const { return m_data.data(); }
+  T* row(std::size_t r) { return m_data.data() + r * m_cols; }
+  const T* row(std::size_t r) const { return m_data.data() + r * m_cols; }
+
+  MatX<T> transpose() const;
+
+  Mat2<T> toMat2() const {
+    assert(m_rows == 2 && m_cols == 2);
+    return Mat2<T>(Vec2<T>((*this)(0, 0), (*this)(0, 1)),
+                   Vec2<T>((*this)(1, 0), (*this)(1, 1)));
+  }
+  Mat3<T> toMat3() const {
+    assert(m_rows == 3 && m_cols == 3);
+    Mat3<T> ret;
+    for (int r = 0; r < 3; ++r) {
+      ret[r] = Vec3<T>((*this)(r, 0), (*this)(r, 1), (*this)(r, 2));
+    }
+    return ret;
+  }
+  Mat4<T> toMat4() const {
+    assert(m_rows == 4 && m_cols == 4);
+    Mat4<T> ret;
+    for (int r = 0; r < 4; ++r) {
+      ret[r] = Vec4<T>((*this)(r, 0), (*this)(r, 1), (*this)(r, 2),
+                       (*this)(r, 3));
+    }
+    return ret;
+  }
+
+  bool operator==(const MatX<T>&) const = default;
+
+ private:
+  template <class M>
+  void copyFixed(const M& m, int n) {
+    for (int r = 0; r < n; ++r) {
+      for (int c = 0; c < n; ++c) (*this)(r, c) = m[r][c];
+    }
+  }
+
+  std::size_t m_rows = 0;
+  std::size_t m_cols = 0;
+  std::vector<T> m_data;
+};
+
+using MatXD = MatX<float>;
+
+template <typename T>
+MatX<T> MatX<T>::transpose() const {
+  MatX<T> ret(m_cols, m_rows);
+  // Tiled so both the reads and the writes stay within a few cache lines.
+  constexpr std::size_t kTile = 32;
+  for (std::size_t rb = 0; rb < m_rows; rb += kTile) {
+    for (std::size_t cb = 0; cb < m_cols; cb += kTile) {
+      std::size_t re = std::min(rb + kTile, m_rows);
+      std::size_t ce = std::min(cb + kTile, m_cols);
+      for (std::size_t r = rb; r < re; ++r) {
+        for (std::size_t c = cb; c < ce; ++c) ret(c, r) = (*this)(r, c);
+      }
+    }
+  }
+  return ret;
+}
+
+namespace detail {
+
+// Block sizes of the GEMM: an MR x NR tile of C stays in registers, a
+// KC x NR panel of B in L1 and an MC x KC block of A in L2.
+inline constexpr std::size_t kGemmMR = 4;
+inline constexpr std::size_t kGemmNR = 16;
+inline constexpr std::size_t kGemmKC = 256;
+inline constexpr std::size_t kGemmMC = 64;
+inline constexpr std::size_t kGemmNC = 2048;
+// Partial sums per gemv row, so its dot products vectorize without
+// reassociation and round the same in every ISA build.
+inline constexpr std::size_t kGemvLanes = 16;
+
+// C[0..mr, 0..nr) += alpha * Ap * Bp over kc steps. Ap holds MR values per
+// step and Bp NR values per step, zero padded, so the loop over j has a
+// fixed trip count and the four accumulator rows live in SIMD registers.
+template <class T>
+void gemmMicroKernel(std::size_t kc, const T* __restrict ap,
+                     const T* __restrict bp, T* __restrict c,
+                     std::size_t ldc, std::size_t mr, std::size_t nr,
+                     T alpha) {
+  static_assert(kGemmMR == 4, "the kernel keeps four accumulator rows");
+  T c0[kGemmNR] = {}, c1[kGemmNR] = {}, c2[kGemmNR] = {}, c3[kGemmNR] = {};
+  for (std::size_t k = 0; k < kc; ++k) {
+    const T* a = ap + k * kGemmMR;
+    const T* b = bp + k * kGemmNR;
+    const T a0 = a[0], a1 = a[1], a2 = a[2], a3 = a[3];
+    for (std::size_t j = 0; j < kGemmNR; ++j) {
+      c0[j] += a0 * b[j];
+      c1[j] += a1 * b[j];
+      c2[j] += a2 * b[j];
+      c3[j] += a3 * b[j];
+    }
+  }
+  const T* acc[kGemmMR] = {c0, c1, c2, c3};
+  for (std::size_t i = 0; i < mr; ++i) {
+    for (std::size_t j = 0; j < nr; ++j) c[i * ldc + j] += alpha * acc[i][j];
+  }
+}
+
+}  // namespace detail
+
+//--------------------------------------------
+// C = alpha * A * B + beta * C, cache blocked and split over row blocks of C
+// across threads. C must already have the shape rows(A) x cols(B).
+//--------------------------------------------
+
+template <typename T>
+void gemm(T alpha, const MatX<T>& a, const MatX<T>& b, T beta, MatX<T>& c) {
+  using namespace detail;
+  APP_ASSERT(a.cols() == b.rows(), "Inner dimensions do not match!");
+  APP_ASSERT(c.rows() == a.rows() && c.cols() == b.cols(),
+             "Output has the wrong shape!");
+  const std::size_t m = a.rows(), n = b.cols(), kk = a.cols();
+  TOOLS_PERF_REGION("gemm", m * n * kk);
+  TOOLS_PROFILE_SCOPE("gemm");
+  const std::size_t ldc = c.cols();
+
+  if (beta != T{1}) {
+    parallelFor(m, kGemmMC, [&](std::size_t rb, std::size_t re) {
+      for (std::size_t r = rb; r < re; ++r) {
+        T* row = c.row(r);
+        for (std::size_t j = 0; j < n; ++j) {
+          row[j] = beta == T{0} ? T{0} : beta * row[j];
+        }
+      }
+    });
+  }
+  if (m == 0 || n == 0 || kk == 0 || alpha == T{0}) return;
+
+  std::vector<T> bPacked;
+  for (std::size_t jc = 0; jc < n; jc += kGemmNC) {
+    const std::size_t nc = std::min(kGemmNC, n - jc);
+    const std::size_t panels = (nc + kGemmNR - 1) / kGemmNR;
+    for (std::size_t pc = 0; pc < kk; pc += kGemmKC) {
+      const std::size_t kc = std::min(kGemmKC, kk - pc);
+
+      // Pack B[pc.., jc..] into NR-wide panels, shared by all threads.
+      bPacked.assign(panels * kc * kGemmNR, T{0});
+      parallelFor(panels, 4, [&](std::size_t pb, std::size_t pe) {
+        for (std::size_t p = pb; p < pe; ++p) {
+          T* dst = bPacked.data() + p * kc * kGemmNR;
+          std::size_t j0 = jc + p * kGemmNR;
+          std::size_t nr = std::min(kGemmNR, jc + nc - j0);
+          for (std::size_t k = 0; k < kc; ++k) {
+            const T* src = b.row(pc + k) + j0;
+            std::copy(src, src + nr, dst + k * kGemmNR);
+          }
+        }
+      });
+
+      // The packing and micro-kernel loops run the build for the active
+      // ISA; the micro-kernel gains most from the wider vectors.
+      const std::size_t blocks = (m + kGemmMC - 1) / kGemmMC;
+      dispatchParallelFor(blocks, 1, [&](std::size_t bb, std::size_t be) {
+        std::vector<T> aPacked(kGemmMC * kc);
+        for (std::size_t blk = bb; blk < be; ++blk) {
+          const std::size_t ic = blk * kGemmMC;
+          const std::size_t mc = std::min(kGemmMC, m - ic);
+          const std::size_t strips = (mc + kGemmMR - 1) / kGemmMR;
+          // Pack A[ic.., pc..] into MR-tall strips, zero padded.
+          std::fill(aPacked.begin(), aPacked.end(), T{0});
+          for (std::size_t s = 0; s < strips; ++s) {
+            T* dst = aPacked.data() + s * kc * kGemmMR;
+            std::size_t mr = std::min(kGemmMR, mc - s * kGemmMR);
+            for (std::size_t i = 0; i < mr; ++i) {
+              const T* src = a.row(ic + s * kGemmMR + i) + pc;
+              for (std::size_t k = 0; k < kc; ++k) {
+                dst[k * kGemmMR + i] = src[k];
+              }
+            }
+          }
+          for (std::size_t p = 0; p < panels; ++p) {
+            std::size_t j0 = jc + p * kGemmNR;
+            std::size_t nr = std::min(kGemmNR, jc + nc - j0);
+            for (std::size_t s = 0; s < strips; ++s) {
+              std::size_t i0 = ic + s * kGemmMR;
+              std::size_t mr = std::min(kGemmMR, m - i0);
+              gemmMicroKernel(kc, aPacked.data() + s * kc * kGemmMR,
+                              bPacked.data() + p * kc * kGemmNR,
+                              c.row(i0) + j0, ldc, mr, nr, alpha);
+            }
+          }
+        }
+      });
+    }
+  }
+}
+
+// y = alpha * A * x + beta * y, one row per dot product, rows split across
+// threads and run in the build for the active ISA.
+template <typename T>
+void gemv(T alpha, const MatX<T>& a, const VecX<T>& x, T beta, VecX<T>& y) {
+  APP_ASSERT(a.cols() == x.size(), "Inner dimensions do not match!");
+  APP_ASSERT(y.size() == a.rows(), "Output has the wrong size!");
+  TOOLS_PERF_REGION("gemv", a.rows() * a.cols());
+  TOOLS_PROFILE_SCOPE("gemv");
+  const std::size_t n = a.cols();
+  const T* xs = x.data();
+  T* ys = y.data();
+  constexpr std::size_t L = detail::kGemvLanes;
+  dispatchParallelFor(a.rows(), 256, [&](std::size_t rb, std::size_t re) {
+    for (std::size_t r = rb; r < re; ++r) {
+      const T* row = a.row(r);
+      T lanes[L] = {};
+      std::size_t j = 0;
+      for (; j + L <= n; j += L) {
+        for (std::size_t l = 0; l < L; ++l) lanes[l] += row[j + l] * xs[j + l];
+      }
+      T sum = T{0};
+      for (; j < n; ++j) sum += row[j] * xs[j];
+      for (std::size_t l = 0; l < L; ++l) sum += lanes[l];
+      ys[r] = alpha * sum + (beta == T{0} ? T{0} : beta * ys[r]);
+    }
+  });
+}
+
+template <typename T>
+MatX<T> operator*(const MatX<T>& a, const MatX<T>& b) {
+  MatX<T> c(a.rows(), b.cols());
+  gemm(T{1}, a, b, T{0}, c);
+  return c;
+}
+
+template <typename T>
+VecX<T> operator*(const MatX<T>& a, const VecX<T>& x) {
+  VecX<T> y(a.rows());
+  gemv(T{1}, a, x, T{0}, y);
+  return y;
+}
+
+template <typename T>
+VecX<T> operator+(const VecX<T>& v1, const VecX<T>& v2) {
+  assert(v1.size() == v2.size());
+  VecX<T> ret(v1.size());
+  for (std::size_t i = 0; i < v1.size(); ++i) ret[i] = v1[i] + v2[i];
+  return ret;
+}
+
+template <typename T>
+VecX<T> operator-(const VecX<T>& v1, const VecX<T>& v2) {
+  assert(v1.size() == v2.size());
+  VecX<T> ret(v1.size());
+  for (std::size_t i = 0; i < v1.size(); ++i) ret[i] = v1[i] - v2[i];
+  return ret;
+}
+
+template <typename T>
+VecX<T> operator*(const VecX<T>& v, T num) {
+  VecX<T> ret(v.size());
+  for (std::size_t i = 0; i < v.size(); ++i) ret[i] = v[i] * num;
+  return ret;
+}
+
+template <typename T>
+T dot(const VecX<T>& v1, const VecX<T>& v2) {
+  assert(v1.size() == v2.size());
+  T sum = T{0};
+  for (std::size_t i = 0; i < v1.size(); ++i) sum += v1[i] * v2[i];
+  return sum;
+}
+
+//--------------------------------------------
+// Least squares: the x minimizing |A x - b| for a full column rank A with
+// rows >= cols, by Householder QR. Accumulates in double so float inputs
+// keep their precision.
+//--------------------------------------------
+
+template <typename T>
+VecX<T> leastSquares(const MatX<T>& a, const VecX<T>& b) {
+  const std::size_t m = a.rows(), n = a.cols();
+  APP_ASSERT(m >= n, "Least squares needs at least as many rows as columns!");
+  APP_ASSERT(b.size() == m, "Right-hand side has the wrong size!");
+  TOOLS_PROFILE_SCOPE("least_squares");
+
+  // Column-major working copy: each reflection walks down columns.
+  std::vector<double> q(m * n);
+  std::vector<double> rhs(m);
+  for (std::size_t r = 0; r < m; ++r) {
+    for (std::size_t c = 0; c < n; ++c) q[c * m + r] = a(r, c);
+    rhs[r] = b[r];
+  }
+
+  std::vector<double> diag(n);
+  for (std::size_t k = 0; k < n; ++k) {
+    double* col = q.data() + k * m;
+    double norm = 0.;
+    for (std::size_t r = k; r < m; ++r) norm += col[r] * col[r];
+    norm = std::sqrt(norm);
+    APP_ASSERT(norm > 0., "Matrix does not have full column rank!");
+    double alpha = col[k] > 0. ? -norm : norm;
+    col[k] -= alpha;
+    double vv = 0.;
+    for (std::size_t r = k; r < m; ++r) vv += col[r] * col[r];
+    diag[k] = alpha;
+
+    auto reflect = [&](double* y) {
+      double s = 0.;
+      for (std::size_t r = k; r < m; ++r) s += col[r] * y[r];
+      s = 2. * s / vv;
+      for (std::size_t r = k; r < m; ++r) y[r] -= s * col[r];
+    };
+    for (std::size_t c = k + 1; c < n; ++c) reflect(q.data() + c * m);
+    reflect(rhs.data());
+  }
+
+  // Back substitution with R = diag on the diagonal, q above it.
+  std::vector<double> xs(n);
+  for (std::size_t i = n; i-- > 0;) {
+    double s = rhs[i];
+    for (std::size_t c = i + 1; c < n; ++c) s -= q[c * m + i] * xs[c];
+    xs[i] = s / diag[i];
+  }
+  VecX<T> x(n);
+  for (std::size_t i = 0; i < n; ++i) x[i] = static_cast<T>(xs[i]);
+  return x;
+}
@@ -0,0 +1,333 @@
+#pragma once
+
+#include <algorithm>
+#include <array>
+#include <cstddef>
+#include <cstdint>
+#include <numeric>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+#include "application/error.h"
+#include "tools/bounds3.h"
+#include "tools/parallel.h"
+#include "tools/perfcounters.h"
+#include "tools/point3.h"
+#include "tools/profiling.h"
+#include "tools/reductions.h"
+
+enum class SpaceFillingCurve : std::uint8_t {
+  Morton,  // Z-order: bit interleaving, cheapest to compute.
+  Hilbert  // Consecutive keys are always neighbouring cells.
+};
+
+namespace detail {
+
+// Spreads the low 10 bits of v so that two zero bits follow each one.
+inline std::uint32_t spreadBits3(std::uint32_t v) {
+  v &= 0x000003ffu;
+  v = (v | (v << 16)) & 0x030000ffu;
+  v = (v | (v << 8)) & 0x0300f00fu;
+  v = (v | (v << 4)) & 0x030c30c3u;
+  v = (v | (v << 2)) & 0x09249249u;
+  return v;
+}
+
+// The same for the low 21 bits into a 63-bit value.
+inline std::uint64_t spreadBits3(std::uint64_t v) {
+  v &= 0x1fffffull;
+  v = (v | (v << 32)) & 0x1f00000000ffffull;
+  v = (v | (v << 16)) & 0x1f0000ff0000ffull;
+  v = (v | (v << 8)) & 0x100f00f00f00f00full;
+  v = (v | (v << 4)) & 0x10c30c30c30c30c3ull;
+  v = (v | (v << 2)) & 0x1249249249249249ull;
+  return v;
+}
+
+inline std::uint32_t spreadBits2(std::uint32_t v) {
+  v &= 0x0000ffffu;
+  v = (v | (v << 8)) & 0x00ff00ffu;
+  v = (v | (v << 4)) & 0x0f0f0f0fu;
+  v = (v | (v << 2)) & 0x33333333u;
+  v = (v | (v << 1)) & 0x55555555u;
+  return v;
+}
+
+// Skilling's transform (AIP Conf. Proc. 707, 2004) of b-bit coordinates to
+// the "transposed" Hilbert index: interleaving the results, x first, gives
+// the distance along the curve.
+template <class U>
+void hilbertTranspose3(U& x, U& y, U& z, int bits) {
+  U v[3] = {x, y, z};
+  const U top = U{1} << (bits - 1);
+  for (U q = top; q > 1; q >>= 1) {
+    U p = q - 1;
+    for (int i = 0; i < 3; ++i) {
+      if (v[i] & q) {
+        v[0] ^= p;
+      } else {
+        U t = (v[0] ^ v[i]) & p;
+        v[0] ^= t;
+        v[i] ^= t;
+      }
+    }
+  }
+  v[1] ^= v[0];
+  v[2] ^= v[1];
+  U t = 0;
+  for (U q = top; q > 1; q >>= 1) {
+    if (v[2] & q) t ^= q - 1;
+  }
+  x = v[0] ^ t;
+  y = v[1] ^ t;
+  z = v[2] ^ t;
+}
+
+}  // namespace detail
+
+// 30-bit Morton code of 10-bit coordinates, x in the highest bit of each
+// triple.
+inline std::uint32_t mortonEncode30(std::uint32_t x, std::uint32_t y,
+                                    std::uint32_t z) {
+  return (detail::spreadBits3(x) << 2) | (detail::spreadBits3(y) << 1) |
+         detail::spreadBits3(z);
+}
+
+// 63-bit Morton code of 21-bit coordinates.
+inline std::uint64_t mortonEncode63(std::uint64_t x, std::uint64_t y,
+                                    std::uint64_t z) {
+  return (detail::spreadBits3(x) << 2) | (detail::spreadBits3(y) << 1) |
+         detail::spreadBits3(z);
+}
+
+inline std::uint32_t hilbertEncode30(std::uint32_t x, std::uint32_t y,
+                                     std::uint32_t z) {
+  detail::hilbertTranspose3(x, y, z, 10);
+  return mortonEncode30(x, y, z);
+}
+
+inline std::uint64_t hilbertEncode63(std::uint64_t x, std::uint64_t y,
+                                     std::uint64_t z) {
+  detail::hilbertTranspose3(x, y, z, 21);
+  return mortonEncode63(x, y, z);
+}
+
+// 2D Morton code of 16-bit coordinates, x in the even bits.
+inline std::uint32_t mortonEncode2(std::uint32_t x, std::uint32_t y) {
+  return detail::spreadBits2(x) | (detail::spreadBits2(y) << 1);
+}
+
+// Distance of (x, y) along the Hilbert curve filling an n x n grid, n a
+// power of two.
+inline std::uint32_t hilbertEncode2(std::uint32_t n, std::uint32_t x,
+                                    std::uint32_t y) {
+  std::uint32_t d = 0;
+  for (std::uint32_t s = n / 2; s > 0; s /= 2) {
+    std::uint32_t rx = (x & s) ? 1 : 0;
+    std::uint32_t ry = (y & s) ? 1 : 0;
+    d += s * s * ((3 * rx) ^ ry);
+    // Rotate the quadrant so the sub-curve starts where the parent enters.
+    if (ry == 0) {
+      if (rx == 1) {
+        x = n - 1 - x;
+        y = n - 1 - y;
+      }
+      std::swap(x, y);
+    }
+  }
+  return d;
+}
+
+namespace detail {
+
+inline constexpr std::size_t kMortonGrain = 16384;
+inline constexpr std::size_t kRadixGrain = 65536;
+inline constexpr int kRadixBits = 8;
+inline constexpr std::size_t kRadixBuckets = std::size_t{1} << kRadixBits;
+
+// Keys for n points whose coordinates come from fetch(i, x, y, z), so AoS
+// and SoA inputs share one kernel.
+template <class Key, class T, typename Fetch>
+void spatialKeys(std::size_t n, const Bounds3<T>& bounds,
+                 SpaceFillingCurve curve, Key* keys, Fetch&& fetch) {
+  static_assert(std::is_same_v<Key, std::uint32_t> ||
+                    std::is_same_v<Key, std::uint64_t>,
+                "Keys are 30-bit (uint32_t) or 63-bit (uint64_t)");
+  constexpr int kBits = std::is_same_v<Key, std::uint32_t> ? 10 : 21;
+  constexpr T kCells = static_cast<T>(std::uint32_t{1} << kBits);
+  TOOLS_PERF_REGION("spatial_keys", n);
+  TOOLS_PROFILE_SCOPE("spatial_keys");
+  const Point3<T> lo = bounds.min();
+  const Vec3<T> d = bounds.diagonal();
+  const T scale[3] = {d.x() > T{0} ? kCells / d.x() : T{0},
+                      d.y() > T{0} ? kCells / d.y() : T{0},
+                      d.z() > T{0} ? kCells / d.z() : T{0}};
+  const T origin[3] = {lo.x(), lo.y(), lo.z()};
+  const T top = kCells - T{1};
+  parallelFor(n, kMortonGrain, [&](std::size_t b, std::size_t e) {
+    for (std::size_t i = b; i < e; ++i) {
+      T p[3];
+      fetch(i, p[0], p[1], p[2]);
+      Key q[3];
+      for (int a = 0; a < 3; ++a) {
+        T c = (p[a] - origin[a]) * scale[a];
+        q[a] = static_cast<Key>(std::min(std::max(c, T{0}), top));
+      }
+      if (curve == SpaceFillingCurve::Hilbert) {
+        hilbertTranspose3(q[0], q[1], q[2], kBits);
+      }
+      keys[i] = (spreadBits3(q[0]) << 2) | (spreadBits3(q[1]) << 1) |
+                spreadBits3(q[2]);
+    }
+  });
+}
+
+}  // namespace detail
+
+//--------------------------------------------
+// Space-filling-curve keys of points quantized to the grid of `bounds`:
+// 10 bits per axis for std::uint32_t keys (30-bit codes), 21 bits per axis
+// for std::uint64_t keys (63-bit codes). Points outside the box are clamped
+// to its boundary cells.
+//--------------------------------------------
+
+template <class Key, class T>
+void computeSpatialKeys(const std::vector<Point3<T>>& points,
+                        const Bounds3<T>& bounds, SpaceFillingCurve curve,
+                        std::vector<Key>& keys) {
+  keys.resize(points.size());
+  detail::spatialKeys(points.size(), bounds, curve, keys.data(),
+                      [&](std::size_t i, T& x, T& y, T& z) {
+                        x = points[i].x();
+                        y = points[i].y();
+                        z = points[i].z();
+                      });
+}
+
+// The same for coordinates in separate arrays (SoA), e.g. ParticleSystem.
+template <class Key, class T>
+void computeSpatialKeys(const T* x, const T* y, const T* z, std::size_t n,
+                        const Bounds3<T>& bounds, SpaceFillingCurve curve,
+                        Key* keys) {
+  detail::spatialKeys(n, bounds, curve, keys,
+                      [&](std::size_t i, T& px, T& py, T& pz) {
+                        px = x[i];
+                        py = y[i];
+                        pz = z[i];
+                      });
+}
+
+//--------------------------------------------
+// Stable parallel LSD radix sort of keys, 8 bits per pass, carrying values
+// along. Only the low keyBits bits take part, and passes in which every
+// key has the same digit are skipped, so 30-bit keys cost at most four
+// passes. Each pass counts digits per chunk, turns the counts into
+// per-chunk output offsets and scatters every chunk on its own thread.
+//--------------------------------------------
+
+template <class Key, class Value>
+void radixSort(std::vector<Key>& keys, std::vector<Value>& values,
+               int keyBits = 8 * sizeof(Key)) {
+  static_assert(std::is_unsigned_v<Key>, "Radix sort needs unsigned keys");
+  APP_ASSERT(keys.size() == values.size(), "Keys and values differ in size!");
+  const std::size_t n = keys.size();
+  TOOLS_PERF_REGION("radix_sort", n);
+  TOOLS_PROFILE_SCOPE("radix_sort");
+  using detail::kRadixBuckets;
+  const std::size_t chunkSize = std::max(
+      detail::kRadixGrain, (n + numWorkerThreads() - 1) / numWorkerThreads());
+  const std::size_t chunks = (n + chunkSize - 1) / chunkSize;
+  std::vector<std::array<std::size_t, kRadixBuckets>> offsets(chunks);
+  std::vector<Key> keysOut(n);
+  std::vector<Value> valuesOut(n);
+
+  keyBits = std::min<int>(keyBits, 8 * sizeof(Key));
+  for (int shift = 0; shift < keyBits; shift += detail::kRadixBits) {
+    auto digit = [shift](Key k) {
+      return static_cast<std::size_t>(k >> shift) & (kRadixBuckets - 1);
+    };
+    parallelFor(chunks, 1, [&](std::size_t cb, std::size_t ce) {
+      for (std::size_t c = cb; c < ce; ++c) {
+        offsets[c].fill(0);
+        std::size_t end = std::min(n, (c + 1) * chunkSize);
+        for (std::size_t i = c * chunkSize; i < end; ++i) {
+          ++offsets[c][digit(keys[i])];
+        }
+      }
+    });
+    // Digit-major, chunk-minor prefix sum keeps the sort stable.
+    std::size_t sum = 0;
+    bool trivial = false;
+    for (std::size_t d = 0; d < kRadixBuckets; ++d) {
+      std::size_t bucket = 0;
+      for (std::size_t c = 0; c < chunks; ++c) {
+        std::size_t count = offsets[c][d];
+        offsets[c][d] = sum;
+        sum += count;
+        bucket += count;
+      }
+      trivial |= bucket == n;
+    }
+    if (trivial) continue;
+
+    parallelFor(chunks, 1, [&](std::size_t cb, std::size_t ce) {
+      for (std::size_t c = cb; c < ce; ++c) {
+        std::array<std::size_t, kRadixBuckets>& next = offsets[c];
+        std::size_t end = std::min(n, (c + 1) * chunkSize);
+        for (std::size_t i = c * chunkSize; i < end; ++i) {
+          std::size_t to = next[digit(keys[i])]++;
+          keysOut[to] = keys[i];
+          valuesOut[to] = values[i];
+        }
+      }
+    });
+    keys.swap(keysOut);
+    values.swap(valuesOut);
+  }
+}
+
+// Sorts keys and returns the permutation applied: entry i is the original
+// index of the i-th smallest key.
+template <class Key>
+std::vector<std::uint32_t> radixSortOrder(std::vector<Key>& keys,
+                                          int keyBits = 8 * sizeof(Key)) {
+  std::vector<std::uint32_t> order(keys.size());
+  std::iota(order.begin(), order.end(), 0u);
+  radixSort(keys, order, keyBits);
+  return order;
+}
+
+// Gathers data into the order of a permutation from radixSortOrder:
+// data[i] becomes the old data[order[i]]. Takes any number of arrays, so
+// every SoA attribute of a point set follows its keys.
+template <class T, class... Rest>
+void applyPermutation(const std::vector<std::uint32_t>& order,
+                      std::vector<T>& data, Rest&... rest) {
+  APP_ASSERT(data.size() == order.size(), "Permutation size mismatch!");
+  std::vector<T> tmp(data.size());
+  parallelFor(order.size(), detail::kMortonGrain,
+              [&](std::size_t b, std::size_t e) {
+                for (std::size_t i = b; i < e; ++i) tmp[i] = data[order[i]];
+              });
+  data.swap(tmp);
+  if constexpr (sizeof...(rest) > 0) applyPermutation(order, rest...);
+}
+
+//--------------------------------------------
+// Reorders points along a space-filling curve over their bounding box,
+// together with any attribute arrays, and returns the permutation so other
+// data can follow with applyPermutation.
+//--------------------------------------------
+
+template <class T, class... Attributes>
+std::vector<std::uint32_t> spatialSort(std::vector<Point3<T>>& points,
+                                       SpaceFillingCurve curve,
+                                       Attributes&... attributes) {
+  TOOLS_PROFILE_SCOPE("spatial_sort");
+  std::vector<std::uint32_t> keys;
+  computeSpatialKeys(points, computeBounds(points), curve, keys);
+  std::vector<std::uint32_t> order = radixSortOrder(keys, 30);
+  applyPermutation(order, points, attributes...);
+  return order;
+}
@@ -2,17 +2,9 @@
 
 #include <cassert>
 #include <cmath>
-#include <iostream>
-#include <random>
 
-template <class T>
-class Vec4;
-
-template <class T>
-class Vec3;
-
-template <class T>
-class Point3;
+#include "tools/fwd.h"
+#include "tools/profiling.h"
 
 template <class T>
 class Normal3 {
@@ -86,27 +78,10 @@ using Normal3D = Normal3<float>;
 
 template <typename T>
 void Normal3<T>::normalize() {
+  TOOLS_COUNT_OP(ProfileOp::Normalize);
   *this = (*this) / (this->length() + 1.E-30f);
 }
 
-//--------------------------------------------
-// Overloaded I/O operators (input, output)
-//--------------------------------------------
-
-template <typename T>
-inline std::istream& operator>>(std::istream& in, Normal3<T>& n) {
-  T x, y, z;
-  in >> x >> y >> z;
-  n.set(x, y, z);
-  return in;
-}
-
-template <typename T>
-inline std::ostream& operator<<(std::ostream& out, const Normal3<T>& n) {
-  out << "(" << n.x() << "," << n.y() << "," << n.z() << ")" << std::endl;
-  return out;
-}
-
 //--------------------------------------------
 // Overloaded Normal Function operators (input, output)
 //--------------------------------------------
@@ -127,7 +102,7 @@ Normal3<T> operator+(const Normal3<T>& n1, const Normal3<T>& n2) {
 
 template <typename T>
 Normal3<T> operator+(const Normal3<T>& n, const Vec3<T>& v) {
-  return Vec3<T>(n.x() + v.x(), n.y() + v.y(), n.z() + v.z());
+  return Normal3<T>(n.x() + v.x(), n.y() + v.y(), n.z() + v.z());
 }
 
 template <typename T>
@@ -150,6 +125,11 @@ Normal3<T> operator-(const Normal3<T>& n1, const Normal3<T>& n2) {
   return Normal3<T>(n1.x() - n2.x(), n1.y() - n2.y(), n1.z() - n2.z());
 }
 
+template <typename T>
+Normal3<T> operator-(const Normal3<T>& n, const Vec3<T>& v) {
+  return Normal3<T>(n.x() - v.x(), n.y() - v.y(), n.z() - v.z());
+}
+
 template <typename T>
 Normal3<T> operator-(const Normal3<T>& n, T num) {
   return Normal3<T>(n.x() - num, n.y() - num, n.z() - num);
@@ -216,5 +196,6 @@ T dot(const Vec3<T>& v, const Normal3<T>& n) {
 
 template <typename T>
 Normal3<T> getUnitVectorOf(const Normal3<T>& n) {
+  TOOLS_COUNT_OP(ProfileOp::Normalize);
   return n / static_cast<T>(n.length() + 1.E-30);
 }
@@ -0,0 +1,437 @@
+#pragma once
+
+#include <algorithm>
+#include <cmath>
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+#include "tools/kdtree.h"
+#include "tools/mat3.h"
+#include "tools/matsoa.h"
+#include "tools/normal3.h"
+#include "tools/parallel.h"
+#include "tools/perfcounters.h"
+#include "tools/point3.h"
+#include "tools/profiling.h"
+#include "tools/symmetriceigen.h"
+#include "tools/vec3.h"
+
+enum class NormalOrientation : std::uint8_t {
+  None,        // Sign left as the eigensolver returns it.
+  Viewpoint,   // Every normal faces params.viewpoint.
+  Propagation  // Consistent across the surface by walking the kNN graph.
+};
+
+struct NormalEstimationParams {
+  // Neighborhood: the k nearest points, or every point within `radius` when
+  // radius > 0.
+  std::size_t k = 16;
+  float radius = 0.f;
+  NormalOrientation orientation = NormalOrientation::Viewpoint;
+  // Target of Viewpoint orientation. Under Propagation it orients the seed
+  // of every connected patch; the first seed is the point nearest to it.
+  Point3D viewpoint = Point3D(0.f, 0.f, 0.f);
+  // Points processed per streamed block. Memory beyond the outputs and the
+  // k-d tree is bounded by this, not by the cloud size. Propagation also
+  // orients each block independently before reconciling them, adding 9
+  // bytes per point.
+  std::size_t blockSize = 65536;
+};
+
+namespace detail {
+
+inline constexpr std::size_t kNormalGrain = 512;
+
+// Mean-centred covariance of the neighborhood. Centring first keeps float
+// accumulation accurate far from the origin.
+inline Mat3D neighborhoodCovariance(const std::vector<Point3D>& points,
+                                    const std::vector<KdNeighbor<float>>& nb) {
+  Mat3D cov(0.f);
+  if (nb.empty()) return cov;
+  float mx = 0.f, my = 0.f, mz = 0.f;
+  for (const auto& n : nb) {
+    mx += points[n.index].x();
+    my += points[n.index].y();
+    mz += points[n.index].z();
+  }
+  float inv = 1.f / nb.size();
+  mx *= inv;
+  my *= inv;
+  mz *= inv;
+  float xx = 0.f, xy = 0.f, xz = 0.f, yy = 0.f, yz = 0.f, zz = 0.f;
+  for (const auto& n : nb) {
+    float dx = points[n.index].x() - mx;
+    float dy = points[n.index].y() - my;
+    float dz = points[n.index].z() - mz;
+    xx += dx * dx;
+    xy += dx * dy;
+    xz += dx * dz;
+    yy += dy * dy;
+    yz += dy * dz;
+    zz += dz * dz;
+  }
+  cov[0] = Vec3D(xx, xy, xz) * inv;
+  cov[1] = Vec3D(xy, yy, yz) * inv;
+  cov[2] = Vec3D(xz, yz, zz) * inv;
+  return cov;
+}
+
+inline void gatherNeighbors(const KdTreePoint3D& tree, const Point3D& p,
+                            const NormalEstimationParams& params,
+                            std::vector<KdNeighbor<float>>& nb) {
+  if (params.radius > 0.f) {
+    tree.radius(p, params.radius, nb);
+  } else {
+    tree.knn(p, params.k, nb);
+  }
+}
+
+inline void orientTowardViewpoint(const std::vector<Point3D>& points,
+                                  const Point3D& viewpoint,
+                                  std::vector<Normal3D>& normals) {
+  parallelFor(points.size(), 8192, [&](std::size_t b, std::size_t e) {
+    for (std::size_t i = b; i < e; ++i) {
+      if (dot(normals[i], viewpoint - points[i]) < 0.f) {
+        normals[i] = -normals[i];
+      }
+    }
+  });
+}
+
+// Binary min-heap over the ids [0, size) with at most one entry per id:
+// pushing a queued id only lowers its key (decrease-key), so the heap never
+// outgrows `size` however many times an id is reached. Each entry carries
+// the payload of the push that set its key.
+class IndexedMinHeap {
+ public:
+  void reset(std::size_t size) {
+    m_heap.clear();
+    m_pos.assign(size, kAbsent);
+    m_key.resize(size);
+    m_from.resize(size);
+  }
+
+  bool empty() const { return m_heap.empty(); }
+
+  void push(std::uint32_t id, float key, std::uint32_t from) {
+    std::uint32_t p = m_pos[id];
+    if (p == kAbsent) {
+      p = static_cast<std::uint32_t>(m_heap.size());
+      m_heap.push_back(id);
+    } else if (key >= m_key[id]) {
+      return;
+    }
+    m_key[id] = key;
+    m_from[id] = from;
+    siftUp(p);
+  }
+
+  // Removes the entry with the smallest key; returns its id and payload.
+  std::uint32_t pop(std::uint32_t& from) {
+    std::uint32_t top = m_heap[0];
+    from = m_from[top];
+    m_pos[top] = kAbsent;
+    std::uint32_t last = m_heap.back();
+    m_heap.pop_back();
+    if (!m_heap.empty()) {
+      m_heap[0] = last;
+      m_pos[last] = 0;
+      siftDown(0);
+    }
+    return top;
+  }
+
+ private:
+  static constexpr std::uint32_t kAbsent = 0xffffffffu;
+
+  void place(std::uint32_t p, std::uint32_t id) {
+    m_heap[p] = id;
+    m_pos[id] = p;
+  }
+
+  void siftUp(std::uint32_t p) {
+    std::uint32_t id = m_heap[p];
+    while (p > 0) {
+      std::uint32_t parent = (p - 1) / 2;
+      if (m_key[m_heap[parent]] <= m_key[id]) break;
+      place(p, m_heap[parent]);
+      p = parent;
+    }
+    place(p, id);
+  }
+
+  void siftDown(std::uint32_t p) {
+    const std::size_t size = m_heap.size();
+    std::uint32_t id = m_heap[p];
+    for (;;) {
+      std::size_t child = 2 * std::size_t(p) + 1;
+      if (child >= size) break;
+      if (child + 1 < size && m_key[m_heap[child + 1]] < m_key[m_heap[child]])
+        ++child;
+      if (m_key[id] <= m_key[m_heap[child]]) break;
+      place(p, m_heap[child]);
+      p = static_cast<std::uint32_t>(child);
+    }
+    place(p, id);
+  }
+
+  std::vector<std::uint32_t> m_heap, m_pos, m_from;
+  std::vector<float> m_key;
+};
+
+// Prim-style propagation (Hoppe et al. 1992): grow a spanning tree of the
+// kNN graph, always crossing the edge whose normals are closest to
+// parallel, and flip each new normal to agree with its parent. It runs in
+// two levels so that it parallelizes and its frontier stays bounded:
+//  1. Each block of params.blockSize points in k-d tree order grows its own
+//     patches in parallel, crossing only edges inside the block. The
+//     frontier holds at most one entry per block point.
+//  2. Patches are then oriented relative to each other by the same Prim
+//     walk over the patch graph, whose edges sum dot(n_i, n_j) over the
+//     kNN edges joining two patches; the largest sums are trusted first.
+// Neighbors are queried again on demand instead of storing the graph, so
+// the extra memory is 9 bytes per point plus one frontier per thread.
+inline void orientByPropagation(const KdTreePoint3D& tree,
+                                const std::vector<Point3D>& points,
+                                const NormalEstimationParams& params,
+                                std::vector<Normal3D>& normals) {
+  constexpr std::uint32_t kNoPatch = 0xffffffffu;
+  const std::size_t n = points.size();
+  const std::vector<std::uint32_t>& order = tree.sortedIndices();
+  const std::size_t blockSize = std::max<std::size_t>(params.blockSize, 1);
+  const std::size_t blocks = (n + blockSize - 1) / blockSize;
+
+  std::vector<std::uint32_t> rank(n), patch(n, kNoPatch);
+  std::vector<std::uint8_t> boundary(n, 0);
+  parallelFor(n, 8192, [&](std::size_t b, std::size_t e) {
+    for (std::size_t r = b; r < e; ++r) {
+      rank[order[r]] = static_cast<std::uint32_t>(r);
+    }
+  });
+
+  // Level 1: patches within each block. patch[] holds block-local ids and
+  // boundary[] marks points with a neighbor in another block.
+  std::vector<std::vector<std::uint32_t>> seeds(blocks);
+  parallelFor(blocks, 1, [&](std::size_t b0, std::size_t e0) {
+    IndexedMinHeap frontier;
+    std::vector<KdNeighbor<float>> nb;
+    for (std::size_t blk = b0; blk < e0; ++blk) {
+      const std::size_t begin = blk * blockSize;
+      const std::size_t end = std::min(begin + blockSize, n);
+      frontier.reset(end - begin);
+      auto expand = [&](std::uint32_t i) {
+        gatherNeighbors(tree, points[i], params, nb);
+        for (const auto& m : nb) {
+          std::uint32_t r = rank[m.index];
+          if (r < begin || r >= end) {
+            boundary[i] = 1;
+          } else if (patch[m.index] == kNoPatch) {
+            float w = 1.f - std::fabs(dot(normals[i], normals[m.index]));
+            frontier.push(static_cast<std::uint32_t>(r - begin), w, i);
+          }
+        }
+      };
+      for (std::size_t r = begin; r < end; ++r) {
+        std::uint32_t seed = order[r];
+        if (patch[seed] != kNoPatch) continue;
+        const std::uint32_t id = static_cast<std::uint32_t>(seeds[blk].size());
+        seeds[blk].push_back(seed);
+        patch[seed] = id;
+        expand(seed);
+        while (!frontier.empty()) {
+          std::uint32_t from;
+          std::uint32_t i = order[begin + frontier.pop(from)];
+          if (dot(normals[from], normals[i]) < 0.f) normals[i] = -normals[i];
+          patch[i] = id;
+          expand(i);
+        }
+      }
+    }
+  });
+
+  // Global patch ids, numbered block after block.
+  std::vector<std::uint32_t> firstPatch(blocks + 1, 0), patchSeed;
+  for (std::size_t blk = 0; blk < blocks; ++blk) {
+    firstPatch[blk + 1] =
+        firstPatch[blk] + static_cast<std::uint32_t>(seeds[blk].size());
+    patchSeed.insert(patchSeed.end(), seeds[blk].begin(), seeds[blk].end());
+  }
+  const std::size_t patches = patchSeed.size();
+  parallelFor(n, 8192, [&](std::size_t b, std::size_t e) {
+    for (std::size_t i = b; i < e; ++i) {
+      patch[i] += firstPatch[rank[i] / blockSize];
+    }
+  });
+
+  // Level 2: vote over the kNN edges between patches. Only boundary points
+  // can have one, since a block's patches absorb all its inner edges. Votes
+  // are combined per block and then in block order, so the sums do not
+  // depend on the thread count.
+  struct Vote {
+    std::uint64_t key;  // Lower patch id in the high word.
+    float sum;
+    bool operator<(const Vote& rhs) const { return key < rhs.key; }
+  };
+  auto combine = [](std::vector<Vote>& votes) {
+    std::stable_sort(votes.begin(), votes.end());
+    std::size_t out = 0;
+    for (std::size_t v = 0; v < votes.size(); ++v) {
+      if (out > 0 && votes[out - 1].key == votes[v].key) {
+        votes[out - 1].sum += votes[v].sum;
+      } else {
+        votes[out++] = votes[v];
+      }
+    }
+    votes.resize(out);
+  };
+  std::vector<std::vector<Vote>> blockVotes(blocks);
+  parallelFor(blocks, 1, [&](std::size_t b0, std::size_t e0) {
+    std::vector<KdNeighbor<float>> nb;
+    for (std::size_t blk = b0; blk < e0; ++blk) {
+      const std::size_t end = std::min((blk + 1) * blockSize, n);
+      for (std::size_t r = blk * blockSize; r < end; ++r) {
+        std::uint32_t i = order[r];
+        if (!boundary[i]) continue;
+        gatherNeighbors(tree, points[i], params, nb);
+        for (const auto& m : nb) {
+          std::uint32_t a = patch[i], c = patch[m.index];
+          if (a == c) continue;
+          std::uint64_t key = (std::uint64_t(std::min(a, c)) << 32) |
+                              std::max(a, c);
+          blockVotes[blk].push_back(
+              Vote{key, dot(normals[i], normals[m.index])});
+        }
+      }
+      combine(blockVotes[blk]);
+    }
+  });
+  std::vector<Vote> votes;
+  for (auto& v : blockVotes) {
+    votes.insert(votes.end(), v.begin(), v.end());
+    std::vector<Vote>().swap(v);
+  }
+  combine(votes);
+
+  // Patch graph in CSR form; each adjacency entry names its vote.
+  std::vector<std::uint32_t> adjBegin(patches + 1, 0), adj(2 * votes.size());
+  for (const Vote& v : votes) {
+    ++adjBegin[(v.key >> 32) + 1];
+    ++adjBegin[(v.key & 0xffffffffu) + 1];
+  }
+  for (std::size_t p = 0; p < patches; ++p) adjBegin[p + 1] += adjBegin[p];
+  {
+    std::vector<std::uint32_t> fill(adjBegin.begin(), adjBegin.end() - 1);
+    for (std::uint32_t v = 0; v < votes.size(); ++v) {
+      adj[fill[votes[v].key >> 32]++] = v;
+      adj[fill[votes[v].key & 0xffffffffu]++] = v;
+    }
+  }
+
+  std::vector<std::int8_t> sign(patches, 0);
+  IndexedMinHeap frontier;
+  frontier.reset(patches);
+  auto expand = [&](std::uint32_t p) {
+    for (std::uint32_t a = adjBegin[p]; a < adjBegin[p + 1]; ++a) {
+      const Vote& v = votes[adj[a]];
+      std::uint32_t lo = std::uint32_t(v.key >> 32);
+      std::uint32_t q = lo == p ? std::uint32_t(v.key & 0xffffffffu) : lo;
+      if (!sign[q]) frontier.push(q, -std::fabs(v.sum), adj[a]);
+    }
+  };
+  auto grow = [&](std::uint32_t root, std::uint32_t seed) {
+    bool faces = dot(normals[seed], params.viewpoint - points[seed]) >= 0.f;
+    sign[root] = faces ? 1 : -1;
+    expand(root);
+    while (!frontier.empty()) {
+      std::uint32_t via;
+      std::uint32_t q = frontier.pop(via);
+      const Vote& v = votes[via];
+      std::uint32_t lo = std::uint32_t(v.key >> 32);
+      std::uint32_t parent = lo == q ? std::uint32_t(v.key & 0xffffffffu) : lo;
+      sign[q] = v.sum < 0.f ? -sign[parent] : sign[parent];
+      expand(q);
+    }
+  };
+
+  // The point nearest the viewpoint sees it most reliably, so the first
+  // walk starts at its patch; the others start at their patch's seed.
+  std::vector<KdNeighbor<float>> nb;
+  tree.knn(params.viewpoint, 1, nb);
+  grow(patch[nb[0].index], nb[0].index);
+  for (std::uint32_t p = 0; p < patches; ++p) {
+    if (!sign[p]) grow(p, patchSeed[p]);
+  }
+
+  parallelFor(n, 8192, [&](std::size_t b, std::size_t e) {
+    for (std::size_t i = b; i < e; ++i) {
+      if (sign[patch[i]] < 0) normals[i] = -normals[i];
+    }
+  });
+}
+
+}  // namespace detail
+
+//--------------------------------------------
+// Estimates a unit normal per point as the direction of least variance of
+// its neighborhood. Points are streamed in k-d tree order, block by block:
+// each block gathers neighborhoods in parallel, reduces them to
+// covariances and runs the batched eigensolver, so at most one block of
+// covariances exists at a time. Points with fewer than three neighbors get
+// a zero normal. If `curvature` is given it receives the surface variation
+// lambda_min / (lambda_0 + lambda_1 + lambda_2).
+//--------------------------------------------
+
+inline void estimateNormals(const std::vector<Point3D>& points,
+                            const NormalEstimationParams& params,
+                            std::vector<Normal3D>& normals,
+                            std::vector<float>* curvature = nullptr) {
+  const std::size_t n = points.size();
+  TOOLS_PERF_REGION("estimate_normals", n);
+  TOOLS_PROFILE_SCOPE("estimate_normals");
+  normals.assign(n, Normal3D(0.f, 0.f, 0.f));
+  if (curvature) curvature->assign(n, 0.f);
+  if (n == 0) return;
+
+  KdTreePoint3D tree(points);
+  const std::vector<std::uint32_t>& order = tree.sortedIndices();
+  const std::size_t blockSize = std::max<std::size_t>(params.blockSize, 1);
+
+  Mat3SoA cov, vectors;
+  Vec3SoA values;
+  std::vector<std::uint8_t> enough;
+  for (std::size_t begin = 0; begin < n; begin += blockSize) {
+    const std::size_t count = std::min(blockSize, n - begin);
+    cov.resize(count);
+    enough.assign(count, 0);
+    parallelFor(count, detail::kNormalGrain,
+                [&](std::size_t b, std::size_t e) {
+                  std::vector<KdNeighbor<float>> nb;
+                  for (std::size_t j = b; j < e; ++j) {
+                    const Point3D& p = points[order[begin + j]];
+                    detail::gatherNeighbors(tree, p, params, nb);
+                    enough[j] = nb.size() >= 3;
+                    cov.set(j, detail::neighborhoodCovariance(points, nb));
+                  }
+                });
+    batchSymmetricEigen(cov, values, vectors);
+    parallelFor(count, 8192, [&](std::size_t b, std::size_t e) {
+      for (std::size_t j = b; j < e; ++j) {
+        if (!enough[j]) continue;
+        std::uint32_t i = order[begin + j];
+        normals[i] = Normal3D(vectors.get(j)[2]);
+        if (curvature) {
+          Vec3D l = values.get(j);
+          float sum = l.x() + l.y() + l.z();
+          (*curvature)[i] = sum > 0.f ? std::max(l.z(), 0.f) / sum : 0.f;
+        }
+      }
+    });
+  }
+
+  if (params.orientation == NormalOrientation::Viewpoint) {
+    detail::orientTowardViewpoint(points, params.viewpoint, normals);
+  } else if (params.orientation == NormalOrientation::Propagation) {
+    detail::orientByPropagation(tree, points, params, normals);
+  }
+}
@@ -5,6 +5,10 @@
 class OrthoNormalBasis {
  public:
   OrthoNormalBasis() = default;
+  // Takes three orthonormal vectors as they are; nothing is re-normalized.
+  OrthoNormalBasis(const Vec3D& u, const Vec3D& v, const Vec3D& w)
+      : m_u(u), m_v(v), m_w(w) {}
+
   Vec3D u() const { return m_u; }
   Vec3D v() const { return m_v; }
   Vec3D w() const { return m_w; }
@@ -17,6 +21,12 @@ class OrthoNormalBasis {
     return a.x() * m_u + a.y() * m_v + a.z() * m_w;
   }
 
+  void set(const Vec3D& u, const Vec3D& v, const Vec3D& w) {
+    m_u = u;
+    m_v = v;
+    m_w = w;
+  }
+
   void buildFromW(const Vec3D& w) {
     auto unit_w = getUnitVectorOf(w);
     auto a =
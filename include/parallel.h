@@ -0,0 +1,78 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <cstddef>
+#include <thread>
+#include <utility>
+#include <vector>
+
+#include "tools/profiling.h"
+
+inline unsigned numWorkerThreads() {
+  unsigned n = std::thread::hardware_concurrency();
+  return n == 0 ? 1 : n;
+}
+
+//--------------------------------------------
+// Runs fn(begin, end) over [0, count). Chunks of `grain` elements are handed
+// out dynamically, so uneven work still keeps every core busy. Runs inline
+// when there is only one chunk.
+//--------------------------------------------
+
+template <typename F>
+void parallelFor(std::size_t count, std::size_t grain, F&& fn) {
+  if (count == 0) return;
+  grain = std::max<std::size_t>(grain, 1);
+  std::size_t chunks = (count + grain - 1) / grain;
+  std::size_t workers = std::min<std::size_t>(numWorkerThreads(), chunks);
+  if (workers <= 1) {
+    fn(std::size_t{0}, count);
+    return;
+  }
+
+  std::atomic<std::size_t> next{0};
+  auto work = [&]() {
+    TOOLS_PROFILE_SCOPE("parallel_for");
+    for (;;) {
+      std::size_t begin = next.fetch_add(grain, std::memory_order_relaxed);
+      if (begin >= count) return;
+      fn(begin, std::min(begin + grain, count));
+    }
+  };
+
+  std::vector<std::thread> pool;
+  pool.reserve(workers - 1);
+  for (std::size_t i = 1; i < workers; ++i) pool.emplace_back(work);
+  work();
+  for (auto& t : pool) t.join();
+}
+
+//--------------------------------------------
+// Reduces map(begin, end) over fixed chunks of `grain` elements. Partials are
+// combined in chunk order, so the result does not depend on thread timing.
+//--------------------------------------------
+
+template <typename R, typename Map, typename Combine>
+R parallelReduce(std::size_t count, std::size_t grain, R identity, Map&& map,
+                 Combine&& combine) {
+  if (count == 0) return identity;
+  grain = std::max<std::size_t>(grain, 1);
+  std::size_t chunks = (count + grain - 1) / grain;
+  std::vector<R> partial(chunks, identity);
+  parallelFor(chunks, 1, [&](std::size_t b, std::size_t e) {
+    for (std::size_t c = b; c < e; ++c) {
+      partial[c] = map(c * grain, std::min((c + 1) * grain, count));
+    }
+  });
+  R ret = identity;
+  for (const auto& p : partial) ret = combine(ret, p);
+  return ret;
+}
+
+template <typename F1, typename F2>
+void parallelInvoke(F1&& f1, F2&& f2) {
+  std::thread t(std::forward<F1>(f1));
+  f2();
+  t.join();
+}
@@ -0,0 +1,275 @@
+#pragma once
+
+//--------------------------------------------
+// Opt-in hardware counter instrumentation. Build with
+// TOOLS_ENABLE_PERF_COUNTERS defined to collect cycles, instructions, cache
+// misses, branch misses and CPU time around named regions via
+// perf_event_open.
+// Otherwise TOOLS_PERF_REGION expands to nothing and its arguments are not
+// evaluated.
+//--------------------------------------------
+
+#define TOOLS_PERF_CONCAT_IMPL(a, b) a##b
+#define TOOLS_PERF_CONCAT(a, b) TOOLS_PERF_CONCAT_IMPL(a, b)
+
+#if defined(TOOLS_ENABLE_PERF_COUNTERS)
+
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <iomanip>
+#include <iostream>
+#include <map>
+#include <mutex>
+#include <string>
+
+#if defined(__linux__)
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
+
+enum PerfEvent {
+  PerfCycles = 0,
+  PerfInstructions,
+  PerfCacheMisses,
+  PerfBranchMisses,
+  PerfTaskClock,
+  kNumPerfEvents
+};
+
+inline const char* perfEventName(int e) {
+  static const char* names[kNumPerfEvents] = {
+      "cycles", "instructions", "cache_misses", "branch_misses",
+      "task_clock_ns"};
+  return names[e];
+}
+
+// Counters of one thread and of every thread it starts afterwards, user
+// space only. The events are opened with inherit, so the counts of a
+// parallelFor worker are added to the starting thread's counters when the
+// worker exits; parallelFor joins its workers before returning, so a region
+// around it sees all of its work, not only the caller's share. Inherited
+// counters cannot be read as a group, so each event has its own descriptor.
+// task_clock_ns (CPU time summed over the threads) is a software event and
+// stays available where the hardware counters are not.
+class PerfCounterGroup {
+ public:
+  PerfCounterGroup() {
+#if defined(__linux__)
+    const std::uint32_t types[kNumPerfEvents] = {
+        PERF_TYPE_HARDWARE, PERF_TYPE_HARDWARE, PERF_TYPE_HARDWARE,
+        PERF_TYPE_HARDWARE, PERF_TYPE_SOFTWARE};
+    const std::uint64_t configs[kNumPerfEvents] = {
+        PERF_COUNT_HW_CPU_CYCLES, PERF_COUNT_HW_INSTRUCTIONS,
+        PERF_COUNT_HW_CACHE_MISSES, PERF_COUNT_HW_BRANCH_MISSES,
+        PERF_COUNT_SW_TASK_CLOCK};
+    for (int e = 0; e < kNumPerfEvents; ++e) {
+      perf_event_attr attr;
+      std::memset(&attr, 0, sizeof(attr));
+      attr.size = sizeof(attr);
+      attr.type = types[e];
+      attr.config = configs[e];
+      attr.inherit = 1;
+      attr.exclude_kernel = 1;
+      attr.exclude_hv = 1;
+      m_fd[e] = static_cast<int>(
+          syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0));
+    }
+#endif
+  }
+
+  ~PerfCounterGroup() {
+#if defined(__linux__)
+    for (int fd : m_fd) {
+      if (fd >= 0) close(fd);
+    }
+#endif
+  }
+
+  PerfCounterGroup(const PerfCounterGroup&) = delete;
+  PerfCounterGroup& operator=(const PerfCounterGroup&) = delete;
+
+  bool available(int e) const { return m_fd[e] >= 0; }
+
+  void read(std::uint64_t out[kNumPerfEvents]) const {
+    for (int e = 0; e < kNumPerfEvents; ++e) {
+      out[e] = 0;
+#if defined(__linux__)
+      if (m_fd[e] >= 0 && ::read(m_fd[e], &out[e], sizeof(out[e])) <= 0) {
+        out[e] = 0;
+      }
+#endif
+    }
+  }
+
+  static PerfCounterGroup& forThisThread() {
+    thread_local PerfCounterGroup group;
+    return group;
+  }
+
+ private:
+  int m_fd[kNumPerfEvents] = {-1, -1, -1, -1, -1};
+};
+
+struct PerfStats {
+  std::uint64_t calls = 0;
+  std::uint64_t elements = 0;
+  double seconds = 0.;
+  std::uint64_t counters[kNumPerfEvents] = {};
+  bool counted[kNumPerfEvents] = {};
+};
+
+class PerfRegistry {
+ public:
+  static PerfRegistry& instance() {
+    static PerfRegistry registry;
+    return registry;
+  }
+
+  void record(const char* name, const std::uint64_t delta[kNumPerfEvents],
+              const bool counted[kNumPerfEvents], std::uint64_t elements,
+              double seconds) {
+    std::lock_guard<std::mutex> lock(m_mutex);
+    PerfStats& s = m_stats[name];
+    s.calls++;
+    s.elements += elements;
+    s.seconds += seconds;
+    for (int e = 0; e < kNumPerfEvents; ++e) {
+      s.counters[e] += delta[e];
+      s.counted[e] = s.counted[e] || counted[e];
+    }
+  }
+
+  std::map<std::string, PerfStats> snapshot() const {
+    std::lock_guard<std::mutex> lock(m_mutex);
+    return m_stats;
+  }
+
+  void reset() {
+    std::lock_guard<std::mutex> lock(m_mutex);
+    m_stats.clear();
+  }
+
+  void reportTable(std::ostream& out) const;
+  void reportJson(std::ostream& out) const;
+
+ private:
+  PerfRegistry() = default;
+
+  mutable std::mutex m_mutex;
+  std::map<std::string, PerfStats> m_stats;
+};
+
+inline void PerfRegistry::reportTable(std::ostream& out) const {
+  auto stats = snapshot();
+  out << std::left << std::setw(28) << "region" << std::right << std::setw(8)
+      << "calls" << std::setw(12) << "elements" << std::setw(11) << "ms";
+  for (int e = 0; e < kNumPerfEvents; ++e) {
+    out << std::setw(15) << perfEventName(e);
+  }
+  out << std::setw(8) << "IPC" << std::setw(12) << "cyc/elem" << "\n";
+  for (const auto& [name, s] : stats) {
+    out << std::left << std::setw(28) << name << std::right << std::setw(8)
+        << s.calls << std::setw(12) << s.elements << std::setw(11)
+        << std::fixed << std::setprecision(3) << s.seconds * 1.E3;
+    for (int e = 0; e < kNumPerfEvents; ++e) {
+      if (s.counted[e]) {
+        out << std::setw(15) << s.counters[e];
+      } else {
+        out << std::setw(15) << "n/a";
+      }
+    }
+    double cycles = static_cast<double>(s.counters[PerfCycles]);
+    double ipc = cycles > 0. ? s.counters[PerfInstructions] / cycles : 0.;
+    double perElem = s.elements > 0 ? cycles / s.elements : 0.;
+    out << std::setw(8) << std::setprecision(2) << ipc << std::setw(12)
+        << perElem << "\n";
+  }
+}
+
+inline void PerfRegistry::reportJson(std::ostream& out) const {
+  auto stats = snapshot();
+  out << "[";
+  bool first = true;
+  for (const auto& [name, s] : stats) {
+    out << (first ? "\n" : ",\n") << "  {\"region\": \"" << name
+        << "\", \"calls\": " << s.calls << ", \"elements\": " << s.elements
+        << ", \"seconds\": " << s.seconds;
+    for (int e = 0; e < kNumPerfEvents; ++e) {
+      out << ", \"" << perfEventName(e) << "\": ";
+      if (s.counted[e]) {
+        out << s.counters[e];
+      } else {
+        out << "null";
+      }
+    }
+    out << "}";
+    first = false;
+  }
+  out << "\n]\n";
+}
+
+// Writes the report selected by TOOLS_PERF_FORMAT (table or json) to the
+// file named by TOOLS_PERF_OUTPUT, or to stderr when it is unset.
+inline void perfReportFromEnv() {
+  const char* format = std::getenv("TOOLS_PERF_FORMAT");
+  const char* path = std::getenv("TOOLS_PERF_OUTPUT");
+  bool json = format && std::strcmp(format, "json") == 0;
+  std::ofstream file;
+  if (path) file.open(path);
+  std::ostream& out = file.is_open() ? file : std::cerr;
+  if (json) {
+    PerfRegistry::instance().reportJson(out);
+  } else {
+    PerfRegistry::instance().reportTable(out);
+  }
+}
+
+class PerfRegion {
+ public:
+  PerfRegion(const char* name, std::uint64_t elements)
+      : m_name(name), m_elements(elements) {
+    m_start_time = std::chrono::steady_clock::now();
+    PerfCounterGroup::forThisThread().read(m_start);
+  }
+
+  ~PerfRegion() {
+    std::uint64_t end[kNumPerfEvents];
+    const PerfCounterGroup& group = PerfCounterGroup::forThisThread();
+    group.read(end);
+    std::chrono::duration<double> dt =
+        std::chrono::steady_clock::now() - m_start_time;
+    std::uint64_t delta[kNumPerfEvents];
+    bool counted[kNumPerfEvents];
+    for (int e = 0; e < kNumPerfEvents; ++e) {
+      delta[e] = end[e] - m_start[e];
+      counted[e] = group.available(e);
+    }
+    PerfRegistry::instance().record(m_name, delta, counted, m_elements,
+                                    dt.count());
+  }
+
+  PerfRegion(const PerfRegion&) = delete;
+  PerfRegion& operator=(const PerfRegion&) = delete;
+
+ private:
+  const char* m_name;
+  std::uint64_t m_elements;
+  std::uint64_t m_start[kNumPerfEvents];
+  std::chrono::steady_clock::time_point m_start_time;
+};
+
+#define TOOLS_PERF_REGION(name, elements)                   \
+  PerfRegion TOOLS_PERF_CONCAT(tools_perf_region_, __LINE__)( \
+      name, static_cast<std::uint64_t>(elements))
+
+#else
+
+#define TOOLS_PERF_REGION(name, elements) static_cast<void>(0)
+
+#endif
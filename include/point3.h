@@ -1,16 +1,8 @@
 #pragma once
 
 #include <cassert>
-#include <sstream>
 
-template <class T>
-class Vec4;
-
-template <class T>
-class Vec3;
-
-template <class T>
-class Normal3;
+#include "tools/fwd.h"
 
 template <class T>
 class Point3 {
@@ -93,18 +85,6 @@ Point3<T> operator+(const Point3<T> &p, T num) {
   return Point3<T>(p.x() + num, p.y() + num, p.z() + num);
 }
 
-template <typename T>
-std::stringstream &operator<<(std::stringstream &out, const Point3<T> &p) {
-  out << "(" << p.x() << "," << p.y() << "," << p.z() << ")";
-  return out;
-}
-
-template <typename T>
-std::ostream &operator<<(std::ostream &out, const Point3<T> &p) {
-  out << "(" << p.x() << "," << p.y() << "," << p.z() << ")";
-  return out;
-}
-
 template <typename T>
 Point3<T> operator*(const Point3<T> &p, T num) {
   return Point3<T>(p.x() * num, p.y() * num, p.z() * num);
@@ -0,0 +1,408 @@
+#pragma once
+
+#include <algorithm>
+#include <cmath>
+#include <cstddef>
+#include <limits>
+#include <vector>
+
+#include "tools/bounds3.h"
+#include "tools/cpudispatch.h"
+#include "tools/hitrecord.h"
+#include "tools/normal3.h"
+#include "tools/perfcounters.h"
+#include "tools/profiling.h"
+#include "tools/raybatch.h"
+
+inline constexpr float kRayEpsilon = 1.E-4f;
+
+struct NearestHit {
+  float t = std::numeric_limits<float>::infinity();
+  int index = -1;
+
+  bool hit() const { return index >= 0; }
+};
+
+//--------------------------------------------
+// SoA primitive containers
+//--------------------------------------------
+
+class SphereSoA {
+ public:
+  void add(const Point3D& center, float radius) {
+    m_cx.push_back(center.x());
+    m_cy.push_back(center.y());
+    m_cz.push_back(center.z());
+    m_r.push_back(radius);
+  }
+
+  void reserve(std::size_t n) {
+    m_cx.reserve(n);
+    m_cy.reserve(n);
+    m_cz.reserve(n);
+    m_r.reserve(n);
+  }
+
+  void clear() {
+    m_cx.clear();
+    m_cy.clear();
+    m_cz.clear();
+    m_r.clear();
+  }
+
+  std::size_t size() const { return m_r.size(); }
+  Point3D center(std::size_t i) const {
+    return Point3D(m_cx[i], m_cy[i], m_cz[i]);
+  }
+  float radius(std::size_t i) const { return m_r[i]; }
+  // Outward unit normal at a point on sphere i.
+  Normal3D normalAt(std::size_t i, const Point3D& p) const {
+    return Normal3D((p - center(i)) / radius(i));
+  }
+
+  const float* cx() const { return m_cx.data(); }
+  const float* cy() const { return m_cy.data(); }
+  const float* cz() const { return m_cz.data(); }
+  const float* radii() const { return m_r.data(); }
+
+ private:
+  std::vector<float> m_cx, m_cy, m_cz, m_r;
+};
+
+// Axis-aligned boxes as six coordinate arrays.
+class BoundsSoA {
+ public:
+  void add(const Bounds3D& b) {
+    m_minx.push_back(b.min().x());
+    m_miny.push_back(b.min().y());
+    m_minz.push_back(b.min().z());
+    m_maxx.push_back(b.max().x());
+    m_maxy.push_back(b.max().y());
+    m_maxz.push_back(b.max().z());
+  }
+
+  void clear() {
+    m_minx.clear();
+    m_miny.clear();
+    m_minz.clear();
+    m_maxx.clear();
+    m_maxy.clear();
+    m_maxz.clear();
+  }
+
+  std::size_t size() const { return m_minx.size(); }
+  Bounds3D bounds(std::size_t i) const {
+    return Bounds3D(Point3D(m_minx[i], m_miny[i], m_minz[i]),
+                    Point3D(m_maxx[i], m_maxy[i], m_maxz[i]));
+  }
+
+  const float* minx() const { return m_minx.data(); }
+  const float* miny() const { return m_miny.data(); }
+  const float* minz() const { return m_minz.data(); }
+  const float* maxx() const { return m_maxx.data(); }
+  const float* maxy() const { return m_maxy.data(); }
+  const float* maxz() const { return m_maxz.data(); }
+
+ private:
+  std::vector<float> m_minx, m_miny, m_minz;
+  std::vector<float> m_maxx, m_maxy, m_maxz;
+};
+
+// Planes stored as dot(normal, p) = offset.
+class PlaneSoA {
+ public:
+  void add(const Point3D& point, const Normal3D& normal) {
+    Normal3D n = getUnitVectorOf(normal);
+    add(n, dot(n, Vec3D(point)));
+  }
+
+  void add(const Normal3D& normal, float offset) {
+    m_nx.push_back(normal.x());
+    m_ny.push_back(normal.y());
+    m_nz.push_back(normal.z());
+    m_d.push_back(offset);
+  }
+
+  void clear() {
+    m_nx.clear();
+    m_ny.clear();
+    m_nz.clear();
+    m_d.clear();
+  }
+
+  std::size_t size() const { return m_d.size(); }
+  Normal3D normal(std::size_t i) const {
+    return Normal3D(m_nx[i], m_ny[i], m_nz[i]);
+  }
+  float offset(std::size_t i) const { return m_d[i]; }
+
+  const float* nx() const { return m_nx.data(); }
+  const float* ny() const { return m_ny.data(); }
+  const float* nz() const { return m_nz.data(); }
+  const float* offsets() const { return m_d.data(); }
+
+ private:
+  std::vector<float> m_nx, m_ny, m_nz, m_d;
+};
+
+//--------------------------------------------
+// Branch-free per-lane tests. They return +infinity on a miss, which lets
+// every kernel below reduce with a plain min.
+//--------------------------------------------
+
+inline float raySphereT(float ox, float oy, float oz, float dx, float dy,
+                        float dz, float cx, float cy, float cz, float r,
+                        float tMin, float tMax) {
+  const float inf = std::numeric_limits<float>::infinity();
+  float px = ox - cx, py = oy - cy, pz = oz - cz;
+  float a = dx * dx + dy * dy + dz * dz;
+  float b = px * dx + py * dy + pz * dz;
+  float c = px * px + py * py + pz * pz - r * r;
+  float disc = b * b - a * c;
+  float s = std::sqrt(std::max(disc, 0.f));
+  float t0 = (-b - s) / a;
+  float t1 = (-b + s) / a;
+  float t = t0 >= tMin ? t0 : t1;
+  return (disc >= 0.f && t >= tMin && t < tMax) ? t : inf;
+}
+
+inline float rayPlaneT(float ox, float oy, float oz, float dx, float dy,
+                       float dz, float nx, float ny, float nz, float d,
+                       float tMin, float tMax) {
+  const float inf = std::numeric_limits<float>::infinity();
+  float denom = nx * dx + ny * dy + nz * dz;
+  float t = (d - (nx * ox + ny * oy + nz * oz)) / denom;
+  return (std::fabs(denom) > 1.E-12f && t >= tMin && t < tMax) ? t : inf;
+}
+
+// Slab test against an axis-aligned box, taking the reciprocal direction.
+// Returns where the ray enters the box (tMin if it starts inside).
+inline float rayBoxT(float ox, float oy, float oz, float idx, float idy,
+                     float idz, float minx, float miny, float minz,
+                     float maxx, float maxy, float maxz, float tMin,
+                     float tMax) {
+  const float inf = std::numeric_limits<float>::infinity();
+  float tx0 = (minx - ox) * idx, tx1 = (maxx - ox) * idx;
+  float ty0 = (miny - oy) * idy, ty1 = (maxy - oy) * idy;
+  float tz0 = (minz - oz) * idz, tz1 = (maxz - oz) * idz;
+  float tNear = std::max({tMin, std::min(tx0, tx1), std::min(ty0, ty1),
+                          std::min(tz0, tz1)});
+  float tFar = std::min({tMax, std::max(tx0, tx1), std::max(ty0, ty1),
+                         std::max(tz0, tz1)});
+  return tNear <= tFar ? tNear : inf;
+}
+
+//--------------------------------------------
+// One ray against many primitives
+//--------------------------------------------
+
+namespace detail {
+
+// Lanes are evaluated a block at a time into a small buffer the compiler can
+// vectorize; the index is only searched for when the block beats the best.
+inline constexpr std::size_t kHitBlock = 16;
+
+template <typename Kernel>
+NearestHit nearestInBlocks(std::size_t n, float tMax, Kernel&& kernel) {
+  NearestHit best;
+  best.t = tMax;
+  float tb[kHitBlock];
+  for (std::size_t base = 0; base < n; base += kHitBlock) {
+    std::size_t count = std::min(kHitBlock, n - base);
+    for (std::size_t k = 0; k < count; ++k) tb[k] = kernel(base + k, best.t);
+    float blockMin = best.t;
+    for (std::size_t k = 0; k < count; ++k) {
+      blockMin = std::min(blockMin, tb[k]);
+    }
+    if (blockMin < best.t) {
+      for (std::size_t k = 0; k < count; ++k) {
+        if (tb[k] == blockMin) {
+          best.t = blockMin;
+          best.index = static_cast<int>(base + k);
+          break;
+        }
+      }
+    }
+  }
+  if (!best.hit()) best.t = std::numeric_limits<float>::infinity();
+  return best;
+}
+
+// Any-hit form of nearestInBlocks: stops after the first block holding a
+// hit inside (tMin, tMax) and never looks for its index. Only the blocks
+// actually tested count as ray-primitive tests.
+template <typename Kernel>
+bool anyInBlocks(std::size_t n, float tMax, Kernel&& kernel) {
+  float tb[kHitBlock];
+  for (std::size_t base = 0; base < n; base += kHitBlock) {
+    std::size_t count = std::min(kHitBlock, n - base);
+    TOOLS_COUNT_OPS(ProfileOp::RayPrimitive, count);
+    for (std::size_t k = 0; k < count; ++k) tb[k] = kernel(base + k, tMax);
+    float blockMin = tMax;
+    for (std::size_t k = 0; k < count; ++k) {
+      blockMin = std::min(blockMin, tb[k]);
+    }
+    if (blockMin < tMax) return true;
+  }
+  return false;
+}
+
+}  // namespace detail
+
+inline NearestHit intersect(const Ray& ray, const SphereSoA& spheres,
+                            float tMin = kRayEpsilon) {
+  TOOLS_COUNT_OPS(ProfileOp::RayPrimitive, spheres.size());
+  const float ox = ray.origin().x(), oy = ray.origin().y(),
+              oz = ray.origin().z();
+  const float dx = ray.direction().x(), dy = ray.direction().y(),
+              dz = ray.direction().z();
+  const float *cx = spheres.cx(), *cy = spheres.cy(), *cz = spheres.cz(),
+              *r = spheres.radii();
+  return detail::nearestInBlocks(
+      spheres.size(), ray.getMaxRange(), [&](std::size_t i, float tMax) {
+        return raySphereT(ox, oy, oz, dx, dy, dz, cx[i], cy[i], cz[i], r[i],
+                          tMin, tMax);
+      });
+}
+
+inline NearestHit intersect(const Ray& ray, const PlaneSoA& planes,
+                            float tMin = kRayEpsilon) {
+  TOOLS_COUNT_OPS(ProfileOp::RayPrimitive, planes.size());
+  const float ox = ray.origin().x(), oy = ray.origin().y(),
+              oz = ray.origin().z();
+  const float dx = ray.direction().x(), dy = ray.direction().y(),
+              dz = ray.direction().z();
+  const float *nx = planes.nx(), *ny = planes.ny(), *nz = planes.nz(),
+              *d = planes.offsets();
+  return detail::nearestInBlocks(
+      planes.size(), ray.getMaxRange(), [&](std::size_t i, float tMax) {
+        return rayPlaneT(ox, oy, oz, dx, dy, dz, nx[i], ny[i], nz[i], d[i],
+                         tMin, tMax);
+      });
+}
+
+// Closest-hit forms: the winner of the call is offered to rec, and its
+// normal is computed only if it beats what rec and the ray's range already
+// hold. Calling them in turn with one ray and record keeps the closest hit
+// over all primitive sets.
+inline bool intersect(const Ray& ray, const SphereSoA& spheres,
+                      HitRecord& rec, float tMin = kRayEpsilon) {
+  NearestHit hit = intersect(ray, spheres, tMin);
+  if (!hit.hit() || !rec.report(ray, hit.t, hit.index)) return false;
+  rec.normal = spheres.normalAt(hit.index, rec.position(ray));
+  return true;
+}
+
+inline bool intersect(const Ray& ray, const PlaneSoA& planes, HitRecord& rec,
+                      float tMin = kRayEpsilon) {
+  NearestHit hit = intersect(ray, planes, tMin);
+  if (!hit.hit() || !rec.report(ray, hit.t, hit.index)) return false;
+  rec.normal = planes.normal(hit.index);
+  return true;
+}
+
+// Occlusion (shadow-ray) queries: whether anything lies on the ray within
+// [tMin, ray max range). They return at the first hit found and compute
+// neither the nearest distance nor a normal.
+inline bool occluded(const Ray& ray, const SphereSoA& spheres,
+                     float tMin = kRayEpsilon) {
+  const float ox = ray.origin().x(), oy = ray.origin().y(),
+              oz = ray.origin().z();
+  const float dx = ray.direction().x(), dy = ray.direction().y(),
+              dz = ray.direction().z();
+  const float *cx = spheres.cx(), *cy = spheres.cy(), *cz = spheres.cz(),
+              *r = spheres.radii();
+  return detail::anyInBlocks(
+      spheres.size(), ray.getMaxRange(), [&](std::size_t i, float tMax) {
+        return raySphereT(ox, oy, oz, dx, dy, dz, cx[i], cy[i], cz[i], r[i],
+                          tMin, tMax);
+      });
+}
+
+inline bool occluded(const Ray& ray, const PlaneSoA& planes,
+                     float tMin = kRayEpsilon) {
+  const float ox = ray.origin().x(), oy = ray.origin().y(),
+              oz = ray.origin().z();
+  const float dx = ray.direction().x(), dy = ray.direction().y(),
+              dz = ray.direction().z();
+  const float *nx = planes.nx(), *ny = planes.ny(), *nz = planes.nz(),
+              *d = planes.offsets();
+  return detail::anyInBlocks(
+      planes.size(), ray.getMaxRange(), [&](std::size_t i, float tMax) {
+        return rayPlaneT(ox, oy, oz, dx, dy, dz, nx[i], ny[i], nz[i], d[i],
+                         tMin, tMax);
+      });
+}
+
+//--------------------------------------------
+// A packet of rays against one primitive. hits must have been reset from the
+// same batch; closer hits overwrite t and index, which also shrinks the range
+// for every later primitive. The loops over a primitive set run the build
+// for the active ISA.
+//--------------------------------------------
+
+inline void intersectSphere(const RayBatch& rays, HitBatch& hits,
+                            const Point3D& center, float radius, int index,
+                            float tMin = kRayEpsilon) {
+  const std::size_t n = rays.size();
+  const float *ox = rays.ox(), *oy = rays.oy(), *oz = rays.oz();
+  const float *dx = rays.dx(), *dy = rays.dy(), *dz = rays.dz();
+  float* t = hits.t();
+  int* id = hits.index();
+  const float cx = center.x(), cy = center.y(), cz = center.z();
+  for (std::size_t i = 0; i < n; ++i) {
+    float ti = raySphereT(ox[i], oy[i], oz[i], dx[i], dy[i], dz[i], cx, cy, cz,
+                          radius, tMin, t[i]);
+    bool closer = ti < t[i];
+    t[i] = closer ? ti : t[i];
+    id[i] = closer ? index : id[i];
+  }
+}
+
+inline void intersectPlane(const RayBatch& rays, HitBatch& hits,
+                           const Normal3D& normal, float offset, int index,
+                           float tMin = kRayEpsilon) {
+  const std::size_t n = rays.size();
+  const float *ox = rays.ox(), *oy = rays.oy(), *oz = rays.oz();
+  const float *dx = rays.dx(), *dy = rays.dy(), *dz = rays.dz();
+  float* t = hits.t();
+  int* id = hits.index();
+  const float nx = normal.x(), ny = normal.y(), nz = normal.z();
+  for (std::size_t i = 0; i < n; ++i) {
+    float ti = rayPlaneT(ox[i], oy[i], oz[i], dx[i], dy[i], dz[i], nx, ny, nz,
+                         offset, tMin, t[i]);
+    bool closer = ti < t[i];
+    t[i] = closer ? ti : t[i];
+    id[i] = closer ? index : id[i];
+  }
+}
+
+inline void intersect(const RayBatch& rays, HitBatch& hits,
+                      const SphereSoA& spheres, float tMin = kRayEpsilon) {
+  TOOLS_PERF_REGION("ray_packet_spheres", rays.size() * spheres.size());
+  TOOLS_PROFILE_SCOPE("ray_packet_spheres");
+  TOOLS_COUNT_OPS(ProfileOp::RayPrimitive, rays.size() * spheres.size());
+  dispatchRange(
+      [&](std::size_t b, std::size_t e) {
+        for (std::size_t s = b; s < e; ++s) {
+          intersectSphere(rays, hits, spheres.center(s), spheres.radius(s),
+                          static_cast<int>(s), tMin);
+        }
+      },
+      0, spheres.size());
+}
+
+inline void intersect(const RayBatch& rays, HitBatch& hits,
+                      const PlaneSoA& planes, float tMin = kRayEpsilon) {
+  TOOLS_PERF_REGION("ray_packet_planes", rays.size() * planes.size());
+  TOOLS_PROFILE_SCOPE("ray_packet_planes");
+  TOOLS_COUNT_OPS(ProfileOp::RayPrimitive, rays.size() * planes.size());
+  dispatchRange(
+      [&](std::size_t b, std::size_t e) {
+        for (std::size_t p = b; p < e; ++p) {
+          intersectPlane(rays, hits, planes.normal(p), planes.offset(p),
+                         static_cast<int>(p), tMin);
+        }
+      },
+      0, planes.size());
+}
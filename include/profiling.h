@@ -0,0 +1,220 @@
+#pragma once
+
+//--------------------------------------------
+// Operation counters and scope timers, compiled in only when
+// TOOLS_ENABLE_PROFILING is defined. Otherwise the TOOLS_COUNT_* and
+// TOOLS_PROFILE_SCOPE macros expand to nothing.
+//
+// Counters live in per-thread slots with a single writer each, so counting is
+// a relaxed load and store with no locking or read-modify-write. Totals can be
+// read at any time. Trace events must only be exported while no profiled
+// work is running, e.g. between frames.
+//--------------------------------------------
+
+#define TOOLS_PROFILE_CONCAT_IMPL(a, b) a##b
+#define TOOLS_PROFILE_CONCAT(a, b) TOOLS_PROFILE_CONCAT_IMPL(a, b)
+
+enum class ProfileOp : int {
+  Mat4Inverse = 0,
+  Normalize,
+  RayBox,
+  RayPrimitive,
+  Count
+};
+
+inline constexpr int kNumProfileOps = static_cast<int>(ProfileOp::Count);
+
+inline const char* profileOpName(ProfileOp op) {
+  static const char* names[kNumProfileOps] = {"mat4_inverse", "normalize",
+                                              "ray_box", "ray_primitive"};
+  return names[static_cast<int>(op)];
+}
+
+#if defined(TOOLS_ENABLE_PROFILING)
+
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <ostream>
+#include <vector>
+
+using ProfileCounts = std::array<std::uint64_t, kNumProfileOps>;
+
+struct TraceEvent {
+  const char* name;
+  double start_us;
+  double duration_us;
+};
+
+struct ThreadProfile {
+  explicit ThreadProfile(int slot) : id(slot) {
+    for (auto& c : counts) c.store(0, std::memory_order_relaxed);
+  }
+
+  int id;
+  std::atomic<std::uint64_t> counts[kNumProfileOps];
+  std::vector<TraceEvent> events;
+};
+
+class Profiler {
+ public:
+  static Profiler& instance() {
+    static Profiler profiler;
+    return profiler;
+  }
+
+  // Slot of the calling thread. Slots are recycled when threads exit, so the
+  // short-lived workers of parallelFor do not grow the registry.
+  static ThreadProfile& local() {
+    struct Handle {
+      ThreadProfile* slot = Profiler::instance().acquire();
+      ~Handle() { Profiler::instance().release(slot); }
+    };
+    thread_local Handle handle;
+    return *handle.slot;
+  }
+
+  static void count(ProfileOp op, std::uint64_t n = 1) {
+    auto& c = local().counts[static_cast<int>(op)];
+    c.store(c.load(std::memory_order_relaxed) + n, std::memory_order_relaxed);
+  }
+
+  double nowUs() const {
+    std::chrono::duration<double, std::micro> dt =
+        std::chrono::steady_clock::now() - m_epoch;
+    return dt.count();
+  }
+
+  ProfileCounts counters() const {
+    std::lock_guard<std::mutex> lock(m_mutex);
+    ProfileCounts total{};
+    for (const auto& slot : m_slots) {
+      for (int i = 0; i < kNumProfileOps; ++i) {
+        total[i] += slot->counts[i].load(std::memory_order_relaxed);
+      }
+    }
+    return total;
+  }
+
+  // Closes a frame: returns the operations counted since the previous mark
+  // and records them as a counter track in the trace.
+  ProfileCounts markFrame() {
+    ProfileCounts now = counters();
+    std::lock_guard<std::mutex> lock(m_mutex);
+    ProfileCounts delta;
+    for (int i = 0; i < kNumProfileOps; ++i) delta[i] = now[i] - m_last[i];
+    m_last = now;
+    m_frames.push_back(Frame{nowUs(), delta});
+    return delta;
+  }
+
+  void reset() {
+    std::lock_guard<std::mutex> lock(m_mutex);
+    for (auto& slot : m_slots) {
+      for (auto& c : slot->counts) c.store(0, std::memory_order_relaxed);
+      slot->events.clear();
+    }
+    m_last = ProfileCounts{};
+    m_frames.clear();
+  }
+
+  void writeChromeTrace(std::ostream& out) const;
+
+ private:
+  struct Frame {
+    double ts;
+    ProfileCounts counts;
+  };
+
+  Profiler() : m_epoch(std::chrono::steady_clock::now()) {}
+
+  ThreadProfile* acquire() {
+    std::lock_guard<std::mutex> lock(m_mutex);
+    if (!m_free.empty()) {
+      ThreadProfile* slot = m_free.back();
+      m_free.pop_back();
+      return slot;
+    }
+    int id = static_cast<int>(m_slots.size());
+    m_slots.push_back(std::make_unique<ThreadProfile>(id));
+    return m_slots.back().get();
+  }
+
+  void release(ThreadProfile* slot) {
+    std::lock_guard<std::mutex> lock(m_mutex);
+    m_free.push_back(slot);
+  }
+
+  mutable std::mutex m_mutex;
+  std::vector<std::unique_ptr<ThreadProfile>> m_slots;
+  std::vector<ThreadProfile*> m_free;
+  std::chrono::steady_clock::time_point m_epoch;
+  ProfileCounts m_last{};
+  std::vector<Frame> m_frames;
+};
+
+// Complete ("X") events per thread slot plus one counter ("C") event per
+// frame, loadable in chrome://tracing or Perfetto.
+inline void Profiler::writeChromeTrace(std::ostream& out) const {
+  std::lock_guard<std::mutex> lock(m_mutex);
+  out << "{\"traceEvents\":[";
+  bool first = true;
+  auto sep = [&]() {
+    out << (first ? "\n" : ",\n");
+    first = false;
+  };
+  for (const auto& slot : m_slots) {
+    for (const auto& e : slot->events) {
+      sep();
+      out << "{\"name\":\"" << e.name << "\",\"ph\":\"X\",\"pid\":1,\"tid\":"
+          << slot->id << ",\"ts\":" << e.start_us
+          << ",\"dur\":" << e.duration_us << "}";
+    }
+  }
+  for (const auto& f : m_frames) {
+    sep();
+    out << "{\"name\":\"ops\",\"ph\":\"C\",\"pid\":1,\"ts\":" << f.ts
+        << ",\"args\":{";
+    for (int i = 0; i < kNumProfileOps; ++i) {
+      auto op = static_cast<ProfileOp>(i);
+      out << (i ? "," : "") << "\"" << profileOpName(op) << "\":" << f.counts[i];
+    }
+    out << "}}";
+  }
+  out << "\n]}\n";
+}
+
+class ScopeTimer {
+ public:
+  explicit ScopeTimer(const char* name)
+      : m_name(name), m_start(Profiler::instance().nowUs()) {}
+  ~ScopeTimer() {
+    double end = Profiler::instance().nowUs();
+    Profiler::local().events.push_back(
+        TraceEvent{m_name, m_start, end - m_start});
+  }
+
+  ScopeTimer(const ScopeTimer&) = delete;
+  ScopeTimer& operator=(const ScopeTimer&) = delete;
+
+ private:
+  const char* m_name;
+  double m_start;
+};
+
+#define TOOLS_COUNT_OP(op) Profiler::count(op)
+#define TOOLS_COUNT_OPS(op, n) \
+  Profiler::count(op, static_cast<std::uint64_t>(n))
+#define TOOLS_PROFILE_SCOPE(name) \
+  ScopeTimer TOOLS_PROFILE_CONCAT(tools_scope_timer_, __LINE__)(name)
+
+#else
+
+#define TOOLS_COUNT_OP(op) static_cast<void>(0)
+#define TOOLS_COUNT_OPS(op, n) static_cast<void>(0)
+#define TOOLS_PROFILE_SCOPE(name) static_cast<void>(0)
+
+#endif
@@ -1,6 +1,9 @@
 #pragma once
 
-#include "tools/tools.h"
+#include <limits>
+
+#include "tools/point3.h"
+#include "tools/vec3.h"
 
 class Ray {
  public:
@@ -17,7 +20,16 @@ class Ray {
   }
 
   void setMaxRange(float t) { m_max_parameter = t; }
-  float getMaxRange(float t) const { return m_max_parameter; }
+  float getMaxRange() const { return m_max_parameter; }
+
+  // Closest-hit narrowing: a hit at t closer than the current range becomes
+  // the new range, so later primitive tests reject anything behind it. Works
+  // on const rays because the range is query state, not part of the ray.
+  bool clipMaxRange(float t) const {
+    if (!(t < m_max_parameter)) return false;
+    m_max_parameter = t;
+    return true;
+  }
 
  private:
   Point3D m_origin;
@@ -0,0 +1,95 @@
+#pragma once
+
+#include <cstddef>
+#include <limits>
+#include <vector>
+
+#include "tools/ray.h"
+
+// Rays in SoA layout, so kernels can run one ray per SIMD lane.
+class RayBatch {
+ public:
+  RayBatch() = default;
+  explicit RayBatch(std::size_t n) { resize(n); }
+
+  void resize(std::size_t n) {
+    m_ox.resize(n);
+    m_oy.resize(n);
+    m_oz.resize(n);
+    m_dx.resize(n);
+    m_dy.resize(n);
+    m_dz.resize(n);
+    m_tmax.resize(n, std::numeric_limits<float>::infinity());
+  }
+
+  void clear() { resize(0); }
+  std::size_t size() const { return m_tmax.size(); }
+
+  void add(const Ray& ray) {
+    std::size_t i = size();
+    resize(i + 1);
+    set(i, ray);
+  }
+
+  void set(std::size_t i, const Ray& ray) {
+    m_ox[i] = ray.origin().x();
+    m_oy[i] = ray.origin().y();
+    m_oz[i] = ray.origin().z();
+    m_dx[i] = ray.direction().x();
+    m_dy[i] = ray.direction().y();
+    m_dz[i] = ray.direction().z();
+    m_tmax[i] = ray.getMaxRange();
+  }
+
+  Ray ray(std::size_t i) const {
+    Ray ret(Point3D(m_ox[i], m_oy[i], m_oz[i]),
+            Vec3D(m_dx[i], m_dy[i], m_dz[i]));
+    ret.setMaxRange(m_tmax[i]);
+    return ret;
+  }
+
+  float* ox() { return m_ox.data(); }
+  float* oy() { return m_oy.data(); }
+  float* oz() { return m_oz.data(); }
+  float* dx() { return m_dx.data(); }
+  float* dy() { return m_dy.data(); }
+  float* dz() { return m_dz.data(); }
+  float* tmax() { return m_tmax.data(); }
+  const float* ox() const { return m_ox.data(); }
+  const float* oy() const { return m_oy.data(); }
+  const float* oz() const { return m_oz.data(); }
+  const float* dx() const { return m_dx.data(); }
+  const float* dy() const { return m_dy.data(); }
+  const float* dz() const { return m_dz.data(); }
+  const float* tmax() const { return m_tmax.data(); }
+
+ private:
+  std::vector<float> m_ox, m_oy, m_oz;
+  std::vector<float> m_dx, m_dy, m_dz;
+  std::vector<float> m_tmax;
+};
+
+// Nearest hit per ray of a RayBatch; index is -1 while nothing was hit.
+class HitBatch {
+ public:
+  HitBatch() = default;
+  explicit HitBatch(const RayBatch& rays) { reset(rays); }
+
+  // Starts every ray at its own max range, so misses past it are rejected.
+  void reset(const RayBatch& rays) {
+    m_t.assign(rays.tmax(), rays.tmax() + rays.size());
+    m_index.assign(rays.size(), -1);
+  }
+
+  std::size_t size() const { return m_t.size(); }
+  bool hit(std::size_t i) const { return m_index[i] >= 0; }
+
+  float* t() { return m_t.data(); }
+  int* index() { return m_index.data(); }
+  const float* t() const { return m_t.data(); }
+  const int* index() const { return m_index.data(); }
+
+ private:
+  std::vector<float> m_t;
+  std::vector<int> m_index;
+};
@@ -0,0 +1,418 @@
+#pragma once
+
+#include <algorithm>
+#include <array>
+#include <cmath>
+#include <cstddef>
+#include <cstdint>
+#include <limits>
+#include <vector>
+
+#include "tools/bounds3.h"
+#include "tools/cpudispatch.h"
+#include "tools/mat3.h"
+#include "tools/perfcounters.h"
+#include "tools/point3.h"
+#include "tools/profiling.h"
+#include "tools/vec3.h"
+
+enum class Summation : std::uint8_t {
+  Naive,    // Running sums: fastest, error grows with n.
+  Kahan,    // Compensated (Neumaier) sums: error independent of n.
+  Pairwise  // Blocked tree summation: error grows with log n.
+};
+
+template <class T>
+struct LengthStatistics {
+  std::size_t count = 0;
+  T min = T{0};
+  T max = T{0};
+  T mean = T{0};
+  T variance = T{0};  // Population variance.
+};
+
+namespace detail {
+
+// Every reduction works on blocks of kReduceLanes elements with one
+// accumulator per lane and component, so the inner loops are independent
+// per lane and vectorize without reassociation.
+inline constexpr std::size_t kReduceLanes = 8;
+inline constexpr std::size_t kReduceGrain = 65536;
+// Elements summed plainly before a Pairwise block is merged into the tree.
+inline constexpr std::size_t kPairwiseBlock = 256;
+
+// Sums of K components under one Summation mode. add() takes a block of
+// kReduceLanes values per component; result() folds the lanes.
+template <class T, int K>
+class LaneSum {
+ public:
+  static constexpr std::size_t L = kReduceLanes;
+
+  explicit LaneSum(Summation mode) : m_mode(mode) {}
+
+  void add(const T (&v)[K][L]) {
+    if (m_mode == Summation::Kahan) {
+      addCompensated(v);
+      return;
+    }
+    for (int k = 0; k < K; ++k) {
+      for (std::size_t l = 0; l < L; ++l) m_sum[k][l] += v[k][l];
+    }
+    if (m_mode == Summation::Pairwise &&
+        ++m_blockCount == kPairwiseBlock / L) {
+      flushBlock();
+    }
+  }
+
+  // Adds another accumulator of the same mode. Kahan keeps both the lane
+  // sums and their compensations, so chunk partials lose nothing here.
+  void merge(LaneSum& other) {
+    if (m_mode == Summation::Pairwise) {
+      std::array<T, K> total = other.result();
+      T v[K][L] = {};
+      for (int k = 0; k < K; ++k) v[k][0] = total[k];
+      add(v);
+      return;
+    }
+    if (m_mode == Summation::Kahan) {
+      addCompensated(other.m_sum);
+      for (int k = 0; k < K; ++k) {
+        for (std::size_t l = 0; l < L; ++l) m_comp[k][l] += other.m_comp[k][l];
+      }
+      return;
+    }
+    for (int k = 0; k < K; ++k) {
+      for (std::size_t l = 0; l < L; ++l) m_sum[k][l] += other.m_sum[k][l];
+    }
+  }
+
+  std::array<T, K> result() {
+    if (m_mode == Summation::Pairwise) {
+      flushBlock();
+      std::array<T, K> total{};
+      for (int i = m_top - 1; i >= 0; --i) {
+        for (int k = 0; k < K; ++k) total[k] += m_stack[i][k];
+      }
+      return total;
+    }
+    std::array<T, K> total{};
+    for (int k = 0; k < K; ++k) {
+      T lanes[L];
+      for (std::size_t l = 0; l < L; ++l) {
+        lanes[l] = m_sum[k][l] + m_comp[k][l];
+      }
+      total[k] = foldLanes(lanes);
+    }
+    return total;
+  }
+
+ private:
+  void addCompensated(const T (&v)[K][L]) {
+    for (int k = 0; k < K; ++k) {
+      for (std::size_t l = 0; l < L; ++l) {
+        T s = m_sum[k][l], x = v[k][l];
+        T t = s + x;
+        bool sBigger = std::fabs(s) >= std::fabs(x);
+        m_comp[k][l] += sBigger ? (s - t) + x : (x - t) + s;
+        m_sum[k][l] = t;
+      }
+    }
+  }
+
+  static T foldLanes(T (&lanes)[L]) {
+    for (std::size_t w = L / 2; w > 0; w /= 2) {
+      for (std::size_t l = 0; l < w; ++l) lanes[l] += lanes[l + w];
+    }
+    return lanes[0];
+  }
+
+  // Pushes the block total like a binary counter: equal levels merge, so
+  // the stack holds a balanced tree of partial sums.
+  void flushBlock() {
+    if (m_blockCount == 0) return;
+    std::array<T, K> value;
+    for (int k = 0; k < K; ++k) {
+      value[k] = foldLanes(m_sum[k]);
+      std::fill(m_sum[k], m_sum[k] + L, T{0});
+    }
+    m_blockCount = 0;
+    int level = 0;
+    while (m_top > 0 && m_level[m_top - 1] == level) {
+      --m_top;
+      for (int k = 0; k < K; ++k) value[k] += m_stack[m_top][k];
+      ++level;
+    }
+    m_stack[m_top] = value;
+    m_level[m_top++] = level;
+  }
+
+  Summation m_mode;
+  T m_sum[K][L] = {};
+  T m_comp[K][L] = {};
+  std::size_t m_blockCount = 0;
+  std::array<T, K> m_stack[64];
+  int m_level[64];
+  int m_top = 0;
+};
+
+// Walks [begin, end) in blocks of kReduceLanes elements, with the K values
+// load(i, x) writes for element i in v[k][l]; lanes past the end are zero.
+// block(v, count) gets each block and its number of valid lanes.
+template <class T, int K, typename Load, typename Block>
+void forEachLaneBlock(std::size_t begin, std::size_t end, Load& load,
+                      Block&& block) {
+  constexpr std::size_t L = kReduceLanes;
+  T v[K][L];
+  for (std::size_t i = begin; i < end; i += L) {
+    std::size_t count = std::min(L, end - i);
+    for (std::size_t l = 0; l < L; ++l) {
+      T x[K];
+      if (l < count) {
+        load(i + l, x);
+      } else {
+        std::fill(x, x + K, T{0});
+      }
+      for (int k = 0; k < K; ++k) v[k][l] = x[k];
+    }
+    block(v, count);
+  }
+}
+
+// Sum over [0, n) of the K values load(i, v) writes. Chunks are fixed, and
+// their accumulators are merged in order, so the result does not depend on
+// the thread count.
+template <class T, int K, typename Load>
+std::array<T, K> parallelSum(std::size_t n, Summation mode, Load&& load) {
+  constexpr std::size_t L = kReduceLanes;
+  const std::size_t chunks = (n + kReduceGrain - 1) / kReduceGrain;
+  std::vector<LaneSum<T, K>> partial(chunks, LaneSum<T, K>(mode));
+  dispatchParallelFor(chunks, 1, [&](std::size_t cb, std::size_t ce) {
+    for (std::size_t c = cb; c < ce; ++c) {
+      std::size_t begin = c * kReduceGrain;
+      forEachLaneBlock<T, K>(begin, std::min(n, begin + kReduceGrain), load,
+                             [&](const T (&v)[K][L], std::size_t) {
+                               partial[c].add(v);
+                             });
+    }
+  });
+  LaneSum<T, K> total(mode);
+  for (auto& p : partial) total.merge(p);
+  return total.result();
+}
+
+template <class T>
+struct SumRange {
+  T sum;
+  T min;
+  T max;
+};
+
+// Sum, minimum and maximum of the values load(i, x) writes over [0, n),
+// n > 0, in one sweep: the lanes keep their own extremes next to the sums.
+template <class T, typename Load>
+SumRange<T> parallelSumRange(std::size_t n, Summation mode, Load&& load) {
+  constexpr std::size_t L = kReduceLanes;
+  struct Partial {
+    LaneSum<T, 1> sum;
+    T lo[L], hi[L];
+  };
+  const std::size_t chunks = (n + kReduceGrain - 1) / kReduceGrain;
+  std::vector<Partial> partial(chunks, Partial{LaneSum<T, 1>(mode), {}, {}});
+  dispatchParallelFor(chunks, 1, [&](std::size_t cb, std::size_t ce) {
+    for (std::size_t c = cb; c < ce; ++c) {
+      Partial& p = partial[c];
+      std::fill(p.lo, p.lo + L, std::numeric_limits<T>::max());
+      std::fill(p.hi, p.hi + L, std::numeric_limits<T>::lowest());
+      std::size_t begin = c * kReduceGrain;
+      forEachLaneBlock<T, 1>(
+          begin, std::min(n, begin + kReduceGrain), load,
+          [&](const T (&v)[1][L], std::size_t count) {
+            p.sum.add(v);
+            // Padding lanes repeat lane 0 so they cannot win.
+            for (std::size_t l = 0; l < L; ++l) {
+              T x = l < count ? v[0][l] : v[0][0];
+              p.lo[l] = std::min(p.lo[l], x);
+              p.hi[l] = std::max(p.hi[l], x);
+            }
+          });
+    }
+  });
+  LaneSum<T, 1> total(mode);
+  SumRange<T> out{T{0}, std::numeric_limits<T>::max(),
+                  std::numeric_limits<T>::lowest()};
+  for (Partial& p : partial) {
+    total.merge(p.sum);
+    for (std::size_t l = 0; l < L; ++l) {
+      out.min = std::min(out.min, p.lo[l]);
+      out.max = std::max(out.max, p.hi[l]);
+    }
+  }
+  out.sum = total.result()[0];
+  return out;
+}
+
+// Box of the points load(i, x) writes over [b, e), in lanes.
+template <class T, typename Load>
+Bounds3<T> laneBounds(std::size_t b, std::size_t e, Load& load) {
+  constexpr std::size_t L = kReduceLanes;
+  T lo[3][L], hi[3][L];
+  for (int k = 0; k < 3; ++k) {
+    std::fill(lo[k], lo[k] + L, std::numeric_limits<T>::max());
+    std::fill(hi[k], hi[k] + L, std::numeric_limits<T>::lowest());
+  }
+  std::size_t i = b;
+  for (; i + L <= e; i += L) {
+    T v[3][L];
+    for (std::size_t l = 0; l < L; ++l) {
+      T x[3];
+      load(i + l, x);
+      for (int k = 0; k < 3; ++k) v[k][l] = x[k];
+    }
+    for (int k = 0; k < 3; ++k) {
+      for (std::size_t l = 0; l < L; ++l) {
+        lo[k][l] = std::min(lo[k][l], v[k][l]);
+        hi[k][l] = std::max(hi[k][l], v[k][l]);
+      }
+    }
+  }
+  Bounds3<T> box;
+  for (; i < e; ++i) {
+    T x[3];
+    load(i, x);
+    box.expand(Point3<T>(x[0], x[1], x[2]));
+  }
+  for (std::size_t l = 0; l < L && b + L <= e; ++l) {
+    box.expand(Point3<T>(lo[0][l], lo[1][l], lo[2][l]));
+    box.expand(Point3<T>(hi[0][l], hi[1][l], hi[2][l]));
+  }
+  return box;
+}
+
+template <class T, typename Load>
+Bounds3<T> parallelBounds(std::size_t n, Load&& load) {
+  return parallelReduce(
+      n, kReduceGrain, Bounds3<T>(),
+      [&](std::size_t b, std::size_t e) {
+        Bounds3<T> box;
+        dispatchRange(
+            [&](std::size_t lo, std::size_t hi) {
+              box = laneBounds<T>(lo, hi, load);
+            },
+            b, e);
+        return box;
+      },
+      [](const Bounds3<T>& a, const Bounds3<T>& b) { return merge(a, b); });
+}
+
+}  // namespace detail
+
+//--------------------------------------------
+// Parallel reductions over point and vector arrays. Each splits the input
+// into fixed chunks over threads and reduces a chunk in SIMD-width lanes;
+// sums use the requested Summation mode inside and across chunks, so
+// results are reproducible for any thread count.
+//--------------------------------------------
+
+template <class T>
+Bounds3<T> computeBounds(const std::vector<Point3<T>>& points) {
+  TOOLS_PERF_REGION("reduce_bounds", points.size());
+  TOOLS_PROFILE_SCOPE("reduce_bounds");
+  return detail::parallelBounds<T>(points.size(),
+                                   [&](std::size_t i, T (&x)[3]) {
+                                     x[0] = points[i].x();
+                                     x[1] = points[i].y();
+                                     x[2] = points[i].z();
+                                   });
+}
+
+// Box of the vectors' end points.
+template <class T>
+Bounds3<T> computeBounds(const std::vector<Vec3<T>>& vectors) {
+  TOOLS_PERF_REGION("reduce_bounds", vectors.size());
+  TOOLS_PROFILE_SCOPE("reduce_bounds");
+  return detail::parallelBounds<T>(vectors.size(),
+                                   [&](std::size_t i, T (&x)[3]) {
+                                     x[0] = vectors[i].x();
+                                     x[1] = vectors[i].y();
+                                     x[2] = vectors[i].z();
+                                   });
+}
+
+// Mean position; the origin for an empty array.
+template <class T>
+Point3<T> computeCentroid(const std::vector<Point3<T>>& points,
+                          Summation mode = Summation::Pairwise) {
+  TOOLS_PERF_REGION("reduce_centroid", points.size());
+  TOOLS_PROFILE_SCOPE("reduce_centroid");
+  if (points.empty()) return Point3<T>();
+  std::array<T, 3> s = detail::parallelSum<T, 3>(
+      points.size(), mode, [&](std::size_t i, T (&x)[3]) {
+        x[0] = points[i].x();
+        x[1] = points[i].y();
+        x[2] = points[i].z();
+      });
+  T inv = T{1} / static_cast<T>(points.size());
+  return Point3<T>(s[0] * inv, s[1] * inv, s[2] * inv);
+}
+
+// Population covariance (divided by n). Two passes: the centroid first,
+// then centred products, which avoids the cancellation of E[xx] - E[x]^2
+// far from the origin. Optionally returns the centroid.
+template <class T>
+Mat3<T> computeCovariance(const std::vector<Point3<T>>& points,
+                          Summation mode = Summation::Pairwise,
+                          Point3<T>* mean = nullptr) {
+  TOOLS_PERF_REGION("reduce_covariance", points.size());
+  TOOLS_PROFILE_SCOPE("reduce_covariance");
+  const Point3<T> c = computeCentroid(points, mode);
+  if (mean) *mean = c;
+  if (points.empty()) return Mat3<T>(T{0});
+  const T cx = c.x(), cy = c.y(), cz = c.z();
+  std::array<T, 6> s = detail::parallelSum<T, 6>(
+      points.size(), mode, [&](std::size_t i, T (&x)[6]) {
+        T dx = points[i].x() - cx, dy = points[i].y() - cy,
+          dz = points[i].z() - cz;
+        x[0] = dx * dx;
+        x[1] = dx * dy;
+        x[2] = dx * dz;
+        x[3] = dy * dy;
+        x[4] = dy * dz;
+        x[5] = dz * dz;
+      });
+  T inv = T{1} / static_cast<T>(points.size());
+  for (T& v : s) v *= inv;
+  return Mat3<T>(Vec3<T>(s[0], s[1], s[2]), Vec3<T>(s[1], s[3], s[4]),
+                 Vec3<T>(s[2], s[4], s[5]));
+}
+
+// Minimum, maximum, mean and variance of the vectors' lengths.
+template <class T>
+LengthStatistics<T> computeLengthStatistics(
+    const std::vector<Vec3<T>>& vectors,
+    Summation mode = Summation::Pairwise) {
+  const std::size_t n = vectors.size();
+  TOOLS_PERF_REGION("reduce_lengths", n);
+  TOOLS_PROFILE_SCOPE("reduce_lengths");
+  LengthStatistics<T> stats;
+  stats.count = n;
+  if (n == 0) return stats;
+  auto length = [&](std::size_t i) {
+    const Vec3<T>& v = vectors[i];
+    return std::sqrt(v.x() * v.x() + v.y() * v.y() + v.z() * v.z());
+  };
+  // Two sweeps, recomputing the lengths rather than storing them: sum and
+  // extremes first, then the squared deviations from the mean.
+  detail::SumRange<T> range = detail::parallelSumRange<T>(
+      n, mode, [&](std::size_t i, T (&x)[1]) { x[0] = length(i); });
+  stats.min = range.min;
+  stats.max = range.max;
+  stats.mean = range.sum / static_cast<T>(n);
+  const T mean = stats.mean;
+  std::array<T, 1> sq = detail::parallelSum<T, 1>(
+      n, mode, [&](std::size_t i, T (&x)[1]) {
+        T d = length(i) - mean;
+        x[0] = d * d;
+      });
+  stats.variance = sq[0] / static_cast<T>(n);
+  return stats;
+}
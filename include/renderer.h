@@ -0,0 +1,163 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <mutex>
+#include <ostream>
+#include <vector>
+
+#include "tools/camera.h"
+#include "tools/morton.h"
+#include "tools/parallel.h"
+#include "tools/perfcounters.h"
+#include "tools/profiling.h"
+#include "tools/raybatch.h"
+#include "tools/vec3.h"
+
+enum class TileOrder : std::uint8_t {
+  Scanline,  // Row by row.
+  Morton,    // Z-order over the tile grid.
+  Hilbert    // Hilbert curve: consecutive tiles are mostly neighbours.
+};
+
+struct RenderSettings {
+  int tileSize = 32;
+  TileOrder order = TileOrder::Hilbert;
+  CameraSampling sampling;
+  // Called after every finished tile with (finished, total). Calls are
+  // serialized, so it need not be thread-safe, but it runs on the workers
+  // and should stay cheap.
+  std::function<void(std::size_t, std::size_t)> progress;
+};
+
+struct RenderStats {
+  std::size_t tiles = 0;
+  std::uint64_t samples = 0;
+  std::uint64_t rays = 0;
+  double seconds = 0.;
+
+  double raysPerSecond() const { return seconds > 0. ? rays / seconds : 0.; }
+  double samplesPerSecond() const {
+    return seconds > 0. ? samples / seconds : 0.;
+  }
+};
+
+inline std::ostream& operator<<(std::ostream& out, const RenderStats& s) {
+  out << s.tiles << " tiles, " << s.samples << " samples, " << s.rays
+      << " rays in " << s.seconds << " s (" << s.samplesPerSecond() * 1.E-6
+      << " Msamples/s, " << s.raysPerSecond() * 1.E-6 << " Mrays/s)";
+  return out;
+}
+
+// Splits a width x height image into tiles of at most tileSize pixels on a
+// side, listed in the given order. Edge tiles are clipped to the image.
+inline std::vector<Tile> makeTiles(int width, int height, int tileSize,
+                                   TileOrder order) {
+  tileSize = std::max(tileSize, 1);
+  const int tilesX = (width + tileSize - 1) / tileSize;
+  const int tilesY = (height + tileSize - 1) / tileSize;
+  std::uint32_t side = 1;
+  while (side < static_cast<std::uint32_t>(std::max(tilesX, tilesY))) {
+    side *= 2;
+  }
+
+  struct Keyed {
+    std::uint32_t key;
+    Tile tile;
+  };
+  std::vector<Keyed> keyed;
+  keyed.reserve(static_cast<std::size_t>(std::max(tilesX, 0)) *
+                std::max(tilesY, 0));
+  for (int ty = 0; ty < tilesY; ++ty) {
+    for (int tx = 0; tx < tilesX; ++tx) {
+      std::uint32_t key = static_cast<std::uint32_t>(keyed.size());
+      if (order == TileOrder::Morton) {
+        key = mortonEncode2(tx, ty);
+      } else if (order == TileOrder::Hilbert) {
+        key = hilbertEncode2(side, tx, ty);
+      }
+      Tile t{tx * tileSize, ty * tileSize,
+             std::min((tx + 1) * tileSize, width),
+             std::min((ty + 1) * tileSize, height)};
+      keyed.push_back(Keyed{key, t});
+    }
+  }
+  std::sort(keyed.begin(), keyed.end(),
+            [](const Keyed& a, const Keyed& b) { return a.key < b.key; });
+  std::vector<Tile> tiles;
+  tiles.reserve(keyed.size());
+  for (const auto& k : keyed) tiles.push_back(k.tile);
+  return tiles;
+}
+
+//--------------------------------------------
+// Renders camera's image tile by tile across all cores. Tiles are handed
+// out dynamically in curve order, so neighbouring tiles are in flight at
+// the same time and share cached scene data.
+//
+// For every tile the camera generates its primary rays (samplesPerPixel
+// consecutive rays per pixel) and
+//   std::uint64_t integrator(const Tile&, const RayBatch&, Vec3D* radiance)
+// writes one radiance value per ray and returns how many rays it traced,
+// primary ones included. The per-pixel average then goes to
+//   void sink(const Tile&, const Vec3D* pixels)
+// in row-major order within the tile. Both run concurrently on worker
+// threads for different tiles.
+//--------------------------------------------
+
+template <typename Integrator, typename Sink>
+RenderStats render(const Camera& camera, const RenderSettings& settings,
+                   Integrator&& integrator, Sink&& sink) {
+  const std::vector<Tile> tiles = makeTiles(
+      camera.width(), camera.height(), settings.tileSize, settings.order);
+  const std::size_t spp =
+      static_cast<std::size_t>(std::max(settings.sampling.samplesPerPixel, 1));
+  const std::size_t pixels =
+      static_cast<std::size_t>(camera.width()) * camera.height();
+  TOOLS_PERF_REGION("render", pixels * spp);
+  TOOLS_PROFILE_SCOPE("render");
+
+  std::atomic<std::uint64_t> rays{0};
+  std::size_t finished = 0;
+  std::mutex progressMutex;
+  auto start = std::chrono::steady_clock::now();
+  parallelFor(tiles.size(), 1, [&](std::size_t b, std::size_t e) {
+    // Scratch reused by every tile this thread renders.
+    thread_local RayBatch primary;
+    thread_local std::vector<Vec3D> radiance, average;
+    for (std::size_t i = b; i < e; ++i) {
+      TOOLS_PROFILE_SCOPE("render_tile");
+      const Tile& tile = tiles[i];
+      camera.generateTile(tile, primary, settings.sampling);
+      radiance.assign(primary.size(), Vec3D(0.f, 0.f, 0.f));
+      rays.fetch_add(integrator(tile, primary, radiance.data()),
+                     std::memory_order_relaxed);
+
+      average.resize(tile.pixelCount());
+      const float weight = 1.f / spp;
+      for (std::size_t p = 0; p < average.size(); ++p) {
+        Vec3D sum(0.f, 0.f, 0.f);
+        for (std::size_t s = 0; s < spp; ++s) sum = sum + radiance[p * spp + s];
+        average[p] = sum * weight;
+      }
+      sink(tile, average.data());
+
+      if (settings.progress) {
+        std::lock_guard<std::mutex> lock(progressMutex);
+        settings.progress(++finished, tiles.size());
+      }
+    }
+  });
+  std::chrono::duration<double> dt = std::chrono::steady_clock::now() - start;
+
+  RenderStats stats;
+  stats.tiles = tiles.size();
+  stats.samples = pixels * spp;
+  stats.rays = rays.load();
+  stats.seconds = dt.count();
+  return stats;
+}
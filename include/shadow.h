@@ -0,0 +1,83 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+#include "tools/bounds3.h"
+#include "tools/lbvh.h"
+#include "tools/light.h"
+#include "tools/morton.h"
+#include "tools/parallel.h"
+#include "tools/perfcounters.h"
+#include "tools/primitives.h"
+#include "tools/profiling.h"
+#include "tools/ray.h"
+
+//--------------------------------------------
+// Shadow rays towards point lights. They only need a yes/no answer, so they
+// go through the occluded() queries, which stop at the first blocker and
+// skip normals and hit distances.
+//--------------------------------------------
+
+// A shadow ray ends this fraction short of the light, so geometry touching
+// the light itself does not block it.
+inline constexpr float kShadowRangeScale = 1.f - 1.E-4f;
+
+// Unit-direction ray from p towards the light, its range ending at the
+// light. A point on the light gets an empty range.
+inline Ray shadowRay(const Point3D& p, const PointLight& light) {
+  Vec3D d = light.position() - p;
+  float dist = d.length();
+  Ray ray(p, dist > 0.f ? d / dist : Vec3D(0.f, 0.f, 1.f));
+  ray.setMaxRange(dist * kShadowRangeScale);
+  return ray;
+}
+
+//--------------------------------------------
+// Visibility of many shading points from one light: visible[i] is 1 unless
+// occluded(shadowRay(points[i], light)) reports a blocker. The rays are
+// traced in the Morton order of their directions, so consecutive rays, and
+// each thread's chunk, walk the same part of the scene; results are written
+// back in input order.
+//--------------------------------------------
+
+template <typename Occluded>
+void lightVisibility(const std::vector<Point3D>& points,
+                     const PointLight& light,
+                     std::vector<std::uint8_t>& visible, Occluded&& occluded) {
+  const std::size_t n = points.size();
+  TOOLS_PERF_REGION("shadow_rays", n);
+  TOOLS_PROFILE_SCOPE("shadow_rays");
+  visible.resize(n);
+  std::vector<float> dx(n), dy(n), dz(n);
+  parallelFor(n, detail::kMortonGrain, [&](std::size_t b, std::size_t e) {
+    for (std::size_t i = b; i < e; ++i) {
+      Vec3D d = getUnitVectorOf(light.position() - points[i]);
+      dx[i] = d.x();
+      dy[i] = d.y();
+      dz[i] = d.z();
+    }
+  });
+  const Bounds3D directions(Point3D(-1.f, -1.f, -1.f), Point3D(1.f, 1.f, 1.f));
+  std::vector<std::uint32_t> keys(n);
+  computeSpatialKeys(dx.data(), dy.data(), dz.data(), n, directions,
+                     SpaceFillingCurve::Morton, keys.data());
+  std::vector<std::uint32_t> order = radixSortOrder(keys, 30);
+  parallelFor(n, 256, [&](std::size_t b, std::size_t e) {
+    for (std::size_t k = b; k < e; ++k) {
+      std::uint32_t i = order[k];
+      visible[i] = occluded(shadowRay(points[i], light)) ? 0 : 1;
+    }
+  });
+}
+
+inline void lightVisibility(const std::vector<Point3D>& points,
+                            const PointLight& light, const LBVH& bvh,
+                            const SphereSoA& spheres,
+                            std::vector<std::uint8_t>& visible,
+                            float tMin = kRayEpsilon) {
+  lightVisibility(points, light, visible, [&](const Ray& ray) {
+    return occluded(ray, bvh, spheres, tMin);
+  });
+}
@@ -0,0 +1,322 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <cmath>
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+#include "tools/parallel.h"
+#include "tools/perfcounters.h"
+#include "tools/point3.h"
+#include "tools/profiling.h"
+
+template <class T>
+struct NeighborPair {
+  std::uint32_t i;
+  std::uint32_t j;
+  T distSquared;
+};
+
+//--------------------------------------------
+// Uniform grid over points, stored as a hash table of cells. Points are
+// counting-sorted by bucket, so the points of one cell are contiguous in
+// the sorted position arrays and neighbor loops stream through memory.
+// Distinct cells may share a bucket; queries filter by distance, so
+// collisions only cost extra distance tests.
+//--------------------------------------------
+
+template <class T>
+class SpatialHashGrid {
+ public:
+  SpatialHashGrid() = default;
+  explicit SpatialHashGrid(T cellSize) { setCellSize(cellSize); }
+
+  void setCellSize(T cellSize) {
+    m_cell_size = cellSize;
+    m_inv_cell_size = T{1} / cellSize;
+  }
+  T cellSize() const { return m_cell_size; }
+
+  void build(const T* x, const T* y, const T* z, std::size_t n);
+  void build(const std::vector<Point3<T>>& points);
+
+  std::size_t size() const { return m_sorted.size(); }
+  std::size_t bucketCount() const { return m_mask + 1; }
+
+  // Original index of the point at sorted position s, for reordering other
+  // per-point arrays into grid order.
+  const std::vector<std::uint32_t>& sortedIndices() const { return m_sorted; }
+  Point3<T> sortedPosition(std::size_t s) const {
+    return Point3<T>(m_sx[s], m_sy[s], m_sz[s]);
+  }
+
+  // Calls fn(index, distSquared) for every point within radius of p.
+  template <typename F>
+  void forEachNeighbor(const Point3<T>& p, T radius, F&& fn) const;
+
+  // All pairs i != j closer than radius, each reported once. Pairs are
+  // grouped by the grid order of their first point.
+  void neighborPairs(T radius, std::vector<NeighborPair<T>>& pairs) const;
+
+  // Neighbors of many query points at once, in CSR form: the neighbors of
+  // query q are indices[offsets[q] .. offsets[q + 1]).
+  void queryRadius(const std::vector<Point3<T>>& queries, T radius,
+                   std::vector<std::uint32_t>& offsets,
+                   std::vector<std::uint32_t>& indices) const;
+
+ private:
+  struct Cell {
+    std::int32_t x, y, z;
+    bool operator==(const Cell&) const = default;
+  };
+
+  Cell cellOf(T x, T y, T z) const {
+    return Cell{static_cast<std::int32_t>(std::floor(x * m_inv_cell_size)),
+                static_cast<std::int32_t>(std::floor(y * m_inv_cell_size)),
+                static_cast<std::int32_t>(std::floor(z * m_inv_cell_size))};
+  }
+
+  std::uint32_t bucketOf(Cell c) const {
+    std::uint32_t h = static_cast<std::uint32_t>(c.x) * 73856093u ^
+                      static_cast<std::uint32_t>(c.y) * 19349663u ^
+                      static_cast<std::uint32_t>(c.z) * 83492791u;
+    return h & m_mask;
+  }
+
+  // Sorted, de-duplicated buckets of the cells within `reach` cells of c.
+  // The pointer form needs room for cellsAround(reach) entries and returns
+  // how many it kept.
+  void bucketsAround(Cell c, int reach,
+                     std::vector<std::uint32_t>& buckets) const;
+  std::size_t bucketsAround(Cell c, int reach, std::uint32_t* buckets) const;
+
+  static std::size_t cellsAround(int reach) {
+    std::size_t side = 2 * static_cast<std::size_t>(reach) + 1;
+    return side * side * side;
+  }
+
+  int reachOf(T radius) const {
+    return std::max(1, static_cast<int>(std::ceil(radius * m_inv_cell_size)));
+  }
+
+  T m_cell_size = T{1};
+  T m_inv_cell_size = T{1};
+  std::uint32_t m_mask = 0;
+  std::vector<std::uint32_t> m_cell_start;
+  std::vector<std::uint32_t> m_sorted;
+  std::vector<T> m_sx, m_sy, m_sz;
+};
+
+using SpatialHashGridD = SpatialHashGrid<float>;
+
+namespace detail {
+inline constexpr std::size_t kHashGrain = 8192;
+}  // namespace detail
+
+template <class T>
+void SpatialHashGrid<T>::build(const T* x, const T* y, const T* z,
+                               std::size_t n) {
+  TOOLS_PERF_REGION("spatial_hash_build", n);
+  TOOLS_PROFILE_SCOPE("spatial_hash_build");
+  // Power-of-two table with at least one bucket per point.
+  std::size_t buckets = 1;
+  while (buckets < n) buckets <<= 1;
+  m_mask = static_cast<std::uint32_t>(buckets - 1);
+
+  std::vector<std::uint32_t> key(n);
+  std::vector<std::atomic<std::uint32_t>> count(buckets);
+  parallelFor(buckets, detail::kHashGrain, [&](std::size_t b, std::size_t e) {
+    for (std::size_t i = b; i < e; ++i) {
+      count[i].store(0, std::memory_order_relaxed);
+    }
+  });
+  parallelFor(n, detail::kHashGrain, [&](std::size_t b, std::size_t e) {
+    for (std::size_t i = b; i < e; ++i) {
+      key[i] = bucketOf(cellOf(x[i], y[i], z[i]));
+      count[key[i]].fetch_add(1, std::memory_order_relaxed);
+    }
+  });
+
+  m_cell_start.resize(buckets + 1);
+  std::uint32_t sum = 0;
+  for (std::size_t i = 0; i < buckets; ++i) {
+    m_cell_start[i] = sum;
+    sum += count[i].load(std::memory_order_relaxed);
+    count[i].store(m_cell_start[i], std::memory_order_relaxed);
+  }
+  m_cell_start[buckets] = sum;
+
+  // Scatter, then sort each bucket by index so the layout does not depend
+  // on thread timing. Buckets hold a handful of points on average.
+  m_sorted.resize(n);
+  parallelFor(n, detail::kHashGrain, [&](std::size_t b, std::size_t e) {
+    for (std::size_t i = b; i < e; ++i) {
+      auto& next = count[key[i]];
+      m_sorted[next.fetch_add(1, std::memory_order_relaxed)] =
+          static_cast<std::uint32_t>(i);
+    }
+  });
+  parallelFor(buckets, detail::kHashGrain, [&](std::size_t b, std::size_t e) {
+    for (std::size_t c = b; c < e; ++c) {
+      std::sort(m_sorted.begin() + m_cell_start[c],
+                m_sorted.begin() + m_cell_start[c + 1]);
+    }
+  });
+
+  m_sx.resize(n);
+  m_sy.resize(n);
+  m_sz.resize(n);
+  parallelFor(n, detail::kHashGrain, [&](std::size_t b, std::size_t e) {
+    for (std::size_t s = b; s < e; ++s) {
+      std::uint32_t i = m_sorted[s];
+      m_sx[s] = x[i];
+      m_sy[s] = y[i];
+      m_sz[s] = z[i];
+    }
+  });
+}
+
+template <class T>
+void SpatialHashGrid<T>::build(const std::vector<Point3<T>>& points) {
+  const std::size_t n = points.size();
+  std::vector<T> x(n), y(n), z(n);
+  for (std::size_t i = 0; i < n; ++i) {
+    x[i] = points[i].x();
+    y[i] = points[i].y();
+    z[i] = points[i].z();
+  }
+  build(x.data(), y.data(), z.data(), n);
+}
+
+template <class T>
+std::size_t SpatialHashGrid<T>::bucketsAround(Cell c, int reach,
+                                              std::uint32_t* buckets) const {
+  std::size_t count = 0;
+  for (int dz = -reach; dz <= reach; ++dz) {
+    for (int dy = -reach; dy <= reach; ++dy) {
+      for (int dx = -reach; dx <= reach; ++dx) {
+        buckets[count++] = bucketOf(Cell{c.x + dx, c.y + dy, c.z + dz});
+      }
+    }
+  }
+  std::sort(buckets, buckets + count);
+  return std::unique(buckets, buckets + count) - buckets;
+}
+
+template <class T>
+void SpatialHashGrid<T>::bucketsAround(
+    Cell c, int reach, std::vector<std::uint32_t>& buckets) const {
+  buckets.resize(cellsAround(reach));
+  buckets.resize(bucketsAround(c, reach, buckets.data()));
+}
+
+template <class T>
+template <typename F>
+void SpatialHashGrid<T>::forEachNeighbor(const Point3<T>& p, T radius,
+                                         F&& fn) const {
+  if (m_sorted.empty()) return;
+  const T r2 = radius * radius;
+  const int reach = reachOf(radius);
+  // Radii up to one cell, the usual query, keep the 27 buckets on the
+  // stack; wider ones fall back to the heap.
+  std::uint32_t local[27];
+  std::vector<std::uint32_t> wide;
+  std::uint32_t* buckets = local;
+  if (reach > 1) {
+    wide.resize(cellsAround(reach));
+    buckets = wide.data();
+  }
+  std::size_t count =
+      bucketsAround(cellOf(p.x(), p.y(), p.z()), reach, buckets);
+  for (std::size_t k = 0; k < count; ++k) {
+    const std::uint32_t b = buckets[k];
+    for (std::uint32_t s = m_cell_start[b]; s < m_cell_start[b + 1]; ++s) {
+      T dx = m_sx[s] - p.x(), dy = m_sy[s] - p.y(), dz = m_sz[s] - p.z();
+      T d2 = dx * dx + dy * dy + dz * dz;
+      if (d2 <= r2) fn(m_sorted[s], d2);
+    }
+  }
+}
+
+template <class T>
+void SpatialHashGrid<T>::neighborPairs(
+    T radius, std::vector<NeighborPair<T>>& pairs) const {
+  const std::size_t n = m_sorted.size();
+  TOOLS_PERF_REGION("spatial_hash_pairs", n);
+  TOOLS_PROFILE_SCOPE("spatial_hash_pairs");
+  pairs.clear();
+  if (n == 0) return;
+  const T r2 = radius * radius;
+  const int reach = reachOf(radius);
+
+  // Walk the points in grid order. Consecutive points mostly share a cell,
+  // so the bucket list is reused and the candidate ranges stay in cache.
+  const std::size_t chunks = (n + detail::kHashGrain - 1) / detail::kHashGrain;
+  std::vector<std::vector<NeighborPair<T>>> partial(chunks);
+  parallelFor(chunks, 1, [&](std::size_t cb, std::size_t ce) {
+    std::vector<std::uint32_t> buckets;
+    for (std::size_t c = cb; c < ce; ++c) {
+      auto& out = partial[c];
+      Cell last{0, 0, 0};
+      bool haveLast = false;
+      std::size_t end = std::min(n, (c + 1) * detail::kHashGrain);
+      for (std::size_t a = c * detail::kHashGrain; a < end; ++a) {
+        Cell cell = cellOf(m_sx[a], m_sy[a], m_sz[a]);
+        if (!haveLast || !(cell == last)) {
+          bucketsAround(cell, reach, buckets);
+          last = cell;
+          haveLast = true;
+        }
+        for (std::uint32_t b : buckets) {
+          // Only partners later in grid order, so each pair appears once.
+          std::uint32_t s = std::max<std::uint32_t>(
+              m_cell_start[b], static_cast<std::uint32_t>(a + 1));
+          for (; s < m_cell_start[b + 1]; ++s) {
+            T dx = m_sx[s] - m_sx[a], dy = m_sy[s] - m_sy[a],
+              dz = m_sz[s] - m_sz[a];
+            T d2 = dx * dx + dy * dy + dz * dz;
+            if (d2 <= r2) out.push_back({m_sorted[a], m_sorted[s], d2});
+          }
+        }
+      }
+    }
+  });
+
+  std::size_t total = 0;
+  for (const auto& p : partial) total += p.size();
+  pairs.reserve(total);
+  for (const auto& p : partial) pairs.insert(pairs.end(), p.begin(), p.end());
+}
+
+template <class T>
+void SpatialHashGrid<T>::queryRadius(
+    const std::vector<Point3<T>>& queries, T radius,
+    std::vector<std::uint32_t>& offsets,
+    std::vector<std::uint32_t>& indices) const {
+  const std::size_t q = queries.size();
+  TOOLS_PERF_REGION("spatial_hash_query", q);
+  TOOLS_PROFILE_SCOPE("spatial_hash_query");
+  const std::size_t chunks = (q + detail::kHashGrain - 1) / detail::kHashGrain;
+  std::vector<std::vector<std::uint32_t>> partial(chunks);
+  offsets.assign(q + 1, 0);
+  parallelFor(chunks, 1, [&](std::size_t cb, std::size_t ce) {
+    for (std::size_t c = cb; c < ce; ++c) {
+      std::size_t end = std::min(q, (c + 1) * detail::kHashGrain);
+      for (std::size_t i = c * detail::kHashGrain; i < end; ++i) {
+        std::size_t before = partial[c].size();
+        forEachNeighbor(queries[i], radius, [&](std::uint32_t j, T) {
+          partial[c].push_back(j);
+        });
+        offsets[i + 1] = static_cast<std::uint32_t>(partial[c].size() - before);
+      }
+    }
+  });
+  for (std::size_t i = 0; i < q; ++i) offsets[i + 1] += offsets[i];
+  indices.clear();
+  indices.reserve(offsets[q]);
+  for (const auto& p : partial) {
+    indices.insert(indices.end(), p.begin(), p.end());
+  }
+}
@@ -0,0 +1,187 @@
+#pragma once
+
+#include <cmath>
+#include <cstddef>
+#include <limits>
+
+#include "tools/mat3.h"
+#include "tools/matsoa.h"
+#include "tools/orthonormal.h"
+#include "tools/perfcounters.h"
+#include "tools/profiling.h"
+#include "tools/vec3.h"
+
+//--------------------------------------------
+// Eigen-decomposition of a symmetric 3x3 matrix. Eigenvalues are sorted in
+// decreasing order and vectors[k] is the unit eigenvector of values[k]. The
+// vectors form a right-handed basis, vectors[2] = cross(vectors[0],
+// vectors[1]), so for a covariance matrix vectors[0] is the principal axis
+// and vectors[2] the normal of the best-fit plane.
+//--------------------------------------------
+
+template <class T>
+struct SymmetricEigen3 {
+  Vec3<T> values;
+  Vec3<T> vectors[3];
+};
+
+namespace detail {
+
+// Cyclic Jacobi on a row-major symmetric matrix a, accumulating the
+// rotations into the columns of v. Element i of a matrix is at [i * S], so
+// the same code handles one matrix (S = 1) or one lane of a block
+// (S = kMatLanes). Each rotation is branch-free: the tangent uses the
+// small-angle root (|angle| <= pi/4) and a zero off-diagonal entry gives
+// the identity rotation.
+template <std::size_t S, class T>
+inline void jacobiRotate(T* a, T* v, int p, int q) {
+  T apq = a[(p * 3 + q) * S];
+  T d = a[(q * 3 + q) * S] - a[(p * 3 + p) * S];
+  T r = std::sqrt(d * d + T{4} * apq * apq);
+  T denom = std::fabs(d) + r;
+  T nonzero = denom > T{0} ? T{1} : T{0};
+  T sign = d < T{0} ? T{-1} : T{1};
+  T t = sign * T{2} * apq * nonzero / (denom + (T{1} - nonzero));
+  T c = T{1} / std::sqrt(T{1} + t * t);
+  T s = t * c;
+  for (int k = 0; k < 3; ++k) {
+    T x = a[(k * 3 + p) * S], y = a[(k * 3 + q) * S];
+    a[(k * 3 + p) * S] = c * x - s * y;
+    a[(k * 3 + q) * S] = s * x + c * y;
+  }
+  for (int k = 0; k < 3; ++k) {
+    T x = a[(p * 3 + k) * S], y = a[(q * 3 + k) * S];
+    a[(p * 3 + k) * S] = c * x - s * y;
+    a[(q * 3 + k) * S] = s * x + c * y;
+  }
+  for (int k = 0; k < 3; ++k) {
+    T x = v[(k * 3 + p) * S], y = v[(k * 3 + q) * S];
+    v[(k * 3 + p) * S] = c * x - s * y;
+    v[(k * 3 + q) * S] = s * x + c * y;
+  }
+}
+
+inline constexpr int kJacobiSweeps = 6;
+
+// Orders eigenpairs i < j by decreasing eigenvalue with selects only.
+template <std::size_t S, class T>
+inline void sortEigenPair(T* w, T* v, int i, int j) {
+  bool swap = w[j * S] > w[i * S];
+  T wi = w[i * S], wj = w[j * S];
+  w[i * S] = swap ? wj : wi;
+  w[j * S] = swap ? wi : wj;
+  for (int k = 0; k < 3; ++k) {
+    T x = v[(k * 3 + i) * S], y = v[(k * 3 + j) * S];
+    v[(k * 3 + i) * S] = swap ? y : x;
+    v[(k * 3 + j) * S] = swap ? x : y;
+  }
+}
+
+// Sorts the eigenpairs and makes the eigenvector columns right-handed.
+template <std::size_t S, class T>
+inline void finishEigen3(const T* a, T* v, T* w) {
+  w[0] = a[0];
+  w[S] = a[4 * S];
+  w[2 * S] = a[8 * S];
+  sortEigenPair<S>(w, v, 0, 1);
+  sortEigenPair<S>(w, v, 0, 2);
+  sortEigenPair<S>(w, v, 1, 2);
+  v[2 * S] = v[3 * S] * v[7 * S] - v[6 * S] * v[4 * S];
+  v[5 * S] = v[6 * S] * v[1 * S] - v[0] * v[7 * S];
+  v[8 * S] = v[0] * v[4 * S] - v[3 * S] * v[1 * S];
+}
+
+}  // namespace detail
+
+template <class T>
+SymmetricEigen3<T> symmetricEigen(const Mat3<T>& m) {
+  T a[9], v[9] = {T{1}, T{0}, T{0}, T{0}, T{1}, T{0}, T{0}, T{0}, T{1}};
+  for (int r = 0; r < 3; ++r) {
+    for (int c = 0; c < 3; ++c) a[r * 3 + c] = m[r][c];
+  }
+  // Converges quadratically; stop early once the off-diagonal part is
+  // negligible next to the diagonal.
+  for (int sweep = 0; sweep < 2 * detail::kJacobiSweeps; ++sweep) {
+    T off = a[1] * a[1] + a[2] * a[2] + a[5] * a[5];
+    T diag = a[0] * a[0] + a[4] * a[4] + a[8] * a[8];
+    if (off <= std::numeric_limits<T>::min() ||
+        off <= diag * std::numeric_limits<T>::epsilon() *
+                   std::numeric_limits<T>::epsilon()) {
+      break;
+    }
+    detail::jacobiRotate<1>(a, v, 0, 1);
+    detail::jacobiRotate<1>(a, v, 0, 2);
+    detail::jacobiRotate<1>(a, v, 1, 2);
+  }
+  T w[3];
+  detail::finishEigen3<1>(a, v, w);
+
+  SymmetricEigen3<T> ret;
+  ret.values = Vec3<T>(w[0], w[1], w[2]);
+  for (int k = 0; k < 3; ++k) {
+    ret.vectors[k] = Vec3<T>(v[k], v[3 + k], v[6 + k]);
+  }
+  return ret;
+}
+
+// Frame of the eigenvectors: u is the principal axis, w the direction of
+// least variance.
+inline OrthoNormalBasis eigenBasis(const SymmetricEigen3<float>& e) {
+  return OrthoNormalBasis(e.vectors[0], e.vectors[1], e.vectors[2]);
+}
+
+namespace detail {
+
+// Works on a whole block at a time: every step is a loop over the lanes of
+// the block, which is what the compiler vectorizes. With GCC the rotation
+// loops only vectorize under -fno-math-errno, since sqrt may set errno.
+template <class T>
+void symmetricEigenBlock(const T* __restrict m, T* __restrict values,
+                         T* __restrict vectors) {
+  constexpr std::size_t L = kMatLanes;
+  T a[9 * L], v[9 * L];
+  for (std::size_t i = 0; i < 9 * L; ++i) {
+    a[i] = m[i];
+    v[i] = i / L % 4 == 0 ? T{1} : T{0};
+  }
+  for (int sweep = 0; sweep < kJacobiSweeps; ++sweep) {
+    for (std::size_t l = 0; l < L; ++l) jacobiRotate<L>(a + l, v + l, 0, 1);
+    for (std::size_t l = 0; l < L; ++l) jacobiRotate<L>(a + l, v + l, 0, 2);
+    for (std::size_t l = 0; l < L; ++l) jacobiRotate<L>(a + l, v + l, 1, 2);
+  }
+  for (std::size_t l = 0; l < L; ++l) {
+    finishEigen3<L>(a + l, v + l, values + l);
+  }
+  // Row k of the output is eigenvector k, i.e. column k of v.
+  for (int k = 0; k < 3; ++k) {
+    for (int c = 0; c < 3; ++c) {
+      for (std::size_t l = 0; l < L; ++l) {
+        vectors[(k * 3 + c) * L + l] = v[(c * 3 + k) * L + l];
+      }
+    }
+  }
+}
+
+}  // namespace detail
+
+//--------------------------------------------
+// Batched decomposition, one matrix per SIMD lane with a fixed number of
+// Jacobi sweeps, built for the active ISA like the matsoa.h kernels. Row k
+// of vectors[i] is the eigenvector of values[i][k].
+//--------------------------------------------
+
+template <class T>
+void batchSymmetricEigen(const MatSoA<T, 3>& m, VecSoA<T, 3>& values,
+                         MatSoA<T, 3>& vectors) {
+  TOOLS_PERF_REGION("symmetric_eigen3", m.size());
+  TOOLS_PROFILE_SCOPE("symmetric_eigen3");
+  values.resize(m.size());
+  vectors.resize(m.size());
+  dispatchParallelFor(m.blocks(), detail::kMatBlockGrain,
+                      [&](std::size_t b, std::size_t e) {
+                        for (std::size_t i = b; i < e; ++i) {
+                          detail::symmetricEigenBlock(
+                              m.block(i), values.block(i), vectors.block(i));
+                        }
+                      });
+}
@@ -1,20 +1,43 @@
 #pragma once
 
-#include <cmath>
-#include <limits>
-
+#include "bounds3.h"
+#include "camera.h"
+#include "constants.h"
+#include "cpudispatch.h"
+#include "framebuffer.h"
+#include "frustum.h"
+#include "fwd.h"
+#include "hitrecord.h"
+#include "instancing.h"
+#include "io.h"
+#include "kdtree.h"
+#include "lbvh.h"
 #include "light.h"
+#include "lightsampler.h"
 #include "mat2.h"
 #include "mat3.h"
 #include "mat4.h"
+#include "matsoa.h"
+#include "matx.h"
+#include "morton.h"
 #include "normal3.h"
+#include "normalestimation.h"
 #include "orthonormal.h"
+#include "parallel.h"
+#include "particles.h"
+#include "perfcounters.h"
 #include "point3.h"
+#include "primitives.h"
+#include "profiling.h"
 #include "ray.h"
+#include "raybatch.h"
+#include "reductions.h"
+#include "renderer.h"
+#include "shadow.h"
+#include "spatialhash.h"
+#include "symmetriceigen.h"
 #include "vec2.h"
 #include "vec3.h"
+#include "vec3a.h"
 #include "vec4.h"
-
-const float PI = acos(-1.);
-constexpr float EPS = std::numeric_limits<float>::epsilon();
-constexpr float EPS1 = 0.000002f;
+#include "wavefront.h"
@@ -2,8 +2,6 @@
 
 #include <cassert>
 #include <cmath>
-#include <iostream>
-#include <random>
 
 template <class T>
 class Vec2 {
@@ -58,24 +56,6 @@ void Vec2<T>::normalize() {
   *this = (*this) / (this->length() + 1.E-30);
 }
 
-//--------------------------------------------
-// Overloaded I/O operators (input, output)
-//--------------------------------------------
-
-template <typename T>
-inline std::istream& operator>>(std::istream& in, Vec2<T>& v) {
-  T x, y;
-  in >> x >> y;
-  v.set(x, y);
-  return in;
-}
-
-template <typename T>
-inline std::ostream& operator<<(std::ostream& out, const Vec2<T>& v) {
-  out << "(" << v.x() << "," << v.y() << ")";
-  return out;
-}
-
 //--------------------------------------------
 // Overloaded operators as normal functions
 // Binary operator (+, -, *)
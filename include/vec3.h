@@ -2,17 +2,9 @@
 
 #include <cassert>
 #include <cmath>
-#include <iostream>
-#include <random>
 
-template <class T>
-class Vec4;
-
-template <class T>
-class Point3;
-
-template <class T>
-class Normal3;
+#include "tools/fwd.h"
+#include "tools/profiling.h"
 
 template <class T>
 class Vec3 {
@@ -86,27 +78,10 @@ using Vec3D = Vec3<float>;
 
 template <typename T>
 void Vec3<T>::normalize() {
+  TOOLS_COUNT_OP(ProfileOp::Normalize);
   *this = (*this) / (this->length() + 1.E-30f);
 }
 
-//--------------------------------------------
-// Overloaded I/O operators (input, output)
-//--------------------------------------------
-
-template <typename T>
-inline std::istream& operator>>(std::istream& in, Vec3<T>& v) {
-  T x, y, z;
-  in >> x >> y >> z;
-  v.set(x, y, z);
-  return in;
-}
-
-template <typename T>
-inline std::ostream& operator<<(std::ostream& out, const Vec3<T>& v) {
-  out << "(" << v.x() << "," << v.y() << "," << v.z() << ")" << std::endl;
-  return out;
-}
-
 //--------------------------------------------
 // Overloaded Normal Function operators (input, output)
 //--------------------------------------------
@@ -184,6 +159,7 @@ Vec3<T> cross(const Vec3<T>& v1, const Vec3<T>& v2) {
 
 template <typename T>
 Vec3<T> getUnitVectorOf(const Vec3<T>& v) {
+  TOOLS_COUNT_OP(ProfileOp::Normalize);
   return v / static_cast<T>(v.length() + 1.E-30);
 }
 
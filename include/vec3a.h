@@ -0,0 +1,581 @@
+#pragma once
+
+#include <cassert>
+#include <cmath>
+#include <compare>
+#include <cstddef>
+#include <type_traits>
+#include <vector>
+
+#include "tools/normal3.h"
+#include "tools/point3.h"
+#include "tools/profiling.h"
+#include "tools/vec3.h"
+
+//--------------------------------------------
+// 16-byte aligned three-component types. They keep the Vec3 / Point3 /
+// Normal3 API but store a fourth, always-zero pad lane, so an element is
+// one aligned 128-bit load and the element-wise operators are written as
+// four-lane loops that compile to a single SSE/NEON instruction. The price
+// is a third more memory than the 12-byte types: use them for hot working
+// sets, and the packed types for large arrays that are streamed once.
+//--------------------------------------------
+
+namespace detail {
+
+template <class T>
+struct alignas(4 * sizeof(T)) Lanes4 {
+  T v[4] = {};
+
+  static Lanes4 make(T x, T y, T z) {
+    Lanes4 r;
+    r.v[0] = x;
+    r.v[1] = y;
+    r.v[2] = z;
+    return r;
+  }
+};
+
+template <class T>
+inline Lanes4<T> lanesAdd(const Lanes4<T>& a, const Lanes4<T>& b) {
+  Lanes4<T> r;
+  for (int i = 0; i < 4; ++i) r.v[i] = a.v[i] + b.v[i];
+  return r;
+}
+
+template <class T>
+inline Lanes4<T> lanesSub(const Lanes4<T>& a, const Lanes4<T>& b) {
+  Lanes4<T> r;
+  for (int i = 0; i < 4; ++i) r.v[i] = a.v[i] - b.v[i];
+  return r;
+}
+
+template <class T>
+inline Lanes4<T> lanesMul(const Lanes4<T>& a, const Lanes4<T>& b) {
+  Lanes4<T> r;
+  for (int i = 0; i < 4; ++i) r.v[i] = a.v[i] * b.v[i];
+  return r;
+}
+
+template <class T>
+inline Lanes4<T> lanesScale(const Lanes4<T>& a, T s) {
+  Lanes4<T> r;
+  for (int i = 0; i < 4; ++i) r.v[i] = a.v[i] * s;
+  return r;
+}
+
+// The scalar in the three used lanes, zero in the pad lane, so scalar
+// sums and differences leave the pad at zero.
+template <class T>
+inline Lanes4<T> lanesSplat(T s) {
+  return Lanes4<T>::make(s, s, s);
+}
+
+// a / (b + 1e-30) like the packed types; the pad lane divides by one.
+template <class T>
+inline Lanes4<T> lanesDiv(const Lanes4<T>& a, const Lanes4<T>& b) {
+  Lanes4<T> d = lanesAdd(b, lanesSplat(static_cast<T>(1.E-30)));
+  d.v[3] = T{1};
+  Lanes4<T> r;
+  for (int i = 0; i < 4; ++i) r.v[i] = a.v[i] / d.v[i];
+  return r;
+}
+
+// Lexicographic over x, y, z, the order the defaulted <=> of the packed
+// types gives.
+template <class T>
+inline auto lanesCompare(const Lanes4<T>& a, const Lanes4<T>& b) {
+  for (int i = 0; i < 2; ++i) {
+    if (auto c = a.v[i] <=> b.v[i]; c != 0) return c;
+  }
+  return a.v[2] <=> b.v[2];
+}
+
+template <class T>
+inline T lanesDot(const Lanes4<T>& a, const Lanes4<T>& b) {
+  Lanes4<T> p = lanesMul(a, b);
+  return p.v[0] + p.v[1] + p.v[2];
+}
+
+}  // namespace detail
+
+template <class T>
+class alignas(4 * sizeof(T)) AlignedVec3 {
+ public:
+  AlignedVec3() = default;
+  AlignedVec3(T x, T y, T z) : m_v(detail::Lanes4<T>::make(x, y, z)) {}
+  explicit AlignedVec3(const Vec3<T>& v) : AlignedVec3(v.x(), v.y(), v.z()) {}
+  explicit AlignedVec3(const detail::Lanes4<T>& v) : m_v(v) {}
+
+  explicit operator Vec3<T>() const { return Vec3<T>(x(), y(), z()); }
+
+  T x() const { return m_v.v[0]; }
+  T y() const { return m_v.v[1]; }
+  T z() const { return m_v.v[2]; }
+
+  void setX(T num) { m_v.v[0] = num; }
+  void setY(T num) { m_v.v[1] = num; }
+  void setZ(T num) { m_v.v[2] = num; }
+  void set(T num) { m_v = detail::lanesSplat(num); }
+  void set(T num1, T num2, T num3) {
+    m_v = detail::Lanes4<T>::make(num1, num2, num3);
+  }
+
+  T operator[](int i) const {
+    assert(i >= 0 && i <= 2);
+    return m_v.v[i];
+  }
+
+  T& operator[](int i) {
+    assert(i >= 0 && i <= 2);
+    return m_v.v[i];
+  }
+
+  bool operator==(const AlignedVec3<T>& rhs) const {
+    return x() == rhs.x() && y() == rhs.y() && z() == rhs.z();
+  }
+
+  auto operator<=>(const AlignedVec3<T>& rhs) const {
+    return detail::lanesCompare(m_v, rhs.m_v);
+  }
+
+  AlignedVec3<T> operator+() const { return *this; }
+  AlignedVec3<T> operator-() const {
+    return AlignedVec3<T>(detail::lanesScale(m_v, T{-1}));
+  }
+
+  void normalize();
+  T length() const { return std::sqrt(detail::lanesDot(m_v, m_v)); }
+
+  void zero() { m_v = detail::Lanes4<T>(); }
+
+  const detail::Lanes4<T>& lanes() const { return m_v; }
+
+ private:
+  detail::Lanes4<T> m_v;
+};
+
+template <class T>
+class alignas(4 * sizeof(T)) AlignedPoint3 {
+ public:
+  AlignedPoint3() = default;
+  AlignedPoint3(T x, T y, T z) : m_v(detail::Lanes4<T>::make(x, y, z)) {}
+  explicit AlignedPoint3(const Point3<T>& p)
+      : AlignedPoint3(p.x(), p.y(), p.z()) {}
+  explicit AlignedPoint3(const detail::Lanes4<T>& v) : m_v(v) {}
+
+  explicit operator Point3<T>() const { return Point3<T>(x(), y(), z()); }
+
+  T x() const { return m_v.v[0]; }
+  T y() const { return m_v.v[1]; }
+  T z() const { return m_v.v[2]; }
+
+  void setX(T num) { m_v.v[0] = num; }
+  void setY(T num) { m_v.v[1] = num; }
+  void setZ(T num) { m_v.v[2] = num; }
+  void setAll(T num) { m_v = detail::lanesSplat(num); }
+
+  T operator[](int i) const {
+    assert(i >= 0 && i <= 2);
+    return m_v.v[i];
+  }
+
+  T& operator[](int i) {
+    assert(i >= 0 && i <= 2);
+    return m_v.v[i];
+  }
+
+  bool operator==(const AlignedPoint3<T>& rhs) const {
+    return x() == rhs.x() && y() == rhs.y() && z() == rhs.z();
+  }
+
+  auto operator<=>(const AlignedPoint3<T>& rhs) const {
+    return detail::lanesCompare(m_v, rhs.m_v);
+  }
+
+  AlignedPoint3<T> operator+(const AlignedVec3<T>& v) const {
+    return AlignedPoint3<T>(detail::lanesAdd(m_v, v.lanes()));
+  }
+
+  AlignedVec3<T> operator+(const AlignedPoint3<T>& rhs) const {
+    return AlignedVec3<T>(detail::lanesAdd(m_v, rhs.m_v));
+  }
+
+  AlignedPoint3<T> operator-(const AlignedVec3<T>& v) const {
+    return AlignedPoint3<T>(detail::lanesSub(m_v, v.lanes()));
+  }
+
+  AlignedVec3<T> operator-(const AlignedPoint3<T>& rhs) const {
+    return AlignedVec3<T>(detail::lanesSub(m_v, rhs.m_v));
+  }
+
+  const detail::Lanes4<T>& lanes() const { return m_v; }
+
+ private:
+  detail::Lanes4<T> m_v;
+};
+
+template <class T>
+class alignas(4 * sizeof(T)) AlignedNormal3 {
+ public:
+  AlignedNormal3() = default;
+  AlignedNormal3(T x, T y, T z) : m_v(detail::Lanes4<T>::make(x, y, z)) {}
+  explicit AlignedNormal3(const Normal3<T>& n)
+      : AlignedNormal3(n.x(), n.y(), n.z()) {}
+  explicit AlignedNormal3(const AlignedVec3<T>& v) : m_v(v.lanes()) {}
+  explicit AlignedNormal3(const detail::Lanes4<T>& v) : m_v(v) {}
+
+  explicit operator Normal3<T>() const { return Normal3<T>(x(), y(), z()); }
+
+  T x() const { return m_v.v[0]; }
+  T y() const { return m_v.v[1]; }
+  T z() const { return m_v.v[2]; }
+
+  void setX(T num) { m_v.v[0] = num; }
+  void setY(T num) { m_v.v[1] = num; }
+  void setZ(T num) { m_v.v[2] = num; }
+  void set(T num) { m_v = detail::lanesSplat(num); }
+  void set(T num1, T num2, T num3) {
+    m_v = detail::Lanes4<T>::make(num1, num2, num3);
+  }
+
+  T operator[](int i) const {
+    assert(i >= 0 && i <= 2);
+    return m_v.v[i];
+  }
+
+  T& operator[](int i) {
+    assert(i >= 0 && i <= 2);
+    return m_v.v[i];
+  }
+
+  bool operator==(const AlignedNormal3<T>& rhs) const {
+    return x() == rhs.x() && y() == rhs.y() && z() == rhs.z();
+  }
+
+  auto operator<=>(const AlignedNormal3<T>& rhs) const {
+    return detail::lanesCompare(m_v, rhs.m_v);
+  }
+
+  AlignedNormal3<T> operator+() const { return *this; }
+
+  AlignedNormal3<T> operator-() const {
+    return AlignedNormal3<T>(detail::lanesScale(m_v, T{-1}));
+  }
+
+  void normalize();
+  T length() const { return std::sqrt(detail::lanesDot(m_v, m_v)); }
+
+  const detail::Lanes4<T>& lanes() const { return m_v; }
+
+ private:
+  detail::Lanes4<T> m_v;
+};
+
+using Vec3A = AlignedVec3<float>;
+using Point3A = AlignedPoint3<float>;
+using Normal3A = AlignedNormal3<float>;
+
+static_assert(sizeof(Vec3A) == 16 && alignof(Vec3A) == 16);
+static_assert(sizeof(Point3A) == 16 && alignof(Point3A) == 16);
+static_assert(sizeof(Normal3A) == 16 && alignof(Normal3A) == 16);
+static_assert(std::is_trivially_copyable_v<Vec3A>);
+
+//--------------------------------------------
+// Overloaded Member operators (input, output)
+//--------------------------------------------
+
+template <typename T>
+void AlignedVec3<T>::normalize() {
+  TOOLS_COUNT_OP(ProfileOp::Normalize);
+  m_v = detail::lanesScale(m_v, T{1} / (length() + static_cast<T>(1.E-30)));
+}
+
+template <typename T>
+void AlignedNormal3<T>::normalize() {
+  TOOLS_COUNT_OP(ProfileOp::Normalize);
+  m_v = detail::lanesScale(m_v, T{1} / (length() + static_cast<T>(1.E-30)));
+}
+
+//--------------------------------------------
+// Overloaded Normal Function operators (input, output)
+//--------------------------------------------
+
+template <typename T>
+AlignedVec3<T> operator+(const AlignedVec3<T>& v1, const AlignedVec3<T>& v2) {
+  return AlignedVec3<T>(detail::lanesAdd(v1.lanes(), v2.lanes()));
+}
+
+template <typename T>
+AlignedVec3<T> operator+(const AlignedVec3<T>& v, T num) {
+  return AlignedVec3<T>(detail::lanesAdd(v.lanes(), detail::lanesSplat(num)));
+}
+
+template <typename T>
+AlignedVec3<T> operator+(T num, const AlignedVec3<T>& v) {
+  return v + num;
+}
+
+template <typename T>
+AlignedVec3<T> operator-(const AlignedVec3<T>& v1, const AlignedVec3<T>& v2) {
+  return AlignedVec3<T>(detail::lanesSub(v1.lanes(), v2.lanes()));
+}
+
+template <typename T>
+AlignedVec3<T> operator-(const AlignedVec3<T>& v, T num) {
+  return AlignedVec3<T>(detail::lanesSub(v.lanes(), detail::lanesSplat(num)));
+}
+
+// Same result as Vec3's num - v, which is v - num, so the types stay
+// interchangeable.
+template <typename T>
+AlignedVec3<T> operator-(T num, const AlignedVec3<T>& v) {
+  return v - num;
+}
+
+template <typename T>
+AlignedVec3<T> operator*(const AlignedVec3<T>& v1, const AlignedVec3<T>& v2) {
+  return AlignedVec3<T>(detail::lanesMul(v1.lanes(), v2.lanes()));
+}
+
+template <typename T>
+AlignedVec3<T> operator*(const AlignedVec3<T>& v, T num) {
+  return AlignedVec3<T>(detail::lanesScale(v.lanes(), num));
+}
+
+template <typename T>
+AlignedVec3<T> operator*(T num, const AlignedVec3<T>& v) {
+  return v * num;
+}
+
+template <typename T>
+AlignedVec3<T> operator/(const AlignedVec3<T>& v1, const AlignedVec3<T>& v2) {
+  return AlignedVec3<T>(detail::lanesDiv(v1.lanes(), v2.lanes()));
+}
+
+template <typename T>
+AlignedVec3<T> operator/(const AlignedVec3<T>& v, T num) {
+  return v * (T{1} / (num + static_cast<T>(1.E-30)));
+}
+
+template <typename T>
+AlignedVec3<T> operator-(const AlignedVec3<T>& v, const AlignedPoint3<T>& p) {
+  return AlignedVec3<T>(detail::lanesSub(v.lanes(), p.lanes()));
+}
+
+template <typename T>
+AlignedVec3<T> operator+(const AlignedVec3<T>& v, const AlignedPoint3<T>& p) {
+  return AlignedVec3<T>(detail::lanesAdd(v.lanes(), p.lanes()));
+}
+
+template <typename T>
+AlignedPoint3<T> operator+(const AlignedPoint3<T>& p, T num) {
+  return AlignedPoint3<T>(detail::lanesAdd(p.lanes(), detail::lanesSplat(num)));
+}
+
+template <typename T>
+AlignedPoint3<T> operator*(const AlignedPoint3<T>& p, T num) {
+  return AlignedPoint3<T>(detail::lanesScale(p.lanes(), num));
+}
+
+template <typename T>
+AlignedPoint3<T> operator*(T num, const AlignedPoint3<T>& p) {
+  return p * num;
+}
+
+template <typename T>
+bool operator==(const AlignedNormal3<T>& n, const AlignedVec3<T>& v) {
+  return n.x() == v.x() && n.y() == v.y() && n.z() == v.z();
+}
+
+template <typename T>
+bool operator!=(const AlignedNormal3<T>& n, const AlignedVec3<T>& v) {
+  return !(n == v);
+}
+
+template <typename T>
+AlignedNormal3<T> operator+(const AlignedNormal3<T>& n1,
+                            const AlignedNormal3<T>& n2) {
+  return AlignedNormal3<T>(detail::lanesAdd(n1.lanes(), n2.lanes()));
+}
+
+template <typename T>
+AlignedNormal3<T> operator+(const AlignedNormal3<T>& n,
+                            const AlignedVec3<T>& v) {
+  return AlignedNormal3<T>(detail::lanesAdd(n.lanes(), v.lanes()));
+}
+
+template <typename T>
+AlignedNormal3<T> operator+(const AlignedVec3<T>& v,
+                            const AlignedNormal3<T>& n) {
+  return n + v;
+}
+
+template <typename T>
+AlignedNormal3<T> operator+(const AlignedNormal3<T>& n, T num) {
+  return AlignedNormal3<T>(
+      detail::lanesAdd(n.lanes(), detail::lanesSplat(num)));
+}
+
+template <typename T>
+AlignedNormal3<T> operator+(T num, const AlignedNormal3<T>& n) {
+  return n + num;
+}
+
+template <typename T>
+AlignedNormal3<T> operator-(const AlignedNormal3<T>& n1,
+                            const AlignedNormal3<T>& n2) {
+  return AlignedNormal3<T>(detail::lanesSub(n1.lanes(), n2.lanes()));
+}
+
+template <typename T>
+AlignedNormal3<T> operator-(const AlignedNormal3<T>& n,
+                            const AlignedVec3<T>& v) {
+  return AlignedNormal3<T>(detail::lanesSub(n.lanes(), v.lanes()));
+}
+
+template <typename T>
+AlignedNormal3<T> operator-(const AlignedNormal3<T>& n, T num) {
+  return AlignedNormal3<T>(
+      detail::lanesSub(n.lanes(), detail::lanesSplat(num)));
+}
+
+// n - num, as Normal3's num - n is.
+template <typename T>
+AlignedNormal3<T> operator-(T num, const AlignedNormal3<T>& n) {
+  return n - num;
+}
+
+template <typename T>
+AlignedNormal3<T> operator*(const AlignedNormal3<T>& n1,
+                            const AlignedNormal3<T>& n2) {
+  return AlignedNormal3<T>(detail::lanesMul(n1.lanes(), n2.lanes()));
+}
+
+template <typename T>
+AlignedNormal3<T> operator*(const AlignedNormal3<T>& n,
+                            const AlignedVec3<T>& v) {
+  return AlignedNormal3<T>(detail::lanesMul(n.lanes(), v.lanes()));
+}
+
+template <typename T>
+AlignedNormal3<T> operator*(const AlignedVec3<T>& v,
+                            const AlignedNormal3<T>& n) {
+  return n * v;
+}
+
+template <typename T>
+AlignedNormal3<T> operator*(const AlignedNormal3<T>& n, T num) {
+  return AlignedNormal3<T>(detail::lanesScale(n.lanes(), num));
+}
+
+template <typename T>
+AlignedNormal3<T> operator*(T num, const AlignedNormal3<T>& n) {
+  return n * num;
+}
+
+template <typename T>
+AlignedNormal3<T> operator/(const AlignedNormal3<T>& n1,
+                            const AlignedNormal3<T>& n2) {
+  return AlignedNormal3<T>(detail::lanesDiv(n1.lanes(), n2.lanes()));
+}
+
+template <typename T>
+AlignedNormal3<T> operator/(const AlignedNormal3<T>& n, T num) {
+  return n * (T{1} / (num + static_cast<T>(1.E-30)));
+}
+
+template <typename T>
+T dot(const AlignedVec3<T>& v1, const AlignedVec3<T>& v2) {
+  return detail::lanesDot(v1.lanes(), v2.lanes());
+}
+
+template <typename T>
+T dot(const AlignedNormal3<T>& n1, const AlignedNormal3<T>& n2) {
+  return detail::lanesDot(n1.lanes(), n2.lanes());
+}
+
+template <typename T>
+T dot(const AlignedNormal3<T>& n, const AlignedVec3<T>& v) {
+  return detail::lanesDot(n.lanes(), v.lanes());
+}
+
+template <typename T>
+T dot(const AlignedVec3<T>& v, const AlignedNormal3<T>& n) {
+  return dot(n, v);
+}
+
+template <typename T>
+AlignedVec3<T> cross(const AlignedVec3<T>& v1, const AlignedVec3<T>& v2) {
+  T x = v1.y() * v2.z() - v1.z() * v2.y();
+  T y = v1.z() * v2.x() - v1.x() * v2.z();
+  T z = v1.x() * v2.y() - v1.y() * v2.x();
+  return AlignedVec3<T>(x, y, z);
+}
+
+template <typename T>
+AlignedVec3<T> getUnitVectorOf(const AlignedVec3<T>& v) {
+  AlignedVec3<T> u = v;
+  u.normalize();
+  return u;
+}
+
+template <typename T>
+AlignedNormal3<T> getUnitVectorOf(const AlignedNormal3<T>& n) {
+  AlignedNormal3<T> u = n;
+  u.normalize();
+  return u;
+}
+
+template <typename T>
+AlignedVec3<T> reflect(const AlignedVec3<T>& in, const AlignedNormal3<T>& n) {
+  AlignedVec3<T> normal(n.lanes());
+  return in - normal * (T{2} * dot(in, normal));
+}
+
+//--------------------------------------------
+// Bulk conversions between the packed 12-byte and the aligned 16-byte
+// layouts.
+//--------------------------------------------
+
+namespace detail {
+
+template <class Out, class In>
+std::vector<Out> convertAll(const std::vector<In>& in) {
+  std::vector<Out> out;
+  out.reserve(in.size());
+  for (const In& v : in) out.emplace_back(v);
+  return out;
+}
+
+}  // namespace detail
+
+template <class T>
+std::vector<AlignedVec3<T>> toAligned(const std::vector<Vec3<T>>& v) {
+  return detail::convertAll<AlignedVec3<T>>(v);
+}
+
+template <class T>
+std::vector<AlignedPoint3<T>> toAligned(const std::vector<Point3<T>>& p) {
+  return detail::convertAll<AlignedPoint3<T>>(p);
+}
+
+template <class T>
+std::vector<AlignedNormal3<T>> toAligned(const std::vector<Normal3<T>>& n) {
+  return detail::convertAll<AlignedNormal3<T>>(n);
+}
+
+template <class T>
+std::vector<Vec3<T>> toPacked(const std::vector<AlignedVec3<T>>& v) {
+  return detail::convertAll<Vec3<T>>(v);
+}
+
+template <class T>
+std::vector<Point3<T>> toPacked(const std::vector<AlignedPoint3<T>>& p) {
+  return detail::convertAll<Point3<T>>(p);
+}
+
+template <class T>
+std::vector<Normal3<T>> toPacked(const std::vector<AlignedNormal3<T>>& n) {
+  return detail::convertAll<Normal3<T>>(n);
+}
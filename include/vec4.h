@@ -1,17 +1,8 @@
 #pragma once
 
 #include <cassert>
-#include <iostream>
-#include <random>
 
-template <typename T>
-class Vec3;
-
-template <typename T>
-class Point3;
-
-template <typename T>
-class Normal3;
+#include "tools/fwd.h"
 
 template <class T>
 class Vec4 {
@@ -109,24 +100,6 @@ void Vec4<T>::normalize() {
   *this = (*this) / (this->length() + (T)1.E-30);
 }
 
-//--------------------------------------------
-// Overloaded I/O operators (input, output)
-//--------------------------------------------
-
-template <typename T>
-std::istream& operator>>(std::istream& in, Vec4<T>& v) {
-  T x, y, z, w;
-  in >> x >> y >> z >> w;
-  v.set(x, y, z, w);
-  return in;
-}
-
-template <typename T>
-std::ostream& operator<<(std::ostream& out, const Vec4<T>& v) {
-  out << "(" << v.x() << "," << v.y() << "," << v.z() << "," << v.w() << ")";
-  return out;
-}
-
 template <typename T>
 Vec4<T> operator+(const Vec4<T>& v1, const Vec4<T>& v2) {
   return Vec4<T>(v1.x() + v2.x(), v1.y() + v2.y(), v1.z() + v2.z(),
@@ -0,0 +1,396 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cmath>
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+#include "application/error.h"
+#include "tools/bounds3.h"
+#include "tools/camera.h"
+#include "tools/constants.h"
+#include "tools/hitrecord.h"
+#include "tools/light.h"
+#include "tools/morton.h"
+#include "tools/orthonormal.h"
+#include "tools/parallel.h"
+#include "tools/perfcounters.h"
+#include "tools/profiling.h"
+#include "tools/ray.h"
+#include "tools/raybatch.h"
+#include "tools/reductions.h"
+#include "tools/renderer.h"
+#include "tools/shadow.h"
+#include "tools/vec3.h"
+
+//--------------------------------------------
+// Queue of rays in SoA layout, each carrying the sample it belongs to and
+// the path weight (throughput) it transports. Slots are claimed with one
+// atomic fetch_add, so any number of threads append at once without locks;
+// a claimed slot is written only by its claimer, and everything appended
+// during a stage is visible to the next stage once parallelFor has joined.
+//--------------------------------------------
+
+class RayQueue {
+ public:
+  RayQueue() = default;
+  explicit RayQueue(std::size_t capacity) { reset(capacity); }
+
+  // Empties the queue and makes room for capacity rays. Not thread-safe.
+  void reset(std::size_t capacity) {
+    resizeArrays(capacity);
+    m_capacity = capacity;
+    m_size.store(0, std::memory_order_relaxed);
+  }
+
+  std::size_t capacity() const { return m_capacity; }
+  std::size_t size() const { return m_size.load(std::memory_order_relaxed); }
+  bool empty() const { return size() == 0; }
+
+  // Claims count consecutive slots and returns the first.
+  std::size_t allocate(std::size_t count) {
+    std::size_t first = m_size.fetch_add(count, std::memory_order_relaxed);
+    APP_ASSERT(first + count <= m_capacity, "Ray queue overflow!");
+    return first;
+  }
+
+  void set(std::size_t i, const Ray& ray, std::uint32_t sample,
+           const Vec3D& weight) {
+    m_ox[i] = ray.origin().x();
+    m_oy[i] = ray.origin().y();
+    m_oz[i] = ray.origin().z();
+    m_dx[i] = ray.direction().x();
+    m_dy[i] = ray.direction().y();
+    m_dz[i] = ray.direction().z();
+    m_tmax[i] = ray.getMaxRange();
+    m_wr[i] = weight.x();
+    m_wg[i] = weight.y();
+    m_wb[i] = weight.z();
+    m_sample[i] = sample;
+  }
+
+  void push(const Ray& ray, std::uint32_t sample, const Vec3D& weight) {
+    set(allocate(1), ray, sample, weight);
+  }
+
+  Ray ray(std::size_t i) const {
+    Ray ret(Point3D(m_ox[i], m_oy[i], m_oz[i]),
+            Vec3D(m_dx[i], m_dy[i], m_dz[i]));
+    ret.setMaxRange(m_tmax[i]);
+    return ret;
+  }
+  std::uint32_t sample(std::size_t i) const { return m_sample[i]; }
+  Vec3D weight(std::size_t i) const {
+    return Vec3D(m_wr[i], m_wg[i], m_wb[i]);
+  }
+
+  const float* ox() const { return m_ox.data(); }
+  const float* oy() const { return m_oy.data(); }
+  const float* oz() const { return m_oz.data(); }
+  const float* dx() const { return m_dx.data(); }
+  const float* dy() const { return m_dy.data(); }
+  const float* dz() const { return m_dz.data(); }
+
+  // Reorders the queued rays by direction octant, then by the Morton code
+  // of their origins over the origins' box (top 27 bits), so rays leaving
+  // the same region in similar directions are traced together. Not
+  // thread-safe.
+  void sortForCoherence();
+
+ private:
+  void resizeArrays(std::size_t n) {
+    for (std::vector<float>* a : {&m_ox, &m_oy, &m_oz, &m_dx, &m_dy, &m_dz,
+                                  &m_tmax, &m_wr, &m_wg, &m_wb, &m_scratch}) {
+      a->resize(n);
+    }
+    m_sample.resize(n);
+    m_sampleScratch.resize(n);
+  }
+
+  // Permutes the first order.size() entries of data into scratch, then
+  // swaps the two. Both stay at capacity, so sorting allocates no arrays;
+  // the tail past the queued rays is left stale.
+  template <class T>
+  static void gather(const std::vector<std::uint32_t>& order,
+                     std::vector<T>& data, std::vector<T>& scratch) {
+    parallelFor(order.size(), detail::kMortonGrain,
+                [&](std::size_t b, std::size_t e) {
+                  for (std::size_t i = b; i < e; ++i) {
+                    scratch[i] = data[order[i]];
+                  }
+                });
+    data.swap(scratch);
+  }
+
+  std::vector<float> m_ox, m_oy, m_oz;
+  std::vector<float> m_dx, m_dy, m_dz;
+  std::vector<float> m_tmax;
+  std::vector<float> m_wr, m_wg, m_wb;
+  std::vector<std::uint32_t> m_sample;
+  // Permutation targets for sortForCoherence, one per element type.
+  std::vector<float> m_scratch;
+  std::vector<std::uint32_t> m_sampleScratch;
+  std::size_t m_capacity = 0;
+  std::atomic<std::size_t> m_size{0};
+};
+
+inline void RayQueue::sortForCoherence() {
+  const std::size_t n = size();
+  TOOLS_PERF_REGION("ray_sort", n);
+  TOOLS_PROFILE_SCOPE("ray_sort");
+  if (n < 2) return;
+  Bounds3D origins =
+      detail::parallelBounds<float>(n, [&](std::size_t i, float (&x)[3]) {
+        x[0] = m_ox[i];
+        x[1] = m_oy[i];
+        x[2] = m_oz[i];
+      });
+  std::vector<std::uint32_t> keys(n);
+  computeSpatialKeys(m_ox.data(), m_oy.data(), m_oz.data(), n, origins,
+                     SpaceFillingCurve::Morton, keys.data());
+  parallelFor(n, detail::kMortonGrain, [&](std::size_t b, std::size_t e) {
+    for (std::size_t i = b; i < e; ++i) {
+      std::uint32_t octant = (m_dx[i] < 0.f ? 1u : 0u) |
+                             (m_dy[i] < 0.f ? 2u : 0u) |
+                             (m_dz[i] < 0.f ? 4u : 0u);
+      keys[i] = (octant << 27) | (keys[i] >> 3);
+    }
+  });
+  std::vector<std::uint32_t> order = radixSortOrder(keys, 30);
+  for (std::vector<float>* a : {&m_ox, &m_oy, &m_oz, &m_dx, &m_dy, &m_dz,
+                                &m_tmax, &m_wr, &m_wg, &m_wb}) {
+    gather(order, *a, m_scratch);
+  }
+  gather(order, m_sample, m_sampleScratch);
+}
+
+//--------------------------------------------
+// Wavefront path tracing. Instead of following one path at a time, every
+// stage runs over a whole queue before the next starts:
+//   generate  camera rays for every sample of the image,
+//   extend    closest hit of each queued ray (intersect(ray, scene, rec)),
+//   shade     direct light through one shadow ray per hit, plus a cosine-
+//             sampled bounce ray into the next path queue,
+//   shadow    any-hit test of the shadow rays (occluded(ray, scene)),
+// and the path queue is sorted for coherence before each bounce is traced.
+// Every surface is Lambertian and lit by one point light. Random numbers
+// are hashes of (seed, sample, bounce), so the image does not depend on
+// the thread count or on the order of the queues.
+//
+// Scene is anything with those intersect/occluded overloads: SphereSoA,
+// PlaneSoA and InstanceBVH.
+//--------------------------------------------
+
+struct ShadeParams {
+  Vec3D albedo = Vec3D(0.7f, 0.7f, 0.7f);  // Of every surface.
+  Vec3D background = Vec3D(0.f, 0.f, 0.f);  // Radiance of escaping rays.
+  std::uint32_t seed = 0;
+};
+
+struct WavefrontSettings {
+  CameraSampling sampling;
+  ShadeParams shading;
+  int maxBounces = 2;    // Indirect bounces after the primary hit.
+  bool sortRays = true;  // Sort bounce and shadow queues before tracing.
+};
+
+namespace detail {
+
+inline constexpr std::size_t kWavefrontGrain = 256;
+
+struct QueuedRay {
+  Ray ray;
+  std::uint32_t sample;
+  Vec3D weight;
+};
+
+// Appends a thread's staged rays with a single slot claim.
+inline void appendStaged(RayQueue& queue, const std::vector<QueuedRay>& rays) {
+  if (rays.empty()) return;
+  std::size_t first = queue.allocate(rays.size());
+  for (std::size_t k = 0; k < rays.size(); ++k) {
+    queue.set(first + k, rays[k].ray, rays[k].sample, rays[k].weight);
+  }
+}
+
+}  // namespace detail
+
+// Appends the camera rays of every sample, tiles in parallel; sample
+// (y * width + x) * samplesPerPixel + s starts with weight one. out needs
+// room for all of them.
+inline void generateRays(const Camera& camera, const CameraSampling& sampling,
+                         RayQueue& out) {
+  const std::uint32_t spp =
+      static_cast<std::uint32_t>(std::max(sampling.samplesPerPixel, 1));
+  const std::vector<Tile> tiles =
+      makeTiles(camera.width(), camera.height(), 32, TileOrder::Hilbert);
+  TOOLS_PROFILE_SCOPE("wavefront_generate");
+  parallelFor(tiles.size(), 1, [&](std::size_t b, std::size_t e) {
+    thread_local RayBatch rays;
+    for (std::size_t t = b; t < e; ++t) {
+      const Tile& tile = tiles[t];
+      camera.generateTile(tile, rays, sampling);
+      std::size_t first = out.allocate(rays.size());
+      for (std::size_t i = 0; i < rays.size(); ++i) {
+        std::uint32_t p = static_cast<std::uint32_t>(i / spp);
+        std::uint32_t x = tile.x0 + p % tile.width();
+        std::uint32_t y = tile.y0 + p / tile.width();
+        std::uint32_t pixel = y * camera.width() + x;
+        out.set(first + i, rays.ray(i), pixel * spp + i % spp,
+                Vec3D(1.f, 1.f, 1.f));
+      }
+    }
+  });
+}
+
+// Closest hit of every queued ray; hits[i] belongs to ray i.
+template <typename Scene>
+void extendRays(const Scene& scene, const RayQueue& rays,
+                std::vector<HitRecord>& hits) {
+  const std::size_t n = rays.size();
+  TOOLS_PERF_REGION("wavefront_extend", n);
+  TOOLS_PROFILE_SCOPE("wavefront_extend");
+  hits.assign(n, HitRecord());
+  parallelFor(n, detail::kWavefrontGrain, [&](std::size_t b, std::size_t e) {
+    for (std::size_t i = b; i < e; ++i) intersect(rays.ray(i), scene, hits[i]);
+  });
+}
+
+// Adds the background to radiance[sample] for misses. Hits queue a shadow
+// ray weighted by their unshadowed direct light and, if spawn is set, a
+// bounce ray into next.
+inline void shadeHits(const RayQueue& rays, const std::vector<HitRecord>& hits,
+                      const PointLight& light, const ShadeParams& params,
+                      int bounce, bool spawn, RayQueue& next,
+                      RayQueue& shadow, Vec3D* radiance) {
+  const std::size_t n = rays.size();
+  TOOLS_PERF_REGION("wavefront_shade", n);
+  TOOLS_PROFILE_SCOPE("wavefront_shade");
+  const Vec3D brdf = params.albedo * (1.f / PI);
+  const std::uint32_t stream =
+      params.seed + 0x9E3779B9u * static_cast<std::uint32_t>(bounce + 1);
+  parallelFor(n, detail::kWavefrontGrain, [&](std::size_t b, std::size_t e) {
+    thread_local std::vector<detail::QueuedRay> bounced, shadowed;
+    bounced.clear();
+    shadowed.clear();
+    for (std::size_t i = b; i < e; ++i) {
+      const std::uint32_t s = rays.sample(i);
+      const Vec3D weight = rays.weight(i);
+      const HitRecord& hit = hits[i];
+      if (!hit.hit()) {
+        radiance[s] = radiance[s] + weight * params.background;
+        continue;
+      }
+      Ray ray = rays.ray(i);
+      Point3D p = hit.position(ray);
+      Vec3D normal(hit.normal.x(), hit.normal.y(), hit.normal.z());
+      if (dot(normal, ray.direction()) > 0.f) normal = -normal;
+
+      Ray toLight = shadowRay(p, light);
+      float cosLight = dot(normal, toLight.direction());
+      if (cosLight > 0.f) {
+        float dist = toLight.getMaxRange() / kShadowRangeScale;
+        Vec3D direct = weight * brdf * light.intensity() *
+                       (cosLight / std::max(dist * dist, 1.E-12f));
+        shadowed.push_back({toLight, s, direct});
+      }
+
+      if (spawn) {
+        std::uint32_t h = detail::pcgHash(detail::pcgHash(s) ^ stream);
+        float u1 = detail::hashToUnitFloat(h);
+        float u2 = detail::hashToUnitFloat(detail::pcgHash(h));
+        float r = std::sqrt(u1), phi = 2.f * PI * u2;
+        OrthoNormalBasis onb;
+        onb.buildFromW(normal);
+        Vec3D d = onb.local(r * std::cos(phi), r * std::sin(phi),
+                            std::sqrt(std::max(1.f - u1, 0.f)));
+        // Cosine sampling cancels the cosine and 1 / PI of the BRDF.
+        bounced.push_back({Ray(p, getUnitVectorOf(d)), s,
+                           weight * params.albedo});
+      }
+    }
+    detail::appendStaged(shadow, shadowed);
+    detail::appendStaged(next, bounced);
+  });
+}
+
+// Adds the weight of every unblocked shadow ray to radiance[sample].
+template <typename Scene>
+void traceShadowRays(const Scene& scene, const RayQueue& rays,
+                     Vec3D* radiance) {
+  const std::size_t n = rays.size();
+  TOOLS_PERF_REGION("wavefront_shadow", n);
+  TOOLS_PROFILE_SCOPE("wavefront_shadow");
+  parallelFor(n, detail::kWavefrontGrain, [&](std::size_t b, std::size_t e) {
+    for (std::size_t i = b; i < e; ++i) {
+      if (occluded(rays.ray(i), scene)) continue;
+      std::uint32_t s = rays.sample(i);
+      radiance[s] = radiance[s] + rays.weight(i);
+    }
+  });
+}
+
+//--------------------------------------------
+// Renders the whole image through the stages above and hands the per-pixel
+// average to sink(const Tile&, const Vec3D* pixels) once, as a single tile
+// covering the image, so the render() sinks work here too. Every sample
+// has at most one ray per queue, so the queues are sized to the sample
+// count and stages write radiance[sample] without races.
+//--------------------------------------------
+
+template <typename Scene, typename Sink>
+RenderStats renderWavefront(const Camera& camera, const Scene& scene,
+                            const PointLight& light,
+                            const WavefrontSettings& settings, Sink&& sink) {
+  const std::size_t spp =
+      static_cast<std::size_t>(std::max(settings.sampling.samplesPerPixel, 1));
+  const std::size_t pixels =
+      static_cast<std::size_t>(camera.width()) * camera.height();
+  const std::size_t samples = pixels * spp;
+  TOOLS_PERF_REGION("render_wavefront", samples);
+  TOOLS_PROFILE_SCOPE("render_wavefront");
+  auto start = std::chrono::steady_clock::now();
+
+  std::vector<Vec3D> radiance(samples, Vec3D(0.f, 0.f, 0.f));
+  RayQueue queues[2];
+  RayQueue shadow;
+  std::vector<HitRecord> hits;
+  queues[0].reset(samples);
+  generateRays(camera, settings.sampling, queues[0]);
+  std::uint64_t rays = 0;
+  for (int bounce = 0, cur = 0; !queues[cur].empty(); ++bounce, cur ^= 1) {
+    RayQueue& paths = queues[cur];
+    RayQueue& next = queues[cur ^ 1];
+    if (settings.sortRays && bounce > 0) paths.sortForCoherence();
+    extendRays(scene, paths, hits);
+    next.reset(samples);
+    shadow.reset(samples);
+    shadeHits(paths, hits, light, settings.shading, bounce,
+              bounce < settings.maxBounces, next, shadow, radiance.data());
+    if (settings.sortRays) shadow.sortForCoherence();
+    traceShadowRays(scene, shadow, radiance.data());
+    rays += paths.size() + shadow.size();
+  }
+
+  std::vector<Vec3D> average(pixels);
+  const float weight = 1.f / spp;
+  parallelFor(pixels, 4096, [&](std::size_t b, std::size_t e) {
+    for (std::size_t p = b; p < e; ++p) {
+      Vec3D sum(0.f, 0.f, 0.f);
+      for (std::size_t s = 0; s < spp; ++s) sum = sum + radiance[p * spp + s];
+      average[p] = sum * weight;
+    }
+  });
+  sink(Tile{0, 0, camera.width(), camera.height()}, average.data());
+  std::chrono::duration<double> dt = std::chrono::steady_clock::now() - start;
+
+  RenderStats stats;
+  stats.tiles = 1;
+  stats.samples = samples;
+  stats.rays = rays;
+  stats.seconds = dt.count();
+  return stats;
+}
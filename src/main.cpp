@@ -1,31 +1,262 @@
+#include <chrono>
+#include <fstream>
 #include <iostream>
+#include <random>
+#include <vector>
 
 #include "../include/tools.h"
 
 using namespace std;
 
+template <typename F>
+double timeIt(F&& f) {
+  auto start = chrono::steady_clock::now();
+  f();
+  chrono::duration<double> dt = chrono::steady_clock::now() - start;
+  return dt.count();
+}
+
 int main() {
-  Vec2d v(1.5, 2.5);
-  cout << v << endl;
-  cout << v.normalize() << endl;
+  mt19937 rng(1234);
+  uniform_real_distribution<float> pos(-100.f, 100.f);
+  uniform_real_distribution<float> unit(0.f, 1.f);
+
+  vector<PointLight> lights;
+  for (int i = 0; i < 100000; ++i) {
+    lights.push_back(PointLight(Point3D(pos(rng), pos(rng), pos(rng)),
+                                Vec3D(unit(rng), unit(rng), unit(rng))));
+  }
+  LightAliasTable table;
+  LightBVH bvh;
+  cout << "light alias build: " << timeIt([&] { table.build(lights); })
+       << " s" << endl;
+  cout << "light bvh build:   " << timeIt([&] { bvh.build(lights); }) << " s"
+       << endl;
+
+  SphereSoA spheres;
+  BoundsSoA boxes;
+  for (int i = 0; i < 200000; ++i) {
+    Point3D c(pos(rng), pos(rng), pos(rng));
+    float r = 0.5f + unit(rng);
+    spheres.add(c, r);
+    boxes.add(Bounds3D(c - Vec3D(r, r, r), c + Vec3D(r, r, r)));
+  }
+  Frustum frustum(perspective(PI / 3.f, 16.f / 9.f, 0.1f, 150.f) *
+                  view_transform(Point3D(0, 0, 0), Point3D(0, 0, -1),
+                                 Vec3D(0, 1, 0)));
+  vector<Visibility> mask;
+  cout << "cull spheres:      "
+       << timeIt([&] { cull(frustum, spheres, mask); }) << " s" << endl;
+  cout << "cull boxes:        " << timeIt([&] { cull(frustum, boxes, mask); })
+       << " s" << endl;
+
+  RayBatch rays;
+  for (int i = 0; i < 4096; ++i) {
+    Vec3D d(pos(rng), pos(rng), pos(rng));
+    rays.add(Ray(Point3D(0, 0, 0), getUnitVectorOf(d)));
+  }
+  SphereSoA few;
+  for (int i = 0; i < 256; ++i) few.add(spheres.center(i), spheres.radius(i));
+  HitBatch hits(rays);
+  cout << "packet vs spheres: "
+       << timeIt([&] { intersect(rays, hits, few); }) << " s" << endl;
+
+  vector<Bounds3D> sphereBoxes = primitiveBounds(spheres);
+  LBVH sphereBvh;
+  cout << "lbvh build 200k:   "
+       << timeIt([&] { sphereBvh.build(sphereBoxes); }) << " s" << endl;
+  HitBatch bvhHits(rays);
+  cout << "packet vs lbvh:    "
+       << timeIt([&] { intersect(rays, bvhHits, sphereBvh, spheres); })
+       << " s" << endl;
+
+  // Shadow rays from scattered points to one light: closest-hit against
+  // any-hit queries, one ray at a time on this thread and then as a
+  // direction-sorted batch over all threads.
+  vector<Point3D> shadePoints(1 << 16);
+  for (Point3D& p : shadePoints) p = Point3D(pos(rng), pos(rng), pos(rng));
+  PointLight sun(Point3D(0, 150, 0), Vec3D(1, 1, 1));
+  vector<uint8_t> lit(shadePoints.size());
+  auto closestBlocks = [&](const Ray& ray) {
+    return intersect(ray, sphereBvh, spheres).hit();
+  };
+  auto anyBlocks = [&](const Ray& ray) {
+    return occluded(ray, sphereBvh, spheres);
+  };
+  cout << "shadow closest:    " << timeIt([&] {
+    for (size_t i = 0; i < shadePoints.size(); ++i) {
+      lit[i] = !closestBlocks(shadowRay(shadePoints[i], sun));
+    }
+  }) << " s" << endl;
+  cout << "shadow any-hit:    " << timeIt([&] {
+    for (size_t i = 0; i < shadePoints.size(); ++i) {
+      lit[i] = !anyBlocks(shadowRay(shadePoints[i], sun));
+    }
+  }) << " s" << endl;
+  cout << "batch closest:     " << timeIt([&] {
+    lightVisibility(shadePoints, sun, lit, closestBlocks);
+  }) << " s" << endl;
+  cout << "batch any-hit:     " << timeIt([&] {
+    lightVisibility(shadePoints, sun, lit, anyBlocks);
+  }) << " s" << endl;
+
+  // 4096 copies of one 10k-sphere object: the bottom level is built once,
+  // and moving every instance costs a top-level refit.
+  SphereSoA object;
+  for (int i = 0; i < 10000; ++i) {
+    object.add(Point3D(pos(rng), pos(rng), pos(rng)) * 0.05f, 0.1f);
+  }
+  InstanceBVH scene;
+  scene.addGeometry(SphereGeometry(object));
+  for (int i = 0; i < 4096; ++i) {
+    scene.addInstance(translation(12.f * (i % 64) - 384.f,
+                                  12.f * (i / 64) - 384.f, -50.f),
+                      0);
+  }
+  cout << "tlas build 4096:   " << timeIt([&] { scene.build(); }) << " s"
+       << endl;
+  cout << "move instances:   " << timeIt([&] {
+    for (size_t i = 0; i < scene.instanceCount(); ++i) {
+      scene.setTransform(i, translation(0.f, 0.f, 0.1f) *
+                                scene.instance(i).objectToWorld());
+    }
+  }) << " s" << endl;
+  cout << "tlas refit 4096:   " << timeIt([&] { scene.refit(); }) << " s"
+       << endl;
+  size_t instanceHits = 0;
+  cout << "rays vs instances: " << timeIt([&] {
+    for (size_t i = 0; i < rays.size(); ++i) {
+      HitRecord rec;
+      instanceHits += intersect(rays.ray(i), scene, rec);
+    }
+  }) << " s (" << instanceHits << " hits)" << endl;
 
-  Vec3d x_unit(1.5, 0., 0.);
-  Vec3d y_unit(0., 1.5, 0.);
-  Vec3d z_unit = cross(x_unit, y_unit);
-  cout << z_unit << endl;
+  // Wavefront path tracing of the instanced scene, with and without the
+  // coherence sort of the bounce and shadow queues.
+  Camera wavefrontCamera(Point3D(0, -200, 150), Point3D(0, 0, -50),
+                         Vec3D(0, 0, 1), 1.f, 320, 240);
+  PointLight overhead(Point3D(0, 0, 300), Vec3D(9e4f, 9e4f, 9e4f));
+  for (bool sorted : {false, true}) {
+    WavefrontSettings settings;
+    settings.sortRays = sorted;
+    auto discard = [](const Tile&, const Vec3D*) {};
+    RenderStats stats =
+        renderWavefront(wavefrontCamera, scene, overhead, settings, discard);
+    cout << "wavefront " << (sorted ? "sorted:  " : "unsorted:") << stats
+         << endl;
+  }
 
-  Vec4d v4(1.4, 5.3, 56., 0.);
-  cout << v4 << endl;
+  // Same kernel over 12-byte and 16-byte vectors: a cache-resident set run
+  // many times, and a large streamed set where the extra third of bytes per
+  // element eats into the gain of aligned loads.
+  auto vecKernel = [](const auto& in, auto& out, float s) {
+    for (size_t i = 0; i < in.size(); ++i) {
+      out[i] = getUnitVectorOf(in[i] * s + out[i]);
+    }
+  };
+  for (size_t n : {size_t(4096), size_t(1) << 22}) {
+    vector<Vec3D> packed(n), packedOut(n);
+    for (Vec3D& v : packed) v = Vec3D(pos(rng), pos(rng), pos(rng));
+    vector<Vec3A> aligned = toAligned(packed), alignedOut(n);
+    const int passes = static_cast<int>((size_t(1) << 24) / n);
+    double tp = timeIt([&] {
+      for (int p = 0; p < passes; ++p) vecKernel(packed, packedOut, 0.5f);
+    });
+    double ta = timeIt([&] {
+      for (int p = 0; p < passes; ++p) vecKernel(aligned, alignedOut, 0.5f);
+    });
+    cout << "vec3 " << (n == 4096 ? "hot   " : "stream") << " packed: " << tp
+         << " s, aligned: " << ta << " s" << endl;
+  }
 
-  Vec2d v2[2];
-  v2[0].setXY(2.);
-  v2[1].setXY(3.);
-  cout << v2[0][0] << endl;
-  cout << v2[1][1] << endl;
+  cout << "cpu dispatch:      ";
+  reportIsa(cout) << endl;
+  MatSoA<float, 4> mats, inverses(1 << 20);
+  for (int i = 0; i < (1 << 20); ++i) {
+    Mat4D m;
+    for (int r = 0; r < 4; ++r) m[r][r] = 1.f + unit(rng);
+    m[0][3] = pos(rng);
+    mats.add(m);
+  }
+  for (Isa isa : {Isa::Baseline, Isa::Avx2, Isa::Avx512}) {
+    if (isa > detectIsa()) continue;
+    ScopedIsa scope(isa);
+    cout << "inverse 4x4 1M " << isaName(isa) << ": "
+         << timeIt([&] { batchInverse(mats, inverses); }) << " s" << endl;
+  }
 
-  Mat2<double> m(v2[0], v2[1]);
-  cout << m[0][0] << endl;
+  MatXD a(512, 512, 1.f), b(512, 512, 0.5f), c(512, 512);
+  MatXD big(4096, 4096, 0.25f);
+  VecXD x(4096), y(4096);
+  for (Isa isa : {Isa::Baseline, Isa::Avx2, Isa::Avx512}) {
+    if (isa > detectIsa()) continue;
+    ScopedIsa scope(isa);
+    cout << "gemm 512 " << isaName(isa) << ": "
+         << timeIt([&] { gemm(1.f, a, b, 0.f, c); }) << " s, gemv 4096: "
+         << timeIt([&] { gemv(1.f, big, x, 0.f, y); }) << " s" << endl;
+  }
 
+  // Headless end-to-end frame: primary rays, Lambert shading and one shadow
+  // ray per hit against the 256 spheres.
+  Camera camera(Point3D(0, 0, 250), Point3D(0, 0, 0), Vec3D(0, 1, 0),
+                PI / 3.f, 640, 360);
+  PointLight light(Point3D(0, 200, 200), Vec3D(1, 1, 1));
+  RenderSettings settings;
+  settings.sampling.samplesPerPixel = 4;
+  settings.sampling.jitter = true;
+  auto integrator = [&](const Tile&, const RayBatch& primary, Vec3D* out) {
+    HitBatch hits(primary);
+    intersect(primary, hits, few);
+    RayBatch shadow;
+    vector<size_t> source;
+    for (size_t i = 0; i < primary.size(); ++i) {
+      if (!hits.hit(i)) continue;
+      Point3D p = primary.ray(i).position(hits.t()[i]);
+      Vec3D n = getUnitVectorOf(p - few.center(hits.index()[i]));
+      Vec3D toLight = light.position() - p;
+      float dist = toLight.length();
+      float cosine = dot(n, toLight) / dist;
+      if (cosine <= 0.f) continue;
+      Ray ray(p, toLight / dist);
+      ray.setMaxRange(dist);
+      shadow.add(ray);
+      source.push_back(i);
+      out[i] = light.intensity() * cosine;
+    }
+    HitBatch blocked(shadow);
+    intersect(shadow, blocked, few);
+    for (size_t j = 0; j < shadow.size(); ++j) {
+      if (blocked.hit(j)) out[source[j]] = Vec3D(0, 0, 0);
+    }
+    return static_cast<uint64_t>(primary.size() + shadow.size());
+  };
+  // Tiles are tone mapped and streamed to the image as they finish.
+  Framebuffer framebuffer(camera.width(), camera.height());
+  ofstream image("tools-bench.ppm", ios::binary);
+  ImageStreamWriter writer(image, ImageFormat::Ppm, camera.width(),
+                           camera.height());
+  RenderStats stats = render(camera, settings, integrator,
+                             [&](const Tile& tile, const Vec3D* pixels) {
+                               framebuffer.setTile(tile, pixels);
+                               writer.writeTile(framebuffer, tile);
+                             });
+  cout << "render 640x360:    " << stats.seconds << " s" << endl;
+  cout << "  " << stats << endl;
+  vector<uint8_t> rgb;
+  cout << "tone map 640x360:  "
+       << timeIt([&] { framebuffer.encode(ToneMapParams(), rgb); }) << " s"
+       << endl;
 
+#if defined(TOOLS_ENABLE_PERF_COUNTERS)
+  perfReportFromEnv();
+#endif
+#if defined(TOOLS_ENABLE_PROFILING)
+  ProfileCounts ops = Profiler::instance().markFrame();
+  for (int i = 0; i < kNumProfileOps; ++i) {
+    cout << profileOpName(static_cast<ProfileOp>(i)) << ": " << ops[i] << endl;
+  }
+  ofstream trace("tools-bench-trace.json");
+  Profiler::instance().writeChromeTrace(trace);
+#endif
   return 0;
 }
@@ -1,3 +1,12 @@
+#include <algorithm>
+#include <array>
+#include <cstdint>
+#include <cstring>
+#include <mutex>
+#include <random>
+#include <sstream>
+#include <thread>
+
 #include "gtest/gtest.h"
 #include "tools.h"
 
@@ -1141,3 +1150,2567 @@ TEST_F(Point3Test, addsVectorToPoint) {
   ASSERT_EQ(p.y(), 4);
   ASSERT_EQ(p.z(), 1);
 }
+
+//--------------------------------------------
+//     LightSampler
+//--------------------------------------------
+
+class LightSamplerTest : public testing::Test {
+ public:
+  std::vector<PointLight> lights;
+
+  void SetUp() override {
+    lights.push_back(PointLight(Point3D(0, 0, 0), Vec3D(1, 1, 1)));
+    lights.push_back(PointLight(Point3D(10, 0, 0), Vec3D(3, 3, 3)));
+    lights.push_back(PointLight(Point3D(0, 10, 0), Vec3D(0, 0, 0)));
+    lights.push_back(PointLight(Point3D(-10, 5, 2), Vec3D(4, 4, 4)));
+  }
+};
+
+TEST_F(LightSamplerTest, AliasTablePdfIsProportionalToPower) {
+  LightAliasTable table(lights);
+  ASSERT_EQ(table.size(), 4u);
+  EXPECT_NEAR(table.pdf(0), 1.f / 8.f, EPS1);
+  EXPECT_NEAR(table.pdf(1), 3.f / 8.f, EPS1);
+  EXPECT_FLOAT_EQ(table.pdf(2), 0.f);
+  EXPECT_NEAR(table.pdf(3), 4.f / 8.f, EPS1);
+}
+
+TEST_F(LightSamplerTest, AliasTableSamplesMatchPdf) {
+  LightAliasTable table(lights);
+  const int n = 80000;
+  std::vector<int> counts(lights.size(), 0);
+  for (int i = 0; i < n; ++i) {
+    float pdf;
+    int index = table.sample((i + 0.5f) / n, &pdf);
+    ASSERT_GE(index, 0);
+    EXPECT_FLOAT_EQ(pdf, table.pdf(index));
+    counts[index]++;
+  }
+  EXPECT_EQ(counts[2], 0);
+  for (int i = 0; i < 4; ++i) {
+    EXPECT_NEAR(counts[i] / float(n), table.pdf(i), 1.E-3f);
+  }
+}
+
+TEST_F(LightSamplerTest, EmptySamplersReturnNoLight) {
+  LightAliasTable table;
+  LightBVH bvh(std::vector<PointLight>{});
+  float pdf = 1.f;
+  EXPECT_EQ(table.sample(0.5f, &pdf), -1);
+  EXPECT_FLOAT_EQ(pdf, 0.f);
+  EXPECT_EQ(bvh.sample(Point3D(0, 0, 0), 0.5f, &pdf), -1);
+  EXPECT_FLOAT_EQ(pdf, 0.f);
+}
+
+TEST_F(LightSamplerTest, LightBVHPdfSumsToOne) {
+  LightBVH bvh(lights);
+  Point3D p(1, 2, 3);
+  float sum = 0.f;
+  for (int i = 0; i < 4; ++i) sum += bvh.pdf(p, i);
+  EXPECT_NEAR(sum, 1.f, 1.E-5f);
+  EXPECT_FLOAT_EQ(bvh.pdf(p, 2), 0.f);
+}
+
+TEST_F(LightSamplerTest, LightBVHSamplePdfMatchesQuery) {
+  LightBVH bvh(lights);
+  Point3D p(9, 1, 0);
+  for (int i = 0; i < 64; ++i) {
+    float pdf;
+    int index = bvh.sample(p, (i + 0.5f) / 64, &pdf);
+    ASSERT_GE(index, 0);
+    EXPECT_NEAR(pdf, bvh.pdf(p, index), 1.E-5f);
+  }
+  // The light next to the shading point dominates.
+  EXPECT_GT(bvh.pdf(p, 1), bvh.pdf(p, 3));
+}
+
+TEST_F(LightSamplerTest, LightBVHHandlesManyLights) {
+  std::vector<PointLight> many;
+  for (int i = 0; i < 20000; ++i) {
+    many.push_back(PointLight(Point3D(i % 100, (i / 100) % 50, i / 5000),
+                              Vec3D(1, 1, 1)));
+  }
+  LightBVH bvh(many);
+  Point3D p(50, 25, 2);
+  float pdf;
+  int index = bvh.sample(p, 0.3f, &pdf);
+  ASSERT_GE(index, 0);
+  EXPECT_GT(pdf, 0.f);
+  EXPECT_NEAR(pdf, bvh.pdf(p, index), 1.E-5f * pdf + 1.E-9f);
+}
+
+//--------------------------------------------
+//     Primitives
+//--------------------------------------------
+
+class PrimitivesTest : public testing::Test {
+ public:
+  SphereSoA spheres;
+  PlaneSoA planes;
+
+  void SetUp() override {
+    for (int i = 0; i < 40; ++i) {
+      spheres.add(Point3D(float(i), 0.f, -5.f - i), 0.5f);
+    }
+    planes.add(Point3D(0, -1, 0), Normal3D(0, 1, 0));
+    planes.add(Point3D(0, 0, -100), Normal3D(0, 0, 1));
+  }
+};
+
+TEST_F(PrimitivesTest, RayHitsNearestSphere) {
+  Ray ray(Point3D(3, 0, 0), Vec3D(0, 0, -1));
+  NearestHit hit = intersect(ray, spheres);
+  ASSERT_TRUE(hit.hit());
+  EXPECT_EQ(hit.index, 3);
+  EXPECT_FLOAT_EQ(hit.t, 7.5f);
+
+  ray = Ray(Point3D(0, 5, 0), Vec3D(0, 0, -1));
+  EXPECT_FALSE(intersect(ray, spheres).hit());
+}
+
+TEST_F(PrimitivesTest, RayFromInsideSphereHitsFarSide) {
+  SphereSoA one;
+  one.add(Point3D(0, 0, 0), 1.f);
+  NearestHit hit = intersect(Ray(Point3D(0, 0, 0), Vec3D(0, 0, 1)), one);
+  ASSERT_TRUE(hit.hit());
+  EXPECT_FLOAT_EQ(hit.t, 1.f);
+}
+
+TEST_F(PrimitivesTest, RespectsRayMaxRange) {
+  Ray ray(Point3D(3, 0, 0), Vec3D(0, 0, -1));
+  ray.setMaxRange(7.f);
+  EXPECT_FALSE(intersect(ray, spheres).hit());
+  ray.setMaxRange(8.f);
+  EXPECT_TRUE(intersect(ray, spheres).hit());
+}
+
+TEST_F(PrimitivesTest, RayHitsNearestPlane) {
+  Ray ray(Point3D(0, 0, 0), Vec3D(0, -1, -1));
+  NearestHit hit = intersect(ray, planes);
+  ASSERT_TRUE(hit.hit());
+  EXPECT_EQ(hit.index, 0);
+  EXPECT_FLOAT_EQ(hit.t, 1.f);
+
+  ray = Ray(Point3D(0, 0, 0), Vec3D(1, 0, 0));
+  EXPECT_FALSE(intersect(ray, planes).hit());
+}
+
+TEST_F(PrimitivesTest, PacketMatchesSingleRayKernels) {
+  RayBatch rays;
+  for (int i = 0; i < 37; ++i) {
+    rays.add(Ray(Point3D(i * 0.5f, 0.2f * (i % 3), 0.f),
+                 Vec3D(0.01f * i, -0.02f * i, -1.f)));
+  }
+  HitBatch sphereHits(rays), planeHits(rays);
+  intersect(rays, sphereHits, spheres);
+  intersect(rays, planeHits, planes);
+  for (std::size_t i = 0; i < rays.size(); ++i) {
+    NearestHit s = intersect(rays.ray(i), spheres);
+    NearestHit p = intersect(rays.ray(i), planes);
+    EXPECT_EQ(sphereHits.index()[i], s.index);
+    EXPECT_EQ(planeHits.index()[i], p.index);
+    if (s.hit()) {
+      EXPECT_FLOAT_EQ(sphereHits.t()[i], s.t);
+    }
+    if (p.hit()) {
+      EXPECT_FLOAT_EQ(planeHits.t()[i], p.t);
+    }
+  }
+}
+
+//--------------------------------------------
+//     Frustum
+//--------------------------------------------
+
+class FrustumTest : public testing::Test {
+ public:
+  Frustum frustum;
+
+  void SetUp() override {
+    Mat4D proj = perspective(PI / 2.f, 1.f, 1.f, 100.f);
+    Mat4D view = view_transform(Point3D(0, 0, 5), Point3D(0, 0, 0),
+                                Vec3D(0, 1, 0));
+    frustum = Frustum(proj * view);
+  }
+};
+
+TEST_F(FrustumTest, ExtractsUnitPlanes) {
+  for (int i = 0; i < 6; ++i) {
+    EXPECT_NEAR(Vec3D(frustum.plane(i)).length(), 1.f, 1.E-5f);
+  }
+  // Near plane faces down the view direction, one unit in front of the eye.
+  Vec4D nearPlane = frustum.plane(4);
+  EXPECT_NEAR(nearPlane.z(), -1.f, 1.E-5f);
+  EXPECT_NEAR(nearPlane.w(), 4.f, 1.E-4f);
+}
+
+TEST_F(FrustumTest, ClassifiesSpheres) {
+  EXPECT_EQ(frustum.classify(Point3D(0, 0, 0), 1.f), Visibility::Inside);
+  EXPECT_EQ(frustum.classify(Point3D(0, 0, 10), 1.f), Visibility::Outside);
+  EXPECT_EQ(frustum.classify(Point3D(0, 0, 4), 0.5f),
+            Visibility::Intersecting);
+  EXPECT_EQ(frustum.classify(Point3D(50, 0, 0), 1.f), Visibility::Outside);
+  EXPECT_EQ(frustum.classify(Point3D(5, 0, 0), 1.f),
+            Visibility::Intersecting);
+}
+
+TEST_F(FrustumTest, ClassifiesBoxes) {
+  EXPECT_EQ(frustum.classify(Bounds3D(Point3D(-1, -1, -1), Point3D(1, 1, 1))),
+            Visibility::Inside);
+  EXPECT_EQ(frustum.classify(Bounds3D(Point3D(-1, -1, 6), Point3D(1, 1, 8))),
+            Visibility::Outside);
+  EXPECT_EQ(
+      frustum.classify(Bounds3D(Point3D(-1, -1, -200), Point3D(1, 1, -2))),
+      Visibility::Intersecting);
+}
+
+TEST_F(FrustumTest, CullsArraysIntoIndexLists) {
+  SphereSoA spheres;
+  BoundsSoA boxes;
+  for (int i = 0; i < 1000; ++i) {
+    Point3D c(float(i % 20 - 10) * 4.f, 0.f, -float(i / 20) * 4.f);
+    spheres.add(c, 1.5f);
+    boxes.add(Bounds3D(c + Vec3D(-1.5f, -1.5f, -1.5f),
+                       c + Vec3D(1.5f, 1.5f, 1.5f)));
+  }
+  std::vector<Visibility> mask;
+  cull(frustum, spheres, mask);
+  std::vector<int> inside, intersecting;
+  cullIndices(frustum, spheres, inside, intersecting);
+  ASSERT_EQ(mask.size(), 1000u);
+  ASSERT_FALSE(inside.empty());
+  ASSERT_FALSE(intersecting.empty());
+  for (int i : inside) EXPECT_EQ(mask[i], Visibility::Inside);
+  for (int i : intersecting) EXPECT_EQ(mask[i], Visibility::Intersecting);
+  for (std::size_t i = 0; i < mask.size(); ++i) {
+    EXPECT_EQ(mask[i], frustum.classify(spheres.center(i), 1.5f));
+  }
+
+  cull(frustum, boxes, mask);
+  for (std::size_t i = 0; i < mask.size(); ++i) {
+    EXPECT_EQ(mask[i], frustum.classify(boxes.bounds(i)));
+  }
+}
+
+//--------------------------------------------
+//     PerfCounters
+//--------------------------------------------
+
+#if defined(TOOLS_ENABLE_PERF_COUNTERS)
+
+class PerfReportEnvironment : public testing::Environment {
+ public:
+  void TearDown() override { perfReportFromEnv(); }
+};
+
+static testing::Environment* const perf_report_env =
+    testing::AddGlobalTestEnvironment(new PerfReportEnvironment);
+
+TEST(PerfCountersTest, RecordsRegions) {
+  for (int i = 0; i < 3; ++i) {
+    TOOLS_PERF_REGION("test_region", 10);
+  }
+  auto stats = PerfRegistry::instance().snapshot();
+  ASSERT_EQ(stats.count("test_region"), 1u);
+  EXPECT_EQ(stats["test_region"].calls, 3u);
+  EXPECT_EQ(stats["test_region"].elements, 30u);
+  EXPECT_GE(stats["test_region"].seconds, 0.);
+
+  std::stringstream json;
+  PerfRegistry::instance().reportJson(json);
+  EXPECT_NE(json.str().find("\"region\": \"test_region\""), std::string::npos);
+}
+
+// Work done by threads the region starts must be counted, not only the
+// caller's share: four threads doing a job each against the caller alone.
+TEST(PerfCountersTest, RegionsCountWorkerThreads) {
+  auto job = [] {
+    volatile double sink = 0.;
+    for (int i = 0; i < 4000000; ++i) sink = sink + std::sqrt(double(i));
+  };
+  {
+    TOOLS_PERF_REGION("caller_only", 1);
+    job();
+  }
+  {
+    TOOLS_PERF_REGION("four_workers", 4);
+    std::vector<std::thread> workers;
+    for (int t = 0; t < 4; ++t) workers.emplace_back(job);
+    for (std::thread& t : workers) t.join();
+  }
+  auto stats = PerfRegistry::instance().snapshot();
+  const PerfStats& one = stats["caller_only"];
+  const PerfStats& four = stats["four_workers"];
+  if (!one.counted[PerfTaskClock] && !one.counted[PerfInstructions]) {
+    GTEST_SKIP() << "perf_event_open is not permitted here";
+  }
+  if (one.counted[PerfInstructions]) {
+    EXPECT_GT(four.counters[PerfInstructions],
+              3 * one.counters[PerfInstructions]);
+  }
+  if (one.counted[PerfTaskClock]) {
+    EXPECT_GT(four.counters[PerfTaskClock], 2 * one.counters[PerfTaskClock]);
+  }
+}
+
+#else
+
+TEST(PerfCountersTest, CompiledOutRegionsDoNotEvaluateArguments) {
+  int evaluated = 0;
+  TOOLS_PERF_REGION("test_region", ++evaluated);
+  EXPECT_EQ(evaluated, 0);
+}
+
+#endif
+
+//--------------------------------------------
+//     Profiling
+//--------------------------------------------
+
+#if defined(TOOLS_ENABLE_PROFILING)
+
+TEST(ProfilingTest, CountsOperationsPerFrame) {
+  Profiler::instance().markFrame();
+  Vec3D v(3, 4, 0);
+  v.normalize();
+  getUnitVectorOf(Vec3D(1, 1, 1));
+  Mat4D m = translation(1.f, 2.f, 3.f);
+  m.inverse();
+  SphereSoA spheres;
+  spheres.add(Point3D(0, 0, -5), 1.f);
+  spheres.add(Point3D(0, 0, -9), 1.f);
+  intersect(Ray(Point3D(0, 0, 0), Vec3D(0, 0, -1)), spheres);
+
+  ProfileCounts frame = Profiler::instance().markFrame();
+  EXPECT_EQ(frame[static_cast<int>(ProfileOp::Normalize)], 2u);
+  EXPECT_EQ(frame[static_cast<int>(ProfileOp::Mat4Inverse)], 1u);
+  EXPECT_EQ(frame[static_cast<int>(ProfileOp::RayPrimitive)], 2u);
+}
+
+TEST(ProfilingTest, OcclusionCountsOnlyTestedBlocks) {
+  SphereSoA spheres;
+  for (int i = 0; i < 4 * static_cast<int>(detail::kHitBlock); ++i) {
+    spheres.add(Point3D(0, 0, -5.f - 3.f * i), 1.f);
+  }
+  Profiler::instance().markFrame();
+  // The blocker is in the first block, so the other three are skipped.
+  EXPECT_TRUE(occluded(Ray(Point3D(0, 0, 0), Vec3D(0, 0, -1)), spheres));
+  ProfileCounts frame = Profiler::instance().markFrame();
+  EXPECT_EQ(frame[static_cast<int>(ProfileOp::RayPrimitive)],
+            detail::kHitBlock);
+}
+
+TEST(ProfilingTest, CountsAcrossThreads) {
+  ProfileCounts before = Profiler::instance().counters();
+  std::vector<std::thread> threads;
+  for (int t = 0; t < 4; ++t) {
+    threads.emplace_back([]() {
+      for (int i = 0; i < 1000; ++i) TOOLS_COUNT_OP(ProfileOp::RayBox);
+    });
+  }
+  for (auto& t : threads) t.join();
+  ProfileCounts after = Profiler::instance().counters();
+  int op = static_cast<int>(ProfileOp::RayBox);
+  EXPECT_EQ(after[op] - before[op], 4000u);
+}
+
+TEST(ProfilingTest, ExportsChromeTrace) {
+  {
+    TOOLS_PROFILE_SCOPE("test_scope");
+  }
+  Profiler::instance().markFrame();
+  std::stringstream trace;
+  Profiler::instance().writeChromeTrace(trace);
+  EXPECT_NE(trace.str().find("\"name\":\"test_scope\",\"ph\":\"X\""),
+            std::string::npos);
+  EXPECT_NE(trace.str().find("\"ph\":\"C\""), std::string::npos);
+}
+
+#else
+
+TEST(ProfilingTest, CompiledOutMacrosDoNotEvaluateArguments) {
+  int evaluated = 0;
+  TOOLS_COUNT_OPS(ProfileOp::Normalize, ++evaluated);
+  TOOLS_PROFILE_SCOPE("test_scope");
+  EXPECT_EQ(evaluated, 0);
+}
+
+#endif
+
+//--------------------------------------------
+//     Particles
+//--------------------------------------------
+
+class ParticlesTest : public testing::Test {
+ public:
+  ParticleSystemD ps;
+  StepParams<float> params;
+
+  void SetUp() override {
+    ps.add(Point3D(0, 10, 0), Vec3D(1, 0, 0), 2.f);
+    ps.add(Point3D(5, 5, 5), Vec3D(0, 0, 0), 0.f);
+    params.dt = 0.01f;
+  }
+};
+
+TEST_F(ParticlesTest, VerletFreeFallIsExact) {
+  for (int i = 0; i < 100; ++i) integrateVelocityVerlet(ps, params);
+  // After 1 s: x = 1, y = 10 - g / 2, vy = -g.
+  compareVectorsApprox(Vec3D(ps.position(0)), Vec3D(1.f, 10.f - 4.905f, 0.f),
+                       1.E-3f);
+  compareVectorsApprox(ps.velocity(0), Vec3D(1.f, -9.81f, 0.f), 1.E-3f);
+}
+
+TEST_F(ParticlesTest, SemiImplicitEulerAppliesForces) {
+  params.gravity = Vec3D(0, 0, 0);
+  ps.addForce(0, Vec3D(4, 0, 0));
+  integrateSemiImplicitEuler(ps, params);
+  // a = F / m = 2, v = 1 + 0.02, x = v * dt.
+  compareVectorsApprox(ps.velocity(0), Vec3D(1.02f, 0.f, 0.f), 1.E-6f);
+  comparePointsApprox(ps.position(0), Point3D(0.0102f, 10.f, 0.f), 1.E-6f);
+}
+
+TEST_F(ParticlesTest, PinnedParticlesDoNotMove) {
+  ps.addForce(1, Vec3D(100, 100, 100));
+  integrateSemiImplicitEuler(ps, params);
+  integrateVelocityVerlet(ps, params);
+  integrateRK4(ps, params);
+  comparePoints(ps.position(1), Point3D(5, 5, 5));
+}
+
+TEST_F(ParticlesTest, DampingSlowsParticles) {
+  params.gravity = Vec3D(0, 0, 0);
+  params.damping = 0.5f;
+  for (int i = 0; i < 100; ++i) integrateRK4(ps, params);
+  EXPECT_NEAR(ps.velocity(0).x(), std::exp(-0.5f), 1.E-4f);
+}
+
+TEST_F(ParticlesTest, RK4FollowsSpringField) {
+  ParticleSystemD spring;
+  spring.add(Point3D(1, 0, 0), Vec3D(0, 0, 0), 1.f);
+  params.gravity = Vec3D(0, 0, 0);
+  auto field = [](const Point3D& p, const Vec3D&) { return -1.f * Vec3D(p); };
+  for (int i = 0; i < 100; ++i) integrateRK4(spring, params, field);
+  EXPECT_NEAR(spring.position(0).x(), std::cos(1.f), 1.E-5f);
+  EXPECT_NEAR(spring.velocity(0).x(), -std::sin(1.f), 1.E-5f);
+}
+
+TEST_F(ParticlesTest, LargeSystemsMatchSingleParticle) {
+  ParticleSystemD many;
+  for (int i = 0; i < 50000; ++i) {
+    many.add(Point3D(0, 10, 0), Vec3D(1, 0, 0), 2.f);
+  }
+  integrateVelocityVerlet(many, params);
+  integrateVelocityVerlet(ps, params);
+  for (std::size_t i = 0; i < many.size(); i += 997) {
+    comparePoints(many.position(i), ps.position(0));
+  }
+}
+
+//--------------------------------------------
+//     Spatial hash grid
+//--------------------------------------------
+
+class SpatialHashTest : public testing::Test {
+ public:
+  std::vector<Point3D> points;
+  SpatialHashGridD grid{1.f};
+
+  void SetUp() override {
+    // A jittered lattice that spans negative and positive cells.
+    for (int i = 0; i < 20000; ++i) {
+      float x = (i % 29) * 0.37f - 5.f;
+      float y = (i / 29 % 31) * 0.41f - 6.f;
+      float z = (i / 899) * 0.53f - 4.f + 0.01f * (i % 7);
+      points.push_back(Point3D(x, y, z));
+    }
+    grid.build(points);
+  }
+
+  std::vector<std::uint32_t> bruteForce(const Point3D& p, float r) const {
+    std::vector<std::uint32_t> ret;
+    for (std::size_t i = 0; i < points.size(); ++i) {
+      Vec3D d = points[i] - p;
+      if (dot(d, d) <= r * r) ret.push_back(static_cast<std::uint32_t>(i));
+    }
+    return ret;
+  }
+};
+
+TEST_F(SpatialHashTest, SortsEveryPointOnce) {
+  ASSERT_EQ(grid.size(), points.size());
+  std::vector<std::uint32_t> sorted = grid.sortedIndices();
+  for (std::size_t s = 0; s < sorted.size(); s += 101) {
+    comparePoints(grid.sortedPosition(s), points[sorted[s]]);
+  }
+  std::sort(sorted.begin(), sorted.end());
+  for (std::size_t i = 0; i < sorted.size(); ++i) EXPECT_EQ(sorted[i], i);
+}
+
+TEST_F(SpatialHashTest, NeighborsMatchBruteForce) {
+  for (float r : {0.5f, 1.f, 2.5f}) {
+    Point3D p(0.3f, -1.2f, 2.f);
+    std::vector<std::uint32_t> found;
+    grid.forEachNeighbor(p, r, [&](std::uint32_t i, float d2) {
+      EXPECT_LE(d2, r * r);
+      found.push_back(i);
+    });
+    std::sort(found.begin(), found.end());
+    EXPECT_EQ(found, bruteForce(p, r));
+  }
+}
+
+TEST_F(SpatialHashTest, PairsAreReportedOnce) {
+  std::vector<Point3D> few = {Point3D(0, 0, 0), Point3D(0.5f, 0, 0),
+                              Point3D(3, 0, 0), Point3D(0, 0.9f, 0)};
+  SpatialHashGridD small(1.f);
+  small.build(few);
+  std::vector<NeighborPair<float>> pairs;
+  small.neighborPairs(1.f, pairs);
+  std::vector<std::pair<std::uint32_t, std::uint32_t>> got;
+  for (const auto& p : pairs) got.push_back(std::minmax(p.i, p.j));
+  std::sort(got.begin(), got.end());
+  std::vector<std::pair<std::uint32_t, std::uint32_t>> expected = {{0, 1},
+                                                                   {0, 3}};
+  EXPECT_EQ(got, expected);
+}
+
+TEST_F(SpatialHashTest, PairCountMatchesBruteForce) {
+  points.resize(3000);
+  grid.build(points);
+  std::vector<NeighborPair<float>> pairs;
+  grid.neighborPairs(0.45f, pairs);
+  std::size_t expected = 0;
+  for (const auto& p : points) expected += bruteForce(p, 0.45f).size() - 1;
+  EXPECT_EQ(pairs.size(), expected / 2);
+  for (const auto& p : pairs) {
+    EXPECT_NE(p.i, p.j);
+    EXPECT_LE(p.distSquared, 0.45f * 0.45f);
+  }
+}
+
+TEST_F(SpatialHashTest, BatchedQueriesMatchSingleQueries) {
+  std::vector<Point3D> queries = {Point3D(0, 0, 0), Point3D(-4, -5, -3),
+                                  Point3D(100, 100, 100)};
+  std::vector<std::uint32_t> offsets, indices;
+  grid.queryRadius(queries, 0.8f, offsets, indices);
+  ASSERT_EQ(offsets.size(), queries.size() + 1);
+  for (std::size_t q = 0; q < queries.size(); ++q) {
+    std::vector<std::uint32_t> got(indices.begin() + offsets[q],
+                                   indices.begin() + offsets[q + 1]);
+    std::sort(got.begin(), got.end());
+    EXPECT_EQ(got, bruteForce(queries[q], 0.8f));
+  }
+  EXPECT_EQ(offsets[3], offsets[2]);
+}
+
+//--------------------------------------------
+//     KdTree
+//--------------------------------------------
+
+template <class P>
+std::vector<KdNeighbor<float>> bruteForceKnn(const std::vector<P>& points,
+                                             const P& q, std::size_t k) {
+  std::vector<KdNeighbor<float>> all;
+  for (std::size_t i = 0; i < points.size(); ++i) {
+    float d2 = 0.f;
+    for (int d = 0; d < KdPointTraits<P>::kDim; ++d) {
+      d2 += (points[i][d] - q[d]) * (points[i][d] - q[d]);
+    }
+    all.push_back({static_cast<std::uint32_t>(i), d2});
+  }
+  std::sort(all.begin(), all.end());
+  all.resize(std::min(k, all.size()));
+  return all;
+}
+
+template <class P>
+void compareNeighbors(const std::vector<KdNeighbor<float>>& got,
+                      const std::vector<KdNeighbor<float>>& expected) {
+  ASSERT_EQ(got.size(), expected.size());
+  for (std::size_t i = 0; i < got.size(); ++i) {
+    EXPECT_EQ(got[i].index, expected[i].index);
+    EXPECT_FLOAT_EQ(got[i].distSquared, expected[i].distSquared);
+  }
+}
+
+class KdTreeTest : public testing::Test {
+ public:
+  std::vector<Point3D> points;
+  KdTreePoint3D tree;
+
+  void SetUp() override {
+    std::mt19937 rng(7);
+    std::uniform_real_distribution<float> u(-10.f, 10.f);
+    for (int i = 0; i < 20000; ++i) {
+      points.push_back(Point3D(u(rng), u(rng), u(rng)));
+    }
+    tree.build(points);
+  }
+};
+
+TEST_F(KdTreeTest, KnnMatchesBruteForce) {
+  std::vector<KdNeighbor<float>> got;
+  for (Point3D q :
+       {Point3D(0, 0, 0), Point3D(9.5f, -9.5f, 3), Point3D(50, 0, 0)}) {
+    tree.knn(q, 10, got);
+    compareNeighbors<Point3D>(got, bruteForceKnn(points, q, 10));
+  }
+}
+
+TEST_F(KdTreeTest, RadiusMatchesBruteForce) {
+  Point3D q(1, 2, 3);
+  std::vector<KdNeighbor<float>> got;
+  tree.radius(q, 1.5f, got);
+  auto expected = bruteForceKnn(points, q, points.size());
+  while (!expected.empty() && expected.back().distSquared > 1.5f * 1.5f) {
+    expected.pop_back();
+  }
+  EXPECT_FALSE(expected.empty());
+  compareNeighbors<Point3D>(got, expected);
+}
+
+TEST_F(KdTreeTest, KnnClampsToTreeSize) {
+  KdTreePoint3D small(
+      std::vector<Point3D>{Point3D(0, 0, 0), Point3D(1, 0, 0)});
+  std::vector<KdNeighbor<float>> got;
+  small.knn(Point3D(0.9f, 0, 0), 5, got);
+  ASSERT_EQ(got.size(), 2u);
+  EXPECT_EQ(got[0].index, 1u);
+  EXPECT_EQ(got[1].index, 0u);
+  KdTreePoint3D none;
+  none.knn(Point3D(0, 0, 0), 3, got);
+  EXPECT_TRUE(got.empty());
+}
+
+TEST_F(KdTreeTest, BatchedQueriesMatchSingleQueries) {
+  std::vector<Point3D> queries(points.begin(), points.begin() + 1000);
+  std::vector<KdNeighbor<float>> batch, single;
+  std::size_t stride = tree.knn(queries, 4, batch);
+  ASSERT_EQ(stride, 4u);
+  std::vector<std::uint32_t> offsets;
+  std::vector<KdNeighbor<float>> within;
+  tree.radius(queries, 0.8f, offsets, within);
+  for (std::size_t i = 0; i < queries.size(); i += 37) {
+    tree.knn(queries[i], 4, single);
+    // Each query point is its own nearest neighbor.
+    EXPECT_EQ(batch[i * stride].index, i);
+    compareNeighbors<Point3D>(
+        std::vector<KdNeighbor<float>>(batch.begin() + i * stride,
+                                       batch.begin() + (i + 1) * stride),
+        single);
+    tree.radius(queries[i], 0.8f, single);
+    compareNeighbors<Point3D>(
+        std::vector<KdNeighbor<float>>(within.begin() + offsets[i],
+                                       within.begin() + offsets[i + 1]),
+        single);
+  }
+}
+
+TEST_F(KdTreeTest, SupportsTwoAndFourDimensions) {
+  std::mt19937 rng(11);
+  std::uniform_real_distribution<float> u(0.f, 1.f);
+  std::vector<Vec2D> flat;
+  std::vector<Vec4D> features;
+  for (int i = 0; i < 3000; ++i) {
+    flat.push_back(Vec2D(u(rng), u(rng)));
+    features.push_back(Vec4D(u(rng), u(rng), u(rng), u(rng)));
+  }
+  KdTreeVec2D tree2(flat);
+  KdTreeVec4D tree4(features);
+  std::vector<KdNeighbor<float>> got;
+  tree2.knn(Vec2D(0.5f, 0.5f), 8, got);
+  compareNeighbors<Vec2D>(got, bruteForceKnn(flat, Vec2D(0.5f, 0.5f), 8));
+  Vec4D q(0.1f, 0.9f, 0.5f, 0.3f);
+  tree4.knn(q, 8, got);
+  compareNeighbors<Vec4D>(got, bruteForceKnn(features, q, 8));
+}
+
+//--------------------------------------------
+//     MatX / VecX
+//--------------------------------------------
+
+MatXD randomMatX(std::size_t rows, std::size_t cols, unsigned seed) {
+  std::mt19937 rng(seed);
+  std::uniform_real_distribution<float> u(-1.f, 1.f);
+  MatXD m(rows, cols);
+  for (std::size_t r = 0; r < rows; ++r) {
+    for (std::size_t c = 0; c < cols; ++c) m(r, c) = u(rng);
+  }
+  return m;
+}
+
+TEST(MatXTest, ConvertsFixedSizeTypes) {
+  Mat4D m4 = translation(1.f, 2.f, 3.f) * rotationOverY(0.3f);
+  EXPECT_TRUE(MatXD(m4).toMat4() == m4);
+  Mat3D m3(Vec3D(1, 2, 3), Vec3D(4, 5, 6), Vec3D(7, 8, 10));
+  MatXD x3(m3);
+  EXPECT_FLOAT_EQ(x3(1, 2), 6.f);
+  EXPECT_FLOAT_EQ(x3.toMat3()[2][2], 10.f);
+  compareVectors(VecXD(Vec3D(1, 2, 3)).toVec3(), Vec3D(1, 2, 3));
+  // Matches the fixed-size product.
+  Vec4D v(1, 2, 3, 1);
+  VecXD y = MatXD(m4) * VecXD(v);
+  Vec4D expected = m4 * v;
+  for (int i = 0; i < 4; ++i) EXPECT_NEAR(y[i], expected[i], 1.E-5f);
+}
+
+TEST(MatXTest, GemmMatchesNaiveProduct) {
+  // Odd sizes exercise every partial tile and block edge.
+  MatXD a = randomMatX(133, 301, 1);
+  MatXD b = randomMatX(301, 37, 2);
+  MatXD c = randomMatX(133, 37, 3);
+  MatXD expected = c;
+  for (std::size_t i = 0; i < 133; ++i) {
+    for (std::size_t j = 0; j < 37; ++j) {
+      double sum = 0.;
+      for (std::size_t k = 0; k < 301; ++k) sum += a(i, k) * b(k, j);
+      expected(i, j) = static_cast<float>(2. * sum - 0.5 * c(i, j));
+    }
+  }
+  gemm(2.f, a, b, -0.5f, c);
+  for (std::size_t i = 0; i < 133; ++i) {
+    for (std::size_t j = 0; j < 37; ++j) {
+      EXPECT_NEAR(c(i, j), expected(i, j), 1.E-4f);
+    }
+  }
+}
+
+TEST(MatXTest, GemmWithIdentityAndTranspose) {
+  MatXD a = randomMatX(70, 90, 4);
+  EXPECT_TRUE(a * MatXD::identity(90) == a);
+  EXPECT_TRUE(a.transpose().transpose() == a);
+  EXPECT_FLOAT_EQ(a.transpose()(5, 3), a(3, 5));
+}
+
+TEST(MatXTest, GemvMatchesGemm) {
+  MatXD a = randomMatX(513, 65, 5);
+  MatXD xm = randomMatX(65, 1, 6);
+  VecXD x(65);
+  for (std::size_t i = 0; i < 65; ++i) x[i] = xm(i, 0);
+  VecXD y = a * x;
+  MatXD ym = a * xm;
+  for (std::size_t i = 0; i < 513; ++i) EXPECT_NEAR(y[i], ym(i, 0), 1.E-5f);
+}
+
+TEST(MatXTest, LeastSquaresFitsLine) {
+  // y = 3 x - 2 sampled with symmetric noise; the fit recovers the line.
+  MatXD a(40, 2);
+  VecXD b(40);
+  for (int i = 0; i < 40; ++i) {
+    float x = i * 0.25f;
+    a(i, 0) = x;
+    a(i, 1) = 1.f;
+    b[i] = 3.f * x - 2.f + (i % 2 ? 0.1f : -0.1f);
+  }
+  VecXD coeffs = leastSquares(a, b);
+  EXPECT_NEAR(coeffs[0], 3.f, 1.E-2f);
+  EXPECT_NEAR(coeffs[1], -2.f, 5.E-2f);
+  // Square systems are solved exactly.
+  MatXD m(Mat3D(Vec3D(2, 1, 0), Vec3D(1, 3, 1), Vec3D(0, 1, 4)));
+  VecXD rhs{3.f, 5.f, 5.f};
+  VecXD x = leastSquares(m, rhs);
+  for (int i = 0; i < 3; ++i) EXPECT_NEAR(x[i], 1.f, 1.E-5f);
+}
+
+//--------------------------------------------
+//     Batched small matrices
+//--------------------------------------------
+
+class MatSoATest : public testing::Test {
+ public:
+  std::mt19937 rng{3};
+  std::uniform_real_distribution<float> u{-2.f, 2.f};
+
+  // Diagonally dominant, so every matrix is well conditioned.
+  Mat3D randomMat3() {
+    Mat3D m(Vec3D(u(rng), u(rng), u(rng)), Vec3D(u(rng), u(rng), u(rng)),
+            Vec3D(u(rng), u(rng), u(rng)));
+    for (int i = 0; i < 3; ++i) m[i][i] += 8.f;
+    return m;
+  }
+  Mat4D randomMat4() {
+    Mat4D m(Vec4D(u(rng), u(rng), u(rng), u(rng)),
+            Vec4D(u(rng), u(rng), u(rng), u(rng)),
+            Vec4D(u(rng), u(rng), u(rng), u(rng)),
+            Vec4D(u(rng), u(rng), u(rng), u(rng)));
+    for (int i = 0; i < 4; ++i) m[i][i] += 10.f;
+    return m;
+  }
+};
+
+TEST_F(MatSoATest, StoresMatricesByLane) {
+  Mat3SoA batch;
+  std::vector<Mat3D> ref;
+  for (int i = 0; i < 37; ++i) {
+    ref.push_back(randomMat3());
+    batch.add(ref.back());
+  }
+  EXPECT_EQ(batch.size(), 37u);
+  EXPECT_EQ(batch.blocks(), 3u);
+  for (int i = 0; i < 37; ++i) {
+    for (int r = 0; r < 3; ++r) compareVectors(batch.get(i)[r], ref[i][r]);
+  }
+  // Shrinking inside the last block leaves its unused lanes zero, and
+  // growing again reads them back as zero matrices.
+  batch.resize(34);
+  batch.resize(37);
+  for (int i = 34; i < 37; ++i) {
+    for (int r = 0; r < 3; ++r) compareVectors(batch.get(i)[r], Vec3D());
+  }
+  Vec3SoA vectors;
+  for (int i = 0; i < 20; ++i) vectors.add(Vec3D(1, 2, 3));
+  vectors.resize(17);
+  vectors.resize(20);
+  EXPECT_EQ(vectors.get(19), Vec3D());
+}
+
+TEST_F(MatSoATest, DeterminantAndInverseMatchMat3) {
+  Mat3SoA batch, inv;
+  std::vector<Mat3D> ref;
+  for (int i = 0; i < 1000; ++i) {
+    ref.push_back(randomMat3());
+    batch.add(ref.back());
+  }
+  std::vector<float> det;
+  batchDeterminant(batch, det);
+  batchInverse(batch, inv);
+  ASSERT_EQ(det.size(), 1000u);
+  for (int i = 0; i < 1000; i += 7) {
+    EXPECT_NEAR(det[i], ref[i].determinant(), 1.E-2f);
+    Mat3D expected = ref[i].inverse();
+    for (int r = 0; r < 3; ++r) {
+      compareVectorsApprox(inv.get(i)[r], expected[r], 1.E-5f);
+    }
+  }
+}
+
+TEST_F(MatSoATest, InverseMatchesMat4AndMat2) {
+  Mat4SoA batch4, inv4;
+  std::vector<Mat4D> ref;
+  for (int i = 0; i < 50; ++i) {
+    ref.push_back(randomMat4());
+    batch4.add(ref.back());
+  }
+  batchInverse(batch4, inv4);
+  for (int i = 0; i < 50; ++i) {
+    Mat4D expected = ref[i].inverse();
+    for (int r = 0; r < 4; ++r) {
+      for (int c = 0; c < 4; ++c) {
+        EXPECT_NEAR(inv4.get(i)[r][c], expected[r][c], 1.E-5f);
+      }
+    }
+  }
+  Mat2SoA batch2, inv2;
+  batch2.add(Mat2D(Vec2D(4, 7), Vec2D(2, 6)));
+  batchInverse(batch2, inv2);
+  EXPECT_FLOAT_EQ(inv2.get(0)[0][0], 0.6f);
+  EXPECT_FLOAT_EQ(inv2.get(0)[0][1], -0.7f);
+  EXPECT_FLOAT_EQ(inv2.get(0)[1][0], -0.2f);
+  EXPECT_FLOAT_EQ(inv2.get(0)[1][1], 0.4f);
+}
+
+TEST_F(MatSoATest, SingularMatricesGiveZeroInverse) {
+  Mat3SoA batch, inv;
+  batch.add(Mat3D(Vec3D(1, 2, 3), Vec3D(2, 4, 6), Vec3D(0, 1, 0)));
+  batchInverse(batch, inv);
+  for (int r = 0; r < 3; ++r) compareVectors(inv.get(0)[r], Vec3D(0, 0, 0));
+}
+
+TEST_F(MatSoATest, MultiplyAndTransposeMatchMat4) {
+  Mat4SoA a, b, prod, tr;
+  std::vector<Mat4D> ra, rb;
+  for (int i = 0; i < 40; ++i) {
+    ra.push_back(randomMat4());
+    rb.push_back(randomMat4());
+    a.add(ra.back());
+    b.add(rb.back());
+  }
+  batchMultiply(a, b, prod);
+  batchTranspose(a, tr);
+  for (int i = 0; i < 40; ++i) {
+    Mat4D expected = ra[i] * rb[i];
+    Mat4D t = ra[i].transpose();
+    for (int r = 0; r < 4; ++r) {
+      for (int c = 0; c < 4; ++c) {
+        EXPECT_NEAR(prod.get(i)[r][c], expected[r][c], 1.E-4f);
+        EXPECT_FLOAT_EQ(tr.get(i)[r][c], t[r][c]);
+      }
+    }
+  }
+}
+
+TEST_F(MatSoATest, SolvesLinearSystems) {
+  Mat3SoA a;
+  Vec3SoA b, x;
+  std::vector<Vec3D> expected;
+  for (int i = 0; i < 100; ++i) {
+    Mat3D m = randomMat3();
+    expected.push_back(Vec3D(u(rng), u(rng), u(rng)));
+    a.add(m);
+    Vec3D rhs(dot(m[0], expected.back()), dot(m[1], expected.back()),
+              dot(m[2], expected.back()));
+    b.add(rhs);
+  }
+  batchSolve(a, b, x);
+  for (int i = 0; i < 100; ++i) {
+    compareVectorsApprox(x.get(i), expected[i], 1.E-5f);
+  }
+}
+
+//--------------------------------------------
+//     Symmetric eigen-decomposition
+//--------------------------------------------
+
+// Closed-form eigenvalues of a symmetric 3x3 matrix (Smith 1961), in double
+// as an independent reference. Sorted in decreasing order.
+std::array<double, 3> referenceEigenvalues(const Mat3D& m) {
+  double a00 = m[0][0], a11 = m[1][1], a22 = m[2][2];
+  double a01 = m[0][1], a02 = m[0][2], a12 = m[1][2];
+  double p1 = a01 * a01 + a02 * a02 + a12 * a12;
+  double q = (a00 + a11 + a22) / 3.;
+  double p2 = (a00 - q) * (a00 - q) + (a11 - q) * (a11 - q) +
+              (a22 - q) * (a22 - q) + 2. * p1;
+  double p = std::sqrt(p2 / 6.);
+  if (p == 0.) return {q, q, q};
+  double b00 = (a00 - q) / p, b11 = (a11 - q) / p, b22 = (a22 - q) / p;
+  double b01 = a01 / p, b02 = a02 / p, b12 = a12 / p;
+  double detB = b00 * (b11 * b22 - b12 * b12) - b01 * (b01 * b22 - b12 * b02) +
+                b02 * (b01 * b12 - b11 * b02);
+  double phi = std::acos(std::clamp(detB / 2., -1., 1.)) / 3.;
+  double e0 = q + 2. * p * std::cos(phi);
+  double e2 = q + 2. * p * std::cos(phi + 2. * std::acos(-1.) / 3.);
+  return {e0, 3. * q - e0 - e2, e2};
+}
+
+class SymmetricEigenTest : public testing::Test {
+ public:
+  std::mt19937 rng{5};
+  std::uniform_real_distribution<float> u{-3.f, 3.f};
+
+  Mat3D randomSymmetric() {
+    float a = u(rng), b = u(rng), c = u(rng);
+    return Mat3D(Vec3D(u(rng), a, b), Vec3D(a, u(rng), c),
+                 Vec3D(b, c, u(rng)));
+  }
+
+  // A v = lambda v to float precision, unit length, right-handed basis.
+  void checkDecomposition(const Mat3D& m, const SymmetricEigen3<float>& e) {
+    std::array<double, 3> ref = referenceEigenvalues(m);
+    double scale = std::max({std::fabs(ref[0]), std::fabs(ref[2]), 1.});
+    for (int k = 0; k < 3; ++k) {
+      EXPECT_NEAR(e.values[k], ref[k], 1.E-5 * scale);
+      Vec3D v = e.vectors[k];
+      EXPECT_NEAR(v.length(), 1.f, 1.E-5f);
+      for (int r = 0; r < 3; ++r) {
+        EXPECT_NEAR(dot(m[r], v), e.values[k] * v[r], 1.E-5 * scale);
+      }
+    }
+    compareVectorsApprox(cross(e.vectors[0], e.vectors[1]), e.vectors[2],
+                         1.E-5f);
+  }
+};
+
+TEST_F(SymmetricEigenTest, MatchesReferenceOnRandomMatrices) {
+  for (int i = 0; i < 200; ++i) {
+    Mat3D m = randomSymmetric();
+    checkDecomposition(m, symmetricEigen(m));
+  }
+}
+
+TEST_F(SymmetricEigenTest, HandlesDiagonalAndRepeatedEigenvalues) {
+  Mat3D diag(Vec3D(1, 0, 0), Vec3D(0, 5, 0), Vec3D(0, 0, 3));
+  SymmetricEigen3<float> e = symmetricEigen(diag);
+  compareVectors(e.values, Vec3D(5, 3, 1));
+  compareVectorsApprox(e.vectors[0], Vec3D(0, 1, 0), 1.E-6f);
+  checkDecomposition(Mat3D(), symmetricEigen(Mat3D()));
+  checkDecomposition(Mat3D(0.f), symmetricEigen(Mat3D(0.f)));
+  // Eigenvalues 4, 1, 1.
+  Mat3D repeated(Vec3D(2, 1, 1), Vec3D(1, 2, 1), Vec3D(1, 1, 2));
+  checkDecomposition(repeated, symmetricEigen(repeated));
+}
+
+TEST_F(SymmetricEigenTest, CovarianceNormalIsSmallestAxis) {
+  // Points spread in the plane z = x, so the normal is (1, 0, -1) / sqrt 2.
+  Mat3D cov(0.f);
+  for (int i = 0; i < 100; ++i) {
+    Vec3D p(u(rng), u(rng), 0.f);
+    p.setZ(p.x());
+    for (int r = 0; r < 3; ++r) {
+      for (int c = 0; c < 3; ++c) cov[r][c] += p[r] * p[c] / 100.f;
+    }
+  }
+  OrthoNormalBasis basis = eigenBasis(symmetricEigen(cov));
+  EXPECT_NEAR(std::fabs(basis.w().x()), std::sqrt(0.5f), 1.E-4f);
+  EXPECT_NEAR(basis.w().x(), -basis.w().z(), 1.E-4f);
+  compareVectorsApprox(basis.local(0, 0, 1), basis.w(), 1.E-6f);
+}
+
+TEST_F(SymmetricEigenTest, BatchedMatchesScalar) {
+  Mat3SoA batch, vectors;
+  Vec3SoA values;
+  std::vector<Mat3D> ref;
+  for (int i = 0; i < 1000; ++i) {
+    ref.push_back(randomSymmetric());
+    batch.add(ref.back());
+  }
+  batchSymmetricEigen(batch, values, vectors);
+  for (int i = 0; i < 1000; i += 3) {
+    SymmetricEigen3<float> e;
+    e.values = values.get(i);
+    Mat3D rows = vectors.get(i);
+    for (int k = 0; k < 3; ++k) e.vectors[k] = rows[k];
+    checkDecomposition(ref[i], e);
+  }
+}
+
+//--------------------------------------------
+//     Normal estimation
+//--------------------------------------------
+
+class NormalEstimationTest : public testing::Test {
+ public:
+  std::vector<Point3D> plane, sphere;
+
+  void SetUp() override {
+    std::mt19937 rng(9);
+    std::uniform_real_distribution<float> u(-1.f, 1.f);
+    // Slightly noisy patch of z = 2 and a unit sphere around (5, 0, 0).
+    for (int i = 0; i < 4000; ++i) {
+      plane.push_back(
+          Point3D(4.f * u(rng), 4.f * u(rng), 2.f + 1.E-3f * u(rng)));
+      Vec3D d = getUnitVectorOf(Vec3D(u(rng), u(rng), u(rng)));
+      sphere.push_back(Point3D(5.f, 0.f, 0.f) + d);
+    }
+  }
+};
+
+TEST_F(NormalEstimationTest, PlaneNormalsFaceViewpoint) {
+  NormalEstimationParams params;
+  params.viewpoint = Point3D(0, 0, 10);
+  std::vector<Normal3D> normals;
+  std::vector<float> curvature;
+  estimateNormals(plane, params, normals, &curvature);
+  ASSERT_EQ(normals.size(), plane.size());
+  for (std::size_t i = 0; i < plane.size(); ++i) {
+    EXPECT_GT(normals[i].z(), 0.99f);
+    EXPECT_LT(curvature[i], 1.E-3f);
+  }
+}
+
+TEST_F(NormalEstimationTest, SphereNormalsAreRadial) {
+  NormalEstimationParams params;
+  params.viewpoint = Point3D(5, 0, 0);
+  std::vector<Normal3D> normals;
+  estimateNormals(sphere, params, normals);
+  for (std::size_t i = 0; i < sphere.size(); ++i) {
+    Vec3D radial = sphere[i] - Point3D(5, 0, 0);
+    // Facing the centre, i.e. inward.
+    EXPECT_LT(dot(normals[i], radial), -0.95f);
+  }
+}
+
+TEST_F(NormalEstimationTest, PropagationIsConsistent) {
+  NormalEstimationParams params;
+  params.orientation = NormalOrientation::Propagation;
+  params.viewpoint = Point3D(5, 0, 10);
+  std::vector<Normal3D> normals;
+  estimateNormals(sphere, params, normals);
+  int outward = 0;
+  for (std::size_t i = 0; i < sphere.size(); ++i) {
+    if (dot(normals[i], sphere[i] - Point3D(5, 0, 0)) > 0.f) ++outward;
+  }
+  EXPECT_EQ(outward, static_cast<int>(sphere.size()));
+}
+
+TEST_F(NormalEstimationTest, PropagationReconcilesBlocks) {
+  NormalEstimationParams params;
+  params.orientation = NormalOrientation::Propagation;
+  params.viewpoint = Point3D(5, 0, 10);
+  params.blockSize = 97;
+  std::vector<Normal3D> normals;
+  estimateNormals(sphere, params, normals);
+  int outward = 0;
+  for (std::size_t i = 0; i < sphere.size(); ++i) {
+    if (dot(normals[i], sphere[i] - Point3D(5, 0, 0)) > 0.f) ++outward;
+  }
+  EXPECT_EQ(outward, static_cast<int>(sphere.size()));
+  // Seen from inside, the whole sphere flips with the first patch.
+  params.viewpoint = Point3D(5, 0, 0.5f);
+  estimateNormals(sphere, params, normals);
+  int inward = 0;
+  for (std::size_t i = 0; i < sphere.size(); ++i) {
+    if (dot(normals[i], sphere[i] - Point3D(5, 0, 0)) < 0.f) ++inward;
+  }
+  EXPECT_EQ(inward, static_cast<int>(sphere.size()));
+}
+
+TEST_F(NormalEstimationTest, BlockSizeAndRadiusSearch) {
+  NormalEstimationParams params;
+  params.viewpoint = Point3D(0, 0, 10);
+  std::vector<Normal3D> whole, streamed;
+  estimateNormals(plane, params, whole);
+  params.blockSize = 100;
+  estimateNormals(plane, params, streamed);
+  for (std::size_t i = 0; i < plane.size(); ++i) {
+    EXPECT_FLOAT_EQ(whole[i].z(), streamed[i].z());
+  }
+  params.radius = 0.3f;
+  estimateNormals(plane, params, streamed);
+  for (std::size_t i = 0; i < plane.size(); ++i) {
+    EXPECT_GT(streamed[i].z(), 0.99f);
+  }
+  // Too sparse for a neighborhood: zero normals.
+  params.radius = 1.E-6f;
+  estimateNormals(plane, params, streamed);
+  EXPECT_FLOAT_EQ(streamed[0].z(), 0.f);
+}
+
+//--------------------------------------------
+//     Camera
+//--------------------------------------------
+
+class CameraTest : public testing::Test {
+ public:
+  Point3D from = Point3D(1.f, 2.f, 5.f);
+  Point3D to = Point3D(0.f, 0.f, 0.f);
+  Vec3D up = Vec3D(0.f, 1.f, 0.f);
+  Camera camera = Camera(from, to, up, PI / 3.f, 64, 48);
+
+  // The per-pixel matrix transform the camera replaces.
+  Vec3D reference(float px, float py) const {
+    float h = std::tan(camera.fov() / 2.f), w = h * camera.aspect();
+    Vec4D d(-w + 2.f * w * px / camera.width(),
+            h - 2.f * h * py / camera.height(), -1.f, 0.f);
+    return getUnitVectorOf(Vec3D(camera.inverseView() * d));
+  }
+
+  // Film position of a world-space direction.
+  void film(const Vec3D& d, float& px, float& py) const {
+    float h = std::tan(camera.fov() / 2.f), w = h * camera.aspect();
+    Vec4D c = camera.inverseView().inverse() * Vec4D(d.x(), d.y(), d.z(), 0);
+    px = (c.x() / -c.z() + w) / (2.f * w) * camera.width();
+    py = (h - c.y() / -c.z()) / (2.f * h) * camera.height();
+  }
+};
+
+TEST_F(CameraTest, CentreRayLooksAtTarget) {
+  Ray ray = camera.generateRay(32.f, 24.f);
+  Vec3D forward = getUnitVectorOf(to - from);
+  EXPECT_NEAR(ray.origin().x(), from.x(), 1.E-5f);
+  EXPECT_NEAR(ray.origin().y(), from.y(), 1.E-5f);
+  EXPECT_NEAR(ray.origin().z(), from.z(), 1.E-5f);
+  EXPECT_NEAR(dot(ray.direction(), forward), 1.f, 1.E-5f);
+}
+
+TEST_F(CameraTest, FieldOfViewSpansImage) {
+  Vec3D top = camera.generateRay(32.f, 0.f).direction();
+  Vec3D bottom = camera.generateRay(32.f, 48.f).direction();
+  EXPECT_NEAR(std::acos(dot(top, bottom)), PI / 3.f, 1.E-4f);
+  // Image x grows to the right of the view direction.
+  Vec3D left = camera.generateRay(0.f, 24.f).direction();
+  Vec3D right = camera.generateRay(64.f, 24.f).direction();
+  EXPECT_GT(dot(cross(getUnitVectorOf(to - from), up), right - left), 0.f);
+}
+
+TEST_F(CameraTest, TileMatchesPerPixelTransform) {
+  Tile tile{8, 4, 24, 12};
+  RayBatch rays;
+  camera.generateTile(tile, rays);
+  ASSERT_EQ(rays.size(), tile.pixelCount());
+  for (std::size_t i = 0; i < rays.size(); ++i) {
+    float px = tile.x0 + static_cast<int>(i % tile.width()) + 0.5f;
+    float py = tile.y0 + static_cast<int>(i / tile.width()) + 0.5f;
+    Vec3D ref = reference(px, py);
+    EXPECT_NEAR(rays.dx()[i], ref.x(), 1.E-5f);
+    EXPECT_NEAR(rays.dy()[i], ref.y(), 1.E-5f);
+    EXPECT_NEAR(rays.dz()[i], ref.z(), 1.E-5f);
+    EXPECT_FLOAT_EQ(rays.ox()[i], camera.position().x());
+    EXPECT_EQ(rays.tmax()[i], std::numeric_limits<float>::infinity());
+  }
+}
+
+TEST_F(CameraTest, JitteredSamplesStayInPixel) {
+  Tile tile{0, 0, 4, 4};
+  CameraSampling sampling;
+  sampling.samplesPerPixel = 8;
+  sampling.jitter = true;
+  sampling.seed = 7;
+  RayBatch a, b, c;
+  camera.generateTile(tile, a, sampling);
+  camera.generateTile(tile, b, sampling);
+  sampling.seed = 8;
+  camera.generateTile(tile, c, sampling);
+  ASSERT_EQ(a.size(), tile.pixelCount() * 8);
+  bool differs = false;
+  for (std::size_t i = 0; i < a.size(); ++i) {
+    EXPECT_EQ(a.dx()[i], b.dx()[i]);
+    differs |= a.dx()[i] != c.dx()[i];
+    std::size_t p = i / 8;
+    float px, py;
+    film(Vec3D(a.dx()[i], a.dy()[i], a.dz()[i]), px, py);
+    EXPECT_GE(px, p % 4 - 1.E-3f);
+    EXPECT_LE(px, p % 4 + 1.f + 1.E-3f);
+    EXPECT_GE(py, p / 4 - 1.E-3f);
+    EXPECT_LE(py, p / 4 + 1.f + 1.E-3f);
+  }
+  EXPECT_TRUE(differs);
+}
+
+TEST_F(CameraTest, SettersRebuildFrame) {
+  camera.setResolution(32, 32);
+  camera.setFov(PI / 2.f);
+  EXPECT_FLOAT_EQ(camera.aspect(), 1.f);
+  Vec3D top = camera.generateRay(16.f, 0.f).direction();
+  Vec3D bottom = camera.generateRay(16.f, 32.f).direction();
+  EXPECT_NEAR(std::acos(dot(top, bottom)), PI / 2.f, 1.E-4f);
+  camera.setView(view_transform(Point3D(0, 0, 0), Point3D(0, 0, -1), up));
+  Ray ray = camera.generateRay(16.f, 16.f);
+  EXPECT_NEAR(ray.direction().z(), -1.f, 1.E-6f);
+  EXPECT_NEAR(ray.origin().x(), 0.f, 1.E-6f);
+}
+
+//--------------------------------------------
+//     Renderer
+//--------------------------------------------
+
+TEST(RendererTest, TilesCoverImageOnce) {
+  for (TileOrder order :
+       {TileOrder::Scanline, TileOrder::Morton, TileOrder::Hilbert}) {
+    std::vector<Tile> tiles = makeTiles(100, 70, 16, order);
+    ASSERT_EQ(tiles.size(), 7u * 5u);
+    std::vector<int> covered(100 * 70, 0);
+    for (const Tile& t : tiles) {
+      for (int y = t.y0; y < t.y1; ++y) {
+        for (int x = t.x0; x < t.x1; ++x) ++covered[y * 100 + x];
+      }
+    }
+    for (int c : covered) EXPECT_EQ(c, 1);
+  }
+  std::vector<Tile> rows = makeTiles(100, 70, 16, TileOrder::Scanline);
+  EXPECT_EQ(rows[1].x0, 16);
+  EXPECT_EQ(rows[7].y0, 16);
+  EXPECT_EQ(rows.back().x1, 100);
+  EXPECT_EQ(rows.back().y1, 70);
+}
+
+TEST(RendererTest, CurveOrders) {
+  // Hilbert steps between edge neighbours on a power-of-two grid.
+  std::vector<Tile> hilbert = makeTiles(128, 128, 16, TileOrder::Hilbert);
+  for (std::size_t i = 1; i < hilbert.size(); ++i) {
+    int step = std::abs(hilbert[i].x0 - hilbert[i - 1].x0) +
+               std::abs(hilbert[i].y0 - hilbert[i - 1].y0);
+    EXPECT_EQ(step, 16);
+  }
+  // Morton visits 2x2 blocks of tiles first.
+  std::vector<Tile> morton = makeTiles(64, 64, 16, TileOrder::Morton);
+  EXPECT_EQ(morton[1].x0, 16);
+  EXPECT_EQ(morton[1].y0, 0);
+  EXPECT_EQ(morton[2].x0, 0);
+  EXPECT_EQ(morton[2].y0, 16);
+  EXPECT_EQ(morton[3].x0, 16);
+  EXPECT_EQ(morton[3].y0, 16);
+  EXPECT_EQ(mortonEncode2(3, 5), 0b100111u);
+}
+
+TEST(RendererTest, IntegratorSinkAndStats) {
+  Camera camera(Point3D(0, 0, 5), Point3D(0, 0, 0), Vec3D(0, 1, 0), PI / 3.f,
+                50, 30);
+  RenderSettings settings;
+  settings.tileSize = 8;
+  settings.sampling.samplesPerPixel = 4;
+  settings.sampling.jitter = true;
+  std::size_t lastProgress = 0, progressCalls = 0;
+  settings.progress = [&](std::size_t done, std::size_t total) {
+    EXPECT_EQ(done, lastProgress + 1);
+    EXPECT_EQ(total, 7u * 4u);
+    lastProgress = done;
+    ++progressCalls;
+  };
+  std::vector<Vec3D> image(50 * 30, Vec3D(-1.f, -1.f, -1.f));
+  std::mutex imageMutex;
+  RenderStats stats = render(
+      camera, settings,
+      [](const Tile& tile, const RayBatch& rays, Vec3D* radiance) {
+        // Pixel x in red, sample direction in green: averages to x.
+        std::size_t spp = rays.size() / tile.pixelCount();
+        for (std::size_t i = 0; i < rays.size(); ++i) {
+          float x = tile.x0 + static_cast<float>(i / spp % tile.width());
+          radiance[i] = Vec3D(x, rays.dy()[i], 1.f);
+        }
+        return static_cast<std::uint64_t>(2 * rays.size());
+      },
+      [&](const Tile& tile, const Vec3D* pixels) {
+        std::lock_guard<std::mutex> lock(imageMutex);
+        for (int y = tile.y0; y < tile.y1; ++y) {
+          for (int x = tile.x0; x < tile.x1; ++x) {
+            image[y * 50 + x] = *pixels++;
+          }
+        }
+      });
+  for (int y = 0; y < 30; ++y) {
+    for (int x = 0; x < 50; ++x) {
+      EXPECT_FLOAT_EQ(image[y * 50 + x].x(), static_cast<float>(x));
+      EXPECT_FLOAT_EQ(image[y * 50 + x].z(), 1.f);
+    }
+  }
+  // Top rows look up, bottom rows down.
+  EXPECT_GT(image[25].y(), 0.f);
+  EXPECT_LT(image[29 * 50 + 25].y(), 0.f);
+  EXPECT_EQ(progressCalls, 28u);
+  EXPECT_EQ(stats.tiles, 28u);
+  EXPECT_EQ(stats.samples, 50u * 30u * 4u);
+  EXPECT_EQ(stats.rays, 2 * stats.samples);
+  EXPECT_GT(stats.seconds, 0.);
+  EXPECT_NEAR(stats.raysPerSecond(), 2 * stats.samplesPerSecond(),
+              1.E-6 * stats.raysPerSecond());
+}
+
+//--------------------------------------------
+//     Framebuffer
+//--------------------------------------------
+
+class FramebufferTest : public testing::Test {
+ public:
+  Framebuffer fb = Framebuffer(37, 21);
+
+  void SetUp() override {
+    for (int y = 0; y < fb.height(); ++y) {
+      for (int x = 0; x < fb.width(); ++x) {
+        fb.set(x, y, Vec3D(0.1f * x, 0.2f * y, x == y ? -1.f : 0.05f));
+      }
+    }
+  }
+};
+
+TEST_F(FramebufferTest, ToneMapOperators) {
+  float r[4] = {0.f, 0.5f, 1.f, 8.f}, g[4] = {}, b[4] = {};
+  float outR[4], outG[4], outB[4];
+  ToneMapParams params;
+  params.op = ToneMap::Reinhard;
+  detail::toneMapRow(4, r, g, b, params, outR, outG, outB);
+  EXPECT_FLOAT_EQ(outR[2], 0.5f);
+  EXPECT_FLOAT_EQ(outR[3], 8.f / 9.f);
+  params.op = ToneMap::Aces;
+  detail::toneMapRow(4, r, g, b, params, outR, outG, outB);
+  EXPECT_NEAR(outR[0], 0.f, 1.E-6f);
+  EXPECT_NEAR(outR[2], 2.54f / 3.16f, 1.E-6f);
+  EXPECT_FLOAT_EQ(outR[3], 1.f);
+  params.op = ToneMap::Clamp;
+  params.exposure = 2.f;
+  detail::toneMapRow(4, r, g, b, params, outR, outG, outB);
+  EXPECT_FLOAT_EQ(outR[1], 1.f);
+  EXPECT_FLOAT_EQ(outR[3], 1.f);
+  EXPECT_FLOAT_EQ(outG[0], 0.f);
+}
+
+TEST_F(FramebufferTest, SrgbLutWithinOneCode) {
+  const SrgbLut& lut = SrgbLut::instance();
+  for (int i = 0; i <= 100000; ++i) {
+    float v = i / 100000.f;
+    int exact = static_cast<int>(linearToSrgb(v) * 255.f + 0.5f);
+    EXPECT_LE(std::abs(lut.encode(v) - exact), 1) << v;
+  }
+  EXPECT_EQ(lut.encode(-1.f), 0);
+  EXPECT_EQ(lut.encode(0.5f), 188);
+  EXPECT_EQ(lut.encode(2.f), 255);
+}
+
+TEST_F(FramebufferTest, TilesMatchWholeImage) {
+  ToneMapParams params;
+  std::vector<std::uint8_t> whole;
+  fb.encode(params, whole);
+  ASSERT_EQ(whole.size(), 3u * 37u * 21u);
+  Tile tile{5, 3, 20, 11};
+  std::vector<std::uint8_t> part(3 * tile.pixelCount());
+  fb.encodeTile(tile, params, part.data());
+  for (int y = tile.y0; y < tile.y1; ++y) {
+    for (int x = tile.x0; x < tile.x1; ++x) {
+      std::size_t t = 3 * ((y - tile.y0) * tile.width() + (x - tile.x0));
+      std::size_t w = 3 * (y * 37 + x);
+      for (int c = 0; c < 3; ++c) EXPECT_EQ(part[t + c], whole[w + c]);
+    }
+  }
+  // Negative radiance clamps to black.
+  EXPECT_EQ(whole[3 * (4 * 37 + 4) + 2], 0);
+
+  Framebuffer copy(37, 21);
+  std::vector<Vec3D> pixels;
+  for (int y = tile.y0; y < tile.y1; ++y) {
+    for (int x = tile.x0; x < tile.x1; ++x) pixels.push_back(fb.get(x, y));
+  }
+  copy.setTile(tile, pixels.data());
+  EXPECT_FLOAT_EQ(copy.get(19, 10).x(), fb.get(19, 10).x());
+  EXPECT_FLOAT_EQ(copy.get(4, 10).x(), 0.f);
+}
+
+TEST_F(FramebufferTest, StreamedPpmMatchesSequential) {
+  ToneMapParams params;
+  params.op = ToneMap::Reinhard;
+  std::stringstream streamed, sequential;
+  {
+    ImageStreamWriter writer(streamed, ImageFormat::Ppm, 37, 21, params);
+    // Out of order and from several threads, as render() delivers them.
+    std::vector<Tile> tiles = makeTiles(37, 21, 8, TileOrder::Hilbert);
+    std::reverse(tiles.begin(), tiles.end());
+    parallelFor(tiles.size(), 1, [&](std::size_t b, std::size_t e) {
+      for (std::size_t i = b; i < e; ++i) writer.writeTile(fb, tiles[i]);
+    });
+    EXPECT_TRUE(writer.good());
+  }
+  ImageStreamWriter(sequential, ImageFormat::Ppm, 37, 21, params).write(fb);
+  std::string s = streamed.str();
+  EXPECT_EQ(s, sequential.str());
+
+  std::string header = "P6\n37 21\n255\n";
+  ASSERT_EQ(s.size(), header.size() + 3u * 37u * 21u);
+  EXPECT_EQ(s.substr(0, header.size()), header);
+  std::vector<std::uint8_t> rgb;
+  fb.encode(params, rgb);
+  EXPECT_EQ(0, std::memcmp(s.data() + header.size(), rgb.data(), rgb.size()));
+}
+
+TEST_F(FramebufferTest, PfmIsLinearBottomUp) {
+  std::stringstream out;
+  ImageStreamWriter writer(out, ImageFormat::Pfm, 37, 21);
+  writer.writeTile(fb, Tile{0, 0, 37, 10});
+  writer.writeTile(fb, Tile{0, 10, 37, 21});
+  std::string s = out.str();
+  std::string header = "PF\n37 21\n-1.0\n";
+  ASSERT_EQ(s.size(), header.size() + 12u * 37u * 21u);
+  EXPECT_EQ(s.substr(0, header.size()), header);
+  // First stored row is the bottom image row.
+  float px[3];
+  std::memcpy(px, s.data() + header.size() + 12 * 3, sizeof(px));
+  EXPECT_FLOAT_EQ(px[0], fb.get(3, 20).x());
+  EXPECT_FLOAT_EQ(px[1], fb.get(3, 20).y());
+  std::memcpy(px, s.data() + s.size() - 12, sizeof(px));
+  EXPECT_FLOAT_EQ(px[0], fb.get(36, 0).x());
+}
+
+//--------------------------------------------
+//     Morton / radix sort
+//--------------------------------------------
+
+TEST(MortonTest, EncodeInterleavesBits) {
+  EXPECT_EQ(mortonEncode30(1, 0, 0), 4u);
+  EXPECT_EQ(mortonEncode30(0, 1, 0), 2u);
+  EXPECT_EQ(mortonEncode30(0, 0, 1), 1u);
+  EXPECT_EQ(mortonEncode30(1023, 1023, 1023), (1u << 30) - 1);
+  EXPECT_EQ(mortonEncode63(0x1fffff, 0x1fffff, 0x1fffff), (1ull << 63) - 1);
+  std::mt19937 rng(3);
+  for (int i = 0; i < 1000; ++i) {
+    std::uint64_t c[3] = {rng() & 0x1fffffu, rng() & 0x1fffffu,
+                          rng() & 0x1fffffu};
+    std::uint64_t ref = 0;
+    for (int b = 0; b < 21; ++b) {
+      for (int a = 0; a < 3; ++a) {
+        ref |= ((c[a] >> b) & 1) << (3 * b + 2 - a);
+      }
+    }
+    EXPECT_EQ(mortonEncode63(c[0], c[1], c[2]), ref);
+    EXPECT_EQ(mortonEncode30(c[0] & 1023, c[1] & 1023, c[2] & 1023),
+              ref & ((1u << 30) - 1));
+  }
+}
+
+TEST(MortonTest, HilbertStepsBetweenNeighbours) {
+  // The first 512 keys of the 10-bit curve fill an 8^3 corner cube.
+  std::vector<std::pair<std::uint32_t, std::array<int, 3>>> cells;
+  for (int x = 0; x < 8; ++x) {
+    for (int y = 0; y < 8; ++y) {
+      for (int z = 0; z < 8; ++z) {
+        cells.push_back({hilbertEncode30(x, y, z), {x, y, z}});
+      }
+    }
+  }
+  std::sort(cells.begin(), cells.end());
+  for (std::size_t i = 0; i < cells.size(); ++i) {
+    EXPECT_EQ(cells[i].first, i);
+    if (i == 0) continue;
+    int step = 0;
+    for (int a = 0; a < 3; ++a) {
+      step += std::abs(cells[i].second[a] - cells[i - 1].second[a]);
+    }
+    EXPECT_EQ(step, 1);
+  }
+  EXPECT_EQ(hilbertEncode63(0, 0, 0), 0u);
+}
+
+TEST(MortonTest, KeysQuantizeAgainstBounds) {
+  Bounds3D box(Point3D(-1, -1, -1), Point3D(1, 3, 1));
+  std::vector<Point3D> points = {Point3D(-1, -1, -1), Point3D(1, 3, 1),
+                                 Point3D(5, -9, 0), Point3D(0, 1, 0)};
+  std::vector<std::uint32_t> keys;
+  computeSpatialKeys(points, box, SpaceFillingCurve::Morton, keys);
+  EXPECT_EQ(keys[0], 0u);
+  EXPECT_EQ(keys[1], (1u << 30) - 1);
+  EXPECT_EQ(keys[2], mortonEncode30(1023, 0, 512));
+  EXPECT_EQ(keys[3], mortonEncode30(512, 512, 512));
+  std::vector<std::uint64_t> wide;
+  computeSpatialKeys(points, box, SpaceFillingCurve::Morton, wide);
+  EXPECT_EQ(wide[1], (1ull << 63) - 1);
+  EXPECT_EQ(wide[3], mortonEncode63(1 << 20, 1 << 20, 1 << 20));
+
+  float x[4], y[4], z[4];
+  for (int i = 0; i < 4; ++i) {
+    x[i] = points[i].x();
+    y[i] = points[i].y();
+    z[i] = points[i].z();
+  }
+  std::uint32_t soa[4];
+  computeSpatialKeys(x, y, z, 4, box, SpaceFillingCurve::Hilbert, soa);
+  computeSpatialKeys(points, box, SpaceFillingCurve::Hilbert, keys);
+  for (int i = 0; i < 4; ++i) EXPECT_EQ(soa[i], keys[i]);
+  EXPECT_EQ(keys[3], hilbertEncode30(512, 512, 512));
+}
+
+TEST(MortonTest, RadixSortIsStable) {
+  std::mt19937 rng(4);
+  const std::size_t n = 300000;
+  std::vector<std::uint32_t> keys(n);
+  std::vector<std::pair<std::uint32_t, std::uint32_t>> ref(n);
+  for (std::size_t i = 0; i < n; ++i) {
+    // Few distinct high digits, so stability is exercised.
+    keys[i] = (rng() & 0x3ff0000u) | (rng() & 0xf);
+    ref[i] = {keys[i], static_cast<std::uint32_t>(i)};
+  }
+  std::vector<std::uint32_t> order = radixSortOrder(keys, 30);
+  std::stable_sort(ref.begin(), ref.end(), [](auto& a, auto& b) {
+    return a.first < b.first;
+  });
+  for (std::size_t i = 0; i < n; ++i) {
+    ASSERT_EQ(keys[i], ref[i].first);
+    ASSERT_EQ(order[i], ref[i].second);
+  }
+
+  std::vector<std::uint64_t> wide(1000);
+  std::vector<float> values(1000);
+  for (std::size_t i = 0; i < wide.size(); ++i) {
+    wide[i] = (std::uint64_t{rng()} << 31) ^ rng();
+    values[i] = static_cast<float>(wide[i] % 1000);
+  }
+  radixSort(wide, values);
+  EXPECT_TRUE(std::is_sorted(wide.begin(), wide.end()));
+  for (std::size_t i = 0; i < wide.size(); ++i) {
+    EXPECT_EQ(values[i], static_cast<float>(wide[i] % 1000));
+  }
+}
+
+TEST(MortonTest, SpatialSortCarriesAttributes) {
+  std::mt19937 rng(5);
+  std::uniform_real_distribution<float> u(-10.f, 10.f);
+  std::vector<Point3D> points;
+  std::vector<int> ids;
+  std::vector<Vec3D> colors;
+  for (int i = 0; i < 20000; ++i) {
+    points.push_back(Point3D(u(rng), u(rng), u(rng)));
+    ids.push_back(i);
+    colors.push_back(Vec3D(points.back()));
+  }
+  std::vector<Point3D> original = points;
+  std::vector<std::uint32_t> order =
+      spatialSort(points, SpaceFillingCurve::Morton, ids, colors);
+  std::vector<std::uint32_t> keys;
+  Bounds3D box = computeBounds(points);
+  computeSpatialKeys(points, box, SpaceFillingCurve::Morton, keys);
+  EXPECT_TRUE(std::is_sorted(keys.begin(), keys.end()));
+  for (std::size_t i = 0; i < points.size(); ++i) {
+    EXPECT_EQ(ids[i], static_cast<int>(order[i]));
+    EXPECT_EQ(points[i].x(), original[order[i]].x());
+    EXPECT_EQ(colors[i].y(), points[i].y());
+  }
+}
+
+//--------------------------------------------
+//     LBVH
+//--------------------------------------------
+
+class LBVHTest : public testing::Test {
+ public:
+  SphereSoA spheres;
+  std::vector<Ray> rays;
+
+  void SetUp() override {
+    std::mt19937 rng(11);
+    std::uniform_real_distribution<float> u(-20.f, 20.f);
+    std::uniform_real_distribution<float> radius(0.1f, 1.5f);
+    for (int i = 0; i < 3000; ++i) {
+      spheres.add(Point3D(u(rng), u(rng), u(rng)), radius(rng));
+    }
+    for (int i = 0; i < 500; ++i) {
+      Point3D o(u(rng), u(rng), 40.f);
+      Point3D target(u(rng), u(rng), u(rng));
+      rays.push_back(Ray(o, getUnitVectorOf(target - o)));
+    }
+  }
+
+  // Every child box holds its subtree and every primitive is one leaf.
+  void checkStructure(const LBVH& bvh, const std::vector<Bounds3D>& boxes) {
+    std::vector<int> seen(boxes.size(), 0);
+    std::vector<std::pair<int, Bounds3D>> stack = {{bvh.root(),
+                                                    bvh.bounds()}};
+    while (!stack.empty()) {
+      auto [node, box] = stack.back();
+      stack.pop_back();
+      if (node < 0) {
+        std::uint32_t prim = bvh.primitive(~node);
+        ++seen[prim];
+        EXPECT_TRUE(box.contains(boxes[prim].min()));
+        EXPECT_TRUE(box.contains(boxes[prim].max()));
+        continue;
+      }
+      const LBVH::Node& n = bvh.nodes()[node];
+      for (int c = 0; c < 2; ++c) {
+        Bounds3D child(Point3D(n.minX[c], n.minY[c], n.minZ[c]),
+                       Point3D(n.maxX[c], n.maxY[c], n.maxZ[c]));
+        EXPECT_TRUE(box.contains(child.min()));
+        EXPECT_TRUE(box.contains(child.max()));
+        if (n.child[c] >= 0) {
+          EXPECT_EQ(bvh.nodes()[n.child[c]].parent, node);
+        }
+        stack.push_back({n.child[c], child});
+      }
+    }
+    for (int s : seen) EXPECT_EQ(s, 1);
+  }
+
+  void checkAgainstBruteForce(const LBVH& bvh) {
+    for (const Ray& ray : rays) {
+      NearestHit ref = intersect(ray, spheres);
+      NearestHit hit = intersect(ray, bvh, spheres);
+      ASSERT_EQ(hit.index, ref.index);
+      if (ref.hit()) {
+        EXPECT_FLOAT_EQ(hit.t, ref.t);
+      }
+    }
+  }
+};
+
+TEST_F(LBVHTest, BuildsValidHierarchy) {
+  std::vector<Bounds3D> boxes = primitiveBounds(spheres);
+  LBVH bvh(boxes);
+  EXPECT_EQ(bvh.size(), boxes.size());
+  EXPECT_EQ(bvh.nodes().size(), boxes.size() - 1);
+  EXPECT_EQ(bvh.root(), 0);
+  Bounds3D all;
+  for (const auto& b : boxes) all.expand(b);
+  EXPECT_FLOAT_EQ(bvh.bounds().min().x(), all.min().x());
+  EXPECT_FLOAT_EQ(bvh.bounds().max().z(), all.max().z());
+  checkStructure(bvh, boxes);
+}
+
+TEST_F(LBVHTest, ClosestHitMatchesBruteForce) {
+  LBVH bvh(primitiveBounds(spheres));
+  checkAgainstBruteForce(bvh);
+  // A limited range only finds hits before it.
+  Ray ray = rays[0];
+  NearestHit full = intersect(ray, bvh, spheres);
+  ASSERT_TRUE(full.hit());
+  ray.setMaxRange(full.t * 0.5f);
+  NearestHit nearer = intersect(ray, bvh, spheres);
+  if (nearer.hit()) {
+    EXPECT_LT(nearer.t, full.t * 0.5f);
+  }
+}
+
+TEST_F(LBVHTest, TreeletOptimizationLowersCost) {
+  std::vector<Bounds3D> boxes = primitiveBounds(spheres);
+  LBVH plain(boxes);
+  LBVHBuildParams params;
+  params.optimizeTreelets = true;
+  LBVH optimized(boxes, params);
+  EXPECT_LT(optimized.sahCost(), plain.sahCost());
+  checkStructure(optimized, boxes);
+  checkAgainstBruteForce(optimized);
+}
+
+TEST_F(LBVHTest, BatchMatchesSingleRays) {
+  LBVH bvh(primitiveBounds(spheres));
+  RayBatch batch;
+  for (const Ray& ray : rays) batch.add(ray);
+  HitBatch hits(batch);
+  intersect(batch, hits, bvh, spheres);
+  for (std::size_t i = 0; i < rays.size(); ++i) {
+    NearestHit ref = intersect(rays[i], bvh, spheres);
+    EXPECT_EQ(hits.index()[i], ref.index);
+  }
+}
+
+TEST_F(LBVHTest, DegenerateInputs) {
+  LBVH empty(std::vector<Bounds3D>{});
+  EXPECT_TRUE(empty.empty());
+  EXPECT_FALSE(intersect(rays[0], empty, spheres).hit());
+
+  SphereSoA one;
+  one.add(Point3D(0, 0, 0), 1.f);
+  LBVH single(primitiveBounds(one));
+  Ray ray(Point3D(0, 0, 5), Vec3D(0, 0, -1));
+  NearestHit hit = intersect(ray, single, one);
+  EXPECT_EQ(hit.index, 0);
+  EXPECT_FLOAT_EQ(hit.t, 4.f);
+
+  // Identical centroids share a Morton code; the index breaks the tie.
+  SphereSoA same;
+  for (int i = 0; i < 100; ++i) same.add(Point3D(1, 1, 1), 0.5f + 0.01f * i);
+  same.add(Point3D(9, 9, 9), 0.5f);
+  std::vector<Bounds3D> boxes = primitiveBounds(same);
+  LBVH stacked(boxes);
+  checkStructure(stacked, boxes);
+  hit = intersect(Ray(Point3D(1, 1, 10), Vec3D(0, 0, -1)), stacked, same);
+  EXPECT_EQ(hit.index, 99);
+}
+
+//--------------------------------------------
+// Reductions
+//--------------------------------------------
+
+class ReductionsTest : public ::testing::Test {
+ protected:
+  // Enough points for several reduction chunks plus a ragged tail.
+  void SetUp() override {
+    std::mt19937 rng(11);
+    std::uniform_real_distribution<float> pos(-50.f, 50.f);
+    for (int i = 0; i < 200003; ++i) {
+      points.push_back(Point3D(pos(rng) + 1000.f, 0.25f * pos(rng),
+                               pos(rng) * pos(rng) * 0.01f));
+    }
+  }
+
+  std::vector<Point3D> points;
+};
+
+TEST_F(ReductionsTest, BoundsMatchBruteForce) {
+  Bounds3D box = computeBounds(points);
+  Bounds3D expected;
+  for (const Point3D& p : points) expected.expand(p);
+  EXPECT_EQ(box.min(), expected.min());
+  EXPECT_EQ(box.max(), expected.max());
+
+  std::vector<Vec3D> vectors = {Vec3D(1, -2, 3), Vec3D(-4, 5, 0)};
+  Bounds3D vbox = computeBounds(vectors);
+  EXPECT_EQ(vbox.min(), Point3D(-4, -2, 0));
+  EXPECT_EQ(vbox.max(), Point3D(1, 5, 3));
+
+  EXPECT_TRUE(computeBounds(std::vector<Point3D>()).empty());
+}
+
+TEST_F(ReductionsTest, CentroidMatchesDoubleReference) {
+  double sx = 0, sy = 0, sz = 0;
+  for (const Point3D& p : points) {
+    sx += p.x();
+    sy += p.y();
+    sz += p.z();
+  }
+  const double n = static_cast<double>(points.size());
+  for (Summation mode :
+       {Summation::Naive, Summation::Kahan, Summation::Pairwise}) {
+    Point3D c = computeCentroid(points, mode);
+    EXPECT_NEAR(c.x(), sx / n, 1e-2);
+    EXPECT_NEAR(c.y(), sy / n, 1e-3);
+    EXPECT_NEAR(c.z(), sz / n, 1e-3);
+  }
+  EXPECT_EQ(computeCentroid(std::vector<Point3D>()), Point3D(0, 0, 0));
+}
+
+TEST_F(ReductionsTest, CovarianceMatchesDoubleReference) {
+  const double n = static_cast<double>(points.size());
+  double m[3] = {0, 0, 0};
+  for (const Point3D& p : points) {
+    m[0] += p.x();
+    m[1] += p.y();
+    m[2] += p.z();
+  }
+  for (double& v : m) v /= n;
+  double cov[3][3] = {};
+  for (const Point3D& p : points) {
+    double d[3] = {p.x() - m[0], p.y() - m[1], p.z() - m[2]};
+    for (int r = 0; r < 3; ++r) {
+      for (int c = 0; c < 3; ++c) cov[r][c] += d[r] * d[c];
+    }
+  }
+  Point3D mean;
+  Mat3D result = computeCovariance(points, Summation::Kahan, &mean);
+  EXPECT_NEAR(mean.x(), m[0], 1e-3);
+  for (int r = 0; r < 3; ++r) {
+    for (int c = 0; c < 3; ++c) {
+      EXPECT_NEAR(result[r][c], cov[r][c] / n,
+                  1e-4 * std::max(1.0, std::fabs(cov[r][c] / n)));
+      EXPECT_EQ(result[r][c], result[c][r]);
+    }
+  }
+}
+
+TEST_F(ReductionsTest, LengthStatistics) {
+  std::vector<Vec3D> vectors = {Vec3D(3, 4, 0), Vec3D(0, 0, 1),
+                                Vec3D(0, -2, 0), Vec3D(0, 0, 0)};
+  LengthStatistics<float> stats = computeLengthStatistics(vectors);
+  EXPECT_EQ(stats.count, 4u);
+  EXPECT_FLOAT_EQ(stats.min, 0.f);
+  EXPECT_FLOAT_EQ(stats.max, 5.f);
+  EXPECT_FLOAT_EQ(stats.mean, 2.f);
+  EXPECT_FLOAT_EQ(stats.variance, (9.f + 1.f + 0.f + 4.f) / 4.f);
+
+  std::vector<Vec3D> many(points.size());
+  for (std::size_t i = 0; i < points.size(); ++i) {
+    many[i] = Vec3D(points[i].x(), points[i].y(), points[i].z());
+  }
+  double sum = 0, sq = 0;
+  float lo = many[0].length(), hi = lo;
+  for (const Vec3D& v : many) {
+    sum += v.length();
+    lo = std::min(lo, v.length());
+    hi = std::max(hi, v.length());
+  }
+  const double mean = sum / many.size();
+  for (const Vec3D& v : many) sq += (v.length() - mean) * (v.length() - mean);
+  stats = computeLengthStatistics(many, Summation::Kahan);
+  EXPECT_FLOAT_EQ(stats.min, lo);
+  EXPECT_FLOAT_EQ(stats.max, hi);
+  EXPECT_NEAR(stats.mean, mean, 1e-4 * mean);
+  EXPECT_NEAR(stats.variance, sq / many.size(), 1e-3 * sq / many.size());
+  EXPECT_EQ(computeLengthStatistics(std::vector<Vec3D>()).count, 0u);
+
+  // A partial last block: its empty lanes must not read as zero lengths.
+  std::vector<Vec3D> tail(11, Vec3D(0, 2, 0));
+  tail.back() = Vec3D(0, 0, -1);
+  stats = computeLengthStatistics(tail);
+  EXPECT_FLOAT_EQ(stats.min, 1.f);
+  EXPECT_FLOAT_EQ(stats.max, 2.f);
+}
+
+TEST_F(ReductionsTest, CompensatedSumsKeepSmallTerms) {
+  // Every lane starts at 1e8, where a float's spacing is 8, so the ones
+  // vanish from a plain running sum; the large terms cancel at the end.
+  const int ones = 100000;
+  std::vector<Vec3D> v(8, Vec3D(1e8f, 0, 0));
+  v.insert(v.end(), ones, Vec3D(1, 0, 0));
+  v.insert(v.end(), 8, Vec3D(-1e8f, 0, 0));
+  std::vector<Point3D> p;
+  for (const Vec3D& x : v) p.push_back(Point3D(x.x(), x.y(), x.z()));
+  const float n = static_cast<float>(p.size());
+  EXPECT_FLOAT_EQ(computeCentroid(p, Summation::Kahan).x() * n, ones);
+  EXPECT_LT(computeCentroid(p, Summation::Naive).x() * n, 0.5f * ones);
+
+  // A long run of 0.1f drifts under naive summation but not the others.
+  std::vector<Point3D> tenths(4000000, Point3D(0.1f, 0, 0));
+  for (Summation mode : {Summation::Kahan, Summation::Pairwise}) {
+    EXPECT_NEAR(computeCentroid(tenths, mode).x(), 0.1, 1e-6);
+  }
+}
+
+TEST_F(ReductionsTest, ResultsIndependentOfWorkDivision) {
+  // Chunks are fixed, so repeated runs are bitwise identical.
+  Mat3D first = computeCovariance(points);
+  for (int run = 0; run < 3; ++run) {
+    Mat3D again = computeCovariance(points);
+    for (int r = 0; r < 3; ++r) {
+      for (int c = 0; c < 3; ++c) EXPECT_EQ(first[r][c], again[r][c]);
+    }
+  }
+}
+
+//--------------------------------------------
+// Aligned vectors
+//--------------------------------------------
+
+TEST(AlignedVec3Test, LayoutIsOneAlignedLane) {
+  EXPECT_EQ(sizeof(Vec3A), 16u);
+  EXPECT_EQ(alignof(Point3A), 16u);
+  std::vector<Vec3A> v(7, Vec3A(1, 2, 3));
+  for (const Vec3A& x : v) {
+    EXPECT_EQ(reinterpret_cast<std::uintptr_t>(&x) % 16, 0u);
+  }
+  // The pad lane stays zero through arithmetic.
+  Vec3A a = (Vec3A(1, 2, 3) + Vec3A(4, 5, 6)) * 2.f - Vec3A(1, 1, 1);
+  EXPECT_EQ(a.lanes().v[3], 0.f);
+  EXPECT_EQ(a, Vec3A(9, 13, 17));
+}
+
+TEST(AlignedVec3Test, MatchesPackedOperations) {
+  Vec3D a(1.5f, -2.f, 0.25f), b(-3.f, 0.5f, 4.f);
+  Vec3A aa(a), ab(b);
+  EXPECT_EQ(Vec3D(aa + ab), a + b);
+  EXPECT_EQ(Vec3D(aa - ab), a - b);
+  EXPECT_EQ(Vec3D(aa * ab), a * b);
+  EXPECT_EQ(Vec3D(-aa), -a);
+  EXPECT_EQ(Vec3D(3.f * aa), 3.f * a);
+  EXPECT_FLOAT_EQ(dot(aa, ab), dot(a, b));
+  EXPECT_EQ(Vec3D(cross(aa, ab)), cross(a, b));
+  EXPECT_FLOAT_EQ(aa.length(), a.length());
+  Vec3D ua = getUnitVectorOf(a);
+  Vec3A uaa = getUnitVectorOf(aa);
+  EXPECT_NEAR(uaa.x(), ua.x(), 1e-6);
+  EXPECT_NEAR(uaa.y(), ua.y(), 1e-6);
+  EXPECT_NEAR(uaa.z(), ua.z(), 1e-6);
+  Vec3A half = aa / 2.f;
+  EXPECT_FLOAT_EQ(half.x(), 0.75f);
+}
+
+TEST(AlignedVec3Test, PointsAndNormals) {
+  Point3A p(1, 2, 3), q(4, 6, 8);
+  Vec3A d = q - p;
+  EXPECT_EQ(d, Vec3A(3, 4, 5));
+  EXPECT_EQ(p + d, q);
+  EXPECT_EQ(q - d, p);
+  EXPECT_EQ(Point3D(p), Point3D(1, 2, 3));
+
+  Normal3A n(0, 2, 0);
+  n.normalize();
+  EXPECT_EQ(n, Normal3A(0, 1, 0));
+  EXPECT_FLOAT_EQ(dot(n, Vec3A(5, -3, 1)), -3.f);
+  EXPECT_EQ(Vec3D(reflect(Vec3A(1, -1, 0), n)), Vec3D(1, 1, 0));
+  EXPECT_EQ(Normal3D(-n), Normal3D(0, -1, 0));
+}
+
+// One set of expressions over the Vec3 / Point3 / Normal3 API, compiled
+// for the packed and for the aligned types.
+template <class V, class P, class N>
+struct VectorApiResults {
+  V vec;
+  P point;
+  N normal;
+  N parsed;
+  N mixed;
+  V offset;
+  float cosine = 0.f;
+  int flags = 0;
+
+  VectorApiResults() {
+    V a(1.5f, -2.f, 0.25f), b(-3.f, 0.5f, 4.f);
+    V scale;
+    scale.set(2.f);
+    vec = (+a + 1.f - (2.f - b) / (b + 0.25f) + a / b) * scale;
+    point = 2.f * (P(1, 2, 3) + 1.f) * 0.5f;
+    normal.set(3.f);
+    normal.setX(0.f);
+    normal.setY(1.f);
+    normal.setZ(0.f);
+    std::istringstream in("1 2 3 0 0 -1");
+    V read;
+    in >> read >> parsed;
+    vec = vec + read;
+    N m(0.5f, -1.f, 2.f), o(1.f, 0.25f, -0.5f);
+    mixed = (m + o) - (m - a) + (b + m) + (2.f + m) - 1.f;
+    mixed = (mixed - 0.5f) + (3.f - m);
+    mixed = (mixed * o) * a * 2.f;
+    mixed = (b * mixed) * (0.5f * m) / (o + 3.f) / 2.f;
+    cosine = dot(m, o);
+    P p(1, 2, 3), q(-1, 0.5f, 4), all;
+    all.setAll(2.f);
+    offset = (p + q) + (a + p) + (a - p) + (all - p);
+    flags = (normal == V(0, 1, 0)) + 2 * (normal != V(0, 1, 1)) +
+            4 * (V(1, 2, 3) < V(1, 3, 0)) + 8 * (P(2, 0, 0) > P(1, 9, 9));
+  }
+};
+
+TEST(AlignedVec3Test, SharesThePackedApi) {
+  VectorApiResults<Vec3D, Point3D, Normal3D> packed;
+  VectorApiResults<Vec3A, Point3A, Normal3A> aligned;
+  compareVectorsApprox(Vec3D(aligned.vec), packed.vec, 1.E-6f);
+  EXPECT_EQ(aligned.vec.lanes().v[3], 0.f);
+  EXPECT_EQ(Point3D(aligned.point), packed.point);
+  EXPECT_EQ(aligned.point.lanes().v[3], 0.f);
+  EXPECT_EQ(Normal3D(aligned.normal), packed.normal);
+  EXPECT_EQ(Normal3D(aligned.parsed), packed.parsed);
+  EXPECT_EQ(Normal3D(aligned.mixed), packed.mixed);
+  EXPECT_EQ(aligned.mixed.lanes().v[3], 0.f);
+  EXPECT_EQ(Vec3D(aligned.offset), packed.offset);
+  EXPECT_EQ(aligned.cosine, packed.cosine);
+  EXPECT_EQ(aligned.flags, 15);
+  EXPECT_EQ(packed.flags, 15);
+}
+
+TEST(AlignedVec3Test, BulkConversionsRoundTrip) {
+  std::vector<Point3D> points = {Point3D(1, 2, 3), Point3D(-4, 5, -6)};
+  std::vector<Point3A> aligned = toAligned(points);
+  ASSERT_EQ(aligned.size(), 2u);
+  EXPECT_EQ(aligned[1], Point3A(-4, 5, -6));
+  EXPECT_EQ(toPacked(aligned), points);
+
+  std::vector<Vec3D> vectors = {Vec3D(0.5f, 0, -1)};
+  EXPECT_EQ(toPacked(toAligned(vectors)), vectors);
+  std::vector<Normal3D> normals = {Normal3D(0, 0, 1)};
+  EXPECT_EQ(toPacked(toAligned(normals)), normals);
+}
+
+//--------------------------------------------
+// CPU dispatch
+//--------------------------------------------
+
+TEST(CpuDispatchTest, ParsesIsaNames) {
+  Isa isa;
+  ASSERT_TRUE(parseIsa("AVX2", isa));
+  EXPECT_EQ(isa, Isa::Avx2);
+  ASSERT_TRUE(parseIsa("avx512", isa));
+  EXPECT_EQ(isa, Isa::Avx512);
+  ASSERT_TRUE(parseIsa("sse2", isa));
+  EXPECT_EQ(isa, Isa::Baseline);
+  EXPECT_FALSE(parseIsa("neon9000", isa));
+  EXPECT_STREQ(isaName(Isa::Avx512), "avx512");
+}
+
+TEST(CpuDispatchTest, OverrideOnlyLowersTheDetectedSet) {
+  IsaSelection s = resolveIsa(Isa::Avx2, nullptr);
+  EXPECT_EQ(s.active, Isa::Avx2);
+  EXPECT_TRUE(s.forced.empty());
+  s = resolveIsa(Isa::Avx2, "baseline");
+  EXPECT_EQ(s.active, Isa::Baseline);
+  EXPECT_EQ(s.forced, "baseline");
+  EXPECT_EQ(resolveIsa(Isa::Avx2, "avx512").active, Isa::Avx2);
+  EXPECT_EQ(resolveIsa(Isa::Avx512, "bogus").active, Isa::Avx512);
+  EXPECT_EQ(resolveIsa(Isa::Baseline, "avx2").active, Isa::Baseline);
+}
+
+TEST(CpuDispatchTest, ReportsTheActivePath) {
+  EXPECT_LE(activeIsa(), detectIsa());
+  std::ostringstream out;
+  reportIsa(out);
+  EXPECT_EQ(out.str().rfind(isaName(activeIsa()), 0), 0u);
+  EXPECT_NE(out.str().find(isaName(detectIsa())), std::string::npos);
+}
+
+TEST(CpuDispatchTest, EverySupportedBuildMatchesBaseline) {
+  std::mt19937 rng(5);
+  std::uniform_real_distribution<float> dist(-1.f, 1.f);
+  MatSoA<float, 4> a;
+  for (int i = 0; i < 100; ++i) {
+    Mat4D m;
+    for (int r = 0; r < 4; ++r) {
+      for (int c = 0; c < 4; ++c) m[r][c] = dist(rng) + (r == c ? 3.f : 0.f);
+    }
+    a.add(m);
+  }
+  MatSoA<float, 4> expected;
+  {
+    ScopedIsa scope(Isa::Baseline);
+    EXPECT_EQ(activeIsa(), Isa::Baseline);
+    batchInverse(a, expected);
+  }
+  EXPECT_EQ(activeIsa(), isaSelection().active);
+  for (Isa isa : {Isa::Avx2, Isa::Avx512}) {
+    if (isa > detectIsa()) continue;
+    ScopedIsa scope(isa);
+    MatSoA<float, 4> out;
+    batchInverse(a, out);
+    for (std::size_t i = 0; i < a.size(); ++i) {
+      for (int r = 0; r < 4; ++r) {
+        for (int c = 0; c < 4; ++c) {
+          EXPECT_NEAR(out.at(i, r, c), expected.at(i, r, c), 1e-5)
+              << isaName(isa);
+        }
+      }
+    }
+  }
+  MatSoA<float, 4> dispatched;
+  batchInverse(a, dispatched);
+  EXPECT_NEAR(dispatched.at(42, 1, 2), expected.at(42, 1, 2), 1e-5);
+}
+
+TEST(CpuDispatchTest, VectorKernelsMatchAcrossBuilds) {
+  std::mt19937 rng(9);
+  std::uniform_real_distribution<float> dist(-1.f, 1.f);
+  ParticleSystemD start;
+  std::vector<Point3D> points;
+  RayBatch rays;
+  SphereSoA spheres;
+  for (int i = 0; i < 1000; ++i) {
+    Point3D p(dist(rng), dist(rng), dist(rng));
+    start.add(p, Vec3D(dist(rng), dist(rng), dist(rng)), 1.f);
+    points.push_back(p);
+    rays.add(Ray(Point3D(0, 0, 5), getUnitVectorOf(Vec3D(p) * 0.2f -
+                                                    Vec3D(0, 0, 1))));
+  }
+  for (int i = 0; i < 16; ++i) {
+    spheres.add(Point3D(dist(rng), dist(rng), dist(rng)), 0.2f);
+  }
+  StepParams<float> params;
+  params.damping = 0.1f;
+
+  auto run = [&](Isa isa, ParticleSystemD& ps, HitBatch& hits) {
+    ScopedIsa scope(isa);
+    ps = start;
+    integrateRK4(ps, params);
+    hits.reset(rays);
+    intersect(rays, hits, spheres);
+    return computeCentroid(points);
+  };
+  ParticleSystemD expectedPs;
+  HitBatch expectedHits;
+  Point3D expectedCentroid = run(Isa::Baseline, expectedPs, expectedHits);
+  for (Isa isa : {Isa::Avx2, Isa::Avx512}) {
+    if (isa > detectIsa()) continue;
+    ParticleSystemD ps;
+    HitBatch hits;
+    comparePointsApprox(run(isa, ps, hits), expectedCentroid, 1.E-6f);
+    for (std::size_t i = 0; i < ps.size(); ++i) {
+      comparePointsApprox(ps.position(i), expectedPs.position(i), 1.E-5f);
+      EXPECT_EQ(hits.index()[i], expectedHits.index()[i]) << isaName(isa);
+    }
+  }
+}
+
+TEST(CpuDispatchTest, GemmAndGemvMatchAcrossBuilds) {
+  MatXD a = randomMatX(75, 130, 7), b = randomMatX(130, 41, 8);
+  MatXD xm = randomMatX(130, 1, 9);
+  VecXD x(130);
+  for (std::size_t i = 0; i < 130; ++i) x[i] = xm(i, 0);
+  auto run = [&](Isa isa, MatXD& c, VecXD& y) {
+    ScopedIsa scope(isa);
+    gemm(1.f, a, b, 0.f, c);
+    gemv(1.f, a, x, 0.f, y);
+  };
+  MatXD expectedC(75, 41);
+  VecXD expectedY(75);
+  run(Isa::Baseline, expectedC, expectedY);
+  for (Isa isa : {Isa::Avx2, Isa::Avx512}) {
+    if (isa > detectIsa()) continue;
+    MatXD c(75, 41);
+    VecXD y(75);
+    run(isa, c, y);
+    // Without FMA contraction every build rounds the same.
+    EXPECT_TRUE(c == expectedC) << isaName(isa);
+    for (std::size_t i = 0; i < 75; ++i) EXPECT_EQ(y[i], expectedY[i]);
+  }
+}
+
+//--------------------------------------------
+// Header layout
+//--------------------------------------------
+
+TEST(HeaderLayoutTest, ConstantsAreCompileTime) {
+  static_assert(PI > 3.14159f && PI < 3.1416f);
+  constexpr float halfTurn = PI / 2.f;
+  EXPECT_FLOAT_EQ(PI, static_cast<float>(std::acos(-1.)));
+  EXPECT_FLOAT_EQ(halfTurn, static_cast<float>(std::acos(0.)));
+  EXPECT_GT(EPS1, EPS);
+}
+
+TEST(HeaderLayoutTest, StreamOperatorsComeFromIoHeader) {
+  std::istringstream in("1 2 3  4 5");
+  Vec3D v;
+  Vec2D w;
+  in >> v >> w;
+  EXPECT_EQ(v, Vec3D(1, 2, 3));
+  EXPECT_EQ(w, Vec2D(4, 5));
+  std::ostringstream out;
+  out << Point3D(1, 2, 3) << Mat2D(Vec2D(1, 0), Vec2D(0, 1))
+      << Point3A(4, 5, 6);
+  EXPECT_EQ(out.str(), "(1,2,3){(1,0),(0,1)}(4,5,6)");
+}
+
+//--------------------------------------------
+// Hit records
+//--------------------------------------------
+
+TEST(HitRecordTest, StaysPlainData) {
+  static_assert(std::is_trivially_copyable_v<HitRecord>);
+  HitRecord rec;
+  EXPECT_FALSE(rec.hit());
+  EXPECT_EQ(rec.t, std::numeric_limits<float>::infinity());
+  std::vector<HitRecord> buffer(4);
+  buffer[2] = rec;
+  EXPECT_FALSE(buffer[2].hit());
+}
+
+TEST(HitRecordTest, ReportShrinksRayRange) {
+  Ray ray(Point3D(0, 0, 0), Vec3D(0, 0, 1));
+  EXPECT_EQ(ray.getMaxRange(), std::numeric_limits<float>::infinity());
+  HitRecord rec;
+  EXPECT_TRUE(rec.report(ray, 5.f, 3, 0.25f, 0.5f));
+  EXPECT_FLOAT_EQ(ray.getMaxRange(), 5.f);
+  EXPECT_FALSE(rec.report(ray, 6.f, 4));
+  EXPECT_EQ(rec.primId, 3);
+  EXPECT_FLOAT_EQ(rec.u, 0.25f);
+  EXPECT_TRUE(rec.report(ray, 2.f, 7));
+  EXPECT_EQ(rec.primId, 7);
+  EXPECT_FLOAT_EQ(ray.getMaxRange(), 2.f);
+  EXPECT_EQ(rec.position(ray), Point3D(0, 0, 2));
+}
+
+TEST(HitRecordTest, ClosestHitOverSeveralPrimitiveSets) {
+  SphereSoA spheres;
+  spheres.add(Point3D(0, 0, -10), 1.f);
+  PlaneSoA planes;
+  planes.add(Normal3D(0, 0, 1), -5.f);
+  Ray ray(Point3D(0, 0, 0), Vec3D(0, 0, -1));
+  HitRecord rec;
+  EXPECT_TRUE(intersect(ray, spheres, rec));
+  EXPECT_FLOAT_EQ(rec.t, 9.f);
+  EXPECT_TRUE(intersect(ray, planes, rec));
+  EXPECT_FLOAT_EQ(rec.t, 5.f);
+  EXPECT_EQ(rec.primId, 0);
+  EXPECT_EQ(rec.normal, Normal3D(0, 0, 1));
+  // The sphere now lies behind the clipped range.
+  EXPECT_FALSE(intersect(ray, spheres, rec));
+  EXPECT_FLOAT_EQ(rec.t, 5.f);
+}
+
+TEST(HitRecordTest, SphereNormalAndBasis) {
+  SphereSoA spheres;
+  spheres.add(Point3D(0, 0, -10), 2.f);
+  Ray ray(Point3D(0, 0, 0), Vec3D(0, 0, -1));
+  HitRecord rec;
+  ASSERT_TRUE(intersect(ray, spheres, rec));
+  EXPECT_NEAR(rec.normal.z(), 1.f, 1e-6);
+  OrthoNormalBasis onb = rec.basis();
+  EXPECT_NEAR(onb.w().z(), 1.f, 1e-6);
+  EXPECT_NEAR(dot(onb.u(), onb.w()), 0.f, 1e-6);
+  EXPECT_NEAR(dot(onb.v(), onb.w()), 0.f, 1e-6);
+}
+
+TEST_F(LBVHTest, HitRecordMatchesNearestHit) {
+  LBVH bvh(primitiveBounds(spheres));
+  for (const Ray& ray : rays) {
+    NearestHit expected = intersect(ray, bvh, spheres);
+    Ray clipped = ray;
+    HitRecord rec;
+    EXPECT_EQ(intersect(clipped, bvh, spheres, rec), expected.hit());
+    EXPECT_EQ(rec.primId, expected.index);
+    if (!expected.hit()) continue;
+    EXPECT_FLOAT_EQ(rec.t, expected.t);
+    EXPECT_FLOAT_EQ(clipped.getMaxRange(), expected.t);
+    Vec3D n(rec.normal.x(), rec.normal.y(), rec.normal.z());
+    EXPECT_NEAR(n.length(), 1.f, 1e-3);
+  }
+}
+
+//--------------------------------------------
+// Occlusion queries
+//--------------------------------------------
+
+TEST(OcclusionTest, ShadowRayEndsAtLight) {
+  PointLight light(Point3D(0, 10, 0), Vec3D(1, 1, 1));
+  Ray ray = shadowRay(Point3D(0, 0, 0), light);
+  EXPECT_EQ(ray.direction(), Vec3D(0, 1, 0));
+  EXPECT_LT(ray.getMaxRange(), 10.f);
+  EXPECT_GT(ray.getMaxRange(), 9.99f);
+
+  SphereSoA spheres;
+  spheres.add(Point3D(0, 5, 0), 1.f);
+  EXPECT_TRUE(occluded(ray, spheres));
+  // A sphere around the light is hit only at or past the range.
+  spheres.clear();
+  spheres.add(Point3D(0, 12, 0), 2.f);
+  EXPECT_FALSE(occluded(ray, spheres));
+}
+
+TEST(OcclusionTest, PlanesBlockOnlyInsideRange) {
+  PlaneSoA planes;
+  planes.add(Normal3D(0, 1, 0), 4.f);
+  Ray ray(Point3D(0, 0, 0), Vec3D(0, 1, 0));
+  EXPECT_TRUE(occluded(ray, planes));
+  ray.setMaxRange(3.f);
+  EXPECT_FALSE(occluded(ray, planes));
+  EXPECT_FALSE(occluded(Ray(Point3D(0, 0, 0), Vec3D(1, 0, 0)), planes));
+}
+
+TEST_F(LBVHTest, OccludedAgreesWithClosestHit) {
+  LBVH bvh(primitiveBounds(spheres));
+  for (Ray ray : rays) {
+    for (float range : {5.f, 30.f, 100.f}) {
+      ray.setMaxRange(range);
+      bool expected = intersect(ray, spheres).hit();
+      EXPECT_EQ(occluded(ray, spheres), expected);
+      EXPECT_EQ(occluded(ray, bvh, spheres), expected);
+      EXPECT_EQ(ray.getMaxRange(), range);
+    }
+  }
+}
+
+TEST_F(LBVHTest, LightVisibilityMatchesPerPointQueries) {
+  LBVH bvh(primitiveBounds(spheres));
+  std::mt19937 rng(5);
+  std::uniform_real_distribution<float> u(-20.f, 20.f);
+  std::vector<Point3D> points(2000);
+  for (Point3D& p : points) p = Point3D(u(rng), u(rng), u(rng));
+  PointLight light(Point3D(0, 0, 30), Vec3D(1, 1, 1));
+  std::vector<std::uint8_t> visible;
+  lightVisibility(points, light, bvh, spheres, visible);
+  ASSERT_EQ(visible.size(), points.size());
+  int shadowed = 0;
+  for (std::size_t i = 0; i < points.size(); ++i) {
+    bool blocked = intersect(shadowRay(points[i], light), spheres).hit();
+    EXPECT_EQ(visible[i], blocked ? 0 : 1);
+    shadowed += blocked;
+  }
+  EXPECT_GT(shadowed, 0);
+  EXPECT_LT(shadowed, static_cast<int>(points.size()));
+}
+
+//--------------------------------------------
+// Instancing
+//--------------------------------------------
+
+class InstancingTest : public testing::Test {
+ public:
+  InstanceBVH scene;
+  // The same spheres placed in world space, for brute-force answers.
+  SphereSoA flat;
+  std::vector<Mat4D> transforms;
+
+  void SetUp() override {
+    std::mt19937 rng(3);
+    std::uniform_real_distribution<float> u(-2.f, 2.f);
+    SphereSoA spheres;
+    for (int i = 0; i < 40; ++i) {
+      spheres.add(Point3D(u(rng), u(rng), u(rng)), 0.3f);
+    }
+    scene.addGeometry(SphereGeometry(spheres));
+    for (int x = 0; x < 6; ++x) {
+      for (int y = 0; y < 6; ++y) {
+        transforms.push_back(translation(10.f * x, 10.f * y, 0.f) *
+                             scale(2.f, 2.f, 2.f));
+        scene.addInstance(transforms.back(), 0);
+      }
+    }
+    scene.build();
+    fillFlat(spheres);
+  }
+
+  // Uniform scale 2 doubles every radius.
+  void fillFlat(const SphereSoA& spheres) {
+    flat.clear();
+    for (const Mat4D& m : transforms) {
+      for (std::size_t i = 0; i < spheres.size(); ++i) {
+        flat.add(Point3D(m * Vec4D(spheres.center(i))),
+                 2.f * spheres.radius(i));
+      }
+    }
+  }
+
+  void checkRays() {
+    std::mt19937 rng(8);
+    std::uniform_real_distribution<float> u(-5.f, 55.f);
+    for (int i = 0; i < 300; ++i) {
+      Point3D o(u(rng), u(rng), 30.f);
+      Point3D target(u(rng), u(rng), 0.f);
+      Ray ray(o, getUnitVectorOf(target - o));
+      NearestHit expected = intersect(ray, flat);
+      // Before the closest-hit query, which clips the range to its hit.
+      EXPECT_EQ(occluded(ray, scene), expected.hit());
+      HitRecord rec;
+      ASSERT_EQ(intersect(ray, scene, rec), expected.hit());
+      if (!expected.hit()) continue;
+      EXPECT_NEAR(rec.t, expected.t, 1e-3f * expected.t);
+      EXPECT_EQ(rec.instId * 40 + rec.primId, expected.index);
+      Normal3D n = flat.normalAt(expected.index, ray.position(expected.t));
+      EXPECT_NEAR(rec.normal.x(), n.x(), 5e-3);
+      EXPECT_NEAR(rec.normal.y(), n.y(), 5e-3);
+      EXPECT_NEAR(rec.normal.z(), n.z(), 5e-3);
+    }
+  }
+};
+
+TEST_F(InstancingTest, InstanceCachesInverse) {
+  const Instance& inst = scene.instance(7);
+  Mat4D product = inst.objectToWorld() * inst.worldToObject();
+  for (int r = 0; r < 4; ++r) {
+    for (int c = 0; c < 4; ++c) {
+      EXPECT_NEAR(product[r][c], r == c ? 1.f : 0.f, 1e-5);
+    }
+  }
+  Ray local = inst.toObject(Ray(Point3D(10, 11, 0), Vec3D(0, 0, 1)));
+  EXPECT_EQ(local.origin(), Point3D(0, 0.5f, 0));
+  EXPECT_EQ(local.direction(), Vec3D(0, 0, 0.5f));
+}
+
+TEST_F(InstancingTest, MatchesFlattenedScene) {
+  EXPECT_EQ(scene.instanceCount(), 36u);
+  EXPECT_EQ(scene.geometryCount(), 1u);
+  checkRays();
+}
+
+TEST_F(InstancingTest, RefitFollowsMovedInstances) {
+  const LBVH* bottom = &scene.geometry(0).bvh();
+  for (std::size_t i = 0; i < transforms.size(); ++i) {
+    transforms[i] = translation(0.f, 0.f, -0.5f * (i % 5)) * transforms[i];
+    scene.setTransform(i, transforms[i]);
+  }
+  scene.refit();
+  EXPECT_EQ(&scene.geometry(0).bvh(), bottom);
+  fillFlat(scene.geometry(0).spheres());
+  checkRays();
+}
+
+TEST_F(LBVHTest, RefitMatchesMovedPrimitives) {
+  LBVH bvh(primitiveBounds(spheres));
+  float before = bvh.sahCost();
+  SphereSoA moved;
+  for (std::size_t i = 0; i < spheres.size(); ++i) {
+    moved.add(spheres.center(i) + Vec3D(0.f, 0.f, 0.01f * (i % 7)),
+              spheres.radius(i));
+  }
+  std::vector<Bounds3D> boxes = primitiveBounds(moved);
+  bvh.refit(boxes);
+  checkStructure(bvh, boxes);
+  EXPECT_NEAR(bvh.sahCost(), before, 0.05f * before);
+  spheres = moved;
+  checkAgainstBruteForce(bvh);
+}
+
+//--------------------------------------------
+// Wavefront pipeline
+//--------------------------------------------
+
+TEST(RayQueueTest, ConcurrentAppendsKeepEverySlot) {
+  const int kThreads = 4, kPerThread = 5000;
+  RayQueue queue(kThreads * kPerThread);
+  std::vector<std::thread> threads;
+  for (int t = 0; t < kThreads; ++t) {
+    threads.emplace_back([&, t] {
+      for (int i = 0; i < kPerThread; ++i) {
+        std::uint32_t s = static_cast<std::uint32_t>(t * kPerThread + i);
+        queue.push(Ray(Point3D(static_cast<float>(s), 0, 0), Vec3D(0, 0, 1)),
+                   s, Vec3D(1, 1, 1));
+      }
+    });
+  }
+  for (std::thread& t : threads) t.join();
+  ASSERT_EQ(queue.size(), static_cast<std::size_t>(kThreads * kPerThread));
+  std::vector<int> seen(queue.size(), 0);
+  for (std::size_t i = 0; i < queue.size(); ++i) {
+    std::uint32_t s = queue.sample(i);
+    ++seen[s];
+    EXPECT_EQ(queue.ray(i).origin().x(), static_cast<float>(s));
+  }
+  for (int c : seen) EXPECT_EQ(c, 1);
+}
+
+TEST(RayQueueTest, SortGroupsOctantsAndKeepsPayload) {
+  std::mt19937 rng(4);
+  std::uniform_real_distribution<float> u(-1.f, 1.f);
+  RayQueue queue(1000);
+  std::vector<Ray> rays;
+  for (std::uint32_t i = 0; i < 800; ++i) {
+    rays.push_back(Ray(Point3D(10 * u(rng), 10 * u(rng), 10 * u(rng)),
+                       getUnitVectorOf(Vec3D(u(rng), u(rng), u(rng)))));
+    rays.back().setMaxRange(static_cast<float>(i));
+    queue.push(rays.back(), i, Vec3D(static_cast<float>(i), 0, 0));
+  }
+  queue.sortForCoherence();
+  ASSERT_EQ(queue.size(), 800u);
+  EXPECT_EQ(queue.capacity(), 1000u);
+  auto octant = [](const Vec3D& d) {
+    return (d.x() < 0 ? 1 : 0) | (d.y() < 0 ? 2 : 0) | (d.z() < 0 ? 4 : 0);
+  };
+  int last = 0;
+  for (std::size_t i = 0; i < queue.size(); ++i) {
+    std::uint32_t s = queue.sample(i);
+    Ray ray = queue.ray(i);
+    EXPECT_GE(octant(ray.direction()), last);
+    last = octant(ray.direction());
+    EXPECT_EQ(ray.origin(), rays[s].origin());
+    EXPECT_EQ(ray.getMaxRange(), static_cast<float>(s));
+    EXPECT_EQ(queue.weight(i).x(), static_cast<float>(s));
+  }
+  // The sort swaps arrays with its scratch; a second sort and later
+  // appends must still see consistent rays and the full capacity.
+  queue.sortForCoherence();
+  for (std::size_t i = 0; i < queue.size(); ++i) {
+    EXPECT_EQ(queue.ray(i).origin(), rays[queue.sample(i)].origin());
+  }
+  for (std::uint32_t i = 800; i < 1000; ++i) {
+    queue.push(Ray(Point3D(0, 0, 0), Vec3D(0, 0, 1)), i, Vec3D(0, 0, 0));
+  }
+  EXPECT_EQ(queue.size(), 1000u);
+  EXPECT_EQ(queue.sample(999), 999u);
+}
+
+class WavefrontTest : public testing::Test {
+ public:
+  SphereSoA spheres;
+  PointLight light{Point3D(0, 8, 4), Vec3D(60, 60, 60)};
+  Camera camera{Point3D(0, 0, 10), Point3D(0, 0, 0), Vec3D(0, 1, 0), 0.8f,
+                48, 32};
+
+  void SetUp() override {
+    spheres.add(Point3D(0, 0, 0), 2.f);
+    spheres.add(Point3D(2.5f, 2.5f, 0), 1.f);
+    spheres.add(Point3D(0, -1002.f, 0), 1000.f);
+  }
+
+  std::vector<Vec3D> render(const WavefrontSettings& settings,
+                            RenderStats* stats = nullptr) {
+    std::vector<Vec3D> image;
+    RenderStats s = renderWavefront(
+        camera, spheres, light, settings,
+        [&](const Tile& tile, const Vec3D* pixels) {
+          EXPECT_EQ(tile.pixelCount(), 48u * 32u);
+          image.assign(pixels, pixels + tile.pixelCount());
+        });
+    if (stats) *stats = s;
+    return image;
+  }
+};
+
+// Without bounces every pixel is the direct light at its primary hit.
+TEST_F(WavefrontTest, DirectLightMatchesPerPixelShading) {
+  WavefrontSettings settings;
+  settings.maxBounces = 0;
+  settings.shading.background = Vec3D(0.1f, 0.2f, 0.3f);
+  RenderStats stats;
+  std::vector<Vec3D> image = render(settings, &stats);
+  EXPECT_EQ(stats.samples, 48u * 32u);
+  EXPECT_GT(stats.rays, stats.samples);
+  const Vec3D albedo = settings.shading.albedo;
+  int mismatches = 0;
+  for (int y = 0; y < 32; ++y) {
+    for (int x = 0; x < 48; ++x) {
+      Ray ray = camera.generateRay(x + 0.5f, y + 0.5f);
+      HitRecord rec;
+      Vec3D expected = settings.shading.background;
+      if (intersect(ray, spheres, rec)) {
+        Point3D p = rec.position(ray);
+        Vec3D n(rec.normal.x(), rec.normal.y(), rec.normal.z());
+        if (dot(n, ray.direction()) > 0.f) n = -n;
+        Ray toLight = shadowRay(p, light);
+        float cosLight = dot(n, toLight.direction());
+        expected = Vec3D(0, 0, 0);
+        if (cosLight > 0.f && !occluded(toLight, spheres)) {
+          Vec3D d = light.position() - p;
+          expected = albedo * light.intensity() *
+                     (cosLight / (PI * dot(d, d)));
+        }
+      }
+      const Vec3D& got = image[y * 48 + x];
+      mismatches += std::fabs(got.x() - expected.x()) >
+                        1e-4f + 1e-3f * expected.x() ||
+                    std::fabs(got.z() - expected.z()) >
+                        1e-4f + 1e-3f * expected.z();
+    }
+  }
+  // Tile rays are normalized by another kernel than generateRay, which can
+  // flip a pixel grazing a shadow boundary.
+  EXPECT_LE(mismatches, 2);
+}
+
+TEST_F(WavefrontTest, SortingDoesNotChangeTheImage) {
+  WavefrontSettings settings;
+  settings.sampling.samplesPerPixel = 2;
+  settings.sampling.jitter = true;
+  settings.maxBounces = 3;
+  std::vector<Vec3D> sorted = render(settings);
+  settings.sortRays = false;
+  std::vector<Vec3D> unsorted = render(settings);
+  ASSERT_EQ(sorted.size(), unsorted.size());
+  for (std::size_t i = 0; i < sorted.size(); ++i) {
+    EXPECT_NEAR(sorted[i].y(), unsorted[i].y(), 1e-5f);
+  }
+}
+
+TEST_F(WavefrontTest, BouncesOnlyAddLight) {
+  WavefrontSettings settings;
+  settings.maxBounces = 0;
+  std::vector<Vec3D> direct = render(settings);
+  settings.maxBounces = 2;
+  std::vector<Vec3D> indirect = render(settings);
+  double sumDirect = 0., sumIndirect = 0.;
+  for (std::size_t i = 0; i < direct.size(); ++i) {
+    EXPECT_GE(indirect[i].x(), direct[i].x() - 1e-6f);
+    sumDirect += direct[i].x();
+    sumIndirect += indirect[i].x();
+  }
+  EXPECT_GT(sumIndirect, sumDirect);
+}